@@ -1,86 +1,694 @@
 #include "cl_kernel.h"
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <exception>
+#include <vector>
+#include "out_debug.h"
+#include "output_bounds.h"
 
-SpoolKernelManager::SpoolKernelManager(const cl::Program *program, cl::CommandQueue *command_queue) :
-    CLKernelManager(program, "Spool") {
+// Side of the work-groups of EnqueueKernel2D()
+static const int kBlockSize = 16;
+// More samples per axis than this take the generic kernels, the unrolled loops would only
+// grow the program
+static const int kMaxVariantAASamples = 8;
+
+// Enqueue a kernel with a thread per pixel of rect, the global ids are the coords of the pixels
+static void EnqueueKernel2D(cl::CommandQueue *command_queue, const cl::Kernel &kernel,
+                            const cv::Rect &rect, cl::Event *event = nullptr) {
+    int block_size = kBlockSize;
+    cl::NDRange global(
+        static_cast<std::size_t>(std::ceil(rect.width / static_cast<float>(block_size))) * block_size,
+        static_cast<std::size_t>(std::ceil(rect.height / static_cast<float>(block_size))) * block_size,
+        1
+    );
+    cl::NDRange local(block_size, block_size, 1);
+    command_queue->enqueueNDRangeKernel(kernel, cl::NDRange(rect.x, rect.y, 0), global, local,
+                                        nullptr, event);
+}
+
+// Enqueue a kernel with a thread per pixel of a w x h area
+static void EnqueueKernel2D(cl::CommandQueue *command_queue, const cl::Kernel &kernel, int w, int h,
+                            cl::Event *event = nullptr) {
+    EnqueueKernel2D(command_queue, kernel, cv::Rect(0, 0, w, h), event);
+}
+
+// Variant of the kernels enqueued over rect by EnqueueKernel2D()
+static CLKernelVariant MakeKernelVariant(const cv::Rect &rect) {
+    CLKernelVariant variant;
+    variant.full_groups = rect.width > 0 && rect.height > 0 &&
+                          rect.width % kBlockSize == 0 && rect.height % kBlockSize == 0;
+    return variant;
+}
+
+// Variant of the anti-aliasing kernels, the fixed sampling of the parameter is a constant of it
+static CLKernelVariant MakeMSKernelVariant(const cv::Rect &rect, const OpticsCompensationParameter &parameter) {
+    CLKernelVariant variant = MakeKernelVariant(rect);
+    int max_sampling = parameter.GetAAMaxSampling(4);
+    if (!parameter.aa_adaptive && max_sampling <= kMaxVariantAASamples)
+        variant.aa_samples = max_sampling;
+    return variant;
+}
+
+std::string CLKernelVariant::MakeBuildOptions() const {
+    return "-D VARIANT_AA_SAMPLES=" + std::to_string(aa_samples) +
+           " -D VARIANT_FULL_GROUPS=" + std::to_string(full_groups ? 1 : 0);
+}
+
+CLProgramVariants::CLProgramVariants(const cl::Context &context, const std::string &source,
+                                     std::shared_ptr<CLProgramCache> program_cache) :
+    context_(context),
+    source_(source),
+    program_cache_(program_cache) {
+    // Without a cache directory the variants are still built, only not stored
+    if (!program_cache_)
+        program_cache_ = std::make_shared<CLProgramCache>(std::string());
+}
+
+CLProgramVariants::~CLProgramVariants() {
+    WaitBuilds();
+}
+
+const cl::Program* CLProgramVariants::GetProgram(const CLKernelVariant &variant) {
+    if (variant.IsGeneric())
+        return nullptr;
+
+    std::string options = variant.MakeBuildOptions();
+    auto it = builds_.find(options);
+    if (it == builds_.end()) {
+        // The thread has its own handles, the members may be gone before it is collected
+        cl::Context context = context_;
+        std::string source = source_;
+        std::shared_ptr<CLProgramCache> program_cache = program_cache_;
+        Build &build = builds_[options];
+        build.future = std::async(std::launch::async, [context, source, options, program_cache]() {
+            try {
+                return program_cache->LoadOrBuild(context, source, options);
+            } catch (const std::exception&) {
+                OutDebugInfo("Variant failed to build : ", options);
+                return static_cast<cl::Program*>(nullptr);
+            }
+        });
+        return nullptr;
+    }
+    CollectBuild(&it->second);
+    return it->second.program.get();
+}
+
+void CLProgramVariants::WaitBuilds() {
+    for (auto &build : builds_) {
+        if (build.second.future.valid())
+            build.second.future.wait();
+        CollectBuild(&build.second);
+    }
+}
+
+int CLProgramVariants::GetBuiltNum() const {
+    int built_num = 0;
+    for (auto &build : builds_) {
+        if (build.second.program)
+            built_num++;
+    }
+    return built_num;
+}
+
+void CLProgramVariants::CollectBuild(Build *build) {
+    if (build->future.valid() &&
+        build->future.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+        build->program.reset(build->future.get());
+}
+
+DistortionKernelManager::DistortionKernelManager(const cl::Program *program,
+                                                 cl::CommandQueue *command_queue,
+                                                 const std::string &kernel_name) :
+    CLKernelManager(program, kernel_name),
+    fused_(true),
+    program_variants_(nullptr) {
+    fused_kernel_ = new cl::Kernel(*program, ("Fused" + kernel_name_).c_str());
     SetCommandQueue(command_queue);
 }
 
+DistortionKernelManager::~DistortionKernelManager() {
+    delete fused_kernel_;
+    for (auto &variant_kernel : variant_kernels_)
+        delete variant_kernel.second;
+}
+
+cl::Kernel* DistortionKernelManager::GetSelectedKernel(const CLKernelVariant &variant) {
+    cl::Kernel *kernel = GetVariantKernel(fused_ ? "Fused" + kernel_name_ : kernel_name_, variant);
+    return kernel ? kernel : GetSelectedKernel();
+}
+
+cl::Kernel* DistortionKernelManager::GetVariantKernel(const std::string &kernel_name,
+                                                      const CLKernelVariant &variant) {
+    const cl::Program *program = program_variants_ ? program_variants_->GetProgram(variant) : nullptr;
+    if (!program)
+        return nullptr;
+
+    cl::Kernel *&kernel = variant_kernels_[std::make_pair(program, kernel_name)];
+    if (!kernel) {
+        cl_int err;
+        std::unique_ptr<cl::Kernel> new_kernel(new cl::Kernel(*program, kernel_name.c_str(), &err));
+        if (err == CL_SUCCESS)
+            kernel = new_kernel.release();
+    }
+    return kernel;
+}
+
+SpoolKernelManager::SpoolKernelManager(const cl::Program *program, cl::CommandQueue *command_queue) :
+    DistortionKernelManager(program, command_queue, "Spool") {}
+
 void SpoolKernelManager::CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
-                                    OpticsCompensationParameter parameter) {
+                                    OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                                    cl::Event *event) {
     cl_int2 image_size = {w, h};
     cl_float2 center_coords = {
         (w - 1) / 2.0f + parameter.center_pos.x,
         (h - 1) / 2.0f + parameter.center_pos.y
     };
-    int block_size = 16;
-    kernel_->setArg(0, in_image);
-    kernel_->setArg(1, out_image);
-    kernel_->setArg(2, image_size);
-    kernel_->setArg(3, center_coords);
-    kernel_->setArg(4, parameter.CalcFocalDistance());
-    cl::NDRange global(
-        static_cast<std::size_t>(std::ceil(w / static_cast<float>(block_size))) * block_size,
-        static_cast<std::size_t>(std::ceil(h / static_cast<float>(block_size))) * block_size,
-        1
-    );
-    cl::NDRange local(block_size, block_size, 1);
-    command_queue_->enqueueNDRangeKernel(*kernel_, cl::NDRange(0, 0, 0), global, local);
+    cl::Kernel *kernel = GetSelectedKernel(MakeKernelVariant(live_rect));
+    kernel->setArg(0, in_image);
+    kernel->setArg(1, out_image);
+    kernel->setArg(2, image_size);
+    kernel->setArg(3, center_coords);
+    kernel->setArg(4, parameter.CalcFocalDistance());
+    EnqueueKernel2D(command_queue_, *kernel, live_rect, event);
 }
 
 BarrelKernelManager::BarrelKernelManager(const cl::Program *program, cl::CommandQueue *command_queue) :
-    CLKernelManager(program, "Barrel") {
-    SetCommandQueue(command_queue);
-}
+    DistortionKernelManager(program, command_queue, "Barrel") {}
 
 void BarrelKernelManager::CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
-                                    OpticsCompensationParameter parameter) {
+                                    OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                                    cl::Event *event) {
     cl_int2 image_size = {w, h};
     cl_float2 center_coords = {
         (w - 1) / 2.0f + parameter.center_pos.x,
         (h - 1) / 2.0f + parameter.center_pos.y
     };
-    int block_size = 16;
-    kernel_->setArg(0, in_image);
-    kernel_->setArg(1, out_image);
-    kernel_->setArg(2, image_size);
-    kernel_->setArg(3, center_coords);
-    kernel_->setArg(4, parameter.CalcFocalDistance());
-    cl::NDRange global(
-        static_cast<std::size_t>(std::ceil(w / static_cast<float>(block_size))) * block_size,
-        static_cast<std::size_t>(std::ceil(h / static_cast<float>(block_size))) * block_size,
-        1
-    );
-    cl::NDRange local(block_size, block_size, 1);
-    command_queue_->enqueueNDRangeKernel(*kernel_, cl::NDRange(0, 0, 0), global, local);
+    cl::Kernel *kernel = GetSelectedKernel(MakeKernelVariant(live_rect));
+    kernel->setArg(0, in_image);
+    kernel->setArg(1, out_image);
+    kernel->setArg(2, image_size);
+    kernel->setArg(3, center_coords);
+    kernel->setArg(4, parameter.CalcFocalDistance());
+    EnqueueKernel2D(command_queue_, *kernel, live_rect, event);
 }
 
-MSBarrelKernelManager::MSBarrelKernelManager(const cl::Program *program, cl::CommandQueue *command_queue) :
-    CLKernelManager(program, "MultiSamplingBarrel") {
-    SetCommandQueue(command_queue);
+SymmetricSpoolKernelManager::SymmetricSpoolKernelManager(const cl::Program *program, cl::CommandQueue *command_queue) :
+    DistortionKernelManager(program, command_queue, "SymmetricSpool") {}
+
+void SymmetricSpoolKernelManager::CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                                    OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                                    cl::Event *event) {
+    cl_int2 image_size = {w, h};
+    cl_float2 center_coords = {
+        (w - 1) / 2.0f + parameter.center_pos.x,
+        (h - 1) / 2.0f + parameter.center_pos.y
+    };
+    // Threads only cover the left-top quadrant, from the first pixel which is
+    // in live_rect or mirrored into it
+    int quadrant_w = (w + 1) / 2;
+    int quadrant_h = (h + 1) / 2;
+    int quadrant_x = std::min(live_rect.x, w - (live_rect.x + live_rect.width));
+    int quadrant_y = std::min(live_rect.y, h - (live_rect.y + live_rect.height));
+    cv::Rect quadrant_rect(quadrant_x, quadrant_y, quadrant_w - quadrant_x, quadrant_h - quadrant_y);
+    cl::Kernel *kernel = GetSelectedKernel(MakeKernelVariant(quadrant_rect));
+    kernel->setArg(0, in_image);
+    kernel->setArg(1, out_image);
+    kernel->setArg(2, image_size);
+    kernel->setArg(3, center_coords);
+    kernel->setArg(4, parameter.CalcFocalDistance());
+    EnqueueKernel2D(command_queue_, *kernel, quadrant_rect, event);
 }
 
+SymmetricBarrelKernelManager::SymmetricBarrelKernelManager(const cl::Program *program, cl::CommandQueue *command_queue) :
+    DistortionKernelManager(program, command_queue, "SymmetricBarrel") {}
+
+void SymmetricBarrelKernelManager::CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                                    OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                                    cl::Event *event) {
+    cl_int2 image_size = {w, h};
+    cl_float2 center_coords = {
+        (w - 1) / 2.0f + parameter.center_pos.x,
+        (h - 1) / 2.0f + parameter.center_pos.y
+    };
+    // Threads only cover the left-top quadrant, from the first pixel which is
+    // in live_rect or mirrored into it
+    int quadrant_w = (w + 1) / 2;
+    int quadrant_h = (h + 1) / 2;
+    int quadrant_x = std::min(live_rect.x, w - (live_rect.x + live_rect.width));
+    int quadrant_y = std::min(live_rect.y, h - (live_rect.y + live_rect.height));
+    cv::Rect quadrant_rect(quadrant_x, quadrant_y, quadrant_w - quadrant_x, quadrant_h - quadrant_y);
+    cl::Kernel *kernel = GetSelectedKernel(MakeKernelVariant(quadrant_rect));
+    kernel->setArg(0, in_image);
+    kernel->setArg(1, out_image);
+    kernel->setArg(2, image_size);
+    kernel->setArg(3, center_coords);
+    kernel->setArg(4, parameter.CalcFocalDistance());
+    EnqueueKernel2D(command_queue_, *kernel, quadrant_rect, event);
+}
+
+MSSpoolKernelManager::MSSpoolKernelManager(const cl::Program *program, cl::CommandQueue *command_queue) :
+    DistortionKernelManager(program, command_queue, "MultiSamplingSpool") {}
+
+void MSSpoolKernelManager::CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                                      OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                                    cl::Event *event) {
+    cl_int2 image_size = {w, h};
+    cl_float2 center_coords = {
+        (w - 1) / 2.0f + parameter.center_pos.x,
+        (h - 1) / 2.0f + parameter.center_pos.y
+    };
+    cl::Kernel *kernel = GetSelectedKernel(MakeMSKernelVariant(live_rect, parameter));
+    kernel->setArg(0, in_image);
+    kernel->setArg(1, out_image);
+    kernel->setArg(2, image_size);
+    kernel->setArg(3, center_coords);
+    kernel->setArg(4, parameter.CalcFocalDistance());
+    kernel->setArg(5, parameter.GetAAMaxSampling(4));
+    // Non-positive quality selects the fixed sampling
+    kernel->setArg(6, parameter.aa_adaptive ? parameter.aa_quality : 0.f);
+    EnqueueKernel2D(command_queue_, *kernel, live_rect, event);
+}
+
+MSBarrelKernelManager::MSBarrelKernelManager(const cl::Program *program, cl::CommandQueue *command_queue) :
+    DistortionKernelManager(program, command_queue, "MultiSamplingBarrel") {}
+
 void MSBarrelKernelManager::CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
-                                    OpticsCompensationParameter parameter) {
+                                    OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                                    cl::Event *event) {
     cl_int2 image_size = {w, h};
     cl_float2 center_coords = {
         (w - 1) / 2.0f + parameter.center_pos.x,
         (h - 1) / 2.0f + parameter.center_pos.y
     };
-    int block_size = 16;
-    kernel_->setArg(0, in_image);
-    kernel_->setArg(1, out_image);
-    kernel_->setArg(2, image_size);
-    kernel_->setArg(3, center_coords);
-    kernel_->setArg(4, parameter.CalcFocalDistance());
-    kernel_->setArg(5, 4);
-    cl::NDRange global(
-        static_cast<std::size_t>(std::ceil(w / static_cast<float>(block_size))) * block_size,
-        static_cast<std::size_t>(std::ceil(h / static_cast<float>(block_size))) * block_size,
-        1
-    );
-    cl::NDRange local(block_size, block_size, 1);
-    command_queue_->enqueueNDRangeKernel(*kernel_, cl::NDRange(0, 0, 0), global, local);
+    cl::Kernel *kernel = GetSelectedKernel(MakeMSKernelVariant(live_rect, parameter));
+    kernel->setArg(0, in_image);
+    kernel->setArg(1, out_image);
+    kernel->setArg(2, image_size);
+    kernel->setArg(3, center_coords);
+    kernel->setArg(4, parameter.CalcFocalDistance());
+    kernel->setArg(5, parameter.GetAAMaxSampling(4));
+    // Non-positive quality selects the fixed sampling
+    kernel->setArg(6, parameter.aa_adaptive ? parameter.aa_quality : 0.f);
+    EnqueueKernel2D(command_queue_, *kernel, live_rect, event);
+}
+
+// Arguments of the camera models from 4 on, the same for both kernels
+static int SetLensModelArgs(cl::Kernel *kernel, int w, int h, const OpticsCompensationParameter &parameter) {
+    const LensCoefficients &lens = parameter.lens;
+    cl_float8 coefficients = {lens.k1, lens.k2, lens.k3, lens.k4, lens.p1, lens.p2, 0, 0};
+    kernel->setArg(4, parameter.CalcLensFocalLength(w, h));
+    kernel->setArg(5, coefficients);
+    kernel->setArg(6, static_cast<cl_int>(parameter.lens_model));
+    kernel->setArg(7, static_cast<cl_int>(lens.undistort));
+    return 8;
+}
+
+LensModelKernelManager::LensModelKernelManager(const cl::Program *program, cl::CommandQueue *command_queue) :
+    DistortionKernelManager(program, command_queue, "LensModel") {}
+
+void LensModelKernelManager::CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                                        OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                                        cl::Event *event) {
+    cl_int2 image_size = {w, h};
+    cl_float2 center_coords = {
+        (w - 1) / 2.0f + parameter.center_pos.x,
+        (h - 1) / 2.0f + parameter.center_pos.y
+    };
+    cl::Kernel *kernel = GetSelectedKernel(MakeKernelVariant(live_rect));
+    kernel->setArg(0, in_image);
+    kernel->setArg(1, out_image);
+    kernel->setArg(2, image_size);
+    kernel->setArg(3, center_coords);
+    SetLensModelArgs(kernel, w, h, parameter);
+    EnqueueKernel2D(command_queue_, *kernel, live_rect, event);
+}
+
+MSLensModelKernelManager::MSLensModelKernelManager(const cl::Program *program, cl::CommandQueue *command_queue) :
+    DistortionKernelManager(program, command_queue, "MultiSamplingLensModel") {}
+
+void MSLensModelKernelManager::CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                                          OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                                          cl::Event *event) {
+    cl_int2 image_size = {w, h};
+    cl_float2 center_coords = {
+        (w - 1) / 2.0f + parameter.center_pos.x,
+        (h - 1) / 2.0f + parameter.center_pos.y
+    };
+    cl::Kernel *kernel = GetSelectedKernel(MakeMSKernelVariant(live_rect, parameter));
+    kernel->setArg(0, in_image);
+    kernel->setArg(1, out_image);
+    kernel->setArg(2, image_size);
+    kernel->setArg(3, center_coords);
+    int arg_index = SetLensModelArgs(kernel, w, h, parameter);
+    kernel->setArg(arg_index, parameter.GetAAMaxSampling(4));
+    // Non-positive quality selects the fixed sampling
+    kernel->setArg(arg_index + 1, parameter.aa_adaptive ? parameter.aa_quality : 0.f);
+    EnqueueKernel2D(command_queue_, *kernel, live_rect, event);
+}
+
+RemapKernelManager::RemapKernelManager(const cl::Program *program, cl::CommandQueue *command_queue) :
+    DistortionKernelManager(program, command_queue, "Remap"),
+    coords_buffer_(nullptr),
+    coords_size_(0) {
+    build_kernel_ = new cl::Kernel(*program, "BuildRemapCoords");
+    ms_kernel_ = new cl::Kernel(*program, "MultiSamplingRemap");
+    fused_ms_kernel_ = new cl::Kernel(*program, "FusedMultiSamplingRemap");
+}
+
+RemapKernelManager::~RemapKernelManager() {
+    delete build_kernel_;
+    delete ms_kernel_;
+    delete fused_ms_kernel_;
+    delete coords_buffer_;
+}
+
+void RemapKernelManager::UpdateCoords(int w, int h, OpticsCompensationParameter parameter) {
+    RemapTableKey key(aut::Size2D(w, h), parameter);
+    if (HasCoords(key))
+        return;
+
+    // Corners of the pixels for the anti-aliasing
+    cl_int2 grid_size = {parameter.anti_aliasing ? w + 1 : w, parameter.anti_aliasing ? h + 1 : h};
+    std::size_t coords_size = static_cast<std::size_t>(grid_size.s[0]) * grid_size.s[1] * sizeof(cl_float2);
+    if (coords_size > coords_size_) {
+        Clear();
+        // The kernels of the previous frames are on the same in-order queue,
+        // so the old buffer is released after them
+        cl::Context context = command_queue_->getInfo<CL_QUEUE_CONTEXT>();
+        coords_buffer_ = new cl::Buffer(context, CL_MEM_READ_WRITE, coords_size);
+        coords_size_ = coords_size;
+    }
+
+    cl_float2 center_coords = {
+        (w - 1) / 2.0f + parameter.center_pos.x,
+        (h - 1) / 2.0f + parameter.center_pos.y
+    };
+    const LensCoefficients &lens = parameter.lens;
+    cl_float8 coefficients = {lens.k1, lens.k2, lens.k3, lens.k4, lens.p1, lens.p2, 0, 0};
+    bool lens_model = parameter.lens_model != lens_tan;
+    build_kernel_->setArg(0, *coords_buffer_);
+    build_kernel_->setArg(1, grid_size);
+    build_kernel_->setArg(2, parameter.anti_aliasing ? -0.5f : 0.f);
+    build_kernel_->setArg(3, center_coords);
+    build_kernel_->setArg(4, lens_model ? 0.f : parameter.CalcFocalDistance());
+    build_kernel_->setArg(5, static_cast<cl_int>(parameter.spool_mode));
+    build_kernel_->setArg(6, lens_model ? parameter.CalcLensFocalLength(w, h) : 0.f);
+    build_kernel_->setArg(7, coefficients);
+    build_kernel_->setArg(8, static_cast<cl_int>(parameter.lens_model));
+    build_kernel_->setArg(9, static_cast<cl_int>(lens.undistort));
+    EnqueueKernel2D(command_queue_, *build_kernel_, grid_size.s[0], grid_size.s[1]);
+    key_.reset(new RemapTableKey(key));
+}
+
+void RemapKernelManager::CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                                    OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                                    cl::Event *event) {
+    cl_int2 image_size = {w, h};
+    cl::Kernel *kernel;
+    if (parameter.anti_aliasing) {
+        cl::Kernel *variant_kernel = GetVariantKernel(fused_ ? "FusedMultiSamplingRemap" : "MultiSamplingRemap",
+                                                      MakeMSKernelVariant(live_rect, parameter));
+        kernel = variant_kernel ? variant_kernel : fused_ ? fused_ms_kernel_ : ms_kernel_;
+    } else {
+        kernel = GetSelectedKernel(MakeKernelVariant(live_rect));
+    }
+    kernel->setArg(0, in_image);
+    kernel->setArg(1, out_image);
+    kernel->setArg(2, image_size);
+    kernel->setArg(3, *coords_buffer_);
+    if (parameter.anti_aliasing) {
+        kernel->setArg(4, parameter.GetAAMaxSampling(4));
+        // Non-positive quality selects the fixed sampling
+        kernel->setArg(5, parameter.aa_adaptive ? parameter.aa_quality : 0.f);
+    }
+    EnqueueKernel2D(command_queue_, *kernel, live_rect, event);
+}
+
+void RemapKernelManager::Clear() {
+    delete coords_buffer_;
+    coords_buffer_ = nullptr;
+    coords_size_ = 0;
+    key_.reset();
+}
+
+AnisotropicKernelManager::AnisotropicKernelManager(const cl::Program *program,
+                                                               cl::CommandQueue *command_queue) :
+    DistortionKernelManager(program, command_queue, "Anisotropic"),
+    pyramid_buffer_(nullptr),
+    pyramid_size_(0) {
+    mip_level0_kernel_ = new cl::Kernel(*program, "MipLevel0");
+    fused_mip_level0_kernel_ = new cl::Kernel(*program, "FusedMipLevel0");
+    downsample_kernel_ = new cl::Kernel(*program, "DownsampleMip");
+}
+
+AnisotropicKernelManager::~AnisotropicKernelManager() {
+    delete mip_level0_kernel_;
+    delete fused_mip_level0_kernel_;
+    delete downsample_kernel_;
+    delete pyramid_buffer_;
+}
+
+void AnisotropicKernelManager::ReservePyramidBuffer(std::size_t size) {
+    if (size <= pyramid_size_)
+        return;
+
+    delete pyramid_buffer_;
+    pyramid_buffer_ = nullptr;
+    pyramid_size_ = 0;
+    // The kernels of the previous frames are on the same in-order queue,
+    // so the old buffer is released after them
+    cl::Context context = command_queue_->getInfo<CL_QUEUE_CONTEXT>();
+    pyramid_buffer_ = new cl::Buffer(context, CL_MEM_READ_WRITE, size);
+    pyramid_size_ = size;
+}
+
+void AnisotropicKernelManager::CallKernel(cl::Image2D &in_image, cl::Image2D &out_image,
+                                                int w, int h,
+                                                OpticsCompensationParameter parameter,
+                                                const cv::Rect &output_rect, cl::Event *event) {
+    // Levels down to 1x1, with the same sizes as GetMipLevelSize in kernel.cl
+    cl_int2 image_size = {w, h};
+    std::vector<cl_int2> level_sizes(1, image_size);
+    std::size_t pixel_num = static_cast<std::size_t>(w) * h;
+    while (level_sizes.back().s[0] > 1 || level_sizes.back().s[1] > 1) {
+        cl_int2 size = {(level_sizes.back().s[0] + 1) / 2, (level_sizes.back().s[1] + 1) / 2};
+        level_sizes.push_back(size);
+        pixel_num += static_cast<std::size_t>(size.s[0]) * size.s[1];
+    }
+    // half4 per pixel
+    ReservePyramidBuffer(pixel_num * 4 * sizeof(cl_half));
+
+    cl::Kernel *level0_kernel = fused_ ? fused_mip_level0_kernel_ : mip_level0_kernel_;
+    level0_kernel->setArg(0, in_image);
+    level0_kernel->setArg(1, *pyramid_buffer_);
+    level0_kernel->setArg(2, image_size);
+    EnqueueKernel2D(command_queue_, *level0_kernel, w, h);
+
+    cl_int offset = 0;
+    for (std::size_t level = 1; level < level_sizes.size(); level++) {
+        cl_int2 src_size = level_sizes[level - 1];
+        cl_int2 dst_size = level_sizes[level];
+        cl_int dst_offset = offset + src_size.s[0] * src_size.s[1];
+        downsample_kernel_->setArg(0, *pyramid_buffer_);
+        downsample_kernel_->setArg(1, offset);
+        downsample_kernel_->setArg(2, src_size);
+        downsample_kernel_->setArg(3, dst_offset);
+        downsample_kernel_->setArg(4, dst_size);
+        EnqueueKernel2D(command_queue_, *downsample_kernel_, dst_size.s[0], dst_size.s[1]);
+        offset = dst_offset;
+    }
+
+    cl_float2 center_coords = {
+        (w - 1) / 2.0f + parameter.center_pos.x,
+        (h - 1) / 2.0f + parameter.center_pos.y
+    };
+    cl::Kernel *kernel = GetSelectedKernel();
+    kernel->setArg(0, *pyramid_buffer_);
+    kernel->setArg(1, out_image);
+    kernel->setArg(2, image_size);
+    kernel->setArg(3, center_coords);
+    kernel->setArg(4, parameter.CalcFocalDistance());
+    kernel->setArg(5, parameter.GetAAMaxSampling(kDefaultMaxAnisotropy));
+    kernel->setArg(6, static_cast<cl_int>(level_sizes.size()));
+    kernel->setArg(7, static_cast<cl_int>(parameter.spool_mode));
+    EnqueueKernel2D(command_queue_, *kernel, output_rect, event);
+}
+
+DistortionKernelSet::DistortionKernelSet(const cl::Program *program, cl::CommandQueue *command_queue) :
+    command_queue_(command_queue),
+    remap_coords_(true) {
+    spool_kernel_manager_ = new SpoolKernelManager(program, command_queue);
+    barrel_kernel_manager_ = new BarrelKernelManager(program, command_queue);
+    symmetric_spool_kernel_manager_ = new SymmetricSpoolKernelManager(program, command_queue);
+    symmetric_barrel_kernel_manager_ = new SymmetricBarrelKernelManager(program, command_queue);
+    ms_spool_kernel_manager_ = new MSSpoolKernelManager(program, command_queue);
+    ms_barrel_kernel_manager_ = new MSBarrelKernelManager(program, command_queue);
+    lens_model_kernel_manager_ = new LensModelKernelManager(program, command_queue);
+    ms_lens_model_kernel_manager_ = new MSLensModelKernelManager(program, command_queue);
+    anisotropic_kernel_manager_ = new AnisotropicKernelManager(program, command_queue);
+    remap_kernel_manager_ = new RemapKernelManager(program, command_queue);
+}
+
+DistortionKernelSet::~DistortionKernelSet() {
+    delete spool_kernel_manager_;
+    delete barrel_kernel_manager_;
+    delete symmetric_spool_kernel_manager_;
+    delete symmetric_barrel_kernel_manager_;
+    delete ms_spool_kernel_manager_;
+    delete ms_barrel_kernel_manager_;
+    delete lens_model_kernel_manager_;
+    delete ms_lens_model_kernel_manager_;
+    delete anisotropic_kernel_manager_;
+    delete remap_kernel_manager_;
+}
+
+void DistortionKernelSet::SetFused(bool fused) {
+    spool_kernel_manager_->SetFused(fused);
+    barrel_kernel_manager_->SetFused(fused);
+    symmetric_spool_kernel_manager_->SetFused(fused);
+    symmetric_barrel_kernel_manager_->SetFused(fused);
+    ms_spool_kernel_manager_->SetFused(fused);
+    ms_barrel_kernel_manager_->SetFused(fused);
+    lens_model_kernel_manager_->SetFused(fused);
+    ms_lens_model_kernel_manager_->SetFused(fused);
+    anisotropic_kernel_manager_->SetFused(fused);
+    remap_kernel_manager_->SetFused(fused);
+}
+
+void DistortionKernelSet::SetProgramVariants(CLProgramVariants *program_variants) {
+    spool_kernel_manager_->SetProgramVariants(program_variants);
+    barrel_kernel_manager_->SetProgramVariants(program_variants);
+    symmetric_spool_kernel_manager_->SetProgramVariants(program_variants);
+    symmetric_barrel_kernel_manager_->SetProgramVariants(program_variants);
+    ms_spool_kernel_manager_->SetProgramVariants(program_variants);
+    ms_barrel_kernel_manager_->SetProgramVariants(program_variants);
+    lens_model_kernel_manager_->SetProgramVariants(program_variants);
+    ms_lens_model_kernel_manager_->SetProgramVariants(program_variants);
+    remap_kernel_manager_->SetProgramVariants(program_variants);
+}
+
+void DistortionKernelSet::SetRemapCoords(bool enable) {
+    remap_coords_ = enable;
+    if (!remap_coords_) {
+        remap_kernel_manager_->Clear();
+        last_key_.reset();
+    }
+}
+
+void DistortionKernelSet::CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                                     OpticsCompensationParameter parameter, cl::Event *event) {
+    CallKernel(in_image, out_image, w, h, parameter, cv::Rect(0, 0, w, h), event);
+}
+
+void DistortionKernelSet::CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                                     OpticsCompensationParameter parameter,
+                                     const cv::Rect &occupied_rect, cl::Event *event) {
+    CallKernel(in_image, out_image, w, h, parameter, occupied_rect, cv::Rect(0, 0, w, h), event);
+}
+
+void DistortionKernelSet::CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                                     OpticsCompensationParameter parameter, const cv::Rect &occupied_rect,
+                                     const cv::Rect &output_rect, cl::Event *event) {
+    cv::Rect image_rect(0, 0, w, h);
+    // Symmetric kernels write the mirrored pixels too, so they need the whole image
+    bool centered = parameter.center_pos.x == 0 && parameter.center_pos.y == 0 &&
+                    output_rect == image_rect;
+    bool lens_model = parameter.lens_model != lens_tan;
+    bool anisotropic = parameter.anti_aliasing && parameter.aa_filter == aa_anisotropic && !lens_model;
+    cv::Rect live_rect = output_rect & image_rect;
+    if (!anisotropic) {
+        glm::vec2 center_coord((w - 1) / 2.0f + parameter.center_pos.x,
+                               (h - 1) / 2.0f + parameter.center_pos.y);
+        live_rect &= CalcLiveRect(aut::Size2D(w, h), occupied_rect, center_coord, parameter);
+    }
+    // Barrel with amount 1 leaves the image empty, and so does a source out of reach
+    if (live_rect.empty() || parameter.IsEmptyOutput()) {
+        cv::Rect clear_rect = output_rect & image_rect;
+        cl::size_t<3> origin;
+        origin[0] = clear_rect.x;
+        origin[1] = clear_rect.y;
+        origin[2] = 0;
+        cl::size_t<3> region;
+        region[0] = clear_rect.width;
+        region[1] = clear_rect.height;
+        region[2] = 1;
+        cl_float4 empty_color = {0, 0, 0, 0};
+        command_queue_->enqueueFillImage(out_image, empty_color, origin, region, nullptr, event);
+        return;
+    }
+    if (live_rect != (output_rect & image_rect))
+        ClearOutside(out_image, output_rect & image_rect, live_rect);
+
+    // A parameter held for two frames in a row is likely static, so its coords are built
+    // then and kept while it stays. Animated parameters keep evaluating the distortion.
+    if (remap_coords_ && !anisotropic) {
+        RemapTableKey key(aut::Size2D(w, h), parameter);
+        bool held = last_key_ && *last_key_ == key;
+        last_key_.reset(new RemapTableKey(key));
+        if (held || remap_kernel_manager_->HasCoords(key)) {
+            remap_kernel_manager_->UpdateCoords(w, h, parameter);
+            remap_kernel_manager_->CallKernel(in_image, out_image, w, h, parameter, live_rect, event);
+            return;
+        }
+    }
+
+    if (lens_model) {
+        if (parameter.anti_aliasing) {
+            ms_lens_model_kernel_manager_->CallKernel(in_image, out_image, w, h, parameter, live_rect, event);
+        } else {
+            lens_model_kernel_manager_->CallKernel(in_image, out_image, w, h, parameter, live_rect, event);
+        }
+    } else if (parameter.spool_mode) {
+        if (anisotropic) {
+            anisotropic_kernel_manager_->CallKernel(in_image, out_image, w, h, parameter, live_rect, event);
+        } else if (parameter.anti_aliasing) {
+            ms_spool_kernel_manager_->CallKernel(in_image, out_image, w, h, parameter, live_rect, event);
+        } else if (centered) {
+            symmetric_spool_kernel_manager_->CallKernel(in_image, out_image, w, h, parameter, live_rect, event);
+        } else {
+            spool_kernel_manager_->CallKernel(in_image, out_image, w, h, parameter, live_rect, event);
+        }
+    } else {
+        if (anisotropic) {
+            anisotropic_kernel_manager_->CallKernel(in_image, out_image, w, h, parameter, live_rect, event);
+        } else if (parameter.anti_aliasing) {
+            ms_barrel_kernel_manager_->CallKernel(in_image, out_image, w, h, parameter, live_rect, event);
+        } else if (centered) {
+            symmetric_barrel_kernel_manager_->CallKernel(in_image, out_image, w, h, parameter, live_rect, event);
+        } else {
+            barrel_kernel_manager_->CallKernel(in_image, out_image, w, h, parameter, live_rect, event);
+        }
+    }
+}
+
+void DistortionKernelSet::ClearOutside(cl::Image2D &out_image, const cv::Rect &bounds,
+                                       const cv::Rect &rect) {
+    // Bands above and below rect, and the sides of rect between them
+    int right = bounds.x + bounds.width;
+    int bottom = bounds.y + bounds.height;
+    cv::Rect bands[] = {
+        cv::Rect(bounds.x, bounds.y, bounds.width, rect.y - bounds.y),
+        cv::Rect(bounds.x, rect.y + rect.height, bounds.width, bottom - (rect.y + rect.height)),
+        cv::Rect(bounds.x, rect.y, rect.x - bounds.x, rect.height),
+        cv::Rect(rect.x + rect.width, rect.y, right - (rect.x + rect.width), rect.height)
+    };
+    cl_float4 empty_color = {0, 0, 0, 0};
+    for (auto &band : bands) {
+        if (band.empty())
+            continue;
+        cl::size_t<3> origin;
+        origin[0] = band.x;
+        origin[1] = band.y;
+        origin[2] = 0;
+        cl::size_t<3> region;
+        region[0] = band.width;
+        region[1] = band.height;
+        region[2] = 1;
+        command_queue_->enqueueFillImage(out_image, empty_color, origin, region);
+    }
 }
 
 PremultKernelManager::PremultKernelManager(const::cl::Program *program, cl::CommandQueue *command_queue) :
@@ -88,7 +696,8 @@ PremultKernelManager::PremultKernelManager(const::cl::Program *program, cl::Comm
     SetCommandQueue(command_queue);
 }
 
-void PremultKernelManager::CallPremult(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h) {
+void PremultKernelManager::CallPremult(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                                       cl::Event *event) {
     cl_int2 image_size = {w, h};
 
     kernel_->setArg(0, in_image);
@@ -103,7 +712,8 @@ void PremultKernelManager::CallPremult(cl::Image2D &in_image, cl::Image2D &out_i
     );
     cl::NDRange local(block_size, block_size, 1);
 
-    command_queue_->enqueueNDRangeKernel(*kernel_, cl::NDRange(0, 0, 0), global, local);
+    command_queue_->enqueueNDRangeKernel(*kernel_, cl::NDRange(0, 0, 0), global, local,
+                                         nullptr, event);
 }
 
 UnpremultKernelManager::UnpremultKernelManager(const::cl::Program *program, cl::CommandQueue *command_queue) :
@@ -111,7 +721,8 @@ UnpremultKernelManager::UnpremultKernelManager(const::cl::Program *program, cl::
     SetCommandQueue(command_queue);
 }
 
-void UnpremultKernelManager::CallUnpremult(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h) {
+void UnpremultKernelManager::CallUnpremult(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                                           cl::Event *event) {
     cl_int2 image_size = {w, h};
 
     kernel_->setArg(0, in_image);
@@ -126,5 +737,6 @@ void UnpremultKernelManager::CallUnpremult(cl::Image2D &in_image, cl::Image2D &o
     );
     cl::NDRange local(block_size, block_size, 1);
 
-    command_queue_->enqueueNDRangeKernel(*kernel_, cl::NDRange(0, 0, 0), global, local);
+    command_queue_->enqueueNDRangeKernel(*kernel_, cl::NDRange(0, 0, 0), global, local,
+                                         nullptr, event);
 }
\ No newline at end of file
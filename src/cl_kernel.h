@@ -1,45 +1,287 @@
 #ifndef _OPTICSCOMPENSATION_S_SRC_CL_KERNEL_H_
 #define _OPTICSCOMPENSATION_S_SRC_CL_KERNEL_H_
 
+#include <cstddef>
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <opencv2/opencv.hpp>
 #include "cl_manager.h"
+#include "cl_program_cache.h"
 #include "parameter.h"
+#include "remap_table.h"
 
-class SpoolKernelManager : public CLKernelManager {
+// Defines of kernel.cl which specialize the distortion kernels of a build
+struct CLKernelVariant {
+    CLKernelVariant() : aa_samples(0), full_groups(false) {}
+
+    bool IsGeneric() const { return aa_samples == 0 && !full_groups; }
+    // -D options of the build
+    std::string MakeBuildOptions() const;
+
+    // Samples per axis of the fixed anti-aliasing, 0 takes the kernel arguments
+    int aa_samples;
+    // Enqueued only over whole work-groups inside the area, so the bounds check is dropped
+    bool full_groups;
+};
+
+// Programs of the kernel source built for the variants. A variant is built on a thread
+// on its first use, and the generic kernels run until it is ready. The builds go through
+// program_cache, so the variants are loaded from the disk on the next start.
+class CLProgramVariants {
+public:
+    CLProgramVariants(const cl::Context &context, const std::string &source,
+                      std::shared_ptr<CLProgramCache> program_cache = nullptr);
+    // Waits for the builds in flight
+    ~CLProgramVariants();
+
+    // Program of the variant, nullptr for the generic one, while it is built or if it failed
+    const cl::Program* GetProgram(const CLKernelVariant &variant);
+    // Wait for the builds in flight, so the next GetProgram() of them returns the program
+    void WaitBuilds();
+    // Variants built successfully so far
+    int GetBuiltNum() const;
+
+private:
+    struct Build {
+        std::future<cl::Program*> future;
+        std::unique_ptr<cl::Program> program;
+    };
+
+    // Move a finished build to its program
+    static void CollectBuild(Build *build);
+
+    cl::Context context_;
+    std::string source_;
+    std::shared_ptr<CLProgramCache> program_cache_;
+    // Keyed on the build options
+    std::map<std::string, Build> builds_;
+};
+
+// Distortion kernel with a fused variant ("Fused" + kernel name), which takes the
+// straight alpha image and does Premult and Unpremult itself.
+// CallKernel of the subclasses only writes the pixels in live_rect.
+class DistortionKernelManager : public CLKernelManager {
+public:
+    DistortionKernelManager(const cl::Program *program, cl::CommandQueue *command_queue,
+                            const std::string &kernel_name);
+    ~DistortionKernelManager();
+
+    void SetFused(bool fused) { fused_ = fused; }
+    bool IsFused() const { return fused_; }
+    // Take the kernels of the specialized programs once they are built, nullptr only
+    // runs the generic ones. program_variants must outlive the manager.
+    void SetProgramVariants(CLProgramVariants *program_variants) { program_variants_ = program_variants; }
+
+protected:
+    cl::Kernel* GetSelectedKernel() const { return fused_ ? fused_kernel_ : kernel_; }
+    // GetSelectedKernel() of the program of variant when it is ready
+    cl::Kernel* GetSelectedKernel(const CLKernelVariant &variant);
+    // Kernel of the program of variant, nullptr until it is ready
+    cl::Kernel* GetVariantKernel(const std::string &kernel_name, const CLKernelVariant &variant);
+
+    cl::Kernel *fused_kernel_;
+    bool fused_;
+    CLProgramVariants *program_variants_;
+    // Kernels created from the programs of the variants, keyed on the program and the name
+    std::map<std::pair<const cl::Program*, std::string>, cl::Kernel*> variant_kernels_;
+};
+
+class SpoolKernelManager : public DistortionKernelManager {
 public:
     SpoolKernelManager(const cl::Program *program, cl::CommandQueue *command_queue);
 
     void CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
-                    OpticsCompensationParameter parameter);
+                    OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                    cl::Event *event = nullptr);
 };
 
-class BarrelKernelManager : public CLKernelManager {
+class BarrelKernelManager : public DistortionKernelManager {
 public:
     BarrelKernelManager(const cl::Program *program, cl::CommandQueue *command_queue);
 
     void CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
-                    OpticsCompensationParameter parameter);
+                    OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                    cl::Event *event = nullptr);
 };
 
-class MSBarrelKernelManager : public CLKernelManager {
+// Kernels for a centered lens, which evaluate the distortion once per 4 mirrored pixels
+class SymmetricSpoolKernelManager : public DistortionKernelManager {
+public:
+    SymmetricSpoolKernelManager(const cl::Program *program, cl::CommandQueue *command_queue);
+
+    void CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                    OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                    cl::Event *event = nullptr);
+};
+
+class SymmetricBarrelKernelManager : public DistortionKernelManager {
+public:
+    SymmetricBarrelKernelManager(const cl::Program *program, cl::CommandQueue *command_queue);
+
+    void CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                    OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                    cl::Event *event = nullptr);
+};
+
+// Anti-aliasing kernels, which sample inside the quad of the corners of every pixel
+class MSSpoolKernelManager : public DistortionKernelManager {
+public:
+    MSSpoolKernelManager(const cl::Program *program, cl::CommandQueue *command_queue);
+
+    void CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                    OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                    cl::Event *event = nullptr);
+};
+
+class MSBarrelKernelManager : public DistortionKernelManager {
 public:
     MSBarrelKernelManager(const cl::Program *program, cl::CommandQueue *command_queue);
 
     void CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
-                    OpticsCompensationParameter parameter);
+                    OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                    cl::Event *event = nullptr);
+};
+
+// Camera models of parameter.lens_model, evaluated per pixel.
+// The inverse runs Newton's method from every pixel itself.
+class LensModelKernelManager : public DistortionKernelManager {
+public:
+    LensModelKernelManager(const cl::Program *program, cl::CommandQueue *command_queue);
+
+    void CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                    OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                    cl::Event *event = nullptr);
+};
+
+// Anti-aliasing of the camera models, the anisotropic filter also falls back to it
+class MSLensModelKernelManager : public DistortionKernelManager {
+public:
+    MSLensModelKernelManager(const cl::Program *program, cl::CommandQueue *command_queue);
+
+    void CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                    OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                    cl::Event *event = nullptr);
+};
+
+// Kernels which read the source coords of the pixels, or of their corners when
+// anti-aliasing, from a buffer kept on the device, instead of evaluating the distortion
+// for every pixel of every frame. The buffer is rebuilt when the parameter or the image
+// size changes. Covers every lens except the anisotropic filter.
+class RemapKernelManager : public DistortionKernelManager {
+public:
+    RemapKernelManager(const cl::Program *program, cl::CommandQueue *command_queue);
+    ~RemapKernelManager();
+
+    // True if the buffer holds the coords of the key
+    bool HasCoords(const RemapTableKey &key) const { return key_ && *key_ == key; }
+    // Enqueue the build of the coords unless the buffer already holds them
+    void UpdateCoords(int w, int h, OpticsCompensationParameter parameter);
+    // The coords must be up to date
+    void CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                    OpticsCompensationParameter parameter, const cv::Rect &live_rect,
+                    cl::Event *event = nullptr);
+    // Release the buffer
+    void Clear();
+    std::size_t GetByteSize() const { return coords_size_; }
+
+private:
+    cl::Kernel *build_kernel_;
+    cl::Kernel *ms_kernel_;
+    cl::Kernel *fused_ms_kernel_;
+    cl::Buffer *coords_buffer_;
+    std::size_t coords_size_;
+    std::unique_ptr<RemapTableKey> key_;
+};
+
+// Anisotropic filter of the anti-aliasing of both modes. Builds the mip pyramid of the source
+// in a buffer kept across frames, then takes the taps along the major axis of every pixel.
+// The fused variant builds the pyramid from the straight alpha image.
+class AnisotropicKernelManager : public DistortionKernelManager {
+public:
+    AnisotropicKernelManager(const cl::Program *program, cl::CommandQueue *command_queue);
+    ~AnisotropicKernelManager();
+
+    // event receives the sampling kernel, the commands of the pyramid come before it.
+    // The pyramid is built from the whole image, only output_rect is sampled.
+    void CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                    OpticsCompensationParameter parameter, const cv::Rect &output_rect,
+                    cl::Event *event = nullptr);
+
+private:
+    // Grow the pyramid buffer to size bytes
+    void ReservePyramidBuffer(std::size_t size);
+
+    cl::Kernel *mip_level0_kernel_;
+    cl::Kernel *fused_mip_level0_kernel_;
+    cl::Kernel *downsample_kernel_;
+    cl::Buffer *pyramid_buffer_;
+    std::size_t pyramid_size_;
+};
+
+// All the distortion kernels bound to a command queue, picking the kernel for the parameter
+class DistortionKernelSet {
+public:
+    DistortionKernelSet(const cl::Program *program, cl::CommandQueue *command_queue);
+    ~DistortionKernelSet();
+
+    void SetFused(bool fused);
+    // See DistortionKernelManager::SetProgramVariants()
+    void SetProgramVariants(CLProgramVariants *program_variants);
+    // Use the remap kernels for a parameter held for two frames in a row
+    void SetRemapCoords(bool enable);
+    bool IsRemapCoordsEnabled() const { return remap_coords_; }
+    RemapKernelManager* GetRemapKernelManager() { return remap_kernel_manager_; }
+
+    // Enqueue the distortion, out_image is cleared for barrel with amount 1
+    void CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                    OpticsCompensationParameter parameter, cl::Event *event = nullptr);
+    // Distort only the output pixels which can sample occupied_rect of the source,
+    // and clear the others. occupied_rect must hold every pixel with alpha != 0.
+    void CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                    OpticsCompensationParameter parameter, const cv::Rect &occupied_rect,
+                    cl::Event *event = nullptr);
+    // Distort only output_rect of the image, like a band of the frame on one of several devices.
+    // The pixels of out_image out of output_rect are left undefined.
+    void CallKernel(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                    OpticsCompensationParameter parameter, const cv::Rect &occupied_rect,
+                    const cv::Rect &output_rect, cl::Event *event = nullptr);
+
+private:
+    // Clear the pixels of bounds out of rect, which is in bounds
+    void ClearOutside(cl::Image2D &out_image, const cv::Rect &bounds, const cv::Rect &rect);
+
+    cl::CommandQueue *command_queue_;
+    SpoolKernelManager *spool_kernel_manager_;
+    BarrelKernelManager *barrel_kernel_manager_;
+    SymmetricSpoolKernelManager *symmetric_spool_kernel_manager_;
+    SymmetricBarrelKernelManager *symmetric_barrel_kernel_manager_;
+    MSSpoolKernelManager *ms_spool_kernel_manager_;
+    MSBarrelKernelManager *ms_barrel_kernel_manager_;
+    LensModelKernelManager *lens_model_kernel_manager_;
+    MSLensModelKernelManager *ms_lens_model_kernel_manager_;
+    AnisotropicKernelManager *anisotropic_kernel_manager_;
+    RemapKernelManager *remap_kernel_manager_;
+    bool remap_coords_;
+    // Parameter of the previous call
+    std::unique_ptr<RemapTableKey> last_key_;
 };
 
 class PremultKernelManager : public CLKernelManager {
 public:
     PremultKernelManager(const cl::Program *program, cl::CommandQueue *command_queue);
 
-    void CallPremult(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h);
+    void CallPremult(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                     cl::Event *event = nullptr);
 };
 
 class UnpremultKernelManager : public CLKernelManager {
 public:
     UnpremultKernelManager(const cl::Program *program, cl::CommandQueue *command_queue);
 
-    void CallUnpremult(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h);
+    void CallUnpremult(cl::Image2D &in_image, cl::Image2D &out_image, int w, int h,
+                       cl::Event *event = nullptr);
 };
 
 #endif // _OPTICSCOMPENSATION_S_SRC_CL_KERNEL_H_
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "cl_manager.h"
+#include <cstring>
 #include "debug_helper.h"
 #include "exception.h"
 
@@ -79,18 +80,25 @@ std::string CLDeviceManager::GetDeviceVendor(int device_index) {
 
 /* CLContextManager */
 
-CLContextManager::CLContextManager(const cl::Device *device) {
+CLContextManager::CLContextManager(const cl::Device *device) :
+    context_(nullptr) {
     if (device)
         context_ = CreateContextFromDevice(device);
 }
 
-CLContextManager::CLContextManager(cl_device_type device_type) {
+CLContextManager::CLContextManager(cl_device_type device_type) :
+    context_(nullptr) {
     context_ = CreateContextFromDeviceType(device_type);
 }
 
+CLContextManager::~CLContextManager() {
+    delete context_;
+}
+
 cl::Context* CLContextManager::CreateContextFromDevice(const cl::Device *device) {
     std::vector<cl::Device> devices = {*device};
     cl_int err;
+    delete context_;
     context_ = new cl::Context(devices, nullptr, nullptr, nullptr, &err);
     CheckCLErrorCode("Init context", err);
     return context_;
@@ -98,6 +106,7 @@ cl::Context* CLContextManager::CreateContextFromDevice(const cl::Device *device)
 
 cl::Context* CLContextManager::CreateContextFromDeviceType(cl_device_type device_type) {
     cl_int err;
+    delete context_;
     context_ = new cl::Context(device_type, nullptr, nullptr, nullptr, &err);
     CheckCLErrorCode("Init context", err);
     return context_;
@@ -106,18 +115,155 @@ cl::Context* CLContextManager::CreateContextFromDeviceType(cl_device_type device
 /* CLCommandQueueManager */
 
 CLCommandQueueManager::CLCommandQueueManager(const cl::Context *context) :
-    command_queue_(nullptr) {
+    context_(context),
+    command_queue_(nullptr),
+    host_unified_memory_(false),
+    profiling_enabled_(false),
+    transfer_mode_(transfer_auto),
+    staging_buffer_(nullptr),
+    staging_ptr_(nullptr),
+    staging_size_(0) {
     CreateCommandQueue(context);
 }
 
+CLCommandQueueManager::~CLCommandQueueManager() {
+    if (staging_buffer_) {
+        command_queue_->enqueueUnmapMemObject(*staging_buffer_, staging_ptr_);
+        command_queue_->finish();
+        delete staging_buffer_;
+    }
+    delete command_queue_;
+}
+
 cl::CommandQueue* CLCommandQueueManager::CreateCommandQueue(const cl::Context *context) {
     auto device = context->getInfo<CL_CONTEXT_DEVICES>()[0];
+    // Profiling is cheap next to the frame, so the events always carry the timestamps
+    // and the profiler can be turned on at any time
+    cl_command_queue_properties properties = 0;
+    if (device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>() & CL_QUEUE_PROFILING_ENABLE)
+        properties |= CL_QUEUE_PROFILING_ENABLE;
     cl_int err;
-    command_queue_ = new cl::CommandQueue(*context, device, 0, &err);
+    command_queue_ = new cl::CommandQueue(*context, device, properties, &err);
+    profiling_enabled_ = (properties & CL_QUEUE_PROFILING_ENABLE) != 0;
     CheckCLErrorCode("Init command queue", err);
+    // Integrated GPUs and CPU runtimes can map the images without a copy
+    host_unified_memory_ = device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE;
     return command_queue_;
 }
 
+CLCommandQueueManager::TransferMode CLCommandQueueManager::GetTransferMode() const {
+    if (transfer_mode_ != transfer_auto)
+        return transfer_mode_;
+    return host_unified_memory_ ? transfer_map : transfer_pinned;
+}
+
+void CLCommandQueueManager::UploadImage2D(const cl::Image2D &image, std::size_t w, std::size_t h,
+                                          std::size_t pixel_size, const void *ptr, cl::Event *event) {
+    std::size_t row_size = w * pixel_size;
+    cl::size_t<3> origin;
+    origin[0] = 0;
+    origin[1] = 0;
+    origin[2] = 0;
+    cl::size_t<3> region;
+    region[0] = w;
+    region[1] = h;
+    region[2] = 1;
+    switch (GetTransferMode()) {
+    case transfer_map: {
+        std::size_t row_pitch;
+        cl_int err;
+        auto *mapped = static_cast<unsigned char*>(command_queue_->enqueueMapImage(
+            image, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, origin, region,
+            &row_pitch, nullptr, nullptr, nullptr, &err));
+        CheckCLErrorCode("Map image", err);
+        auto *src = static_cast<const unsigned char*>(ptr);
+        for (std::size_t y = 0; y < h; y++)
+            std::memcpy(mapped + y * row_pitch, src + y * row_size, row_size);
+        command_queue_->enqueueUnmapMemObject(image, mapped, nullptr, event);
+        break;
+    }
+    case transfer_pinned:
+        ReserveStagingBuffer(row_size * h);
+        std::memcpy(staging_ptr_, ptr, row_size * h);
+        // Staging buffer is not touched by the host until the next download,
+        // which is queued after this write
+        command_queue_->enqueueWriteImage(image, CL_FALSE, origin, region, 0, 0, staging_ptr_,
+                                          nullptr, event);
+        break;
+    default:
+        command_queue_->enqueueWriteImage(image, CL_TRUE, origin, region, 0, 0, const_cast<void*>(ptr),
+                                          nullptr, event);
+        break;
+    }
+}
+
+void CLCommandQueueManager::DownloadImage2D(const cl::Image2D &image, std::size_t w, std::size_t h,
+                                            std::size_t pixel_size, void *ptr, cl::Event *event) {
+    std::size_t row_size = w * pixel_size;
+    cl::size_t<3> origin;
+    origin[0] = 0;
+    origin[1] = 0;
+    origin[2] = 0;
+    cl::size_t<3> region;
+    region[0] = w;
+    region[1] = h;
+    region[2] = 1;
+    switch (GetTransferMode()) {
+    case transfer_map: {
+        std::size_t row_pitch;
+        cl_int err;
+        auto *mapped = static_cast<const unsigned char*>(command_queue_->enqueueMapImage(
+            image, CL_TRUE, CL_MAP_READ, origin, region,
+            &row_pitch, nullptr, nullptr, event, &err));
+        CheckCLErrorCode("Map image", err);
+        auto *dst = static_cast<unsigned char*>(ptr);
+        for (std::size_t y = 0; y < h; y++)
+            std::memcpy(dst + y * row_size, mapped + y * row_pitch, row_size);
+        command_queue_->enqueueUnmapMemObject(image, const_cast<unsigned char*>(mapped));
+        break;
+    }
+    case transfer_pinned:
+        ReserveStagingBuffer(row_size * h);
+        command_queue_->enqueueReadImage(image, CL_TRUE, origin, region, 0, 0, staging_ptr_,
+                                         nullptr, event);
+        std::memcpy(ptr, staging_ptr_, row_size * h);
+        break;
+    default:
+        command_queue_->enqueueReadImage(image, CL_TRUE, origin, region, 0, 0, ptr,
+                                         nullptr, event);
+        break;
+    }
+}
+
+void CLCommandQueueManager::ReserveStagingBuffer(std::size_t size) {
+    if (size <= staging_size_)
+        return;
+
+    if (staging_buffer_) {
+        // Wait for the transfers which still use the old buffer
+        command_queue_->enqueueUnmapMemObject(*staging_buffer_, staging_ptr_);
+        command_queue_->finish();
+        delete staging_buffer_;
+        staging_buffer_ = nullptr;
+        staging_ptr_ = nullptr;
+        staging_size_ = 0;
+    }
+
+    cl_int err;
+    staging_buffer_ = new cl::Buffer(*context_, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                                     size, nullptr, &err);
+    if (err != CL_SUCCESS) {
+        delete staging_buffer_;
+        staging_buffer_ = nullptr;
+        CheckCLErrorCode("Create staging buffer", err);
+    }
+    staging_ptr_ = command_queue_->enqueueMapBuffer(*staging_buffer_, CL_TRUE,
+                                                    CL_MAP_READ | CL_MAP_WRITE, 0, size,
+                                                    nullptr, nullptr, &err);
+    CheckCLErrorCode("Map staging buffer", err);
+    staging_size_ = size;
+}
+
 void CLCommandQueueManager::ReadBuffer(const cl::Buffer &buffer, cl_bool blocking,
                                        std::size_t offset, std::size_t size, void *ptr) {
     command_queue_->enqueueReadBuffer(buffer, blocking, offset, size, ptr);
@@ -167,8 +313,8 @@ void CLCommandQueueManager::FillImage2D(const cl::Image2D &image, cl_float4 fill
                                         std::size_t origin_x, std::size_t origin_y,
                                         std::size_t region_x, std::size_t region_y) {
     cl::size_t<3> origin;
-    origin[0] = 0;
-    origin[1] = 0;
+    origin[0] = origin_x;
+    origin[1] = origin_y;
     origin[2] = 0;
     cl::size_t<3> region;
     region[0] = region_x;
@@ -178,14 +324,175 @@ void CLCommandQueueManager::FillImage2D(const cl::Image2D &image, cl_float4 fill
     command_queue_->enqueueFillImage(image, fill_color, origin, region);
 }
 
+/* CLImagePool */
+
+CLImagePool::CLImagePool(const cl::Context *context) :
+    context_(context),
+    created_count_(0) {}
+
+CLImagePool::~CLImagePool() {
+    for (auto &entry : entries_)
+        delete entry.image;
+}
+
+cl::Image2D* CLImagePool::Acquire(std::size_t w, std::size_t h, const cl::ImageFormat &format,
+                                  cl_mem_flags flags) {
+    for (auto &entry : entries_) {
+        if (!entry.in_use && entry.w == w && entry.h == h && entry.flags == flags &&
+            entry.format.image_channel_order == format.image_channel_order &&
+            entry.format.image_channel_data_type == format.image_channel_data_type) {
+            entry.in_use = true;
+            return entry.image;
+        }
+    }
+
+    // Resolution changed, drop the images for the previous one
+    for (auto it = entries_.begin(); it != entries_.end();) {
+        if (!it->in_use && (it->w != w || it->h != h)) {
+            delete it->image;
+            it = entries_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    cl_int err;
+    auto *image = new cl::Image2D(*context_, flags, format, w, h, 0, nullptr, &err);
+    if (err != CL_SUCCESS) {
+        delete image;
+        CheckCLErrorCode("Create pooled image", err);
+    }
+    entries_.push_back({image, w, h, format, flags, true});
+    created_count_++;
+    return image;
+}
+
+void CLImagePool::Release(cl::Image2D *image) {
+    for (auto &entry : entries_) {
+        if (entry.image == image) {
+            entry.in_use = false;
+            return;
+        }
+    }
+}
+
+void CLImagePool::Clear() {
+    for (auto it = entries_.begin(); it != entries_.end();) {
+        if (!it->in_use) {
+            delete it->image;
+            it = entries_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+std::size_t CLImagePool::GetUsedImageNum() const {
+    std::size_t used_num = 0;
+    for (auto &entry : entries_) {
+        if (entry.in_use)
+            used_num++;
+    }
+    return used_num;
+}
+
+std::size_t CLImagePool::GetByteSize() const {
+    std::size_t size = 0;
+    for (auto &entry : entries_)
+        size += entry.w * entry.h * CalcPixelSize(entry.format);
+    return size;
+}
+
+std::size_t CLImagePool::CalcPixelSize(const cl::ImageFormat &format) {
+    std::size_t channel_size = 4;
+    switch (format.image_channel_data_type) {
+    case CL_UNORM_INT8:
+    case CL_SNORM_INT8:
+    case CL_SIGNED_INT8:
+    case CL_UNSIGNED_INT8:
+        channel_size = 1;
+        break;
+    case CL_UNORM_INT16:
+    case CL_SNORM_INT16:
+    case CL_SIGNED_INT16:
+    case CL_UNSIGNED_INT16:
+    case CL_HALF_FLOAT:
+        channel_size = 2;
+        break;
+    default:
+        break;
+    }
+
+    std::size_t channel_num = 4;
+    switch (format.image_channel_order) {
+    case CL_R:
+    case CL_A:
+        channel_num = 1;
+        break;
+    case CL_RG:
+        channel_num = 2;
+        break;
+    default:
+        break;
+    }
+    return channel_size * channel_num;
+}
+
+/* PooledImage */
+
+PooledImage::PooledImage() :
+    image_pool_(nullptr),
+    image_(nullptr) {}
+
+PooledImage::PooledImage(CLImagePool *image_pool, std::size_t w, std::size_t h,
+                         const cl::ImageFormat &format, cl_mem_flags flags) :
+    image_pool_(image_pool),
+    image_(image_pool->Acquire(w, h, format, flags)) {}
+
+PooledImage::PooledImage(PooledImage &&other) :
+    image_pool_(other.image_pool_),
+    image_(other.image_) {
+    other.image_ = nullptr;
+}
+
+PooledImage& PooledImage::operator=(PooledImage &&other) {
+    if (this != &other) {
+        Reset();
+        image_pool_ = other.image_pool_;
+        image_ = other.image_;
+        other.image_ = nullptr;
+    }
+    return *this;
+}
+
+PooledImage::~PooledImage() {
+    Reset();
+}
+
+void PooledImage::Reset() {
+    if (image_)
+        image_pool_->Release(image_);
+    image_ = nullptr;
+}
+
 /* CLProgramManager */
 
-CLProgramManager::CLProgramManager(const cl::Context *context, const std::string &source, bool build) {
+CLProgramManager::CLProgramManager(const cl::Context *context, const std::string &source, bool build) :
+    loaded_from_cache_(false) {
     cl_int err;
     program_ = new cl::Program(*context, source, build, &err);
     CheckCLErrorCode("Init program", err);
 }
 
+CLProgramManager::CLProgramManager(const cl::Context *context, const std::string &source,
+                                   CLProgramCache *program_cache) {
+    program_ = program_cache->LoadOrBuild(*context, source, std::string(), &loaded_from_cache_);
+}
+
+CLProgramManager::~CLProgramManager() {
+    delete program_;
+}
+
 std::string CLProgramManager::GetBuildLog() {
     auto device = program_->getInfo<CL_PROGRAM_DEVICES>()[0];
     return program_->getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
@@ -202,23 +509,54 @@ CLKernelManager::CLKernelManager(const cl::Program *program, const std::string k
     kernel_ = new cl::Kernel(*program, kernel_name_.c_str());
 }
 
+CLKernelManager::~CLKernelManager() {
+    delete kernel_;
+}
+
 void CLKernelManager::SetCommandQueue(cl::CommandQueue *command_queue) {
     command_queue_ = command_queue;
 }
 
 /* OpenCLManager */
 
-OpenCLManager::OpenCLManager(const std::string &kernel_source) {
+OpenCLManager::OpenCLManager(const std::string &kernel_source, cl_device_type device_type,
+                             CLProgramCache *program_cache) :
+    platform_manager_(nullptr) {
     OutDebugInfo("Init context manager");
-    context_manager_ = new CLContextManager(CL_DEVICE_TYPE_GPU);
+    context_manager_ = new CLContextManager(device_type);
     cl::Context *context = context_manager_->GetContext();
 
     // Print context info when built in debug config
     DebugPrintContextInfo(*context);
 
     device_manager_ = new CLDeviceManager(context_manager_->GetContext());
-    program_manager_ = new CLProgramManager(context, kernel_source, true);
+    program_manager_ = program_cache ? new CLProgramManager(context, kernel_source, program_cache) :
+                                       new CLProgramManager(context, kernel_source, true);
+    command_queue_manager_ = new CLCommandQueueManager(context);
+    image_pool_ = new CLImagePool(context);
+}
+
+OpenCLManager::OpenCLManager(const std::string &kernel_source, const cl::Device &device,
+                             CLProgramCache *program_cache) :
+    platform_manager_(nullptr) {
+    context_manager_ = new CLContextManager(&device);
+    cl::Context *context = context_manager_->GetContext();
+
+    device_manager_ = new CLDeviceManager(context);
+    program_manager_ = program_cache ? new CLProgramManager(context, kernel_source, program_cache) :
+                                       new CLProgramManager(context, kernel_source, true);
     command_queue_manager_ = new CLCommandQueueManager(context);
+    image_pool_ = new CLImagePool(context);
+}
+
+OpenCLManager::~OpenCLManager() {
+    // The images and the queue go before the context they were created on
+    delete image_pool_;
+    delete program_manager_;
+    delete command_queue_manager_;
+    delete context_manager_;
+    delete device_manager_;
+    delete platform_manager_;
 }
 
 CLPlatformManager* OpenCLManager::GetPlatformManager() {
@@ -239,4 +577,23 @@ CLCommandQueueManager* OpenCLManager::GetCommandQueueManager() {
 
 CLProgramManager* OpenCLManager::GetProgramManager() {
     return program_manager_;
+}
+
+CLImagePool* OpenCLManager::GetImagePool() {
+    return image_pool_;
+}
+
+std::vector<cl::Device> GetAllCLDevices(cl_device_type device_type) {
+    CLPlatformManager platform_manager;
+    std::vector<cl::Device> devices;
+    for (std::size_t i = 0; i < platform_manager.GetPlatformNum(); i++) {
+        try {
+            CLDeviceManager device_manager(device_type, platform_manager.SelectPlatform(static_cast<int>(i)));
+            auto *platform_devices = device_manager.GetDeviceList();
+            devices.insert(devices.end(), platform_devices->begin(), platform_devices->end());
+        } catch (InitOpenCLManagerException&) {
+            // CL_DEVICE_NOT_FOUND
+        }
+    }
+    return devices;
 }
\ No newline at end of file
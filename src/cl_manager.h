@@ -5,11 +5,14 @@
 #include <string>
 #include <vector>
 #include <CL/cl.hpp>
+#include "cl_program_cache.h"
+#ifdef _WIN32
 #ifndef NOMINMAX
 #define NOMINMAX
 #endif // NOMINMAX
 #include <windows.h>
 #include <delayimp.h>
+#endif // _WIN32
 
 class CLPlatformManager {
 public:
@@ -59,6 +62,7 @@ class CLContextManager {
 public:
     CLContextManager(const cl::Device *device = nullptr);
     CLContextManager(cl_device_type device_type);
+    ~CLContextManager();
 
     cl::Context* CreateContextFromDevice(const cl::Device *device);
     cl::Context* CreateContextFromDeviceType(cl_device_type device_type);
@@ -71,11 +75,34 @@ private:
 
 class CLCommandQueueManager {
 public:
+    // How UploadImage2D / DownloadImage2D move the pixels.
+    // transfer_copy reads and writes the image from the host pointer directly,
+    // transfer_map maps the image itself (no extra copy on host unified memory),
+    // transfer_pinned goes through a pinned staging buffer for discrete devices.
+    enum TransferMode {transfer_auto, transfer_copy, transfer_map, transfer_pinned};
+
     CLCommandQueueManager(const cl::Context *context);
+    ~CLCommandQueueManager();
 
     cl::CommandQueue* CreateCommandQueue(const cl::Context *context);
 
     cl::CommandQueue* GetCommandQueue() const { return command_queue_; }
+    // Queue was created with CL_QUEUE_PROFILING_ENABLE
+    bool IsProfilingEnabled() const { return profiling_enabled_; }
+
+    // Device of the queue shares the memory with the host
+    bool IsHostUnifiedMemory() const { return host_unified_memory_; }
+    void SetTransferMode(TransferMode transfer_mode) { transfer_mode_ = transfer_mode; }
+    // Mode actually used, transfer_auto is resolved from the device
+    TransferMode GetTransferMode() const;
+
+    // Transfer the whole image with the current mode.
+    // UploadImage2D returns once ptr can be reused, DownloadImage2D blocks until
+    // the pixels are in ptr. event receives the command which moves the pixels on the device.
+    void UploadImage2D(const cl::Image2D &image, std::size_t w, std::size_t h,
+                       std::size_t pixel_size, const void *ptr, cl::Event *event = nullptr);
+    void DownloadImage2D(const cl::Image2D &image, std::size_t w, std::size_t h,
+                         std::size_t pixel_size, void *ptr, cl::Event *event = nullptr);
 
     void ReadBuffer(const cl::Buffer &buffer, cl_bool blocking,
                     std::size_t offset, std::size_t size, void *ptr);
@@ -97,25 +124,104 @@ public:
                      std::size_t region_x, std::size_t region_y);
 
 private:
+    // Grow the pinned staging buffer to size bytes, it stays mapped for its lifetime
+    void ReserveStagingBuffer(std::size_t size);
+
+    const cl::Context *context_;
     cl::CommandQueue *command_queue_;
+    bool host_unified_memory_;
+    bool profiling_enabled_;
+    TransferMode transfer_mode_;
+    cl::Buffer *staging_buffer_;
+    void *staging_ptr_;
+    std::size_t staging_size_;
+};
+
+// Device images reused across frames of the same resolution
+class CLImagePool {
+public:
+    CLImagePool(const cl::Context *context);
+    ~CLImagePool();
+
+    // Return an unused image of the size and format, creating it if there is none.
+    // Unused images of other sizes are released on creation.
+    cl::Image2D* Acquire(std::size_t w, std::size_t h, const cl::ImageFormat &format,
+                         cl_mem_flags flags = CL_MEM_READ_WRITE);
+    // Return the image to the pool
+    void Release(cl::Image2D *image);
+    // Delete all the unused images
+    void Clear();
+
+    std::size_t GetImageNum() const { return entries_.size(); }
+    std::size_t GetUsedImageNum() const;
+    std::size_t GetByteSize() const;
+    std::size_t GetCreatedCount() const { return created_count_; }
+
+private:
+    struct Entry {
+        cl::Image2D *image;
+        std::size_t w;
+        std::size_t h;
+        cl::ImageFormat format;
+        cl_mem_flags flags;
+        bool in_use;
+    };
+
+    static std::size_t CalcPixelSize(const cl::ImageFormat &format);
+
+    const cl::Context *context_;
+    std::vector<Entry> entries_;
+    std::size_t created_count_;
+};
+
+// Image of the pool held until the lease is destroyed or reset, so an exception of
+// the commands using it doesn't keep it out of the pool
+class PooledImage {
+public:
+    PooledImage();
+    PooledImage(CLImagePool *image_pool, std::size_t w, std::size_t h, const cl::ImageFormat &format,
+                cl_mem_flags flags = CL_MEM_READ_WRITE);
+    PooledImage(PooledImage &&other);
+    PooledImage& operator=(PooledImage &&other);
+    PooledImage(const PooledImage&) = delete;
+    PooledImage& operator=(const PooledImage&) = delete;
+    ~PooledImage();
+
+    // Return the image to the pool now
+    void Reset();
+
+    cl::Image2D* Get() const { return image_; }
+    cl::Image2D& operator*() const { return *image_; }
+    explicit operator bool() const { return image_ != nullptr; }
+
+private:
+    CLImagePool *image_pool_;
+    cl::Image2D *image_;
 };
 
 class CLProgramManager {
 public:
     CLProgramManager(const cl::Context *context, const std::string &source, bool build = false);
+    // Built, from the binary of program_cache when it has one for the device
+    CLProgramManager(const cl::Context *context, const std::string &source, CLProgramCache *program_cache);
+    ~CLProgramManager();
 
     cl::Program* GetProgram() const { return program_; }
     std::string GetBuildLog();
+    // The program came from a binary of the cache instead of the source
+    bool IsLoadedFromCache() const { return loaded_from_cache_; }
 
     void Build();
 
 private:
     cl::Program *program_;
+    bool loaded_from_cache_;
 };
 
 class CLKernelManager {
 public:
     CLKernelManager(const cl::Program *program, const std::string kernel_name);
+    virtual ~CLKernelManager();
 
     void SetCommandQueue(cl::CommandQueue *command_queue);
 
@@ -129,7 +235,14 @@ protected:
 
 class OpenCLManager {
 public:
-    OpenCLManager(const std::string &kernel_source);
+    // The program is loaded from program_cache when it is given, see CLProgramCache
+    OpenCLManager(const std::string &kernel_source, cl_device_type device_type = CL_DEVICE_TYPE_GPU,
+                  CLProgramCache *program_cache = nullptr);
+    // Context of the device alone
+    OpenCLManager(const std::string &kernel_source, const cl::Device &device,
+                  CLProgramCache *program_cache = nullptr);
+    // The kernels and the images of the context must be released before
+    ~OpenCLManager();
 
     cl::Platform* GetPlatform() { return platform_manager_->GetSelectedPlatform(); }
     cl::Device* GetDevice() { return device_manager_->GetSelectedDevice(); }
@@ -142,6 +255,7 @@ public:
     CLContextManager* GetContextManager();
     CLCommandQueueManager* GetCommandQueueManager();
     CLProgramManager* GetProgramManager();
+    CLImagePool* GetImagePool();
 
 private:
     CLPlatformManager *platform_manager_;
@@ -149,9 +263,15 @@ private:
     CLContextManager *context_manager_;
     CLCommandQueueManager *command_queue_manager_;
     CLProgramManager *program_manager_;
+    CLImagePool *image_pool_;
 };
 
+// Devices of device_type of every platform, platforms without any are skipped
+std::vector<cl::Device> GetAllCLDevices(cl_device_type device_type = CL_DEVICE_TYPE_ALL);
+
+// OpenCL.dll is delay loaded on Windows, elsewhere the library is linked normally
 inline void LoadOpenCLDLL() {
+#ifdef _WIN32
     bool success = false;
     try {
     HRESULT result = __HrLoadAllImportsForDll("OpenCL.dll");
@@ -164,6 +284,7 @@ inline void LoadOpenCLDLL() {
     if (!success) {
         throw std::runtime_error("Failed to load OpenCL.dll");
     }
+#endif // _WIN32
 }
 
 #endif // _OPTICSCOMPENSATION_S_SRC_CL_MANAGER_H_
\ No newline at end of file
@@ -0,0 +1,199 @@
+#include "cl_pipeline.h"
+#include <algorithm>
+#include <cstring>
+
+CLFramePipeline::CLFramePipeline(OpenCLManager *opencl_manager, int depth) :
+    image_pool_(opencl_manager->GetImagePool()),
+    fused_(true),
+    intermediate_format_(intermediate_float),
+    slots_(std::max(depth, 1)),
+    next_frame_(0),
+    profiler_(nullptr) {
+    cl::Context *context = opencl_manager->GetContext();
+    upload_queue_manager_ = new CLCommandQueueManager(context);
+    compute_queue_manager_ = new CLCommandQueueManager(context);
+    download_queue_manager_ = new CLCommandQueueManager(context);
+    cl::CommandQueue *compute_queue = compute_queue_manager_->GetCommandQueue();
+    distortion_kernel_set_ = new DistortionKernelSet(opencl_manager->GetProgram(), compute_queue);
+    premult_kernel_manager_ = new PremultKernelManager(opencl_manager->GetProgram(), compute_queue);
+    unpremult_kernel_manager_ = new UnpremultKernelManager(opencl_manager->GetProgram(), compute_queue);
+    for (auto &slot : slots_) {
+        slot.packed_format = intermediate_float;
+        slot.image_size = {0, 0};
+        slot.frame = 0;
+        slot.in_flight = false;
+        slot.profiled = false;
+        slot.enqueue_ns = 0;
+        slot.fused = true;
+    }
+}
+
+CLFramePipeline::~CLFramePipeline() {
+    // The images of the slots go back to the pool with them
+    Finish();
+    delete unpremult_kernel_manager_;
+    delete premult_kernel_manager_;
+    delete distortion_kernel_set_;
+    delete upload_queue_manager_;
+    delete compute_queue_manager_;
+    delete download_queue_manager_;
+}
+
+void CLFramePipeline::SetFused(bool fused) {
+    fused_ = fused;
+    distortion_kernel_set_->SetFused(fused);
+}
+
+void CLFramePipeline::SetProgramVariants(CLProgramVariants *program_variants) {
+    distortion_kernel_set_->SetProgramVariants(program_variants);
+}
+
+void CLFramePipeline::SetRemapCoords(bool enable) {
+    distortion_kernel_set_->SetRemapCoords(enable);
+}
+
+std::uint64_t CLFramePipeline::Submit(const aut::PixelRGBA *src, aut::PixelRGBA *dst,
+                                      const aut::Size2D &image_size,
+                                      const OpticsCompensationParameter &parameter) {
+    std::uint64_t frame = next_frame_++;
+    FrameSlot &slot = slots_[frame % slots_.size()];
+    // The images of the slot are free once its previous frame is read back
+    WaitSlot(&slot);
+    slot.frame = frame;
+
+    // No distortion, the frame is complete right away
+    if (parameter.IsIdentity()) {
+        if (dst != src)
+            std::memcpy(dst, src, sizeof(aut::PixelRGBA) * image_size.w * image_size.h);
+        return frame;
+    }
+
+    bool packed_intermediate = !fused_ && intermediate_format_ != intermediate_float;
+    ReserveImages(&slot, image_size, packed_intermediate);
+
+    cl::size_t<3> origin;
+    origin[0] = 0;
+    origin[1] = 0;
+    origin[2] = 0;
+    cl::size_t<3> region;
+    region[0] = image_size.w;
+    region[1] = image_size.h;
+    region[2] = 1;
+
+    slot.profiled = profiler_ && profiler_->IsEnabled() && compute_queue_manager_->IsProfilingEnabled();
+    if (slot.profiled) {
+        slot.profile_key = Profiler::MakeKey(image_size, parameter, "opencl_pipeline");
+        slot.enqueue_ns = Profiler::Now();
+    }
+
+    upload_queue_manager_->GetCommandQueue()->enqueueWriteImage(
+        *slot.in_image, CL_FALSE, origin, region, 0, 0, const_cast<aut::PixelRGBA*>(src),
+        nullptr, &slot.upload_event);
+
+    std::vector<cl::Event> upload_events = {slot.upload_event};
+    cl::CommandQueue *compute_queue = compute_queue_manager_->GetCommandQueue();
+    compute_queue->enqueueBarrierWithWaitList(&upload_events);
+    // The same chain as OpticsCompensationEngine::Process(), the 8 bit intermediates of the
+    // unfused kernels go back and forth between the images of the frame
+    slot.fused = fused_;
+    cl::Image2D *intermediate_0 = packed_intermediate ? slot.packed_image_0.Get() : slot.out_image.Get();
+    cl::Image2D *intermediate_1 = packed_intermediate ? slot.packed_image_1.Get() : slot.in_image.Get();
+    if (!fused_)
+        premult_kernel_manager_->CallPremult(*slot.in_image, *intermediate_0, image_size.w, image_size.h,
+                                             slot.profiled ? &slot.premult_event : nullptr);
+    distortion_kernel_set_->CallKernel(fused_ ? *slot.in_image : *intermediate_0,
+                                       fused_ ? *slot.out_image : *intermediate_1,
+                                       image_size.w, image_size.h, parameter,
+                                       slot.profiled ? &slot.distortion_event : nullptr);
+    if (!fused_)
+        unpremult_kernel_manager_->CallUnpremult(*intermediate_1, *slot.out_image, image_size.w, image_size.h,
+                                                 slot.profiled ? &slot.unpremult_event : nullptr);
+    cl::Event compute_event;
+    compute_queue->enqueueMarkerWithWaitList(nullptr, &compute_event);
+
+    std::vector<cl::Event> compute_events = {compute_event};
+    download_queue_manager_->GetCommandQueue()->enqueueReadImage(
+        *slot.out_image, CL_FALSE, origin, region, 0, 0, dst,
+        &compute_events, &slot.done_event);
+    slot.in_flight = true;
+
+    // Start the work without waiting for the next frame
+    upload_queue_manager_->GetCommandQueue()->flush();
+    compute_queue->flush();
+    download_queue_manager_->GetCommandQueue()->flush();
+    return frame;
+}
+
+void CLFramePipeline::Wait(std::uint64_t frame) {
+    if (frame >= next_frame_)
+        return;
+    FrameSlot &slot = slots_[frame % slots_.size()];
+    // The slot is already used by a later frame, so this one has completed
+    if (slot.frame == frame)
+        WaitSlot(&slot);
+}
+
+void CLFramePipeline::Finish() {
+    for (auto &slot : slots_)
+        WaitSlot(&slot);
+}
+
+void CLFramePipeline::WaitSlot(FrameSlot *slot) {
+    if (!slot->in_flight)
+        return;
+    slot->done_event.wait();
+    slot->in_flight = false;
+
+    if (slot->profiled) {
+        // Latency of the frame from Submit() until the host saw it done
+        profiler_->Record(slot->profile_key, Profiler::stage_frame, slot->enqueue_ns, Profiler::Now());
+        std::int64_t clock_offset = Profiler::GetCLClockOffset(slot->upload_event, slot->enqueue_ns);
+        profiler_->RecordCLEvent(slot->profile_key, Profiler::stage_upload, slot->upload_event, clock_offset);
+        if (!slot->fused)
+            profiler_->RecordCLEvent(slot->profile_key, Profiler::stage_premult, slot->premult_event, clock_offset);
+        profiler_->RecordCLEvent(slot->profile_key, Profiler::stage_distortion, slot->distortion_event,
+                                 clock_offset);
+        if (!slot->fused)
+            profiler_->RecordCLEvent(slot->profile_key, Profiler::stage_unpremult, slot->unpremult_event,
+                                     clock_offset);
+        profiler_->RecordCLEvent(slot->profile_key, Profiler::stage_download, slot->done_event, clock_offset);
+        slot->profiled = false;
+    }
+}
+
+void CLFramePipeline::ReserveImages(FrameSlot *slot, const aut::Size2D &image_size, bool packed) {
+    if (!slot->in_image || slot->image_size.w != image_size.w || slot->image_size.h != image_size.h) {
+        // Back to the pool first, the new size drops the unused images of the old one
+        slot->in_image.Reset();
+        slot->out_image.Reset();
+        slot->packed_image_0.Reset();
+        slot->packed_image_1.Reset();
+        cl::ImageFormat fmt;
+        fmt.image_channel_data_type = CL_UNORM_INT8;
+        fmt.image_channel_order = CL_BGRA;
+        slot->in_image = PooledImage(image_pool_, image_size.w, image_size.h, fmt);
+        slot->out_image = PooledImage(image_pool_, image_size.w, image_size.h, fmt);
+        slot->image_size = image_size;
+    }
+    if (!packed) {
+        slot->packed_image_0.Reset();
+        slot->packed_image_1.Reset();
+        return;
+    }
+    if (slot->packed_image_0 && slot->packed_format == intermediate_format_)
+        return;
+
+    // Formats of OpticsCompensationEngine::ProcessOpenCL()
+    slot->packed_image_0.Reset();
+    slot->packed_image_1.Reset();
+    cl::ImageFormat intermediate_fmt;
+    intermediate_fmt.image_channel_data_type =
+        intermediate_format_ == intermediate_half ? CL_HALF_FLOAT : CL_UNORM_INT16;
+    intermediate_fmt.image_channel_order = CL_RGBA;
+    cl::ImageFormat distorted_fmt;
+    distorted_fmt.image_channel_data_type = CL_FLOAT;
+    distorted_fmt.image_channel_order = CL_RGBA;
+    slot->packed_image_0 = PooledImage(image_pool_, image_size.w, image_size.h, intermediate_fmt);
+    slot->packed_image_1 = PooledImage(image_pool_, image_size.w, image_size.h, distorted_fmt);
+    slot->packed_format = intermediate_format_;
+}
\ No newline at end of file
@@ -0,0 +1,96 @@
+#ifndef _OPTICSCOMPENSATION_S_SRC_CL_PIPELINE_H_
+#define _OPTICSCOMPENSATION_S_SRC_CL_PIPELINE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <aut/AUL_Type.h>
+#include <CL/cl.hpp>
+#include "cl_kernel.h"
+#include "cl_manager.h"
+#include "parameter.h"
+#include "profiler.h"
+#include "simd_sampler.h"
+
+// A slot is reused once its readback is done, so the three stages only overlap with 3 slots or more
+const int kDefaultPipelineDepth = 3;
+
+// Asynchronous frame pipeline for batch rendering.
+// Upload, distortion and readback run on their own in-order queues chained with events,
+// so the upload of frame N + 1 overlaps the kernel of frame N and the readback of
+// frame N - 1. Up to depth frames are in flight, each with its own pair of images.
+// Runs the fused generic kernels unless the setters say otherwise,
+// OpticsCompensationEngine::CreateCLFramePipeline() copies the settings of the engine.
+class CLFramePipeline {
+public:
+    CLFramePipeline(OpenCLManager *opencl_manager, int depth = kDefaultPipelineDepth);
+    ~CLFramePipeline();
+
+    // Settings of the kernels like the setters of OpticsCompensationEngine,
+    // they apply to the frames submitted after the call
+    void SetFused(bool fused);
+    // program_variants must outlive the pipeline, nullptr only runs the generic kernels
+    void SetProgramVariants(CLProgramVariants *program_variants);
+    void SetRemapCoords(bool enable);
+    // Premultiplied image of the unfused kernels, see OpticsCompensationEngine::SetIntermediateFormat()
+    void SetIntermediateFormat(IntermediateFormat format) { intermediate_format_ = format; }
+
+    // Queue a frame and return its number. Blocks while depth frames are in flight.
+    // src must stay valid until the upload is done and dst until the frame is done,
+    // so keep both until Wait() for the frame returns. src and dst can be the same.
+    std::uint64_t Submit(const aut::PixelRGBA *src, aut::PixelRGBA *dst,
+                         const aut::Size2D &image_size,
+                         const OpticsCompensationParameter &parameter);
+    // Wait until dst of the frame is written
+    void Wait(std::uint64_t frame);
+    // Wait for all the frames in flight
+    void Finish();
+
+    // Record the device time of the stages of every frame while the profiler is enabled
+    void SetProfiler(Profiler *profiler) { profiler_ = profiler; }
+
+    int GetDepth() const { return static_cast<int>(slots_.size()); }
+    std::uint64_t GetSubmittedCount() const { return next_frame_; }
+
+private:
+    struct FrameSlot {
+        PooledImage in_image;
+        PooledImage out_image;
+        // Intermediates of the unfused kernels in the packed formats
+        PooledImage packed_image_0;
+        PooledImage packed_image_1;
+        IntermediateFormat packed_format;
+        aut::Size2D image_size;
+        cl::Event done_event;
+        std::uint64_t frame;
+        bool in_flight;
+        // Kept for the profiler until the frame is done
+        bool profiled;
+        std::string profile_key;
+        std::int64_t enqueue_ns;
+        bool fused;
+        cl::Event upload_event;
+        cl::Event premult_event;
+        cl::Event distortion_event;
+        cl::Event unpremult_event;
+    };
+
+    void WaitSlot(FrameSlot *slot);
+    // The frame images, and the packed intermediates when the unfused kernels need them
+    void ReserveImages(FrameSlot *slot, const aut::Size2D &image_size, bool packed);
+
+    CLImagePool *image_pool_;
+    CLCommandQueueManager *upload_queue_manager_;
+    CLCommandQueueManager *compute_queue_manager_;
+    CLCommandQueueManager *download_queue_manager_;
+    DistortionKernelSet *distortion_kernel_set_;
+    PremultKernelManager *premult_kernel_manager_;
+    UnpremultKernelManager *unpremult_kernel_manager_;
+    bool fused_;
+    IntermediateFormat intermediate_format_;
+    std::vector<FrameSlot> slots_;
+    std::uint64_t next_frame_;
+    Profiler *profiler_;
+};
+
+#endif // _OPTICSCOMPENSATION_S_SRC_CL_PIPELINE_H_
\ No newline at end of file
@@ -0,0 +1,183 @@
+#include "cl_program_cache.h"
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <vector>
+#include "exception.h"
+#include "out_debug.h"
+
+namespace fs = std::filesystem;
+
+// Bumped when the layout of the file changes
+static const char kFileMagic[8] = {'O', 'C', 'S', 'C', 'L', 'B', 'N', '1'};
+
+// FNV-1a, enough to tell the sources and the keys apart
+static std::uint64_t HashString(const std::string &text) {
+    std::uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static std::string ToHex(std::uint64_t value) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(16, '0');
+    for (int i = 15; i >= 0; i--) {
+        hex[i] = digits[value & 0xf];
+        value >>= 4;
+    }
+    return hex;
+}
+
+CLProgramCache::CLProgramCache(const std::string &directory) :
+    directory_(directory),
+    hit_count_(0),
+    miss_count_(0) {}
+
+cl::Program* CLProgramCache::LoadOrBuild(const cl::Context &context, const std::string &source,
+                                         const std::string &options, bool *loaded) {
+    if (loaded)
+        *loaded = false;
+    std::vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
+    std::string key;
+    if (devices.size() == 1 && !directory_.empty()) {
+        key = MakeKey(devices[0], source, options);
+        cl::Program *program = Load(context, devices[0], key, options);
+        if (program) {
+            hit_count_++;
+            if (loaded)
+                *loaded = true;
+            return program;
+        }
+        miss_count_++;
+    }
+
+    cl_int err;
+    std::unique_ptr<cl::Program> program(new cl::Program(context, source, false, &err));
+    CheckCLErrorCode("Init program", err);
+    err = program->build(devices, options.c_str());
+    CheckCLErrorCode("Build program", err);
+    if (!key.empty())
+        Store(*program, key);
+    return program.release();
+}
+
+std::string CLProgramCache::MakeKey(const cl::Device &device, const std::string &source,
+                                    const std::string &options) {
+    return "device:" + device.getInfo<CL_DEVICE_NAME>() +
+           "\nvendor:" + device.getInfo<CL_DEVICE_VENDOR>() +
+           "\ndriver:" + device.getInfo<CL_DRIVER_VERSION>() +
+           "\nversion:" + device.getInfo<CL_DEVICE_VERSION>() +
+           "\noptions:" + options +
+           "\nsource:" + ToHex(HashString(source));
+}
+
+std::string CLProgramCache::GetPath(const std::string &key) const {
+    return (fs::path(directory_) / (ToHex(HashString(key)) + ".bin")).string();
+}
+
+cl::Program* CLProgramCache::Load(const cl::Context &context, const cl::Device &device,
+                                  const std::string &key, const std::string &options) const {
+    std::ifstream file(GetPath(key), std::ios::binary);
+    if (!file)
+        return nullptr;
+
+    // The whole key is stored, so a collision of the file names is a miss
+    char magic[sizeof(kFileMagic)];
+    std::uint32_t key_size = 0;
+    file.read(magic, sizeof(magic));
+    file.read(reinterpret_cast<char*>(&key_size), sizeof(key_size));
+    if (!file || std::memcmp(magic, kFileMagic, sizeof(magic)) != 0 || key_size != key.size())
+        return nullptr;
+    std::string file_key(key_size, '\0');
+    std::uint64_t binary_size = 0;
+    file.read(&file_key[0], key_size);
+    file.read(reinterpret_cast<char*>(&binary_size), sizeof(binary_size));
+    if (!file || file_key != key || binary_size == 0 || binary_size > (1ull << 30))
+        return nullptr;
+    std::vector<unsigned char> binary(static_cast<std::size_t>(binary_size));
+    file.read(reinterpret_cast<char*>(binary.data()), binary.size());
+    if (!file)
+        return nullptr;
+
+    std::vector<cl::Device> devices = {device};
+    cl::Program::Binaries binaries = {{binary.data(), binary.size()}};
+    std::vector<cl_int> binary_status(1, CL_SUCCESS);
+    cl_int err;
+    std::unique_ptr<cl::Program> program(new cl::Program(context, devices, binaries, &binary_status, &err));
+    if (err != CL_SUCCESS || binary_status[0] != CL_SUCCESS) {
+        OutDebugInfo("Program binary rejected : ", GetPath(key));
+        return nullptr;
+    }
+    // A binary still has to be built, which is only the link on most drivers
+    if (program->build(devices, options.c_str()) != CL_SUCCESS) {
+        OutDebugInfo("Program binary failed to build : ", GetPath(key));
+        return nullptr;
+    }
+    OutDebugInfo("Program binary loaded : ", GetPath(key));
+    return program.release();
+}
+
+void CLProgramCache::Store(const cl::Program &program, const std::string &key) const {
+    std::vector<std::size_t> binary_sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+    if (binary_sizes.size() != 1 || binary_sizes[0] == 0)
+        return;
+    // cl.hpp doesn't own the buffers of CL_PROGRAM_BINARIES, so they go through the C API
+    std::vector<unsigned char> binary(binary_sizes[0]);
+    unsigned char *binary_ptr = binary.data();
+    if (clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(binary_ptr), &binary_ptr, nullptr) != CL_SUCCESS)
+        return;
+
+    std::error_code error;
+    fs::create_directories(directory_, error);
+    if (error)
+        return;
+    // Written aside and renamed, so another process never reads half a file
+    std::string path = GetPath(key);
+    std::string temp_path = path + "." +
+        std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+    {
+        std::ofstream file(temp_path, std::ios::binary);
+        auto key_size = static_cast<std::uint32_t>(key.size());
+        auto binary_size = static_cast<std::uint64_t>(binary.size());
+        file.write(kFileMagic, sizeof(kFileMagic));
+        file.write(reinterpret_cast<const char*>(&key_size), sizeof(key_size));
+        file.write(key.data(), key.size());
+        file.write(reinterpret_cast<const char*>(&binary_size), sizeof(binary_size));
+        file.write(reinterpret_cast<const char*>(binary.data()), binary.size());
+        if (!file) {
+            file.close();
+            fs::remove(temp_path, error);
+            return;
+        }
+    }
+    fs::rename(temp_path, path, error);
+    if (error) {
+        fs::remove(temp_path, error);
+        return;
+    }
+    OutDebugInfo("Program binary stored : ", path);
+}
+
+std::string GetDefaultCLProgramCacheDirectory() {
+#ifdef _WIN32
+    const char *base = std::getenv("LOCALAPPDATA");
+    if (!base || !*base)
+        return std::string();
+    return (fs::path(base) / "OpticsCompensation_s" / "cl_cache").string();
+#else
+    const char *base = std::getenv("XDG_CACHE_HOME");
+    if (base && *base)
+        return (fs::path(base) / "OpticsCompensation_s" / "cl_cache").string();
+    base = std::getenv("HOME");
+    if (!base || !*base)
+        return std::string();
+    return (fs::path(base) / ".cache" / "OpticsCompensation_s" / "cl_cache").string();
+#endif // _WIN32
+}
\ No newline at end of file
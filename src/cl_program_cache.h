@@ -0,0 +1,47 @@
+#ifndef _OPTICSCOMPENSATION_S_SRC_CL_PROGRAM_CACHE_H_
+#define _OPTICSCOMPENSATION_S_SRC_CL_PROGRAM_CACHE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <CL/cl.hpp>
+
+// Binaries of the built programs on disk, so that the next process skips the compile.
+// A binary is keyed on the device name, the driver version, the hash of the source and
+// the build options. Anything which doesn't match or fails to load is built from the source,
+// and the cache never makes a build fail which would succeed without it.
+// LoadOrBuild() can run on several threads at once, like the builds of CLProgramVariants.
+class CLProgramCache {
+public:
+    CLProgramCache(const std::string &directory);
+
+    const std::string& GetDirectory() const { return directory_; }
+
+    // Program of source built for the device of context. Contexts of several devices
+    // are built from the source every time. Throws InitOpenCLManagerException like
+    // CLProgramManager when the build fails. loaded receives whether a binary from
+    // the disk was used.
+    cl::Program* LoadOrBuild(const cl::Context &context, const std::string &source,
+                             const std::string &options = std::string(), bool *loaded = nullptr);
+
+    std::size_t GetHitCount() const { return hit_count_; }
+    std::size_t GetMissCount() const { return miss_count_; }
+
+private:
+    static std::string MakeKey(const cl::Device &device, const std::string &source, const std::string &options);
+    std::string GetPath(const std::string &key) const;
+    // nullptr unless the file of key holds a binary which builds on the device
+    cl::Program* Load(const cl::Context &context, const cl::Device &device,
+                      const std::string &key, const std::string &options) const;
+    // Write the binary of program, failures only skip the cache
+    void Store(const cl::Program &program, const std::string &key) const;
+
+    std::string directory_;
+    std::atomic<std::size_t> hit_count_;
+    std::atomic<std::size_t> miss_count_;
+};
+
+// Per-user cache directory of the binaries, empty when the environment gives none
+std::string GetDefaultCLProgramCacheDirectory();
+
+#endif // _OPTICSCOMPENSATION_S_SRC_CL_PROGRAM_CACHE_H_
\ No newline at end of file
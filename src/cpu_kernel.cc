@@ -1,46 +1,202 @@
 #include "cpu_kernel.h"
+#include "cpu_scheduler.h"
+#include <algorithm>
+#include <memory>
 #include "debug_helper.h"
-#define SAMPLE_NUM 2
+#include "lens_model.h"
+#include "mip_pyramid.h"
+#include "simd_sampler.h"
+
+// Sampling multiple times inside the quad of the corner coords for anti-aliasing
+static cv::Vec4f MultiSamplingPixel(const cv::Mat &in_image,
+                                    const glm::vec2 &coord_lt, const glm::vec2 &coord_rt,
+                                    const glm::vec2 &coord_lb, const glm::vec2 &coord_rb,
+                                    const glm::ivec2 &sampling_num,
+                                    const aut::Size2D &image_size) {
+    cv::Vec4f pixel(cv::Scalar::all(0));
+    int sampled_num = 0;
+    for (int iy = 0; iy < sampling_num.y; iy++) {
+        for (int ix = 0; ix < sampling_num.x; ix++) {
+            glm::vec2 alpha((ix + 0.5f) / sampling_num.x, (iy + 0.5f) / sampling_num.y);
+            auto sampling_coord = CalcAASampleCoords(coord_lt, coord_rt,
+                                                     coord_lb, coord_rb,
+                                                     alpha);
+            auto sampled_pixel =
+                SamplingPixel<float>(in_image, sampling_coord.x, sampling_coord.y,
+                                     image_size);
+            pixel += sampled_pixel;
+            sampled_num++;
+        }
+    }
+    pixel /= sampled_num;
+    return pixel;
+}
+
+// Same samples as above with the samples per axis fixed at compile time, so the loops unroll
+template<int SampleNum>
+static cv::Vec4f MultiSamplingPixel(const cv::Mat &in_image,
+                                    const glm::vec2 &coord_lt, const glm::vec2 &coord_rt,
+                                    const glm::vec2 &coord_lb, const glm::vec2 &coord_rb,
+                                    const aut::Size2D &image_size) {
+    cv::Vec4f pixel(cv::Scalar::all(0));
+    for (int iy = 0; iy < SampleNum; iy++) {
+        for (int ix = 0; ix < SampleNum; ix++) {
+            glm::vec2 alpha((ix + 0.5f) / SampleNum, (iy + 0.5f) / SampleNum);
+            auto sampling_coord = CalcAASampleCoords(coord_lt, coord_rt,
+                                                     coord_lb, coord_rb,
+                                                     alpha);
+            pixel += SamplingPixel<float>(in_image, sampling_coord.x, sampling_coord.y,
+                                          image_size);
+        }
+    }
+    pixel /= SampleNum * SampleNum;
+    return pixel;
+}
+
+void PremultRow(const cv::Vec4b *in_row, cv::Vec4f *out_row, int w) {
+    for (int x = 0; x < w; x++) {
+        auto in_pixel = in_row[x];
+        float alpha = in_pixel[3];
+        out_row[x][0] = in_pixel[0] * alpha;
+        out_row[x][1] = in_pixel[1] * alpha;
+        out_row[x][2] = in_pixel[2] * alpha;
+        out_row[x][3] = alpha;
+    }
+}
+
+void PremultRow(const cv::Vec4b *in_row, cv::Vec4w *out_row, int w, IntermediateFormat format) {
+    if (format == intermediate_half) {
+        for (int x = 0; x < w; x++) {
+            auto in_pixel = in_row[x];
+            int alpha = in_pixel[3];
+            out_row[x][0] = FloatToHalf(static_cast<float>(in_pixel[0] * alpha));
+            out_row[x][1] = FloatToHalf(static_cast<float>(in_pixel[1] * alpha));
+            out_row[x][2] = FloatToHalf(static_cast<float>(in_pixel[2] * alpha));
+            out_row[x][3] = FloatToHalf(static_cast<float>(alpha));
+        }
+        return;
+    }
+    // Up to 255 * 255, exact in 16 bits
+    for (int x = 0; x < w; x++) {
+        auto in_pixel = in_row[x];
+        int alpha = in_pixel[3];
+        out_row[x][0] = static_cast<ushort>(in_pixel[0] * alpha);
+        out_row[x][1] = static_cast<ushort>(in_pixel[1] * alpha);
+        out_row[x][2] = static_cast<ushort>(in_pixel[2] * alpha);
+        out_row[x][3] = static_cast<ushort>(alpha);
+    }
+}
+
+void UnpremultRow(const cv::Vec4f *in_row, cv::Vec4b *out_row, int w) {
+    for (int x = 0; x < w; x++) {
+        auto in_pixel = in_row[x];
+        float alpha = in_pixel[3];
+        if (alpha != 0) {
+            out_row[x][0] = static_cast<uchar>(in_pixel[0] / alpha);
+            out_row[x][1] = static_cast<uchar>(in_pixel[1] / alpha);
+            out_row[x][2] = static_cast<uchar>(in_pixel[2] / alpha);
+            out_row[x][3] = static_cast<uchar>(alpha);
+        } else {
+            out_row[x][0] = 0;
+            out_row[x][1] = 0;
+            out_row[x][2] = 0;
+            out_row[x][3] = 0;
+        }
+    }
+}
 
 void PremultKernel(const cv::Mat &in_image, const cv::Mat &out_image) {
     auto w = in_image.cols;
     auto h = in_image.rows;
-    aut::Size2D image_size(w, h);
+    #pragma omp parallel for num_threads(GetCPUThreadNum())
     for (int y = 0; y < h; y++) {
-        for (int x = 0; x < w; x++) {
-            auto in_pixel = SamplingPixel<uchar>(in_image, x, y, image_size);
-            auto out_pixel = reinterpret_cast<cv::Vec4f*>(out_image.data) + y * w + x;
-            float alpha = in_pixel[3];
-            (*out_pixel)[0] = in_pixel[0] * alpha;
-            (*out_pixel)[1] = in_pixel[1] * alpha;
-            (*out_pixel)[2] = in_pixel[2] * alpha;
-            (*out_pixel)[3] = alpha;
-        }
+        PremultRow(reinterpret_cast<const cv::Vec4b*>(in_image.data) + y * w,
+                   reinterpret_cast<cv::Vec4f*>(out_image.data) + y * w, w);
     }
 }
 
 void UnpremultKernel(const cv::Mat &in_image, const cv::Mat &out_image) {
     auto w = in_image.cols;
     auto h = in_image.rows;
-    aut::Size2D image_size(w, h);
+    #pragma omp parallel for num_threads(GetCPUThreadNum())
     for (int y = 0; y < h; y++) {
-        for (int x = 0; x < w; x++) {
-            auto in_pixel = SamplingPixel<float>(in_image, x, y, image_size);
-            auto out_pixel = reinterpret_cast<cv::Vec4b*>(out_image.data) + y * w + x;
-            float alpha = in_pixel[3];
-            if (alpha != 0) {
-                (*out_pixel)[0] = static_cast<uchar>(in_pixel[0] / alpha);
-                (*out_pixel)[1] = static_cast<uchar>(in_pixel[1] / alpha);
-                (*out_pixel)[2] = static_cast<uchar>(in_pixel[2] / alpha);
-                (*out_pixel)[3] = static_cast<uchar>(alpha);
-            } else {
-                (*out_pixel)[0] = 0;
-                (*out_pixel)[1] = 0;
-                (*out_pixel)[2] = 0;
-                (*out_pixel)[3] = 0;
+        UnpremultRow(reinterpret_cast<const cv::Vec4f*>(in_image.data) + y * w,
+                     reinterpret_cast<cv::Vec4b*>(out_image.data) + y * w, w);
+    }
+}
+
+// Anti-aliasing over the quad of the corners of every pixel on the source,
+// calc_coord maps an output coord to the source. SampleNum > 0 fixes the samples
+// per axis of the supersampling, 0 takes them from the parameter.
+template<int SampleNum, typename CalcCoord>
+static void MultiSamplingTiles(const cv::Mat &in_image, const cv::Mat &out_image,
+                               const aut::Size2D &image_size,
+                               const OpticsCompensationParameter &parameter,
+                               CalcCoord calc_coord) {
+    bool anisotropic = parameter.aa_filter == aa_anisotropic;
+    // Samples per axis, or taps along the major axis for the anisotropic filter
+    int max_sampling = parameter.GetAAMaxSampling(anisotropic ? kDefaultMaxAnisotropy : SAMPLE_NUM);
+    std::vector<const cv::Vec4f*> source_rows;
+    std::unique_ptr<MipPyramid> pyramid;
+    if (anisotropic) {
+        source_rows = GetRowPointers(in_image);
+        pyramid.reset(new MipPyramid({source_rows.data(), image_size.w, image_size.h}));
+    }
+    TileScheduler scheduler(image_size);
+    scheduler.Run([&](const ImageTile &tile) {
+        for (int y = tile.y_begin; y < tile.y_end; y++) {
+            auto out_row = reinterpret_cast<cv::Vec4f*>(out_image.data) + y * image_size.w;
+            for (int x = tile.x_begin; x < tile.x_end; x++) {
+                glm::vec2 coord(x, y);
+                // Calculate the coords of the corners.
+                auto coord_lt = calc_coord(glm::vec2(coord.x - 0.5f, coord.y - 0.5f));
+                auto coord_rt = calc_coord(glm::vec2(coord.x + 0.5f, coord.y - 0.5f));
+                auto coord_lb = calc_coord(glm::vec2(coord.x - 0.5f, coord.y + 0.5f));
+                auto coord_rb = calc_coord(glm::vec2(coord.x + 0.5f, coord.y + 0.5f));
+
+                if (SampleNum > 0) {
+                    out_row[x] = MultiSamplingPixel<SampleNum>(in_image, coord_lt, coord_rt,
+                                                               coord_lb, coord_rb, image_size);
+                    continue;
+                }
+                if (anisotropic) {
+                    out_row[x] = SampleAnisotropic(*pyramid, coord_lt, coord_rt,
+                                                   coord_lb, coord_rb, max_sampling);
+                    continue;
+                }
+                auto sampling_num = CalcAASamplingNum(coord_lt, coord_rt, coord_lb, coord_rb,
+                                                      max_sampling, parameter.aa_adaptive,
+                                                      parameter.aa_quality);
+                out_row[x] = MultiSamplingPixel(in_image, coord_lt, coord_rt,
+                                                coord_lb, coord_rb, sampling_num, image_size);
             }
         }
+    });
+}
+
+template<typename CalcCoord>
+static void MultiSamplingCPUKernel(const cv::Mat &in_image, const cv::Mat &out_image,
+                                   const aut::Size2D &image_size,
+                                   const OpticsCompensationParameter &parameter,
+                                   CalcCoord calc_coord) {
+    // The supersampling without the adaptive mode takes the same samples on every pixel,
+    // the common counts get their own loops like the kernel variants of OpenCL
+    if (parameter.aa_filter == aa_supersampling && !parameter.aa_adaptive) {
+        switch (parameter.GetAAMaxSampling(SAMPLE_NUM)) {
+        case 2:
+            MultiSamplingTiles<2>(in_image, out_image, image_size, parameter, calc_coord);
+            return;
+        case 3:
+            MultiSamplingTiles<3>(in_image, out_image, image_size, parameter, calc_coord);
+            return;
+        case 4:
+            MultiSamplingTiles<4>(in_image, out_image, image_size, parameter, calc_coord);
+            return;
+        default:
+            break;
+        }
     }
+    MultiSamplingTiles<0>(in_image, out_image, image_size, parameter, calc_coord);
 }
 
 void SpoolCPUKernel(const cv::Mat &in_image, const cv::Mat &out_image,
@@ -51,21 +207,28 @@ void SpoolCPUKernel(const cv::Mat &in_image, const cv::Mat &out_image,
         (image_size.h - 1) / 2.f - parameter.center_pos.y
     );
 
-    #pragma omp parallel for
-    for (int y = 0; y < image_size.h; y++) {
-        #pragma omp parallel for
-        for (int x = 0; x < image_size.w; x++) {
-            glm::vec2 coord(x, y);
-            glm::vec2 sampling_coord = CalcSpoolCoord(coord, center_coord,
-                                                       parameter.CalcFocalDistance());
+    auto focal_distance = parameter.CalcFocalDistance();
+    if (parameter.anti_aliasing) {
+        MultiSamplingCPUKernel(in_image, out_image, image_size, parameter,
+                               [&](const glm::vec2 &coord) {
+                                   return CalcSpoolCoord(coord, center_coord, focal_distance);
+                               });
+        return;
+    }
 
-            auto pixel = SamplingPixel<float>(in_image, sampling_coord.x, sampling_coord.y,
-                                              image_size);
+    TileScheduler scheduler(image_size);
+    scheduler.Run([&](const ImageTile &tile) {
+        for (int y = tile.y_begin; y < tile.y_end; y++) {
+            auto out_row = reinterpret_cast<cv::Vec4f*>(out_image.data) + y * image_size.w;
+            for (int x = tile.x_begin; x < tile.x_end; x++) {
+                glm::vec2 coord(x, y);
+                glm::vec2 sampling_coord = CalcSpoolCoord(coord, center_coord, focal_distance);
 
-            auto out_pixel = reinterpret_cast<cv::Vec4f*>(out_image.data) + y * image_size.w + x;
-            (*out_pixel) = pixel;
+                out_row[x] = SamplingPixel<float>(in_image, sampling_coord.x, sampling_coord.y,
+                                                  image_size);
+            }
         }
-    }
+    });
 }
 
 void BarrelCPUKernel(const cv::Mat &in_image, const cv::Mat &out_image,
@@ -80,50 +243,183 @@ void BarrelCPUKernel(const cv::Mat &in_image, const cv::Mat &out_image,
     );
 
     auto focal_distance = parameter.CalcFocalDistance();
-    #pragma omp parallel for
-    for (int y = 0; y < image_size.h; y++) {
-        #pragma omp parallel for
-        for (int x = 0; x < image_size.w; x++) {
-            glm::vec2 coord(x, y);
-            auto out_pixel = reinterpret_cast<cv::Vec4f*>(out_image.data) + y * image_size.w + x;
-            if (parameter.anti_aliasing) {
-                // Calculate the coords of the corners.
-                auto coord_lt = CalcBarrelCoord(glm::vec2(coord.x - 0.5f, coord.y - 0.5f),
-                                                center_coord, focal_distance);
-                auto coord_rt = CalcBarrelCoord(glm::vec2(coord.x + 0.5f, coord.y - 0.5f),
-                                                center_coord, focal_distance);
-                auto coord_lb = CalcBarrelCoord(glm::vec2(coord.x - 0.5f, coord.y + 0.5f),
-                                                center_coord, focal_distance);
-                auto coord_rb = CalcBarrelCoord(glm::vec2(coord.x + 0.5f, coord.y + 0.5f),
-                                                center_coord, focal_distance);
-
-                // Sampling multiple times for anti-aliasing
-                cv::Vec4f pixel(cv::Scalar::all(0));
-                int sampled_num = 0;
-                for (float sy = 1.f / SAMPLE_NUM / 2; sy < 1; sy += (1.f / SAMPLE_NUM)) {
-                    for (float sx = 1.f / SAMPLE_NUM / 2; sx < 1; sx += (1.f / SAMPLE_NUM)) {
-                        glm::vec2 alpha(sx, sy);
-                        auto sampling_coord = CalcAASampleCoords(coord_lt, coord_rt,
-                                                               coord_lb, coord_rb,
-                                                               alpha);
-                        auto sampled_pixel =
-                            SamplingPixel<float>(in_image, sampling_coord.x, sampling_coord.y,
-                                                 image_size);
-                        pixel += sampled_pixel;
-                        sampled_num++;
-                    }
-                }
-                pixel /= sampled_num;
-                (*out_pixel) = pixel;
-            } else {
+    if (parameter.anti_aliasing) {
+        MultiSamplingCPUKernel(in_image, out_image, image_size, parameter,
+                               [&](const glm::vec2 &coord) {
+                                   return CalcBarrelCoord(coord, center_coord, focal_distance);
+                               });
+        return;
+    }
+
+    TileScheduler scheduler(image_size);
+    scheduler.Run([&](const ImageTile &tile) {
+        for (int y = tile.y_begin; y < tile.y_end; y++) {
+            auto out_row = reinterpret_cast<cv::Vec4f*>(out_image.data) + y * image_size.w;
+            for (int x = tile.x_begin; x < tile.x_end; x++) {
+                glm::vec2 coord(x, y);
                 glm::vec2 sampling_coord = CalcBarrelCoord(coord, center_coord,
-                                                           parameter.CalcFocalDistance());
+                                                           focal_distance);
 
-                auto pixel = SamplingPixel<float>(in_image, sampling_coord.x, sampling_coord.y,
+                out_row[x] = SamplingPixel<float>(in_image, sampling_coord.x,
+                                                  sampling_coord.y, image_size);
+            }
+        }
+    });
+}
+
+void LensModelCPUKernel(const cv::Mat &in_image, const cv::Mat &out_image,
+                        const aut::Size2D &image_size,
+                        OpticsCompensationParameter parameter) {
+    glm::vec2 center_coord(
+        (image_size.w - 1) / 2.f - parameter.center_pos.x,
+        (image_size.h - 1) / 2.f - parameter.center_pos.y
+    );
+
+    float focal_length = parameter.CalcLensFocalLength(image_size.w, image_size.h);
+    auto calc_coord = [&](const glm::vec2 &coord) {
+        return CalcLensModelOffset(coord - center_coord, parameter, focal_length) + center_coord;
+    };
+    if (parameter.anti_aliasing) {
+        MultiSamplingCPUKernel(in_image, out_image, image_size, parameter, calc_coord);
+        return;
+    }
+
+    TileScheduler scheduler(image_size);
+    scheduler.Run([&](const ImageTile &tile) {
+        for (int y = tile.y_begin; y < tile.y_end; y++) {
+            auto out_row = reinterpret_cast<cv::Vec4f*>(out_image.data) + y * image_size.w;
+            for (int x = tile.x_begin; x < tile.x_end; x++) {
+                glm::vec2 sampling_coord = calc_coord(glm::vec2(x, y));
+
+                out_row[x] = SamplingPixel<float>(in_image, sampling_coord.x, sampling_coord.y,
                                                   image_size);
+            }
+        }
+    });
+}
+
+void DistortionCPUKernel(const cv::Mat &in_image, const cv::Mat &out_image,
+                         const aut::Size2D &image_size,
+                         const OpticsCompensationParameter &parameter) {
+    if (parameter.lens_model != lens_tan)
+        LensModelCPUKernel(in_image, out_image, image_size, parameter);
+    else if (parameter.spool_mode)
+        SpoolCPUKernel(in_image, out_image, image_size, parameter);
+    else
+        BarrelCPUKernel(in_image, out_image, image_size, parameter);
+}
+
+void RemapRow(const SamplingSource &source, const RemapTable &remap_table, int y,
+              RemapRowBuffer *buffer, cv::Vec4f *out_row) {
+    RemapRow(source, remap_table, y, buffer, out_row, 0, remap_table.GetImageSize().w);
+}
+
+template<typename Source>
+static void RemapSpanImpl(const Source &source, const RemapTable &remap_table, int y,
+                          RemapRowBuffer *buffer, cv::Vec4f *out_pixels, int x_begin, int x_end) {
+    // Pixels out of the live span sample transparent black
+    int live_begin = std::min(std::max(x_begin, remap_table.GetLiveBegin(y)), x_end);
+    int live_end = std::max(std::min(x_end, remap_table.GetLiveEnd(y)), live_begin);
+    cv::Vec4f zero(cv::Scalar::all(0));
+    std::fill(out_pixels, out_pixels + (live_begin - x_begin), zero);
+    std::fill(out_pixels + (live_end - x_begin), out_pixels + (x_end - x_begin), zero);
+    if (live_begin >= live_end)
+        return;
+    cv::Vec4f *live_pixels = out_pixels + (live_begin - x_begin);
+
+    if (remap_table.GetLayout() != RemapTable::pixel_corner) {
+        SampleRow(source, remap_table.GetRow(y) + live_begin, live_end - live_begin, live_pixels);
+        return;
+    }
+
+    // Samples per axis of every pixel, decided when the table was built
+    const RemapTable::SamplingNum *sampling_nums = remap_table.GetSamplingNumRow(y);
+    int row_sample_num = 0;
+    if (live_begin == 0 && live_end == remap_table.GetImageSize().w) {
+        row_sample_num = remap_table.GetRowSampleNum(y);
+    } else {
+        for (int x = live_begin; x < live_end; x++)
+            row_sample_num += sampling_nums[x].x * sampling_nums[x].y;
+    }
+    buffer->sample_coords.resize(row_sample_num);
+    buffer->samples.resize(row_sample_num);
 
-                (*out_pixel) = pixel;
+    // Corners of pixel x are x and x + 1 in the rows y and y + 1
+    const glm::vec2 *top_row = remap_table.GetRow(y);
+    const glm::vec2 *bottom_row = remap_table.GetRow(y + 1);
+    glm::vec2 *coords = buffer->sample_coords.data();
+    for (int x = live_begin; x < live_end; x++) {
+        glm::ivec2 sampling_num(sampling_nums[x].x, sampling_nums[x].y);
+        for (int iy = 0; iy < sampling_num.y; iy++) {
+            for (int ix = 0; ix < sampling_num.x; ix++) {
+                glm::vec2 alpha((ix + 0.5f) / sampling_num.x, (iy + 0.5f) / sampling_num.y);
+                *coords++ = CalcAASampleCoords(top_row[x], top_row[x + 1],
+                                               bottom_row[x], bottom_row[x + 1], alpha);
             }
         }
     }
+    SampleRow(source, buffer->sample_coords.data(), row_sample_num, buffer->samples.data());
+
+    // Average in the same order as MultiSamplingPixel
+    const cv::Vec4f *samples = buffer->samples.data();
+    for (int x = live_begin; x < live_end; x++) {
+        int sample_per_pixel = sampling_nums[x].x * sampling_nums[x].y;
+        cv::Vec4f pixel(cv::Scalar::all(0));
+        for (int i = 0; i < sample_per_pixel; i++)
+            pixel += *samples++;
+        pixel /= sample_per_pixel;
+        live_pixels[x - live_begin] = pixel;
+    }
+}
+
+template<typename Source>
+static void RemapRowImpl(const Source &source, const RemapTable &remap_table, int y,
+                         RemapRowBuffer *buffer, cv::Vec4f *out_row, int x_begin, int x_end) {
+    int w = remap_table.GetImageSize().w;
+    x_begin = std::max(x_begin, 0);
+    x_end = std::min(x_end, w);
+    cv::Vec4f zero(cv::Scalar::all(0));
+    if (x_begin >= x_end) {
+        std::fill(out_row, out_row + w, zero);
+        return;
+    }
+    std::fill(out_row, out_row + x_begin, zero);
+    std::fill(out_row + x_end, out_row + w, zero);
+    RemapSpanImpl(source, remap_table, y, buffer, out_row + x_begin, x_begin, x_end);
+}
+
+void RemapRow(const SamplingSource &source, const RemapTable &remap_table, int y,
+              RemapRowBuffer *buffer, cv::Vec4f *out_row, int x_begin, int x_end) {
+    RemapRowImpl(source, remap_table, y, buffer, out_row, x_begin, x_end);
+}
+
+void RemapRow(const PackedSamplingSource &source, const RemapTable &remap_table, int y,
+              RemapRowBuffer *buffer, cv::Vec4f *out_row, int x_begin, int x_end) {
+    RemapRowImpl(source, remap_table, y, buffer, out_row, x_begin, x_end);
+}
+
+void RemapSpan(const SamplingSource &source, const RemapTable &remap_table, int y,
+               RemapRowBuffer *buffer, cv::Vec4f *out_pixels, int x_begin, int x_end) {
+    RemapSpanImpl(source, remap_table, y, buffer, out_pixels, x_begin, x_end);
+}
+
+void RemapSpan(const PackedSamplingSource &source, const RemapTable &remap_table, int y,
+               RemapRowBuffer *buffer, cv::Vec4f *out_pixels, int x_begin, int x_end) {
+    RemapSpanImpl(source, remap_table, y, buffer, out_pixels, x_begin, x_end);
+}
+
+void RemapCPUKernel(const cv::Mat &in_image, const cv::Mat &out_image,
+                    const aut::Size2D &image_size, const RemapTable &remap_table) {
+    auto rows = GetRowPointers(in_image);
+    SamplingSource source = {rows.data(), image_size.w, image_size.h};
+
+    #pragma omp parallel num_threads(GetCPUThreadNum())
+    {
+        RemapRowBuffer buffer;
+        #pragma omp for schedule(dynamic, 4)
+        for (int y = 0; y < image_size.h; y++) {
+            auto out_row = reinterpret_cast<cv::Vec4f*>(out_image.data) + y * image_size.w;
+            RemapRow(source, remap_table, y, &buffer, out_row);
+        }
+    }
 }
\ No newline at end of file
@@ -8,6 +8,11 @@
 #include <glm/glm.hpp>
 #include <opencv2/opencv.hpp>
 #include "parameter.h"
+#include "remap_table.h"
+#include "simd_sampler.h"
+
+// Samples per axis of the anti-aliasing on the CPU unless the parameter sets it
+#define SAMPLE_NUM 2
 
 // Sampling for integer coords
 template<typename T> cv::Vec<T, 4> SamplingPixel(const cv::Mat &img, int x, int y,
@@ -41,6 +46,11 @@ template<typename T> cv::Vec4f SamplingPixel(const cv::Mat &img, float x, float
                 dx  *      dy  * prb;
 }
 
+void PremultRow(const cv::Vec4b *in_row, cv::Vec4f *out_row, int w);
+// Premultiply into intermediate_fixed16 or intermediate_half
+void PremultRow(const cv::Vec4b *in_row, cv::Vec4w *out_row, int w, IntermediateFormat format);
+void UnpremultRow(const cv::Vec4f *in_row, cv::Vec4b *out_row, int w);
+
 void PremultKernel(const cv::Mat &in_image, const cv::Mat &out_image);
 void UnpremultKernel(const cv::Mat &in_image, const cv::Mat &out_image);
 
@@ -52,27 +62,78 @@ void BarrelCPUKernel(const cv::Mat &in_image, const cv::Mat &out_image,
                      const aut::Size2D &image_size,
                      OpticsCompensationParameter parameter);
 
-inline glm::vec2 CalcSpoolCoord(const glm::vec2 &coord,
-                                const glm::vec2 &center_coord,
-                                float focal_distance) {
-    auto relative_coords = coord - center_coord;
+// Camera models of parameter.lens_model, see lens_model.h
+void LensModelCPUKernel(const cv::Mat &in_image, const cv::Mat &out_image,
+                        const aut::Size2D &image_size,
+                        OpticsCompensationParameter parameter);
+
+// Spool, barrel or the camera model of the parameter
+void DistortionCPUKernel(const cv::Mat &in_image, const cv::Mat &out_image,
+                         const aut::Size2D &image_size,
+                         const OpticsCompensationParameter &parameter);
+
+// Work buffers of RemapRow, one per thread
+struct RemapRowBuffer {
+    std::vector<glm::vec2> sample_coords;
+    std::vector<cv::Vec4f> samples;
+};
+
+// Sampling a row with the coords precomputed in the remap table.
+// Pixels out of the live span of the table are cleared without sampling.
+void RemapRow(const SamplingSource &source, const RemapTable &remap_table, int y,
+              RemapRowBuffer *buffer, cv::Vec4f *out_row);
+// Only the pixels in [x_begin, x_end) are sampled, the others are cleared
+void RemapRow(const SamplingSource &source, const RemapTable &remap_table, int y,
+              RemapRowBuffer *buffer, cv::Vec4f *out_row, int x_begin, int x_end);
+void RemapRow(const PackedSamplingSource &source, const RemapTable &remap_table, int y,
+              RemapRowBuffer *buffer, cv::Vec4f *out_row, int x_begin, int x_end);
+// Only the pixels [x_begin, x_end) of the row, written to out_pixels[0, x_end - x_begin)
+// without touching the others, for a tile of the row
+void RemapSpan(const SamplingSource &source, const RemapTable &remap_table, int y,
+               RemapRowBuffer *buffer, cv::Vec4f *out_pixels, int x_begin, int x_end);
+void RemapSpan(const PackedSamplingSource &source, const RemapTable &remap_table, int y,
+               RemapRowBuffer *buffer, cv::Vec4f *out_pixels, int x_begin, int x_end);
+
+// Sampling with the coords precomputed in the remap table
+void RemapCPUKernel(const cv::Mat &in_image, const cv::Mat &out_image,
+                    const aut::Size2D &image_size, const RemapTable &remap_table);
+
+// pi / 2 as float, M_PI_2 is missing if <cmath> was included before _USE_MATH_DEFINES (MSVC)
+const float kHalfPi = static_cast<float>(1.57079632679489661923);
+
+// Offsets from the center depend only on the relative coords, and are odd
+// functions of them, so mirrored pixels get the same offset with the sign flipped.
+inline glm::vec2 CalcSpoolOffset(const glm::vec2 &relative_coords, float focal_distance) {
     auto distance = glm::length(relative_coords);
+    // The center isn't moved
+    if (distance == 0)
+        return glm::vec2(0);
 
     return relative_coords / distance * focal_distance *
-           glm::atan(distance / focal_distance) + center_coord;
+           glm::atan(distance / focal_distance);
 }
 
-inline glm::vec2 CalcBarrelCoord(const glm::vec2 &coord,
-                                 const glm::vec2 &center_coord,
-                                 float focal_distance) {
-    auto relative_coords = coord - center_coord;
+inline glm::vec2 CalcBarrelOffset(const glm::vec2 &relative_coords, float focal_distance) {
     auto distance = glm::length(relative_coords);
+    // The center isn't moved
+    if (distance == 0)
+        return glm::vec2(0);
 
     return relative_coords / distance * focal_distance *
            glm::tan(glm::clamp(distance / focal_distance,
-                               static_cast<float>(-M_PI_2),
-                               static_cast<float>(M_PI_2))) +
-           center_coord;
+                               -kHalfPi, kHalfPi));
+}
+
+inline glm::vec2 CalcSpoolCoord(const glm::vec2 &coord,
+                                const glm::vec2 &center_coord,
+                                float focal_distance) {
+    return CalcSpoolOffset(coord - center_coord, focal_distance) + center_coord;
+}
+
+inline glm::vec2 CalcBarrelCoord(const glm::vec2 &coord,
+                                 const glm::vec2 &center_coord,
+                                 float focal_distance) {
+    return CalcBarrelOffset(coord - center_coord, focal_distance) + center_coord;
 }
 
 inline glm::vec2 LinearInterpolation2D(const glm::vec2 &a, const glm::vec2 &b, float alpha) {
@@ -87,4 +148,25 @@ inline glm::vec2 CalcAASampleCoords(const glm::vec2 &coords_lt, const glm::vec2
     return LinearInterpolation2D(interpolated_top, interpolated_bottom, alpha.y);
 }
 
+// Samples per axis for the quad of a pixel on the source.
+// Adaptive mode takes quality samples per source pixel along each side of the quad,
+// so the almost undistorted pixels near the center take a single sample.
+inline glm::ivec2 CalcAASamplingNum(const glm::vec2 &coords_lt, const glm::vec2 &coords_rt,
+                                    const glm::vec2 &coords_lb, const glm::vec2 &coords_rb,
+                                    int max_sampling, bool adaptive, float quality) {
+    if (!adaptive)
+        return glm::ivec2(max_sampling);
+
+    float extent_x = glm::max(glm::distance(coords_lt, coords_rt),
+                              glm::distance(coords_lb, coords_rb));
+    float extent_y = glm::max(glm::distance(coords_lt, coords_lb),
+                              glm::distance(coords_rt, coords_rb));
+    // Comparing in float keeps huge extents near the clamped tan from overflowing
+    auto sampling_num = [max_sampling, quality](float extent) {
+        float n = std::floor(extent * quality + 0.5f);
+        return n < 1 ? 1 : n > max_sampling ? max_sampling : static_cast<int>(n);
+    };
+    return glm::ivec2(sampling_num(extent_x), sampling_num(extent_y));
+}
+
 #endif // _OPTICSCOMPENSATION_S_SRC_CPU_KERNEL_H_
\ No newline at end of file
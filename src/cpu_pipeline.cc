@@ -0,0 +1,320 @@
+#include "cpu_pipeline.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "cpu_kernel.h"
+#include "cpu_scheduler.h"
+#include "mip_pyramid.h"
+
+/* PremultRowCache */
+
+template<typename Pixel>
+PremultRowCache<Pixel>::PremultRowCache(const aut::PixelRGBA *image_data,
+                                        const aut::Size2D &image_size,
+                                        IntermediateFormat format) :
+    image_data_(reinterpret_cast<const cv::Vec4b*>(image_data)),
+    image_size_(image_size),
+    format_(format),
+    zero_row_(image_size.w, Pixel(cv::Scalar::all(0))),
+    rows_(image_size.h, zero_row_.data()),
+    row_slots_(image_size.h, -1) {}
+
+template<typename Pixel>
+void PremultRowCache<Pixel>::Reserve(int y) {
+    if (row_slots_[y] >= 0)
+        return;
+
+    int slot;
+    if (free_slots_.empty()) {
+        slot = static_cast<int>(slots_.size());
+        slots_.emplace_back(image_size_.w);
+    } else {
+        slot = free_slots_.back();
+        free_slots_.pop_back();
+    }
+    row_slots_[y] = slot;
+    rows_[y] = slots_[slot].data();
+}
+
+// Premultiply into the pixels of the cache
+static void PremultCacheRow(const cv::Vec4b *in_row, cv::Vec4f *out_row, int w, IntermediateFormat) {
+    PremultRow(in_row, out_row, w);
+}
+
+static void PremultCacheRow(const cv::Vec4b *in_row, cv::Vec4w *out_row, int w,
+                            IntermediateFormat format) {
+    PremultRow(in_row, out_row, w, format);
+}
+
+template<typename Pixel>
+void PremultRowCache<Pixel>::Premult(int y) {
+    PremultCacheRow(image_data_ + static_cast<std::size_t>(y) * image_size_.w,
+                    slots_[row_slots_[y]].data(), image_size_.w, format_);
+}
+
+template<typename Pixel>
+void PremultRowCache<Pixel>::Release(int y) {
+    if (row_slots_[y] < 0)
+        return;
+
+    free_slots_.push_back(row_slots_[y]);
+    row_slots_[y] = -1;
+    rows_[y] = zero_row_.data();
+}
+
+template class PremultRowCache<cv::Vec4f>;
+template class PremultRowCache<cv::Vec4w>;
+
+static SamplingSource GetSamplingSource(const PremultRowCache<cv::Vec4f> &row_cache,
+                                        const aut::Size2D &image_size) {
+    return {row_cache.GetRows(), image_size.w, image_size.h};
+}
+
+static PackedSamplingSource GetSamplingSource(const PremultRowCache<cv::Vec4w> &row_cache,
+                                              const aut::Size2D &image_size) {
+    return {row_cache.GetRows(), image_size.w, image_size.h, row_cache.GetFormat()};
+}
+
+// Clamp the source row to the image, comparing in float for huge coords
+static int ClampSourceRow(float y, int h) {
+    return static_cast<int>(std::min(std::max(y, 0.f), static_cast<float>(h - 1)));
+}
+
+void FusedCPUKernel(aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                    const RemapTable &remap_table, int band_height) {
+    FusedCPUKernel(image_data, image_size, remap_table,
+                   cv::Rect(0, 0, image_size.w, image_size.h), intermediate_float, band_height);
+}
+
+template<typename Pixel>
+static void FusedCPUKernelImpl(aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                               const RemapTable &remap_table, const cv::Rect &live_rect,
+                               IntermediateFormat format, int band_height) {
+    int w = image_size.w;
+    int h = image_size.h;
+    if (w <= 0 || h <= 0)
+        return;
+
+    bool use_corner = remap_table.GetLayout() == RemapTable::pixel_corner;
+    int band_num = (h + band_height - 1) / band_height;
+
+    // Source rows sampled by each band. Bilinear taps reach floor(y) + 1, and a row
+    // of margin on both sides covers the rounding of the anti-aliasing sample coords.
+    std::vector<int> band_first(band_num);
+    std::vector<int> band_last(band_num);
+    for (int b = 0; b < band_num; b++) {
+        // Rows out of live_rect don't sample anything
+        int y_begin = std::max(b * band_height, live_rect.y);
+        int y_end = std::min({b * band_height + band_height, h, live_rect.y + live_rect.height});
+        // Corner grid has one more row than the image
+        int grid_end = use_corner ? y_end + 1 : y_end;
+        // Rows without live pixels have min > max
+        float min_y = std::numeric_limits<float>::max();
+        float max_y = std::numeric_limits<float>::lowest();
+        for (int y = y_begin; y < grid_end; y++) {
+            min_y = std::min(min_y, remap_table.GetRowMinY(y));
+            max_y = std::max(max_y, remap_table.GetRowMaxY(y));
+        }
+        if (y_begin >= y_end || min_y > max_y) {
+            band_first[b] = 0;
+            band_last[b] = -1;
+            continue;
+        }
+        band_first[b] = ClampSourceRow(std::floor(min_y) - 1, h);
+        band_last[b] = ClampSourceRow(std::floor(max_y) + 2, h);
+    }
+
+    // Last band which samples each source row
+    std::vector<int> last_use(h, -1);
+    for (int b = 0; b < band_num; b++) {
+        for (int y = band_first[b]; y <= band_last[b]; y++)
+            last_use[y] = b;
+    }
+
+    PremultRowCache<Pixel> row_cache(image_data, image_size, format);
+    auto source = GetSamplingSource(row_cache, image_size);
+    std::vector<int> load_rows;
+
+    int live_x_end = live_rect.x + live_rect.width;
+    int live_y_end = live_rect.y + live_rect.height;
+
+    #pragma omp parallel num_threads(GetCPUThreadNum())
+    {
+        RemapRowBuffer buffer;
+        std::vector<cv::Vec4f> distorted_pixels;
+
+        for (int b = 0; b < band_num; b++) {
+            int y_begin = b * band_height;
+            int y_end = std::min(y_begin + band_height, h);
+
+            #pragma omp single
+            {
+                // Rows of the previous band sampled by no later band
+                if (b > 0) {
+                    for (int y = band_first[b - 1]; y <= band_last[b - 1]; y++) {
+                        if (last_use[y] == b - 1)
+                            row_cache.Release(y);
+                    }
+                }
+                load_rows.clear();
+                for (int y = band_first[b]; y <= band_last[b]; y++) {
+                    if (!row_cache.IsReserved(y)) {
+                        row_cache.Reserve(y);
+                        load_rows.push_back(y);
+                    }
+                }
+                // Keep the rows overwritten by this band which are sampled later
+                for (int y = y_begin; y < y_end; y++) {
+                    if (last_use[y] > b && !row_cache.IsReserved(y)) {
+                        row_cache.Reserve(y);
+                        load_rows.push_back(y);
+                    }
+                }
+            }
+
+            #pragma omp for
+            for (int i = 0; i < static_cast<int>(load_rows.size()); i++)
+                row_cache.Premult(load_rows[i]);
+
+            // 2D tiles of the band like TileScheduler, so a band of a few rows
+            // still keeps every thread busy on the wide images
+            TileScheduler scheduler(aut::Size2D(w, y_end - y_begin));
+            #pragma omp for schedule(dynamic, 1)
+            for (int t = 0; t < scheduler.GetTileNum(); t++) {
+                ImageTile tile = scheduler.GetTile(t);
+                int tile_w = tile.x_end - tile.x_begin;
+                distorted_pixels.resize(tile_w);
+                // Columns of the tile in live_rect, the others are cleared
+                int span_begin = std::min(std::max(tile.x_begin, live_rect.x), tile.x_end);
+                int span_end = std::max(std::min(tile.x_end, live_x_end), span_begin);
+                for (int y = y_begin + tile.y_begin; y < y_begin + tile.y_end; y++) {
+                    cv::Vec4f zero(cv::Scalar::all(0));
+                    if (y >= live_rect.y && y < live_y_end && span_begin < span_end) {
+                        std::fill(distorted_pixels.begin(),
+                                  distorted_pixels.begin() + (span_begin - tile.x_begin), zero);
+                        std::fill(distorted_pixels.begin() + (span_end - tile.x_begin),
+                                  distorted_pixels.end(), zero);
+                        RemapSpan(source, remap_table, y, &buffer,
+                                  distorted_pixels.data() + (span_begin - tile.x_begin),
+                                  span_begin, span_end);
+                    } else {
+                        std::fill(distorted_pixels.begin(), distorted_pixels.end(), zero);
+                    }
+                    UnpremultRow(distorted_pixels.data(),
+                                 reinterpret_cast<cv::Vec4b*>(image_data) +
+                                     static_cast<std::size_t>(y) * w + tile.x_begin,
+                                 tile_w);
+                }
+            }
+        }
+    }
+}
+
+void FusedCPUKernel(aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                    const RemapTable &remap_table, const cv::Rect &live_rect,
+                    IntermediateFormat format, int band_height) {
+    if (format == intermediate_float)
+        FusedCPUKernelImpl<cv::Vec4f>(image_data, image_size, remap_table, live_rect, format, band_height);
+    else
+        FusedCPUKernelImpl<cv::Vec4w>(image_data, image_size, remap_table, live_rect, format, band_height);
+}
+
+template<typename Pixel>
+static void FusedCPUBandKernelImpl(const aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                                   const RemapTable &remap_table, int y_begin, int y_end,
+                                   aut::PixelRGBA *output, IntermediateFormat format) {
+    int w = image_size.w;
+    int h = image_size.h;
+    if (w <= 0 || h <= 0 || y_begin >= y_end)
+        return;
+
+    // Source rows sampled by the band, with the margins of FusedCPUKernel()
+    int grid_end = remap_table.GetLayout() == RemapTable::pixel_corner ? y_end + 1 : y_end;
+    float min_y = std::numeric_limits<float>::max();
+    float max_y = std::numeric_limits<float>::lowest();
+    for (int y = y_begin; y < grid_end; y++) {
+        min_y = std::min(min_y, remap_table.GetRowMinY(y));
+        max_y = std::max(max_y, remap_table.GetRowMaxY(y));
+    }
+    PremultRowCache<Pixel> row_cache(image_data, image_size, format);
+    std::vector<int> load_rows;
+    if (min_y <= max_y) {
+        int first = ClampSourceRow(std::floor(min_y) - 1, h);
+        int last = ClampSourceRow(std::floor(max_y) + 2, h);
+        for (int y = first; y <= last; y++) {
+            row_cache.Reserve(y);
+            load_rows.push_back(y);
+        }
+    }
+    auto source = GetSamplingSource(row_cache, image_size);
+    TileScheduler scheduler(aut::Size2D(w, y_end - y_begin));
+
+    #pragma omp parallel num_threads(GetCPUThreadNum())
+    {
+        // The barrier of the loop keeps the output from overwriting a source row before it is read
+        #pragma omp for
+        for (int i = 0; i < static_cast<int>(load_rows.size()); i++)
+            row_cache.Premult(load_rows[i]);
+
+        RemapRowBuffer buffer;
+        std::vector<cv::Vec4f> distorted_pixels;
+        #pragma omp for schedule(dynamic, 1)
+        for (int t = 0; t < scheduler.GetTileNum(); t++) {
+            ImageTile tile = scheduler.GetTile(t);
+            int tile_w = tile.x_end - tile.x_begin;
+            distorted_pixels.resize(tile_w);
+            for (int y = tile.y_begin; y < tile.y_end; y++) {
+                RemapSpan(source, remap_table, y_begin + y, &buffer, distorted_pixels.data(),
+                          tile.x_begin, tile.x_end);
+                UnpremultRow(distorted_pixels.data(),
+                             reinterpret_cast<cv::Vec4b*>(output) +
+                                 static_cast<std::size_t>(y) * w + tile.x_begin,
+                             tile_w);
+            }
+        }
+    }
+}
+
+void FusedCPUBandKernel(const aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                        const RemapTable &remap_table, int y_begin, int y_end,
+                        aut::PixelRGBA *output, IntermediateFormat format) {
+    if (format == intermediate_float)
+        FusedCPUBandKernelImpl<cv::Vec4f>(image_data, image_size, remap_table, y_begin, y_end, output, format);
+    else
+        FusedCPUBandKernelImpl<cv::Vec4w>(image_data, image_size, remap_table, y_begin, y_end, output, format);
+}
+
+void AnisotropicCPUKernel(aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                          const RemapTable &remap_table, int max_anisotropy) {
+    AnisotropicCPUBandKernel(image_data, image_size, remap_table, 0, image_size.h, image_data,
+                             max_anisotropy);
+}
+
+void AnisotropicCPUBandKernel(const aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                              const RemapTable &remap_table, int y_begin, int y_end,
+                              aut::PixelRGBA *output, int max_anisotropy) {
+    int w = image_size.w;
+    int h = image_size.h;
+    if (w <= 0 || h <= 0 || y_begin >= y_end)
+        return;
+
+    cv::Size mat_size(w, h);
+    cv::Mat image_in(mat_size, CV_8UC4, const_cast<aut::PixelRGBA*>(image_data));
+    cv::Mat premultiplied(mat_size, CV_32FC4);
+    PremultKernel(image_in, premultiplied);
+    auto rows = GetRowPointers(premultiplied);
+    MipPyramid pyramid({rows.data(), w, h});
+
+    // The source is the premultiplied copy, so the rows can be overwritten in any order
+    #pragma omp parallel num_threads(GetCPUThreadNum())
+    {
+        std::vector<cv::Vec4f> distorted_row(w);
+        #pragma omp for schedule(dynamic, 4)
+        for (int y = y_begin; y < y_end; y++) {
+            AnisotropicRemapRow(pyramid, remap_table, y, max_anisotropy, distorted_row.data());
+            UnpremultRow(distorted_row.data(),
+                         reinterpret_cast<cv::Vec4b*>(output) + static_cast<std::size_t>(y - y_begin) * w,
+                         w);
+        }
+    }
+}
\ No newline at end of file
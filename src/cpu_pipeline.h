@@ -0,0 +1,75 @@
+#ifndef _OPTICSCOMPENSATION_S_SRC_CPU_PIPELINE_H_
+#define _OPTICSCOMPENSATION_S_SRC_CPU_PIPELINE_H_
+
+#include <vector>
+#include <aut/AUL_Type.h>
+#include <opencv2/opencv.hpp>
+#include "remap_table.h"
+#include "simd_sampler.h"
+
+// Premultiplied copies of the source rows, loaded on demand.
+// Pixel is cv::Vec4f for intermediate_float and cv::Vec4w for the packed formats.
+// Released rows are recycled, so the memory only grows to the number of rows
+// loaded at the same time.
+template<typename Pixel>
+class PremultRowCache {
+public:
+    PremultRowCache(const aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                    IntermediateFormat format = intermediate_float);
+
+    // Assign a buffer to row y, must be called from one thread at a time
+    void Reserve(int y);
+    // Premultiply row y into its buffer, can be called in parallel
+    void Premult(int y);
+    void Release(int y);
+
+    bool IsReserved(int y) const { return row_slots_[y] >= 0; }
+    std::size_t GetSlotNum() const { return slots_.size(); }
+    IntermediateFormat GetFormat() const { return format_; }
+
+    // Row pointers for SamplingSource, rows not loaded point to a row of zeros
+    const Pixel* const* GetRows() const { return rows_.data(); }
+
+private:
+    const cv::Vec4b *image_data_;
+    aut::Size2D image_size_;
+    IntermediateFormat format_;
+    std::vector<Pixel> zero_row_;
+    std::vector<const Pixel*> rows_;
+    std::vector<int> row_slots_;
+    std::vector<std::vector<Pixel>> slots_;
+    std::vector<int> free_slots_;
+};
+
+// Premultiply, distort and unpremultiply the image in place in a single pass.
+// Output rows are processed in bands of band_height rows, each split into tiles which the
+// threads take dynamically. Only the source rows used by the current band (or overwritten
+// by it and used later) are kept as floats.
+// The result is bit-identical to PremultKernel -> RemapCPUKernel -> UnpremultKernel.
+void FusedCPUKernel(aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                    const RemapTable &remap_table, int band_height = 32);
+// Only the pixels in live_rect are sampled and the others are cleared, see CalcLiveRect().
+// The source rows are kept in format, intermediate_fixed16 gives the same result as
+// intermediate_float with half the memory, intermediate_half differs by 1 at most.
+void FusedCPUKernel(aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                    const RemapTable &remap_table, const cv::Rect &live_rect,
+                    IntermediateFormat format = intermediate_float, int band_height = 32);
+
+// Distort rows [y_begin, y_end) of the image into output, which holds only those rows,
+// with the table of the whole image. image_data isn't written, and every source row the band
+// samples is premultiplied before the first output row, so output can share its pixels.
+// The rows are bit-identical to the rows of FusedCPUKernel() with the same table.
+void FusedCPUBandKernel(const aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                        const RemapTable &remap_table, int y_begin, int y_end,
+                        aut::PixelRGBA *output, IntermediateFormat format = intermediate_float);
+
+// Anisotropic filtering of a pixel_corner remap table in place.
+// The mip pyramid needs the whole source, so it is premultiplied at once instead of in bands.
+void AnisotropicCPUKernel(aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                          const RemapTable &remap_table, int max_anisotropy);
+// Rows [y_begin, y_end) into output like FusedCPUBandKernel()
+void AnisotropicCPUBandKernel(const aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                              const RemapTable &remap_table, int y_begin, int y_end,
+                              aut::PixelRGBA *output, int max_anisotropy);
+
+#endif // _OPTICSCOMPENSATION_S_SRC_CPU_PIPELINE_H_
\ No newline at end of file
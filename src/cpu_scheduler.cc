@@ -0,0 +1,20 @@
+#include "cpu_scheduler.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+static int cpu_thread_num = 0;
+
+void SetCPUThreadNum(int thread_num) {
+    cpu_thread_num = std::max(thread_num, 0);
+}
+
+int GetCPUThreadNum() {
+    if (cpu_thread_num > 0)
+        return cpu_thread_num;
+#ifdef _OPENMP
+    return omp_get_num_procs();
+#else
+    return 1;
+#endif
+}
\ No newline at end of file
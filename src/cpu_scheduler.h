@@ -0,0 +1,66 @@
+#ifndef _OPTICSCOMPENSATION_S_SRC_CPU_SCHEDULER_H_
+#define _OPTICSCOMPENSATION_S_SRC_CPU_SCHEDULER_H_
+
+#include <algorithm>
+#include <aut/AUL_Type.h>
+
+// Number of threads used by the CPU kernels, 0 uses all the cores
+void SetCPUThreadNum(int thread_num);
+// Resolved number of threads (at least 1)
+int GetCPUThreadNum();
+
+// Pixel range [begin, end) of a tile
+struct ImageTile {
+    int x_begin;
+    int y_begin;
+    int x_end;
+    int y_end;
+};
+
+// Splits the image into 2D tiles small enough for the cache, and hands them out
+// to the threads dynamically since the cost per pixel depends on the radius.
+class TileScheduler {
+public:
+    TileScheduler(const aut::Size2D &image_size, int tile_w = 64, int tile_h = 16);
+
+    int GetTileNum() const { return tile_num_x_ * tile_num_y_; }
+    ImageTile GetTile(int index) const;
+
+    // Call process_tile(const ImageTile&) for every tile in parallel
+    template<typename ProcessTile> void Run(ProcessTile process_tile) const;
+
+private:
+    aut::Size2D image_size_;
+    int tile_w_;
+    int tile_h_;
+    int tile_num_x_;
+    int tile_num_y_;
+};
+
+inline TileScheduler::TileScheduler(const aut::Size2D &image_size, int tile_w, int tile_h) :
+    image_size_(image_size),
+    tile_w_(tile_w),
+    tile_h_(tile_h),
+    tile_num_x_((std::max(image_size.w, 0) + tile_w - 1) / tile_w),
+    tile_num_y_((std::max(image_size.h, 0) + tile_h - 1) / tile_h) {}
+
+inline ImageTile TileScheduler::GetTile(int index) const {
+    // Row-major order, so the tiles processed at the same time share the source rows
+    int tx = index % tile_num_x_;
+    int ty = index / tile_num_x_;
+    ImageTile tile;
+    tile.x_begin = tx * tile_w_;
+    tile.y_begin = ty * tile_h_;
+    tile.x_end = std::min(tile.x_begin + tile_w_, image_size_.w);
+    tile.y_end = std::min(tile.y_begin + tile_h_, image_size_.h);
+    return tile;
+}
+
+template<typename ProcessTile> void TileScheduler::Run(ProcessTile process_tile) const {
+    int tile_num = GetTileNum();
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(GetCPUThreadNum())
+    for (int i = 0; i < tile_num; i++)
+        process_tile(GetTile(i));
+}
+
+#endif // _OPTICSCOMPENSATION_S_SRC_CPU_SCHEDULER_H_
\ No newline at end of file
@@ -1,11 +1,17 @@
 #ifndef CL_KERNEL_SOURCE
 #define CL_KERNEL_SOURCE(x) x
+#define VARIANT_AA_SAMPLES 0
+#define VARIANT_FULL_GROUPS 0
 #endif // CL_KERNEL_SOURCE
 
 CL_KERNEL_SOURCE(
 
 __constant sampler_t sampler_ = CLK_NORMALIZED_COORDS_TRUE | CLK_ADDRESS_CLAMP | CLK_FILTER_LINEAR;
 
+// Unnormalized nearest sampler for the manual filtering of the fused kernels,
+// out of range reads return transparent black like sampler_
+__constant sampler_t pixel_sampler_ = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP | CLK_FILTER_NEAREST;
+
 __constant float half_pi = 3.14159265358979323846 * 0.5;
 
 inline float2 ToNormalizedCoordsi(int2 coords, int2 image_size) {
@@ -24,6 +30,13 @@ inline bool IsProcessArea(int2 coords, int2 image_size) {
     return true;
 }
 
+// Threads of the distortion kernels out of the area. The variants built with
+// VARIANT_FULL_GROUPS are enqueued only over whole work-groups inside the area,
+// so the check folds away.
+inline bool IsOutOfDistortionArea(int2 thread_id, int2 area) {
+    return !VARIANT_FULL_GROUPS && !IsProcessArea(thread_id, area);
+}
+
 inline float2 LinearInterpolation2D(float2 a, float2 b, float alpha) {
     return a + (b - a) * alpha;
 }
@@ -36,24 +49,350 @@ inline float2 CalcSampleCoords(float2 coords_lt, float2 coords_rt,
     return LinearInterpolation2D(interpolated_top, interpolated_bottom, alpha.y);
 }
 
-inline float2 CalcBarrelCoords(float2 coords, float2 center_coords, float focal_distance) {
-    // Coords relative to the center
-    float2 relative_coords = coords - center_coords;
+// Samples per axis for the quad of a pixel on the source.
+// Adaptive mode (quality > 0) takes quality samples per source pixel along each side
+// of the quad, so the almost undistorted pixels near the center take a single sample.
+inline int2 CalcAASamplingNum(float2 coords_lt, float2 coords_rt,
+                              float2 coords_lb, float2 coords_rb,
+                              int max_sampling, float quality) {
+    if (quality <= 0)
+        return (int2)max_sampling;
+
+    float2 extent = (float2)(
+        fmax(distance(coords_lt, coords_rt), distance(coords_lb, coords_rb)),
+        fmax(distance(coords_lt, coords_lb), distance(coords_rt, coords_rb))
+    );
+    // Clamping in float keeps huge extents near the clamped tan from overflowing
+    return convert_int2(clamp(floor(extent * quality + (float2)0.5),
+                              (float2)1, (float2)max_sampling));
+}
+
+inline float2 CalcBarrelOffset(float2 relative_coords, float focal_distance) {
+    // Distance from center
+    float distance = length(relative_coords);
+    // The center isn't moved, the corners of the pixels can be on it
+    if (distance == 0)
+        return (float2)0;
+
+    return relative_coords / distance * focal_distance *
+           tan(clamp(distance / focal_distance, -half_pi, half_pi));
+}
+
+inline float2 CalcSpoolOffset(float2 relative_coords, float focal_distance) {
     // Distance from center
     float distance = length(relative_coords);
+    // The center isn't moved, the corners of the pixels can be on it
+    if (distance == 0)
+        return (float2)0;
 
     return relative_coords / distance * focal_distance *
-           tan(clamp(distance / focal_distance, -half_pi, half_pi)) +
-           center_coords;
+           atan(distance / focal_distance);
+}
+
+inline float2 CalcBarrelCoords(float2 coords, float2 center_coords, float focal_distance) {
+    // Coords relative to the center
+    float2 relative_coords = coords - center_coords;
+
+    return CalcBarrelOffset(relative_coords, focal_distance) + center_coords;
 }
 
 inline float2 CalcSpoolCoords(float2 coords, float2 center_coords, float focal_distance) {
         // Coords relative to the center
         float2 relative_coords = coords - center_coords;
-        // Distance from center
-        float distance = length(relative_coords);
-        return relative_coords / distance * focal_distance *
-               atan(distance / focal_distance) + center_coords;
+
+        return CalcSpoolOffset(relative_coords, focal_distance) + center_coords;
+}
+
+inline float2 CalcDistortedCoords(float2 coords, float2 center_coords, float focal_distance,
+                                  int spool_mode) {
+    return spool_mode ? CalcSpoolCoords(coords, center_coords, focal_distance) :
+                        CalcBarrelCoords(coords, center_coords, focal_distance);
+}
+
+// Camera models of lens_brown_conrady (model 1) and lens_fisheye (model 2), same as
+// lens_model.h. coords are normalized by the focal length, lens holds k1 to k4, p1 and p2.
+// Returns the distorted coords with the partial derivatives by x and y.
+inline float2 DistortLensModel(float2 coords, float8 lens, int model,
+                               float2 *d_dx, float2 *d_dy) {
+    float x = coords.x;
+    float y = coords.y;
+    float r2 = x * x + y * y;
+    if (model == 2) {
+        float r = sqrt(r2);
+        // Near the center the model is the identity up to the cube of r
+        if (r < 1e-6f) {
+            *d_dx = (float2)(1, 0);
+            *d_dy = (float2)(0, 1);
+            return coords;
+        }
+        // theta_d = theta (1 + k1 theta^2 + ...) and the coords are scaled by theta_d / r
+        float theta = atan(r);
+        float theta2 = theta * theta;
+        float scale = 1 + theta2 * (lens.s0 + theta2 * (lens.s1 + theta2 * (lens.s2 + theta2 * lens.s3)));
+        float d_scale = 1 + theta2 * (3 * lens.s0 + theta2 * (5 * lens.s1 +
+                                      theta2 * (7 * lens.s2 + theta2 * 9 * lens.s3)));
+        float s = theta * scale / r;
+        float ds_dr_r = (d_scale / (1 + r2) - s) / r2;
+        *d_dx = (float2)(s + x * x * ds_dr_r, x * y * ds_dr_r);
+        *d_dy = (float2)(x * y * ds_dr_r, s + y * y * ds_dr_r);
+        return coords * s;
+    }
+
+    // Radial polynomial by Horner's method on the squared radius
+    float radial = 1 + r2 * (lens.s0 + r2 * (lens.s1 + r2 * lens.s2));
+    float d_radial = lens.s0 + r2 * (2 * lens.s1 + r2 * 3 * lens.s2);
+    float cross = 2 * x * y * d_radial + 2 * lens.s4 * x + 2 * lens.s5 * y;
+    *d_dx = (float2)(radial + 2 * x * x * d_radial + 2 * lens.s4 * y + 6 * lens.s5 * x, cross);
+    *d_dy = (float2)(cross, radial + 2 * y * y * d_radial + 6 * lens.s4 * y + 2 * lens.s5 * x);
+    return (float2)(x * radial + 2 * lens.s4 * x * y + lens.s5 * (r2 + 2 * x * x),
+                    y * radial + lens.s4 * (r2 + 2 * y * y) + 2 * lens.s5 * x * y);
+}
+
+// Undistorted coords by Newton's method from the distorted coords themselves.
+// False if it doesn't converge, or converges beyond the fold of the model.
+inline bool UndistortLensModel(float2 distorted_coords, float8 lens, int model,
+                               float max_error, float2 *coords) {
+    float2 u = distorted_coords;
+    for (int i = 0; i < 20; i++) {
+        float2 d_dx;
+        float2 d_dy;
+        float2 error = DistortLensModel(u, lens, model, &d_dx, &d_dy) - distorted_coords;
+        float det = d_dx.x * d_dy.y - d_dy.x * d_dx.y;
+        if (!(det > 0))
+            return false;
+        if (dot(error, error) <= max_error * max_error) {
+            *coords = u;
+            return true;
+        }
+        u -= (float2)(d_dy.y * error.x - d_dy.x * error.y,
+                      d_dx.x * error.y - d_dx.y * error.x) / det;
+    }
+    return false;
+}
+
+// Undistorting samples the footage through the model, distorting through its inverse.
+// The pixels without a source sample far out of the image.
+inline float2 CalcLensModelCoords(float2 coords, float2 center_coords, float focal_length,
+                                  float8 lens, int model, int undistort) {
+    float2 normalized_coords = (coords - center_coords) / focal_length;
+    float2 source_coords;
+    if (undistort) {
+        float2 d_dx;
+        float2 d_dy;
+        source_coords = DistortLensModel(normalized_coords, lens, model, &d_dx, &d_dy);
+    } else if (!UndistortLensModel(normalized_coords, lens, model, 0.01f / focal_length,
+                                   &source_coords)) {
+        return center_coords + (float2)-1e6f;
+    }
+    return source_coords * focal_length + center_coords;
+}
+
+// Sample and write the pixel and its mirrors across the center lines.
+// The offsets of the mirrored pixels only differ in sign.
+inline void WriteMirroredPixels(read_only image2d_t in_image, write_only image2d_t out_image,
+                                int2 coords, int2 image_size, float2 center_coords,
+                                float2 offset) {
+    int2 mirror_coords = image_size - 1 - coords;
+    float4 pixel_data = read_imagef(in_image, sampler_,
+                                    ToNormalizedCoordsf(center_coords + offset, image_size));
+    write_imagef(out_image, coords, pixel_data);
+    if (mirror_coords.x != coords.x) {
+        pixel_data = read_imagef(in_image, sampler_,
+            ToNormalizedCoordsf(center_coords + (float2)(-offset.x, offset.y), image_size));
+        write_imagef(out_image, (int2)(mirror_coords.x, coords.y), pixel_data);
+    }
+    if (mirror_coords.y != coords.y) {
+        pixel_data = read_imagef(in_image, sampler_,
+            ToNormalizedCoordsf(center_coords + (float2)(offset.x, -offset.y), image_size));
+        write_imagef(out_image, (int2)(coords.x, mirror_coords.y), pixel_data);
+        if (mirror_coords.x != coords.x) {
+            pixel_data = read_imagef(in_image, sampler_,
+                                     ToNormalizedCoordsf(center_coords - offset, image_size));
+            write_imagef(out_image, mirror_coords, pixel_data);
+        }
+    }
+}
+
+inline float4 ReadPremultPixel(read_only image2d_t image, int2 coords) {
+    float4 pixel_data = read_imagef(image, pixel_sampler_, coords);
+    pixel_data.xyz *= pixel_data.w;
+    return pixel_data;
+}
+
+inline float4 UnpremultPixel(float4 pixel_data) {
+    if (pixel_data.w != 0)
+        pixel_data.xyz /= pixel_data.w;
+    return pixel_data;
+}
+
+// Bilinear sampling of the premultiplied image. The taps are premultiplied before
+// the interpolation, so the filtering has to be done here instead of the sampler.
+inline float4 SamplePremultPixel(read_only image2d_t image, float2 coords, int2 image_size) {
+    // Coords beyond one pixel outside only read the border
+    coords = clamp(coords, (float2)-1, convert_float2(image_size));
+    float2 floor_coords = floor(coords);
+    float2 alpha = coords - floor_coords;
+    int2 coords_lt = convert_int2(floor_coords);
+    float4 top = mix(ReadPremultPixel(image, coords_lt),
+                     ReadPremultPixel(image, coords_lt + (int2)(1, 0)), alpha.x);
+    float4 bottom = mix(ReadPremultPixel(image, coords_lt + (int2)(0, 1)),
+                        ReadPremultPixel(image, coords_lt + (int2)(1, 1)), alpha.x);
+    return mix(top, bottom, alpha.y);
+}
+
+// WriteMirroredPixels for the fused kernels, which read the straight alpha source
+inline void WriteMirroredFusedPixels(read_only image2d_t in_image, write_only image2d_t out_image,
+                                     int2 coords, int2 image_size, float2 center_coords,
+                                     float2 offset) {
+    int2 mirror_coords = image_size - 1 - coords;
+    float4 pixel_data = SamplePremultPixel(in_image, center_coords + offset, image_size);
+    write_imagef(out_image, coords, UnpremultPixel(pixel_data));
+    if (mirror_coords.x != coords.x) {
+        pixel_data = SamplePremultPixel(in_image,
+            center_coords + (float2)(-offset.x, offset.y), image_size);
+        write_imagef(out_image, (int2)(mirror_coords.x, coords.y), UnpremultPixel(pixel_data));
+    }
+    if (mirror_coords.y != coords.y) {
+        pixel_data = SamplePremultPixel(in_image,
+            center_coords + (float2)(offset.x, -offset.y), image_size);
+        write_imagef(out_image, (int2)(coords.x, mirror_coords.y), UnpremultPixel(pixel_data));
+        if (mirror_coords.x != coords.x) {
+            pixel_data = SamplePremultPixel(in_image, center_coords - offset, image_size);
+            write_imagef(out_image, mirror_coords, UnpremultPixel(pixel_data));
+        }
+    }
+}
+
+// Average of the samples inside the quad of the corners of a pixel on the source
+inline float4 MultiSampleQuad(read_only image2d_t in_image, int2 image_size,
+                              float2 coords_lt, float2 coords_rt,
+                              float2 coords_lb, float2 coords_rb,
+                              int max_sampling_per_dimension, float adaptive_quality) {
+    // A constant count of the variants unrolls the loops
+    int2 sampling_num = VARIANT_AA_SAMPLES > 0 ? (int2)VARIANT_AA_SAMPLES :
+                        CalcAASamplingNum(coords_lt, coords_rt, coords_lb, coords_rb,
+                                          max_sampling_per_dimension, adaptive_quality);
+    float2 sampling_step = (float2)1 / convert_float2(sampling_num);
+    float4 pixel_data = (float4)0;
+    for (int y = 0; y < sampling_num.y; y++) {
+        for (int x = 0; x < sampling_num.x; x++) {
+            float2 alpha = (convert_float2((int2)(x, y)) + (float2)0.5) * sampling_step;
+            float2 coords = CalcSampleCoords(coords_lt, coords_rt, coords_lb, coords_rb, alpha);
+            pixel_data += read_imagef(in_image, sampler_,
+                                      ToNormalizedCoordsf(coords, image_size));
+        }
+    }
+    int sampled_num = sampling_num.x * sampling_num.y;
+    return pixel_data / sampled_num;
+}
+
+// MultiSampleQuad for the fused kernels, which read the straight alpha source
+inline float4 FusedMultiSampleQuad(read_only image2d_t in_image, int2 image_size,
+                                   float2 coords_lt, float2 coords_rt,
+                                   float2 coords_lb, float2 coords_rb,
+                                   int max_sampling_per_dimension, float adaptive_quality) {
+    // A constant count of the variants unrolls the loops
+    int2 sampling_num = VARIANT_AA_SAMPLES > 0 ? (int2)VARIANT_AA_SAMPLES :
+                        CalcAASamplingNum(coords_lt, coords_rt, coords_lb, coords_rb,
+                                          max_sampling_per_dimension, adaptive_quality);
+    float2 sampling_step = (float2)1 / convert_float2(sampling_num);
+    float4 pixel_data = (float4)0;
+    for (int y = 0; y < sampling_num.y; y++) {
+        for (int x = 0; x < sampling_num.x; x++) {
+            float2 alpha = (convert_float2((int2)(x, y)) + (float2)0.5) * sampling_step;
+            float2 coords = CalcSampleCoords(coords_lt, coords_rt, coords_lb, coords_rb, alpha);
+            pixel_data += SamplePremultPixel(in_image, coords, image_size);
+        }
+    }
+    int sampled_num = sampling_num.x * sampling_num.y;
+    return pixel_data / sampled_num;
+}
+
+// Mip pyramid of the premultiplied source for the anisotropic filter.
+// The levels are stored one after another as half4 in a buffer, level l + 1 is
+// the 2x2 box filter of level l with the size rounded up.
+
+inline int2 GetMipLevelSize(int2 image_size, int level) {
+    int2 size = image_size;
+    for (int i = 0; i < level; i++)
+        size = (size + 1) / 2;
+    return size;
+}
+
+inline int GetMipLevelOffset(int2 image_size, int level) {
+    int2 size = image_size;
+    int offset = 0;
+    for (int i = 0; i < level; i++) {
+        offset += size.x * size.y;
+        size = (size + 1) / 2;
+    }
+    return offset;
+}
+
+// Pixels out of the level are transparent black like the image samplers
+inline float4 ReadMipPixel(__global const half *pyramid, int offset, int2 size, int2 coords) {
+    if (!IsProcessArea(coords, size))
+        return (float4)0;
+    return vload_half4(offset + coords.y * size.x + coords.x, pyramid);
+}
+
+// Bilinear sampling of a level, coords are on level 0 and scale is 2^-level
+inline float4 SampleMipLevel(__global const half *pyramid, int offset, int2 size,
+                             float scale, float2 coords) {
+    // Centers of the pixels of the level are at (i + 0.5) * 2^level - 0.5 on level 0.
+    // Coords beyond one pixel outside only read the border.
+    coords = clamp((coords + (float2)0.5) * scale - (float2)0.5,
+                   (float2)-1, convert_float2(size));
+    float2 floor_coords = floor(coords);
+    float2 alpha = coords - floor_coords;
+    int2 coords_lt = convert_int2(floor_coords);
+    float4 top = mix(ReadMipPixel(pyramid, offset, size, coords_lt),
+                     ReadMipPixel(pyramid, offset, size, coords_lt + (int2)(1, 0)), alpha.x);
+    float4 bottom = mix(ReadMipPixel(pyramid, offset, size, coords_lt + (int2)(0, 1)),
+                        ReadMipPixel(pyramid, offset, size, coords_lt + (int2)(1, 1)), alpha.x);
+    return mix(top, bottom, alpha.y);
+}
+
+// Trilinear taps along the major axis of the quad of a pixel on the source, up to
+// max_anisotropy of them, on the level whose pixels cover the minor axis.
+// Same filter as SampleAnisotropic on the CPU.
+inline float4 SampleAnisotropic(__global const half *pyramid, int2 image_size, int level_num,
+                                float2 coords_lt, float2 coords_rt,
+                                float2 coords_lb, float2 coords_rb,
+                                int max_anisotropy) {
+    // Center and axes of the parallelogram fitted to the quad
+    float2 center = (coords_lt + coords_rt + coords_lb + coords_rb) * 0.25f;
+    float2 axis_x = ((coords_rt - coords_lt) + (coords_rb - coords_lb)) * 0.5f;
+    float2 axis_y = ((coords_lb - coords_lt) + (coords_rb - coords_rt)) * 0.5f;
+    float length_x = length(axis_x);
+    float length_y = length(axis_y);
+    float2 major_axis = length_x >= length_y ? axis_x : axis_y;
+    float major_length = fmax(length_x, length_y);
+    // Magnified axes are sampled on level 0
+    float minor_length = fmax(fmin(length_x, length_y), 1.0f);
+
+    // Clamping in float keeps huge footprints near the clamped tan from overflowing
+    float tap_num = clamp(ceil(major_length / minor_length), 1.0f, convert_float(max_anisotropy));
+    float lod = clamp(log2(major_length / tap_num), 0.0f, convert_float(level_num - 1));
+    int level = convert_int(lod);
+    float level_alpha = lod - convert_float(level);
+    int2 size = GetMipLevelSize(image_size, level);
+    int offset = GetMipLevelOffset(image_size, level);
+    int2 next_size = (size + 1) / 2;
+    int next_offset = offset + size.x * size.y;
+    float scale = ldexp(1.0f, -level);
+
+    float4 pixel_data = (float4)0;
+    for (int i = 0; i < convert_int(tap_num); i++) {
+        float2 coords = center + major_axis * ((convert_float(i) + 0.5f) / tap_num - 0.5f);
+        float4 tap = SampleMipLevel(pyramid, offset, size, scale, coords);
+        if (level_alpha > 0) {
+            tap = mix(tap, SampleMipLevel(pyramid, next_offset, next_size, scale * 0.5f, coords),
+                      level_alpha);
+        }
+        pixel_data += tap;
+    }
+    return pixel_data / tap_num;
 }
 
 __kernel void Spool(read_only image2d_t in_image, write_only image2d_t out_image,
@@ -63,14 +402,10 @@ __kernel void Spool(read_only image2d_t in_image, write_only image2d_t out_image
         get_global_id(1)
     );
     // Do nothing if coord is out of process area
-    if(!IsProcessArea(thread_id, image_size))
+    if(IsOutOfDistortionArea(thread_id, image_size))
         return;
 
-    float2 coords = convert_float2(thread_id);
-    if (coords.x != center_coords.x ||
-        coords.y != center_coords.y) {
-        coords = CalcSpoolCoords(coords, center_coords, focal_distance);
-    }
+    float2 coords = CalcSpoolCoords(convert_float2(thread_id), center_coords, focal_distance);
     float4 pixel_data = read_imagef(in_image, sampler_,
                                     ToNormalizedCoordsf(coords, image_size));
     write_imagef(out_image, thread_id, pixel_data);
@@ -83,33 +418,86 @@ __kernel void Barrel(read_only image2d_t in_image, write_only image2d_t out_imag
         get_global_id(1)
     );
     // Do nothing if coord is out of process area
-    if(!IsProcessArea(thread_id, image_size))
+    if(IsOutOfDistortionArea(thread_id, image_size))
         return;
 
-    float2 coords = convert_float2(thread_id);
-    if (coords.x != center_coords.x ||
-        coords.y != center_coords.y) {
-        // Coords relative to the center
-        float2 relative_coords = coords - center_coords;
-        // Distance from center
-        float distance = length(relative_coords);
-
-        coords = CalcBarrelCoords(coords, center_coords, focal_distance);
-    }
+    float2 coords = CalcBarrelCoords(convert_float2(thread_id), center_coords, focal_distance);
     float4 pixel_data = read_imagef(in_image, sampler_,
                                     ToNormalizedCoordsf(coords, image_size));
     write_imagef(out_image, thread_id, pixel_data);
 }
 
+// Spool for a centered lens, a thread processes a pixel of the left-top quadrant
+// and its three mirrored pixels
+__kernel void SymmetricSpool(read_only image2d_t in_image, write_only image2d_t out_image,
+                             int2 image_size, float2 center_coords, float focal_distance) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of the quadrant
+    if(IsOutOfDistortionArea(thread_id, (image_size + 1) / 2))
+        return;
+
+    float2 offset = CalcSpoolOffset(convert_float2(thread_id) - center_coords, focal_distance);
+    WriteMirroredPixels(in_image, out_image, thread_id, image_size, center_coords, offset);
+}
+
+// Barrel for a centered lens, a thread processes a pixel of the left-top quadrant
+// and its three mirrored pixels
+__kernel void SymmetricBarrel(read_only image2d_t in_image, write_only image2d_t out_image,
+                              int2 image_size, float2 center_coords, float focal_distance) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of the quadrant
+    if(IsOutOfDistortionArea(thread_id, (image_size + 1) / 2))
+        return;
+
+    float2 offset = CalcBarrelOffset(convert_float2(thread_id) - center_coords, focal_distance);
+    WriteMirroredPixels(in_image, out_image, thread_id, image_size, center_coords, offset);
+}
+
+__kernel void MultiSamplingSpool(read_only image2d_t in_image, write_only image2d_t out_image,
+                                 int2 image_size, float2 center_coords,
+                                 float focal_distance, int max_sampling_per_dimension,
+                                 float adaptive_quality) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of process area
+    if(IsOutOfDistortionArea(thread_id, image_size))
+        return;
+
+    float2 coords = convert_float2(thread_id);
+    // Calc corner coords
+    float2 coords_lt = CalcSpoolCoords(coords + (float2)(-0.5, -0.5), center_coords,
+                                       focal_distance);
+    float2 coords_rt = CalcSpoolCoords(coords + (float2)( 0.5, -0.5), center_coords,
+                                       focal_distance);
+    float2 coords_lb = CalcSpoolCoords(coords + (float2)(-0.5,  0.5), center_coords,
+                                       focal_distance);
+    float2 coords_rb = CalcSpoolCoords(coords + (float2)( 0.5,  0.5), center_coords,
+                                       focal_distance);
+    float4 pixel_data = MultiSampleQuad(in_image, image_size,
+                                        coords_lt, coords_rt, coords_lb, coords_rb,
+                                        max_sampling_per_dimension, adaptive_quality);
+
+    write_imagef(out_image, thread_id, pixel_data);
+}
+
 __kernel void MultiSamplingBarrel(read_only image2d_t in_image, write_only image2d_t out_image,
                                   int2 image_size, float2 center_coords,
-                                  float focal_distance, int max_sampling_per_dimension) {
+                                  float focal_distance, int max_sampling_per_dimension,
+                                  float adaptive_quality) {
     int2 thread_id = (int2)(
         get_global_id(0),
         get_global_id(1)
     );
     // Do nothing if coord is out of process area
-    if(!IsProcessArea(thread_id, image_size))
+    if(IsOutOfDistortionArea(thread_id, image_size))
         return;
 
     float2 coords = convert_float2(thread_id);
@@ -122,21 +510,428 @@ __kernel void MultiSamplingBarrel(read_only image2d_t in_image, write_only image
                                         focal_distance);
     float2 coords_rb = CalcBarrelCoords(coords + (float2)( 0.5,  0.5), center_coords,
                                         focal_distance);
-    float4 pixel_data = (float4)0;
-    int sampled_num = 0;
-    for (float y = 1.f / (max_sampling_per_dimension * 2); y < 1;
-         y += (1.f / max_sampling_per_dimension)) {
-        for (float x = 1.f / (max_sampling_per_dimension * 2); x < 1;
-             x += (1.f / max_sampling_per_dimension)) {
-            float2 alpha = (float2)(x, y);
-            coords = CalcSampleCoords(coords_lt, coords_rt, coords_lb, coords_rb, alpha);
-            pixel_data += read_imagef(in_image, sampler_,
-                                      ToNormalizedCoordsf(coords, image_size));
-            sampled_num++;
-        }
+    float4 pixel_data = MultiSampleQuad(in_image, image_size,
+                                        coords_lt, coords_rt, coords_lb, coords_rb,
+                                        max_sampling_per_dimension, adaptive_quality);
+
+    write_imagef(out_image, thread_id, pixel_data);
+}
+
+__kernel void LensModel(read_only image2d_t in_image, write_only image2d_t out_image,
+                        int2 image_size, float2 center_coords, float focal_length,
+                        float8 lens, int model, int undistort) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of process area
+    if(IsOutOfDistortionArea(thread_id, image_size))
+        return;
+
+    float2 coords = CalcLensModelCoords(convert_float2(thread_id), center_coords, focal_length,
+                                        lens, model, undistort);
+    float4 pixel_data = read_imagef(in_image, sampler_,
+                                    ToNormalizedCoordsf(coords, image_size));
+    write_imagef(out_image, thread_id, pixel_data);
+}
+
+__kernel void MultiSamplingLensModel(read_only image2d_t in_image, write_only image2d_t out_image,
+                                     int2 image_size, float2 center_coords, float focal_length,
+                                     float8 lens, int model, int undistort,
+                                     int max_sampling_per_dimension, float adaptive_quality) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of process area
+    if(IsOutOfDistortionArea(thread_id, image_size))
+        return;
+
+    float2 coords = convert_float2(thread_id);
+    // Calc corner coords
+    float2 coords_lt = CalcLensModelCoords(coords + (float2)(-0.5, -0.5), center_coords,
+                                           focal_length, lens, model, undistort);
+    float2 coords_rt = CalcLensModelCoords(coords + (float2)( 0.5, -0.5), center_coords,
+                                           focal_length, lens, model, undistort);
+    float2 coords_lb = CalcLensModelCoords(coords + (float2)(-0.5,  0.5), center_coords,
+                                           focal_length, lens, model, undistort);
+    float2 coords_rb = CalcLensModelCoords(coords + (float2)( 0.5,  0.5), center_coords,
+                                           focal_length, lens, model, undistort);
+    float4 pixel_data = MultiSampleQuad(in_image, image_size,
+                                        coords_lt, coords_rt, coords_lb, coords_rb,
+                                        max_sampling_per_dimension, adaptive_quality);
+
+    write_imagef(out_image, thread_id, pixel_data);
+}
+
+// Source coords of a grid for the Remap kernels, stored row by row in remap_coords.
+// origin is 0 for the pixels and -0.5 for their corners, whose grid has a point more per axis.
+// model picks the camera models, spool_mode the tan / atan lens otherwise.
+__kernel void BuildRemapCoords(__global float2 *remap_coords, int2 grid_size, float origin,
+                               float2 center_coords, float focal_distance, int spool_mode,
+                               float focal_length, float8 lens, int model, int undistort) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of the grid
+    if(!IsProcessArea(thread_id, grid_size))
+        return;
+
+    float2 coords = convert_float2(thread_id) + (float2)origin;
+    if (model) {
+        coords = CalcLensModelCoords(coords, center_coords, focal_length, lens, model, undistort);
+    } else if (coords.x != center_coords.x ||
+               coords.y != center_coords.y) {
+        coords = CalcDistortedCoords(coords, center_coords, focal_distance, spool_mode);
     }
+    remap_coords[thread_id.y * grid_size.x + thread_id.x] = coords;
+}
+
+// Distortion with the coords of the pixels from BuildRemapCoords
+__kernel void Remap(read_only image2d_t in_image, write_only image2d_t out_image,
+                    int2 image_size, __global const float2 *remap_coords) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of process area
+    if(IsOutOfDistortionArea(thread_id, image_size))
+        return;
+
+    float2 coords = remap_coords[thread_id.y * image_size.x + thread_id.x];
+    float4 pixel_data = read_imagef(in_image, sampler_,
+                                    ToNormalizedCoordsf(coords, image_size));
+    write_imagef(out_image, thread_id, pixel_data);
+}
+
+// Anti-aliasing with the coords of the corners from BuildRemapCoords
+__kernel void MultiSamplingRemap(read_only image2d_t in_image, write_only image2d_t out_image,
+                                 int2 image_size, __global const float2 *remap_coords,
+                                 int max_sampling_per_dimension, float adaptive_quality) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of process area
+    if(IsOutOfDistortionArea(thread_id, image_size))
+        return;
+
+    int grid_w = image_size.x + 1;
+    int index = thread_id.y * grid_w + thread_id.x;
+    float4 pixel_data = MultiSampleQuad(in_image, image_size,
+                                        remap_coords[index], remap_coords[index + 1],
+                                        remap_coords[index + grid_w], remap_coords[index + grid_w + 1],
+                                        max_sampling_per_dimension, adaptive_quality);
+
+    write_imagef(out_image, thread_id, pixel_data);
+}
+
+// Fused variants of the distortion kernels.
+// They take the straight alpha source, premultiply every bilinear tap and write
+// the unpremultiplied result, so no intermediate image is needed.
+
+__kernel void FusedSpool(read_only image2d_t in_image, write_only image2d_t out_image,
+                         int2 image_size, float2 center_coords, float focal_distance) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of process area
+    if(IsOutOfDistortionArea(thread_id, image_size))
+        return;
+
+    float2 coords = CalcSpoolCoords(convert_float2(thread_id), center_coords, focal_distance);
+    float4 pixel_data = SamplePremultPixel(in_image, coords, image_size);
+    write_imagef(out_image, thread_id, UnpremultPixel(pixel_data));
+}
+
+__kernel void FusedBarrel(read_only image2d_t in_image, write_only image2d_t out_image,
+                          int2 image_size, float2 center_coords, float focal_distance) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of process area
+    if(IsOutOfDistortionArea(thread_id, image_size))
+        return;
+
+    float2 coords = CalcBarrelCoords(convert_float2(thread_id), center_coords, focal_distance);
+    float4 pixel_data = SamplePremultPixel(in_image, coords, image_size);
+    write_imagef(out_image, thread_id, UnpremultPixel(pixel_data));
+}
+
+__kernel void FusedSymmetricSpool(read_only image2d_t in_image, write_only image2d_t out_image,
+                                  int2 image_size, float2 center_coords, float focal_distance) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of the quadrant
+    if(IsOutOfDistortionArea(thread_id, (image_size + 1) / 2))
+        return;
+
+    float2 offset = CalcSpoolOffset(convert_float2(thread_id) - center_coords, focal_distance);
+    WriteMirroredFusedPixels(in_image, out_image, thread_id, image_size, center_coords, offset);
+}
+
+__kernel void FusedSymmetricBarrel(read_only image2d_t in_image, write_only image2d_t out_image,
+                                   int2 image_size, float2 center_coords, float focal_distance) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of the quadrant
+    if(IsOutOfDistortionArea(thread_id, (image_size + 1) / 2))
+        return;
+
+    float2 offset = CalcBarrelOffset(convert_float2(thread_id) - center_coords, focal_distance);
+    WriteMirroredFusedPixels(in_image, out_image, thread_id, image_size, center_coords, offset);
+}
+
+__kernel void FusedMultiSamplingSpool(read_only image2d_t in_image, write_only image2d_t out_image,
+                                      int2 image_size, float2 center_coords,
+                                      float focal_distance, int max_sampling_per_dimension,
+                                      float adaptive_quality) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of process area
+    if(IsOutOfDistortionArea(thread_id, image_size))
+        return;
+
+    float2 coords = convert_float2(thread_id);
+    // Calc corner coords
+    float2 coords_lt = CalcSpoolCoords(coords + (float2)(-0.5, -0.5), center_coords,
+                                       focal_distance);
+    float2 coords_rt = CalcSpoolCoords(coords + (float2)( 0.5, -0.5), center_coords,
+                                       focal_distance);
+    float2 coords_lb = CalcSpoolCoords(coords + (float2)(-0.5,  0.5), center_coords,
+                                       focal_distance);
+    float2 coords_rb = CalcSpoolCoords(coords + (float2)( 0.5,  0.5), center_coords,
+                                       focal_distance);
+    float4 pixel_data = FusedMultiSampleQuad(in_image, image_size,
+                                             coords_lt, coords_rt, coords_lb, coords_rb,
+                                             max_sampling_per_dimension, adaptive_quality);
+
+    write_imagef(out_image, thread_id, UnpremultPixel(pixel_data));
+}
+
+__kernel void FusedMultiSamplingBarrel(read_only image2d_t in_image, write_only image2d_t out_image,
+                                       int2 image_size, float2 center_coords,
+                                       float focal_distance, int max_sampling_per_dimension,
+                                       float adaptive_quality) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of process area
+    if(IsOutOfDistortionArea(thread_id, image_size))
+        return;
+
+    float2 coords = convert_float2(thread_id);
+    // Calc corner coords
+    float2 coords_lt = CalcBarrelCoords(coords + (float2)(-0.5, -0.5), center_coords,
+                                        focal_distance);
+    float2 coords_rt = CalcBarrelCoords(coords + (float2)( 0.5, -0.5), center_coords,
+                                        focal_distance);
+    float2 coords_lb = CalcBarrelCoords(coords + (float2)(-0.5,  0.5), center_coords,
+                                        focal_distance);
+    float2 coords_rb = CalcBarrelCoords(coords + (float2)( 0.5,  0.5), center_coords,
+                                        focal_distance);
+    float4 pixel_data = FusedMultiSampleQuad(in_image, image_size,
+                                             coords_lt, coords_rt, coords_lb, coords_rb,
+                                             max_sampling_per_dimension, adaptive_quality);
+
+    write_imagef(out_image, thread_id, UnpremultPixel(pixel_data));
+}
+
+__kernel void FusedLensModel(read_only image2d_t in_image, write_only image2d_t out_image,
+                             int2 image_size, float2 center_coords, float focal_length,
+                             float8 lens, int model, int undistort) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of process area
+    if(IsOutOfDistortionArea(thread_id, image_size))
+        return;
+
+    float2 coords = CalcLensModelCoords(convert_float2(thread_id), center_coords, focal_length,
+                                        lens, model, undistort);
+    float4 pixel_data = SamplePremultPixel(in_image, coords, image_size);
+    write_imagef(out_image, thread_id, UnpremultPixel(pixel_data));
+}
+
+__kernel void FusedMultiSamplingLensModel(read_only image2d_t in_image, write_only image2d_t out_image,
+                                          int2 image_size, float2 center_coords, float focal_length,
+                                          float8 lens, int model, int undistort,
+                                          int max_sampling_per_dimension, float adaptive_quality) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of process area
+    if(IsOutOfDistortionArea(thread_id, image_size))
+        return;
+
+    float2 coords = convert_float2(thread_id);
+    // Calc corner coords
+    float2 coords_lt = CalcLensModelCoords(coords + (float2)(-0.5, -0.5), center_coords,
+                                           focal_length, lens, model, undistort);
+    float2 coords_rt = CalcLensModelCoords(coords + (float2)( 0.5, -0.5), center_coords,
+                                           focal_length, lens, model, undistort);
+    float2 coords_lb = CalcLensModelCoords(coords + (float2)(-0.5,  0.5), center_coords,
+                                           focal_length, lens, model, undistort);
+    float2 coords_rb = CalcLensModelCoords(coords + (float2)( 0.5,  0.5), center_coords,
+                                           focal_length, lens, model, undistort);
+    float4 pixel_data = FusedMultiSampleQuad(in_image, image_size,
+                                             coords_lt, coords_rt, coords_lb, coords_rb,
+                                             max_sampling_per_dimension, adaptive_quality);
+
+    write_imagef(out_image, thread_id, UnpremultPixel(pixel_data));
+}
+
+__kernel void FusedRemap(read_only image2d_t in_image, write_only image2d_t out_image,
+                         int2 image_size, __global const float2 *remap_coords) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of process area
+    if(IsOutOfDistortionArea(thread_id, image_size))
+        return;
+
+    float2 coords = remap_coords[thread_id.y * image_size.x + thread_id.x];
+    float4 pixel_data = SamplePremultPixel(in_image, coords, image_size);
+    write_imagef(out_image, thread_id, UnpremultPixel(pixel_data));
+}
+
+__kernel void FusedMultiSamplingRemap(read_only image2d_t in_image, write_only image2d_t out_image,
+                                      int2 image_size, __global const float2 *remap_coords,
+                                      int max_sampling_per_dimension, float adaptive_quality) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of process area
+    if(IsOutOfDistortionArea(thread_id, image_size))
+        return;
+
+    int grid_w = image_size.x + 1;
+    int index = thread_id.y * grid_w + thread_id.x;
+    float4 pixel_data = FusedMultiSampleQuad(in_image, image_size,
+                                             remap_coords[index], remap_coords[index + 1],
+                                             remap_coords[index + grid_w], remap_coords[index + grid_w + 1],
+                                             max_sampling_per_dimension, adaptive_quality);
+
+    write_imagef(out_image, thread_id, UnpremultPixel(pixel_data));
+}
+
+// Level 0 of the mip pyramid from the premultiplied image
+__kernel void MipLevel0(read_only image2d_t in_image, __global half *pyramid, int2 image_size) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of process area
+    if(!IsProcessArea(thread_id, image_size))
+        return;
+
+    float4 pixel_data = read_imagef(in_image, pixel_sampler_, thread_id);
+    vstore_half4(pixel_data, thread_id.y * image_size.x + thread_id.x, pyramid);
+}
+
+// Level 0 of the mip pyramid from the straight alpha image
+__kernel void FusedMipLevel0(read_only image2d_t in_image, __global half *pyramid, int2 image_size) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of process area
+    if(!IsProcessArea(thread_id, image_size))
+        return;
+
+    float4 pixel_data = ReadPremultPixel(in_image, thread_id);
+    vstore_half4(pixel_data, thread_id.y * image_size.x + thread_id.x, pyramid);
+}
+
+// Level l + 1 of the mip pyramid from level l, a thread per pixel of level l + 1
+__kernel void DownsampleMip(__global half *pyramid, int src_offset, int2 src_size,
+                            int dst_offset, int2 dst_size) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of the level
+    if(!IsProcessArea(thread_id, dst_size))
+        return;
+
+    int2 src_coords = thread_id * 2;
+    float4 pixel_data = ReadMipPixel(pyramid, src_offset, src_size, src_coords) +
+                        ReadMipPixel(pyramid, src_offset, src_size, src_coords + (int2)(1, 0)) +
+                        ReadMipPixel(pyramid, src_offset, src_size, src_coords + (int2)(0, 1)) +
+                        ReadMipPixel(pyramid, src_offset, src_size, src_coords + (int2)(1, 1));
+    vstore_half4(pixel_data * 0.25f, dst_offset + thread_id.y * dst_size.x + thread_id.x, pyramid);
+}
+
+// Anisotropic filter of spool or barrel, the distortion is picked by spool_mode
+__kernel void Anisotropic(__global const half *pyramid, write_only image2d_t out_image,
+                          int2 image_size, float2 center_coords, float focal_distance,
+                          int max_anisotropy, int level_num, int spool_mode) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of process area
+    if(!IsProcessArea(thread_id, image_size))
+        return;
+
+    float2 coords = convert_float2(thread_id);
+    // Calc corner coords
+    float2 coords_lt = CalcDistortedCoords(coords + (float2)(-0.5, -0.5), center_coords,
+                                           focal_distance, spool_mode);
+    float2 coords_rt = CalcDistortedCoords(coords + (float2)( 0.5, -0.5), center_coords,
+                                           focal_distance, spool_mode);
+    float2 coords_lb = CalcDistortedCoords(coords + (float2)(-0.5,  0.5), center_coords,
+                                           focal_distance, spool_mode);
+    float2 coords_rb = CalcDistortedCoords(coords + (float2)( 0.5,  0.5), center_coords,
+                                           focal_distance, spool_mode);
+    float4 pixel_data = SampleAnisotropic(pyramid, image_size, level_num,
+                                          coords_lt, coords_rt, coords_lb, coords_rb,
+                                          max_anisotropy);
+
+    write_imagef(out_image, thread_id, pixel_data);
+}
+
+// The pyramid is premultiplied either way, only the output is unpremultiplied
+__kernel void FusedAnisotropic(__global const half *pyramid, write_only image2d_t out_image,
+                               int2 image_size, float2 center_coords, float focal_distance,
+                               int max_anisotropy, int level_num, int spool_mode) {
+    int2 thread_id = (int2)(
+        get_global_id(0),
+        get_global_id(1)
+    );
+    // Do nothing if coord is out of process area
+    if(!IsProcessArea(thread_id, image_size))
+        return;
+
+    float2 coords = convert_float2(thread_id);
+    // Calc corner coords
+    float2 coords_lt = CalcDistortedCoords(coords + (float2)(-0.5, -0.5), center_coords,
+                                           focal_distance, spool_mode);
+    float2 coords_rt = CalcDistortedCoords(coords + (float2)( 0.5, -0.5), center_coords,
+                                           focal_distance, spool_mode);
+    float2 coords_lb = CalcDistortedCoords(coords + (float2)(-0.5,  0.5), center_coords,
+                                           focal_distance, spool_mode);
+    float2 coords_rb = CalcDistortedCoords(coords + (float2)( 0.5,  0.5), center_coords,
+                                           focal_distance, spool_mode);
+    float4 pixel_data = SampleAnisotropic(pyramid, image_size, level_num,
+                                          coords_lt, coords_rt, coords_lb, coords_rb,
+                                          max_anisotropy);
 
-    write_imagef(out_image, thread_id, pixel_data / sampled_num);
+    write_imagef(out_image, thread_id, UnpremultPixel(pixel_data));
 }
 
 __kernel void Premult(read_only image2d_t in_image, write_only image2d_t out_image,
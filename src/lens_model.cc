@@ -0,0 +1,74 @@
+#include "lens_model.h"
+
+// Iterations of Newton's method, a guess from the neighbouring pixel takes 2 or 3
+const int kMaxNewtonIteration = 20;
+
+glm::vec2 DistortLensModel(LensModel model, const LensCoefficients &lens, const glm::vec2 &coords,
+                           glm::vec2 *d_dx, glm::vec2 *d_dy) {
+    float x = coords.x;
+    float y = coords.y;
+    float r2 = x * x + y * y;
+    if (model == lens_fisheye) {
+        // d = coords * s(r) with s = theta_d / r, so J = s I + coords (ds/dr) coords^T / r
+        float r = std::sqrt(r2);
+        float theta = std::atan(r);
+        float theta2 = theta * theta;
+        float scale = 1 + theta2 * (lens.k1 + theta2 * (lens.k2 + theta2 * (lens.k3 + theta2 * lens.k4)));
+        float d_scale = 1 + theta2 * (3 * lens.k1 + theta2 * (5 * lens.k2 + theta2 * (7 * lens.k3 + theta2 * 9 * lens.k4)));
+        // Near the center the model is the identity up to the cube of r
+        if (r < 1e-6f) {
+            *d_dx = glm::vec2(1, 0);
+            *d_dy = glm::vec2(0, 1);
+            return coords;
+        }
+        float theta_d = theta * scale;
+        float s = theta_d / r;
+        // d theta_d / dr = d_scale / (1 + r^2)
+        float ds_dr_r = (d_scale / (1 + r2) - s) / r2;
+        *d_dx = glm::vec2(s + x * x * ds_dr_r, x * y * ds_dr_r);
+        *d_dy = glm::vec2(x * y * ds_dr_r, s + y * y * ds_dr_r);
+        return coords * s;
+    }
+
+    float radial = 1 + r2 * (lens.k1 + r2 * (lens.k2 + r2 * lens.k3));
+    // d radial / d r^2
+    float d_radial = lens.k1 + r2 * (2 * lens.k2 + r2 * 3 * lens.k3);
+    float cross = 2 * x * y * d_radial + 2 * lens.p1 * x + 2 * lens.p2 * y;
+    *d_dx = glm::vec2(radial + 2 * x * x * d_radial + 2 * lens.p1 * y + 6 * lens.p2 * x, cross);
+    *d_dy = glm::vec2(cross, radial + 2 * y * y * d_radial + 6 * lens.p1 * y + 2 * lens.p2 * x);
+    return DistortBrownConrady(lens, coords);
+}
+
+bool UndistortLensModel(LensModel model, const LensCoefficients &lens,
+                        const glm::vec2 &distorted_coords, const glm::vec2 &guess,
+                        float max_error, glm::vec2 *coords) {
+    glm::vec2 u = guess;
+    for (int i = 0; i < kMaxNewtonIteration; i++) {
+        glm::vec2 d_dx, d_dy;
+        glm::vec2 error = DistortLensModel(model, lens, u, &d_dx, &d_dy) - distorted_coords;
+        float det = d_dx.x * d_dy.y - d_dy.x * d_dx.y;
+        if (!(det > 0))
+            return false;
+        if (glm::dot(error, error) <= max_error * max_error) {
+            *coords = u;
+            return true;
+        }
+        // u -= J^-1 error
+        u -= glm::vec2(d_dy.y * error.x - d_dy.x * error.y,
+                       d_dx.x * error.y - d_dx.y * error.x) / det;
+    }
+    return false;
+}
+
+glm::vec2 CalcLensModelOffset(const glm::vec2 &relative_coords, const OpticsCompensationParameter &parameter,
+                              float focal_length) {
+    glm::vec2 coords = relative_coords / focal_length;
+    if (parameter.lens.undistort)
+        return DistortLensModel(parameter.lens_model, parameter.lens, coords) * focal_length;
+
+    glm::vec2 source_coords;
+    if (!UndistortLensModel(parameter.lens_model, parameter.lens, coords, coords,
+                            kLensModelMaxError / focal_length, &source_coords))
+        return glm::vec2(kLensModelUnreachableOffset);
+    return source_coords * focal_length;
+}
\ No newline at end of file
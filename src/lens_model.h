@@ -0,0 +1,64 @@
+#ifndef _OPTICSCOMPENSATION_S_SRC_LENS_MODEL_H_
+#define _OPTICSCOMPENSATION_S_SRC_LENS_MODEL_H_
+
+#include <cmath>
+#include <glm/glm.hpp>
+#include "parameter.h"
+
+// Camera models of lens_brown_conrady and lens_fisheye.
+// They map the coords of a pinhole camera to the distorted coords on the footage, both
+// relative to the principal point and normalized by the focal length.
+// Same models as CalcLensModelCoords in kernel.cl.
+
+// Offset of the pixels which have no source on the model, far out of any image
+// so that they sample transparent black, and small enough to interpolate the quads
+const float kLensModelUnreachableOffset = -1e6f;
+
+// Residual of the inverse in pixels
+const float kLensModelMaxError = 0.01f;
+
+// Radial polynomials are evaluated by Horner's method on the squared radius
+inline glm::vec2 DistortBrownConrady(const LensCoefficients &lens, const glm::vec2 &coords) {
+    float r2 = coords.x * coords.x + coords.y * coords.y;
+    float radial = 1 + r2 * (lens.k1 + r2 * (lens.k2 + r2 * lens.k3));
+    float xy = coords.x * coords.y;
+    return glm::vec2(
+        coords.x * radial + 2 * lens.p1 * xy + lens.p2 * (r2 + 2 * coords.x * coords.x),
+        coords.y * radial + lens.p1 * (r2 + 2 * coords.y * coords.y) + 2 * lens.p2 * xy
+    );
+}
+
+// Kannala-Brandt model on the angle of the ray, theta_d = theta (1 + k1 theta^2 + ...)
+inline glm::vec2 DistortFisheye(const LensCoefficients &lens, const glm::vec2 &coords) {
+    float r = glm::length(coords);
+    // The center isn't moved
+    if (r == 0)
+        return coords;
+    float theta = std::atan(r);
+    float theta2 = theta * theta;
+    float theta_d = theta * (1 + theta2 * (lens.k1 + theta2 * (lens.k2 + theta2 * (lens.k3 + theta2 * lens.k4))));
+    return coords * (theta_d / r);
+}
+
+inline glm::vec2 DistortLensModel(LensModel model, const LensCoefficients &lens, const glm::vec2 &coords) {
+    return model == lens_fisheye ? DistortFisheye(lens, coords) : DistortBrownConrady(lens, coords);
+}
+
+// Distorted coords with the partial derivatives by x and y
+glm::vec2 DistortLensModel(LensModel model, const LensCoefficients &lens, const glm::vec2 &coords,
+                           glm::vec2 *d_dx, glm::vec2 *d_dy);
+
+// Undistorted coords of distorted_coords by Newton's method from guess.
+// Returns false if it doesn't converge to max_error, or converges beyond the radius
+// where the model folds back (the Jacobian isn't positive), which has no source.
+bool UndistortLensModel(LensModel model, const LensCoefficients &lens,
+                        const glm::vec2 &distorted_coords, const glm::vec2 &guess,
+                        float max_error, glm::vec2 *coords);
+
+// Offset of the source from the center for the relative coords of an output pixel,
+// like CalcBarrelOffset. Undistorting samples the footage through the model, and
+// distorting samples it through the inverse, which starts from the relative coords.
+glm::vec2 CalcLensModelOffset(const glm::vec2 &relative_coords, const OpticsCompensationParameter &parameter,
+                              float focal_length);
+
+#endif // _OPTICSCOMPENSATION_S_SRC_LENS_MODEL_H_
\ No newline at end of file
@@ -0,0 +1,139 @@
+#include "mip_pyramid.h"
+#include <algorithm>
+#include <cmath>
+#include "cpu_scheduler.h"
+
+/* MipPyramid */
+
+MipPyramid::MipPyramid(const SamplingSource &source) {
+    levels_.push_back(source);
+    while (levels_.back().w > 1 || levels_.back().h > 1) {
+        SamplingSource src = levels_.back();
+        int w = (src.w + 1) / 2;
+        int h = (src.h + 1) / 2;
+        pixels_.emplace_back(static_cast<std::size_t>(w) * h);
+        rows_.emplace_back(h);
+        cv::Vec4f *pixels = pixels_.back().data();
+        auto &rows = rows_.back();
+        for (int y = 0; y < h; y++)
+            rows[y] = pixels + static_cast<std::size_t>(y) * w;
+
+        #pragma omp parallel for num_threads(GetCPUThreadNum())
+        for (int y = 0; y < h; y++) {
+            const cv::Vec4f *top_row = src.rows[2 * y];
+            // Odd height, the bottom row is beyond the border
+            const cv::Vec4f *bottom_row = 2 * y + 1 < src.h ? src.rows[2 * y + 1] : nullptr;
+            cv::Vec4f *out_row = pixels + static_cast<std::size_t>(y) * w;
+            for (int x = 0; x < w; x++) {
+                int sx = 2 * x;
+                bool has_right = sx + 1 < src.w;
+                cv::Vec4f pixel = top_row[sx];
+                if (has_right)
+                    pixel += top_row[sx + 1];
+                if (bottom_row) {
+                    pixel += bottom_row[sx];
+                    if (has_right)
+                        pixel += bottom_row[sx + 1];
+                }
+                out_row[x] = 0.25f * pixel;
+            }
+        }
+        levels_.push_back({rows.data(), w, h});
+    }
+}
+
+std::size_t MipPyramid::GetByteSize() const {
+    std::size_t byte_size = 0;
+    for (auto &pixels : pixels_)
+        byte_size += pixels.size() * sizeof(cv::Vec4f);
+    return byte_size;
+}
+
+// Pixels out of the level are transparent black like SamplingPixel
+static inline cv::Vec4f ReadLevelPixel(const SamplingSource &level, int x, int y) {
+    if (x < 0 || x >= level.w || y < 0 || y >= level.h)
+        return cv::Vec4f(cv::Scalar::all(0));
+    return level.rows[y][x];
+}
+
+// Bilinear sampling of a level, coords are on level 0 and scale is 2^-level
+static cv::Vec4f SampleLevel(const SamplingSource &level, float scale, const glm::vec2 &coords) {
+    // Centers of the pixels of the level are at (i + 0.5) * 2^level - 0.5 on level 0.
+    // Coords beyond one pixel outside only read the border.
+    float x = std::min(std::max((coords.x + 0.5f) * scale - 0.5f, -1.f), static_cast<float>(level.w));
+    float y = std::min(std::max((coords.y + 0.5f) * scale - 0.5f, -1.f), static_cast<float>(level.h));
+    float fx = std::floor(x);
+    float fy = std::floor(y);
+    float dx = x - fx;
+    float dy = y - fy;
+    int ix = static_cast<int>(fx);
+    int iy = static_cast<int>(fy);
+
+    cv::Vec4f top = (1 - dx) * ReadLevelPixel(level, ix, iy) + dx * ReadLevelPixel(level, ix + 1, iy);
+    cv::Vec4f bottom = (1 - dx) * ReadLevelPixel(level, ix, iy + 1) +
+                            dx  * ReadLevelPixel(level, ix + 1, iy + 1);
+    return (1 - dy) * top + dy * bottom;
+}
+
+AnisotropicFootprint CalcAnisotropicFootprint(const glm::vec2 &coords_lt, const glm::vec2 &coords_rt,
+                                              const glm::vec2 &coords_lb, const glm::vec2 &coords_rb,
+                                              int max_anisotropy) {
+    AnisotropicFootprint footprint;
+    // Center and axes of the parallelogram fitted to the quad
+    footprint.center = (coords_lt + coords_rt + coords_lb + coords_rb) * 0.25f;
+    glm::vec2 axis_x = ((coords_rt - coords_lt) + (coords_rb - coords_lb)) * 0.5f;
+    glm::vec2 axis_y = ((coords_lb - coords_lt) + (coords_rb - coords_rt)) * 0.5f;
+    float length_x = glm::length(axis_x);
+    float length_y = glm::length(axis_y);
+    footprint.major_axis = length_x >= length_y ? axis_x : axis_y;
+    float major_length = std::max(length_x, length_y);
+    // Magnified axes are sampled on level 0
+    float minor_length = std::max(std::min(length_x, length_y), 1.f);
+
+    // Comparing in float keeps huge footprints near the clamped tan from overflowing
+    footprint.tap_num = std::min(std::max(std::ceil(major_length / minor_length), 1.f),
+                                 static_cast<float>(max_anisotropy));
+    footprint.lod = std::max(std::log2(major_length / footprint.tap_num), 0.f);
+    return footprint;
+}
+
+cv::Vec4f SampleAnisotropic(const MipPyramid &pyramid,
+                            const glm::vec2 &coords_lt, const glm::vec2 &coords_rt,
+                            const glm::vec2 &coords_lb, const glm::vec2 &coords_rb,
+                            int max_anisotropy) {
+    auto footprint = CalcAnisotropicFootprint(coords_lt, coords_rt, coords_lb, coords_rb,
+                                              max_anisotropy);
+    const glm::vec2 &center = footprint.center;
+    const glm::vec2 &major_axis = footprint.major_axis;
+    float tap_num_f = footprint.tap_num;
+    int tap_num = static_cast<int>(tap_num_f);
+    float lod = std::min(footprint.lod, static_cast<float>(pyramid.GetLevelNum() - 1));
+    int level = static_cast<int>(lod);
+    float level_alpha = lod - level;
+    float scale = std::ldexp(1.f, -level);
+
+    cv::Vec4f pixel(cv::Scalar::all(0));
+    for (int i = 0; i < tap_num; i++) {
+        glm::vec2 coords = center + major_axis * ((i + 0.5f) / tap_num_f - 0.5f);
+        cv::Vec4f tap = SampleLevel(pyramid.GetLevel(level), scale, coords);
+        if (level_alpha > 0) {
+            cv::Vec4f next_tap = SampleLevel(pyramid.GetLevel(level + 1), scale * 0.5f, coords);
+            tap = (1 - level_alpha) * tap + level_alpha * next_tap;
+        }
+        pixel += tap;
+    }
+    pixel /= tap_num_f;
+    return pixel;
+}
+
+void AnisotropicRemapRow(const MipPyramid &pyramid, const RemapTable &remap_table, int y,
+                         int max_anisotropy, cv::Vec4f *out_row) {
+    int w = remap_table.GetImageSize().w;
+    // Corners of pixel x are x and x + 1 in the rows y and y + 1
+    const glm::vec2 *top_row = remap_table.GetRow(y);
+    const glm::vec2 *bottom_row = remap_table.GetRow(y + 1);
+    for (int x = 0; x < w; x++) {
+        out_row[x] = SampleAnisotropic(pyramid, top_row[x], top_row[x + 1],
+                                       bottom_row[x], bottom_row[x + 1], max_anisotropy);
+    }
+}
\ No newline at end of file
@@ -0,0 +1,55 @@
+#ifndef _OPTICSCOMPENSATION_S_SRC_MIP_PYRAMID_H_
+#define _OPTICSCOMPENSATION_S_SRC_MIP_PYRAMID_H_
+
+#include <cstddef>
+#include <vector>
+#include <glm/glm.hpp>
+#include <opencv2/opencv.hpp>
+#include "remap_table.h"
+#include "simd_sampler.h"
+
+// Premultiplied float images halved level by level down to 1x1 for the anisotropic filter.
+// Level 0 is the source itself, level l + 1 is the 2x2 box filter of level l with
+// the size rounded up, counting the pixels beyond the border as transparent.
+class MipPyramid {
+public:
+    // The rows of source must stay valid while the pyramid is used
+    MipPyramid(const SamplingSource &source);
+
+    int GetLevelNum() const { return static_cast<int>(levels_.size()); }
+    const SamplingSource& GetLevel(int level) const { return levels_[level]; }
+    // Memory of the levels below the source
+    std::size_t GetByteSize() const;
+
+private:
+    std::vector<SamplingSource> levels_;
+    std::vector<std::vector<cv::Vec4f>> pixels_;
+    std::vector<std::vector<const cv::Vec4f*>> rows_;
+};
+
+// Parallelogram fitted to the quad of a pixel on the source and the taps along its major axis
+struct AnisotropicFootprint {
+    glm::vec2 center;
+    glm::vec2 major_axis;
+    float tap_num;
+    // Level of the taps before clamping to the pyramid
+    float lod;
+};
+
+AnisotropicFootprint CalcAnisotropicFootprint(const glm::vec2 &coords_lt, const glm::vec2 &coords_rt,
+                                              const glm::vec2 &coords_lb, const glm::vec2 &coords_rb,
+                                              int max_anisotropy);
+
+// Trilinear taps along the major axis of the quad of a pixel on the source, up to
+// max_anisotropy of them, on the level whose pixels cover the minor axis.
+// Same filter as SampleAnisotropic in kernel.cl.
+cv::Vec4f SampleAnisotropic(const MipPyramid &pyramid,
+                            const glm::vec2 &coords_lt, const glm::vec2 &coords_rt,
+                            const glm::vec2 &coords_lb, const glm::vec2 &coords_rb,
+                            int max_anisotropy);
+
+// Anisotropic filtering of row y with the corners of a pixel_corner remap table
+void AnisotropicRemapRow(const MipPyramid &pyramid, const RemapTable &remap_table, int y,
+                         int max_anisotropy, cv::Vec4f *out_row);
+
+#endif // _OPTICSCOMPENSATION_S_SRC_MIP_PYRAMID_H_
\ No newline at end of file
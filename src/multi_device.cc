@@ -0,0 +1,468 @@
+#include "multi_device.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include "cpu_pipeline.h"
+#include "cpu_scheduler.h"
+#include "exception.h"
+#include "output_bounds.h"
+#include "tile_pipeline.h"
+
+// The CPU kernels take the center on the other side of the OpenCL ones (see CalcLiveRect),
+// fewer samples by default and don't fall back from the anisotropic filter for the camera
+// models, so the parameter is matched to keep their bands like the bands of the devices
+static OpticsCompensationParameter MatchCLParameter(OpticsCompensationParameter parameter) {
+    parameter.center_pos = -parameter.center_pos;
+    if (parameter.anti_aliasing &&
+        (parameter.aa_filter == aa_supersampling || parameter.lens_model != lens_tan)) {
+        parameter.aa_max_sampling = parameter.GetAAMaxSampling(4);
+        parameter.aa_filter = aa_supersampling;
+    }
+    return parameter;
+}
+
+// Weight of the last frame in the average throughput of a worker
+static const double kBalanceSmoothing = 0.3;
+// Workers slower than this share of the total are left out, since the whole source they
+// receive would cost more than their band saves. Every kProbeInterval frames they get
+// a band of this share again to measure their throughput.
+static const double kMinShare = 0.02;
+static const int kProbeInterval = 30;
+
+// Host time of the completion of a device band, for the queues without profiling.
+// user_data is a std::promise allocated for the callback.
+static void CL_CALLBACK RecordCompletion(cl_event, cl_int, void *user_data) {
+    auto *completion = static_cast<std::promise<std::chrono::steady_clock::time_point>*>(user_data);
+    completion->set_value(std::chrono::steady_clock::now());
+    delete completion;
+}
+
+static cl::ImageFormat GetFrameFormat() {
+    cl::ImageFormat fmt;
+    fmt.image_channel_data_type = CL_UNORM_INT8;
+    fmt.image_channel_order = CL_BGRA;
+    return fmt;
+}
+
+MultiDeviceExecutor::MultiDeviceExecutor(const std::string &kernel_source, cl_device_type device_type,
+                                         bool use_cpu, CLProgramCache *program_cache,
+                                         RemapTableCache *remap_table_cache) :
+    cpu_worker_(-1),
+    remap_table_cache_(nullptr),
+    dynamic_balancing_(true),
+    processed_count_(0),
+    next_frame_(0),
+    cpu_frame_number_(0) {
+    InitWorkers(kernel_source, GetAllCLDevices(device_type), use_cpu, program_cache, remap_table_cache);
+}
+
+MultiDeviceExecutor::MultiDeviceExecutor(const std::string &kernel_source, const std::vector<cl::Device> &devices,
+                                         bool use_cpu, CLProgramCache *program_cache,
+                                         RemapTableCache *remap_table_cache) :
+    cpu_worker_(-1),
+    remap_table_cache_(nullptr),
+    dynamic_balancing_(true),
+    processed_count_(0),
+    next_frame_(0),
+    cpu_frame_number_(0) {
+    InitWorkers(kernel_source, devices, use_cpu, program_cache, remap_table_cache);
+}
+
+void MultiDeviceExecutor::InitWorkers(const std::string &kernel_source, const std::vector<cl::Device> &devices,
+                                      bool use_cpu, CLProgramCache *program_cache,
+                                      RemapTableCache *remap_table_cache) {
+    for (auto &device : devices) {
+        std::string name = device.getInfo<CL_DEVICE_NAME>();
+        if (!device.getInfo<CL_DEVICE_IMAGE_SUPPORT>()) {
+            skipped_devices_.push_back(name + " : no image support");
+            continue;
+        }
+        OpenCLManager *opencl_manager = nullptr;
+        try {
+            opencl_manager = new OpenCLManager(kernel_source, device, program_cache);
+        } catch (InitOpenCLManagerException &e) {
+            skipped_devices_.push_back(name + " : " + e.message());
+            continue;
+        } catch (std::runtime_error &e) {
+            skipped_devices_.push_back(name + " : " + e.what());
+            continue;
+        }
+        CLWorker worker;
+        worker.opencl_manager = opencl_manager;
+        worker.distortion_kernel_set = new DistortionKernelSet(
+            opencl_manager->GetProgram(), opencl_manager->GetCommandQueueManager()->GetCommandQueue());
+        worker.pipeline = nullptr;
+        cl_workers_.push_back(worker);
+        stats_.push_back({name, false, 0, 0, 0});
+    }
+    if (use_cpu) {
+        if (!remap_table_cache) {
+            own_remap_table_cache_.reset(new RemapTableCache());
+            remap_table_cache = own_remap_table_cache_.get();
+        }
+        remap_table_cache_ = remap_table_cache;
+        cpu_worker_ = static_cast<int>(stats_.size());
+        stats_.push_back({"CPU (" + std::to_string(GetCPUThreadNum()) + " threads)", true, 0, 0, 0});
+    }
+    if (stats_.empty())
+        throw std::runtime_error("No OpenCL device is available");
+
+    SetShares(std::vector<double>(stats_.size(), 1.0));
+    assigned_counts_.assign(stats_.size(), 0);
+}
+
+MultiDeviceExecutor::~MultiDeviceExecutor() {
+    // The pipelines finish their frames on deletion
+    if (cpu_frame_.valid())
+        cpu_frame_.wait();
+    for (auto &worker : cl_workers_) {
+        delete worker.pipeline;
+        delete worker.distortion_kernel_set;
+        delete worker.opencl_manager;
+    }
+}
+
+void MultiDeviceExecutor::SetShares(const std::vector<double> &weights) {
+    double weight_sum = 0;
+    for (double weight : weights)
+        weight_sum += weight;
+    for (std::size_t i = 0; i < stats_.size(); i++)
+        stats_[i].share = weight_sum > 0 ? weights[i] / weight_sum : 1.0 / stats_.size();
+}
+
+void MultiDeviceExecutor::SetSharesFromThroughput() {
+    double throughput_sum = 0;
+    for (auto &stats : stats_)
+        throughput_sum += stats.throughput;
+    if (throughput_sum <= 0)
+        return;
+    std::vector<double> weights(stats_.size());
+    for (std::size_t i = 0; i < stats_.size(); i++)
+        weights[i] = stats_[i].throughput >= kMinShare * throughput_sum ? stats_[i].throughput : 0;
+    SetShares(weights);
+}
+
+void MultiDeviceExecutor::UpdateShares(const std::vector<cv::Range> &rows, int w) {
+    for (std::size_t i = 0; i < stats_.size(); i++) {
+        WorkerStats &stats = stats_[i];
+        if (rows[i].empty() || stats.band_seconds <= 0)
+            continue;
+        double throughput = static_cast<double>(rows[i].size()) * w / stats.band_seconds;
+        stats.throughput = stats.throughput > 0 ?
+                           stats.throughput + kBalanceSmoothing * (throughput - stats.throughput) :
+                           throughput;
+    }
+    SetSharesFromThroughput();
+}
+
+std::vector<cv::Range> MultiDeviceExecutor::SplitRows(int h, bool probe) const {
+    std::vector<double> shares(stats_.size());
+    double share_sum = 0;
+    for (std::size_t i = 0; i < stats_.size(); i++) {
+        shares[i] = probe && stats_[i].share <= 0 ? kMinShare : stats_[i].share;
+        share_sum += shares[i];
+    }
+    // Rounded at the cumulative shares, so the bands cover every row once
+    std::vector<cv::Range> rows;
+    double cumulative_share = 0;
+    int begin = 0;
+    for (std::size_t i = 0; i < stats_.size(); i++) {
+        cumulative_share += shares[i] / share_sum;
+        int end = i + 1 == stats_.size() ? h :
+                  std::min(static_cast<int>(std::lround(cumulative_share * h)), h);
+        end = std::max(end, begin);
+        rows.emplace_back(begin, end);
+        begin = end;
+    }
+    return rows;
+}
+
+void MultiDeviceExecutor::Calibrate(const aut::Size2D &image_size, const OpticsCompensationParameter &parameter,
+                                    int iteration_num) {
+    if (parameter.IsIdentity() || parameter.IsEmptyOutput() || image_size.w <= 0 || image_size.h <= 0)
+        return;
+
+    // Opaque gradient, so every pixel is sampled
+    std::size_t pixel_num = static_cast<std::size_t>(image_size.w) * image_size.h;
+    std::vector<aut::PixelRGBA> source(pixel_num);
+    for (int y = 0; y < image_size.h; y++) {
+        for (int x = 0; x < image_size.w; x++) {
+            auto &pixel = source[static_cast<std::size_t>(y) * image_size.w + x];
+            pixel.r = static_cast<unsigned char>(x * 255 / image_size.w);
+            pixel.g = static_cast<unsigned char>(y * 255 / image_size.h);
+            pixel.b = 128;
+            pixel.a = 255;
+        }
+    }
+    std::vector<aut::PixelRGBA> frame(pixel_num);
+    cv::Rect image_rect(0, 0, image_size.w, image_size.h);
+
+    for (int i = 0; i < GetWorkerNum(); i++) {
+        double min_seconds = std::numeric_limits<double>::max();
+        // The first run builds the kernels and the images, and is left out
+        for (int iteration = 0; iteration <= std::max(iteration_num, 1); iteration++) {
+            frame = source;
+            auto start = std::chrono::steady_clock::now();
+            if (IsCPUWorker(i)) {
+                ProcessCPUBand(frame.data(), image_size, parameter, cv::Range(0, image_size.h), frame.data());
+            } else {
+                CLWorker &worker = cl_workers_[i];
+                PooledImage in_image;
+                PooledImage out_image;
+                EnqueueBand(&worker, frame.data(), image_size, parameter, image_rect, image_rect,
+                            &in_image, &out_image);
+                worker.opencl_manager->GetCommandQueueManager()->DownloadImage2D(
+                    *out_image, image_size.w, image_size.h, sizeof(aut::PixelRGBA), frame.data());
+            }
+            std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+            if (iteration > 0)
+                min_seconds = std::min(min_seconds, seconds.count());
+        }
+        stats_[i].throughput = pixel_num / std::max(min_seconds, 1e-9);
+    }
+    SetSharesFromThroughput();
+}
+
+void MultiDeviceExecutor::EnqueueBand(CLWorker *worker, const aut::PixelRGBA *image_data,
+                                      const aut::Size2D &image_size, const OpticsCompensationParameter &parameter,
+                                      const cv::Rect &occupied_rect, const cv::Rect &output_rect,
+                                      PooledImage *in_image, PooledImage *out_image,
+                                      cl::Event *upload_event, cl::Event *kernel_event) {
+    CLImagePool *image_pool = worker->opencl_manager->GetImagePool();
+    CLCommandQueueManager *command_queue_manager = worker->opencl_manager->GetCommandQueueManager();
+    cl::ImageFormat fmt = GetFrameFormat();
+    *in_image = PooledImage(image_pool, image_size.w, image_size.h, fmt);
+    *out_image = PooledImage(image_pool, image_size.w, image_size.h, fmt);
+    command_queue_manager->UploadImage2D(**in_image, image_size.w, image_size.h,
+                                         sizeof(aut::PixelRGBA), image_data, upload_event);
+    worker->distortion_kernel_set->CallKernel(**in_image, **out_image, image_size.w, image_size.h,
+                                              parameter, occupied_rect, output_rect, kernel_event);
+    // Start the device before the next one is fed
+    command_queue_manager->GetCommandQueue()->flush();
+}
+
+void MultiDeviceExecutor::ProcessCPUBand(const aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                                         const OpticsCompensationParameter &parameter, const cv::Range &rows,
+                                         aut::PixelRGBA *output) {
+    OpticsCompensationParameter cpu_parameter = MatchCLParameter(parameter);
+    std::size_t band_pixel_num = static_cast<std::size_t>(image_size.w) * rows.size();
+    // Barrel with amount 1 leaves the image empty
+    if (cpu_parameter.IsEmptyOutput()) {
+        std::memset(output, 0, sizeof(aut::PixelRGBA) * band_pixel_num);
+        return;
+    }
+
+    // The table of the whole frame, shared by the bands of every frame of the parameter
+    std::shared_ptr<const RemapTable> remap_table;
+    {
+        std::lock_guard<std::mutex> lock(remap_table_mutex_);
+        remap_table = remap_table_cache_->GetTable(image_size, cpu_parameter);
+    }
+    if (remap_table && remap_table->GetLayout() == RemapTable::pixel_corner &&
+        cpu_parameter.aa_filter == aa_anisotropic) {
+        AnisotropicCPUBandKernel(image_data, image_size, *remap_table, rows.start, rows.end, output,
+                                 cpu_parameter.GetAAMaxSampling(kDefaultMaxAnisotropy));
+    } else if (remap_table) {
+        FusedCPUBandKernel(image_data, image_size, *remap_table, rows.start, rows.end, output);
+    } else {
+        // Fall back to a table of the band if the table couldn't be allocated
+        cv::Mat image(image_size.h, image_size.w, CV_8UC4, const_cast<aut::PixelRGBA*>(image_data));
+        cv::Mat output_band(rows.size(), image_size.w, CV_8UC4, output);
+        cv::Rect image_rect(0, 0, image_size.w, image_size.h);
+        cv::Rect output_rect(0, rows.start, image_size.w, rows.size());
+        // The camera models would scan a table for the bounds, the whole source costs less
+        cv::Rect source_rect = cpu_parameter.lens_model == lens_tan ?
+                               CalcTileSourceRect(image_size, output_rect, cpu_parameter) : image_rect;
+        // TileCPUKernel premultiplies the whole source before it writes the output,
+        // so output can share the pixels of the image
+        TileCPUKernel(source_rect.empty() ? cv::Mat() : image(source_rect), source_rect, output_band,
+                      image_size, output_rect, cpu_parameter);
+    }
+}
+
+void MultiDeviceExecutor::Process(aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                                  const OpticsCompensationParameter &parameter) {
+    if (parameter.IsIdentity())
+        return;
+
+    std::size_t pixel_num = static_cast<std::size_t>(image_size.w) * image_size.h;
+    // Barrel with amount 1 leaves the image empty, and so does a transparent source
+    cv::Rect occupied_rect = CalcOccupiedRect(image_data, image_size);
+    if (occupied_rect.empty() || parameter.IsEmptyOutput()) {
+        std::memset(image_data, 0, sizeof(aut::PixelRGBA) * pixel_num);
+        return;
+    }
+
+    bool probe = dynamic_balancing_ && ++processed_count_ % kProbeInterval == 0;
+    std::vector<cv::Range> rows = SplitRows(image_size.h, probe);
+    auto band_rect = [&](int index) {
+        return cv::Rect(0, rows[index].start, image_size.w, rows[index].size());
+    };
+    auto seconds_since = [](const std::chrono::steady_clock::time_point &start) {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    for (auto &stats : stats_)
+        stats.band_seconds = 0;
+
+    // Every device gets its band before the CPU takes its own.
+    // A band of a device takes the host time of its transfers and the device time between them.
+    // Without profiling the device time runs from the enqueue to the completion callback,
+    // which is timestamped as it happens, so the CPU band running meanwhile isn't counted.
+    std::size_t cl_worker_num = cl_workers_.size();
+    std::vector<PooledImage> in_images(cl_worker_num);
+    std::vector<PooledImage> out_images(cl_worker_num);
+    std::vector<cl::Event> upload_events(cl_worker_num);
+    std::vector<cl::Event> kernel_events(cl_worker_num);
+    std::vector<std::chrono::steady_clock::time_point> enqueue_ends(cl_worker_num);
+    std::vector<std::future<std::chrono::steady_clock::time_point>> completions(cl_worker_num);
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < cl_worker_num; i++) {
+        if (rows[i].empty())
+            continue;
+        auto upload_start = std::chrono::steady_clock::now();
+        EnqueueBand(&cl_workers_[i], image_data, image_size, parameter, occupied_rect,
+                    band_rect(static_cast<int>(i)), &in_images[i], &out_images[i],
+                    &upload_events[i], &kernel_events[i]);
+        enqueue_ends[i] = std::chrono::steady_clock::now();
+        stats_[i].band_seconds = std::chrono::duration<double>(enqueue_ends[i] - upload_start).count();
+        if (cl_workers_[i].opencl_manager->GetCommandQueueManager()->IsProfilingEnabled())
+            continue;
+        auto *completion = new std::promise<std::chrono::steady_clock::time_point>();
+        completions[i] = completion->get_future();
+        if (kernel_events[i].setCallback(CL_COMPLETE, RecordCompletion, completion) != CL_SUCCESS) {
+            completions[i] = std::future<std::chrono::steady_clock::time_point>();
+            delete completion;
+        }
+    }
+    cv::Mat cpu_output;
+    if (cpu_worker_ >= 0 && !rows[cpu_worker_].empty()) {
+        auto cpu_start = std::chrono::steady_clock::now();
+        cpu_output.create(rows[cpu_worker_].size(), image_size.w, CV_8UC4);
+        ProcessCPUBand(image_data, image_size, parameter, rows[cpu_worker_],
+                       reinterpret_cast<aut::PixelRGBA*>(cpu_output.data));
+        stats_[cpu_worker_].band_seconds = seconds_since(cpu_start);
+    }
+
+    // The source has been read by everyone, so the bands can be written back
+    for (std::size_t i = 0; i < cl_worker_num; i++) {
+        if (!out_images[i])
+            continue;
+        CLWorker &worker = cl_workers_[i];
+        CLCommandQueueManager *command_queue_manager = worker.opencl_manager->GetCommandQueueManager();
+        kernel_events[i].wait();
+        if (command_queue_manager->IsProfilingEnabled()) {
+            cl_ulong device_start = upload_events[i].getProfilingInfo<CL_PROFILING_COMMAND_START>();
+            cl_ulong device_end = kernel_events[i].getProfilingInfo<CL_PROFILING_COMMAND_END>();
+            stats_[i].band_seconds += (device_end - device_start) * 1e-9;
+        } else if (completions[i].valid()) {
+            stats_[i].band_seconds += std::chrono::duration<double>(completions[i].get() - enqueue_ends[i]).count();
+        } else {
+            // Without any timestamp of the device, the wait for the other workers is counted too
+            stats_[i].band_seconds = seconds_since(start);
+        }
+        auto download_start = std::chrono::steady_clock::now();
+        command_queue_manager->ReadImage2D(
+            *out_images[i], CL_TRUE, 0, rows[i].start, image_size.w, rows[i].size(),
+            image_data + static_cast<std::size_t>(rows[i].start) * image_size.w);
+        stats_[i].band_seconds += seconds_since(download_start);
+        in_images[i].Reset();
+        out_images[i].Reset();
+    }
+    if (!cpu_output.empty()) {
+        cv::Mat image(image_size.h, image_size.w, CV_8UC4, image_data);
+        cpu_output.copyTo(image(band_rect(cpu_worker_)));
+    }
+
+    if (dynamic_balancing_)
+        UpdateShares(rows, image_size.w);
+}
+
+int MultiDeviceExecutor::PickWorker() {
+    bool cpu_busy = cpu_frame_.valid() &&
+                    cpu_frame_.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+    int picked = -1;
+    double min_progress = std::numeric_limits<double>::max();
+    for (int i = 0; i < GetWorkerNum(); i++) {
+        if (stats_[i].share <= 0 || (IsCPUWorker(i) && cpu_busy))
+            continue;
+        // Frames after this one relative to the share
+        double progress = (assigned_counts_[i] + 1) / stats_[i].share;
+        if (progress < min_progress) {
+            min_progress = progress;
+            picked = i;
+        }
+    }
+    // Only the CPU is left, so it takes the frame once the previous one is done
+    return picked >= 0 ? picked : cpu_worker_;
+}
+
+std::uint64_t MultiDeviceExecutor::Submit(const aut::PixelRGBA *src, aut::PixelRGBA *dst,
+                                          const aut::Size2D &image_size,
+                                          const OpticsCompensationParameter &parameter) {
+    std::uint64_t frame = next_frame_++;
+    std::size_t pixel_num = static_cast<std::size_t>(image_size.w) * image_size.h;
+    // No distortion, the frame is complete right away
+    if (parameter.IsIdentity()) {
+        if (dst != src)
+            std::memcpy(dst, src, sizeof(aut::PixelRGBA) * pixel_num);
+        return frame;
+    }
+
+    int worker = PickWorker();
+    assigned_counts_[worker]++;
+    FrameRecord record = {worker, frame};
+    if (IsCPUWorker(worker)) {
+        // Rethrows the exception of the previous frame
+        if (cpu_frame_.valid())
+            cpu_frame_.get();
+        if (dst != src)
+            std::memcpy(dst, src, sizeof(aut::PixelRGBA) * pixel_num);
+        cpu_frame_ = std::async(std::launch::async, [this, dst, image_size, parameter]() {
+            ProcessCPUBand(dst, image_size, parameter, cv::Range(0, image_size.h), dst);
+        });
+        cpu_frame_number_ = frame;
+    } else {
+        CLWorker &cl_worker = cl_workers_[worker];
+        if (!cl_worker.pipeline)
+            cl_worker.pipeline = new CLFramePipeline(cl_worker.opencl_manager);
+        record.worker_frame = cl_worker.pipeline->Submit(src, dst, image_size, parameter);
+    }
+    in_flight_[frame] = record;
+    return frame;
+}
+
+void MultiDeviceExecutor::Wait(std::uint64_t frame) {
+    auto it = in_flight_.find(frame);
+    if (it == in_flight_.end())
+        return;
+    FrameRecord record = it->second;
+    in_flight_.erase(it);
+    if (IsCPUWorker(record.worker)) {
+        // A later CPU frame has already waited for this one
+        if (cpu_frame_number_ == frame && cpu_frame_.valid())
+            cpu_frame_.get();
+    } else {
+        cl_workers_[record.worker].pipeline->Wait(record.worker_frame);
+    }
+}
+
+void MultiDeviceExecutor::Finish() {
+    for (auto &worker : cl_workers_) {
+        if (worker.pipeline)
+            worker.pipeline->Finish();
+    }
+    if (cpu_frame_.valid())
+        cpu_frame_.get();
+    in_flight_.clear();
+}
+
+int MultiDeviceExecutor::GetDepth() const {
+    // Pipelines are created with the default depth
+    int depth = 0;
+    for (auto &worker : cl_workers_)
+        depth += worker.pipeline ? worker.pipeline->GetDepth() : kDefaultPipelineDepth;
+    return cpu_worker_ >= 0 ? depth + 1 : depth;
+}
\ No newline at end of file
@@ -0,0 +1,142 @@
+#ifndef _OPTICSCOMPENSATION_S_SRC_MULTI_DEVICE_H_
+#define _OPTICSCOMPENSATION_S_SRC_MULTI_DEVICE_H_
+
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <aut/AUL_Type.h>
+#include <opencv2/opencv.hpp>
+#include "cl_kernel.h"
+#include "cl_manager.h"
+#include "cl_pipeline.h"
+#include "cl_program_cache.h"
+#include "parameter.h"
+#include "remap_table.h"
+
+// Runs the effect on every OpenCL device of every platform at once, with the CPU kernels
+// as one more worker. Process() cuts a frame into horizontal bands sized by the throughput
+// of the workers, and Submit() hands whole frames of a batch to them in the same ratio.
+// The throughput is measured on every band, so the bands follow the load frame to frame.
+// The CPU worker takes the center like the OpenCL kernels, so the bands don't show a seam.
+// The OpenCL workers always run the fused generic kernels, whatever the settings of the engine.
+class MultiDeviceExecutor {
+public:
+    struct WorkerStats {
+        std::string name;
+        bool cpu_kernel;
+        // Output pixels per second measured by Calibrate() and averaged over the bands
+        // of Process(), 0 before
+        double throughput;
+        // Share of the rows of a frame and of the frames of a batch, the shares add up to 1
+        double share;
+        // Time of the band of the last Process()
+        double band_seconds;
+    };
+
+    // Set up every device of device_type which builds the program, and the CPU kernels
+    // when use_cpu is true. Devices which fail are skipped, see GetSkippedDevices().
+    // The programs are loaded from program_cache when it is given.
+    // The CPU kernels take the tables of the whole frame from remap_table_cache, which has to
+    // outlive the executor, or from a cache of their own without it.
+    MultiDeviceExecutor(const std::string &kernel_source, cl_device_type device_type = CL_DEVICE_TYPE_ALL,
+                        bool use_cpu = true, CLProgramCache *program_cache = nullptr,
+                        RemapTableCache *remap_table_cache = nullptr);
+    // Only the devices given, like a single device with the CPU kernels
+    MultiDeviceExecutor(const std::string &kernel_source, const std::vector<cl::Device> &devices,
+                        bool use_cpu = true, CLProgramCache *program_cache = nullptr,
+                        RemapTableCache *remap_table_cache = nullptr);
+    ~MultiDeviceExecutor();
+
+    int GetWorkerNum() const { return static_cast<int>(stats_.size()); }
+    const WorkerStats& GetWorkerStats(int index) const { return stats_[index]; }
+    // Names of the devices which couldn't be set up, with the reason
+    const std::vector<std::string>& GetSkippedDevices() const { return skipped_devices_; }
+
+    // Time every worker alone on an opaque frame of image_size and set the shares from
+    // the throughput. The workers share the rows equally until then.
+    void Calibrate(const aut::Size2D &image_size, const OpticsCompensationParameter &parameter,
+                   int iteration_num = 3);
+
+    // Move the shares toward the throughput of the last bands after every Process() (default).
+    // Otherwise the shares of Calibrate() stay.
+    void SetDynamicBalancing(bool enable) { dynamic_balancing_ = enable; }
+    bool IsDynamicBalancingEnabled() const { return dynamic_balancing_; }
+
+    // Apply the effect in place, each worker distorting its band of rows
+    void Process(aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                 const OpticsCompensationParameter &parameter);
+
+    // Queue a whole frame on the next worker and return its number, like CLFramePipeline::Submit().
+    // The CPU worker runs a frame at a time on its own thread, and is passed over while busy.
+    std::uint64_t Submit(const aut::PixelRGBA *src, aut::PixelRGBA *dst, const aut::Size2D &image_size,
+                         const OpticsCompensationParameter &parameter);
+    // Wait until dst of the frame is written
+    void Wait(std::uint64_t frame);
+    // Wait for all the frames in flight
+    void Finish();
+    // Frames which can be in flight at once
+    int GetDepth() const;
+
+private:
+    struct CLWorker {
+        OpenCLManager *opencl_manager;
+        DistortionKernelSet *distortion_kernel_set;
+        // Created on the first Submit()
+        CLFramePipeline *pipeline;
+    };
+
+    // Worker and its own number of a frame in flight
+    struct FrameRecord {
+        int worker;
+        std::uint64_t worker_frame;
+    };
+
+    bool IsCPUWorker(int index) const { return index == cpu_worker_; }
+    // Rows [begin, end) of every worker for the shares, probe gives a band to the workers left out
+    std::vector<cv::Range> SplitRows(int h, bool probe = false) const;
+    void InitWorkers(const std::string &kernel_source, const std::vector<cl::Device> &devices, bool use_cpu,
+                     CLProgramCache *program_cache, RemapTableCache *remap_table_cache);
+    // Distort output_rect of the frame on a device, the source is uploaded whole.
+    // The events receive the upload and the last kernel.
+    void EnqueueBand(CLWorker *worker, const aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                     const OpticsCompensationParameter &parameter, const cv::Rect &occupied_rect,
+                     const cv::Rect &output_rect, PooledImage *in_image, PooledImage *out_image,
+                     cl::Event *upload_event = nullptr, cl::Event *kernel_event = nullptr);
+    // Distort the rows of the frame on the CPU into output, which holds only those rows
+    // and can share the pixels of image_data
+    void ProcessCPUBand(const aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                        const OpticsCompensationParameter &parameter, const cv::Range &rows,
+                        aut::PixelRGBA *output);
+    // Next worker of a batch, the one furthest behind its share
+    int PickWorker();
+    void SetShares(const std::vector<double> &weights);
+    // Shares in the ratio of the throughput, leaving out the workers under kMinShare
+    void SetSharesFromThroughput();
+    // Average the throughput of the bands of a frame into the stats and set the shares from it
+    void UpdateShares(const std::vector<cv::Range> &rows, int w);
+
+    std::vector<CLWorker> cl_workers_;
+    // Index of the CPU worker, -1 without it. The OpenCL workers come first.
+    int cpu_worker_;
+    std::vector<WorkerStats> stats_;
+    std::vector<std::string> skipped_devices_;
+    std::unique_ptr<RemapTableCache> own_remap_table_cache_;
+    RemapTableCache *remap_table_cache_;
+    // The CPU frames of Submit() run on their own thread
+    std::mutex remap_table_mutex_;
+    bool dynamic_balancing_;
+    std::uint64_t processed_count_;
+
+    // Batch state
+    std::vector<std::uint64_t> assigned_counts_;
+    std::uint64_t next_frame_;
+    std::unordered_map<std::uint64_t, FrameRecord> in_flight_;
+    std::future<void> cpu_frame_;
+    std::uint64_t cpu_frame_number_;
+};
+
+#endif // _OPTICSCOMPENSATION_S_SRC_MULTI_DEVICE_H_
\ No newline at end of file
@@ -0,0 +1,511 @@
+#include "optics_compensation.h"
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include "cpu_kernel.h"
+#include "cpu_pipeline.h"
+#include "cpu_scheduler.h"
+#include "exception.h"
+#include "out_debug.h"
+#include "output_bounds.h"
+#include "tile_pipeline.h"
+
+#define CL_KERNEL_SOURCE(x) #x
+// The defines of CLKernelVariant default to the generic kernels
+static const std::string kernel_source =
+    "#ifndef VARIANT_AA_SAMPLES\n#define VARIANT_AA_SAMPLES 0\n#endif\n"
+    "#ifndef VARIANT_FULL_GROUPS\n#define VARIANT_FULL_GROUPS 0\n#endif\n"
+#include "kernel.cl"
+;
+
+OpticsCompensationEngine::OpticsCompensationEngine() :
+    use_opencl_(false),
+    cl_fused_kernel_(false),
+    cl_kernel_variants_(true),
+    cl_remap_coords_(true),
+    cl_transfer_mode_(CLCommandQueueManager::transfer_auto),
+    intermediate_format_(intermediate_float),
+    opencl_manager_(nullptr),
+    distortion_kernel_set_(nullptr),
+    cl_program_variants_(nullptr),
+    premult_kernel_manager_(nullptr),
+    unpremult_kernel_manager_(nullptr),
+    multi_device_executor_(nullptr) {
+    SetCLProgramCacheDirectory(GetDefaultCLProgramCacheDirectory());
+}
+
+OpticsCompensationEngine::~OpticsCompensationEngine() {
+    // The kernels may still be created on the thread of InitOpenCLAsync()
+    if (cl_init_future_.valid())
+        cl_init_future_.wait();
+    delete distortion_kernel_set_;
+    delete cl_program_variants_;
+    delete premult_kernel_manager_;
+    delete unpremult_kernel_manager_;
+    delete multi_device_executor_;
+    delete opencl_manager_;
+}
+
+void OpticsCompensationEngine::SetCLProgramCacheDirectory(const std::string &directory) {
+    std::lock_guard<std::mutex> lock(cl_settings_mutex_);
+    cl_program_cache_.reset(directory.empty() ? nullptr : new CLProgramCache(directory));
+}
+
+bool OpticsCompensationEngine::InitOpenCL(cl_device_type device_type) {
+    std::lock_guard<std::mutex> init_lock(cl_init_mutex_);
+    if (use_opencl_)
+        return true;
+
+    try {
+        OutDebugInfo("Init OpenCL");
+        LoadOpenCLDLL();
+        std::shared_ptr<CLProgramCache> program_cache;
+        {
+            std::lock_guard<std::mutex> lock(cl_settings_mutex_);
+            program_cache = cl_program_cache_;
+        }
+        if (!opencl_manager_)
+            opencl_manager_ = new OpenCLManager(kernel_source, device_type, program_cache.get());
+        CLCommandQueueManager *cqman = opencl_manager_->GetCommandQueueManager();
+
+        if (!distortion_kernel_set_)
+            distortion_kernel_set_ = new DistortionKernelSet(opencl_manager_->GetProgram(), cqman->GetCommandQueue());
+        if (!cl_program_variants_)
+            cl_program_variants_ = new CLProgramVariants(*opencl_manager_->GetContext(), kernel_source, program_cache);
+        if (!premult_kernel_manager_)
+            premult_kernel_manager_ = new PremultKernelManager(opencl_manager_->GetProgram(), cqman->GetCommandQueue());
+        if (!unpremult_kernel_manager_)
+            unpremult_kernel_manager_ = new UnpremultKernelManager(opencl_manager_->GetProgram(), cqman->GetCommandQueue());
+
+        CLDeviceManager *dman = opencl_manager_->GetDeviceManager();
+        for (unsigned int i = 0; i < dman->GetDeviceNum(); i++) {
+            OutDebugInfo("Device ", i, " : ", dman->GetDeviceName(i));
+        }
+        OutDebugInfo("Host unified memory : ", cqman->IsHostUnifiedMemory());
+        OutDebugInfo("Program from the cache : ", opencl_manager_->GetProgramManager()->IsLoadedFromCache());
+        OutDebugInfo("Build Log : ",
+                     opencl_manager_->GetProgramManager()->GetBuildLog());
+
+        // The settings changed during the initialization apply before the switch
+        std::lock_guard<std::mutex> lock(cl_settings_mutex_);
+        distortion_kernel_set_->SetFused(cl_fused_kernel_);
+        distortion_kernel_set_->SetProgramVariants(cl_kernel_variants_ ? cl_program_variants_ : nullptr);
+        distortion_kernel_set_->SetRemapCoords(cl_remap_coords_);
+        cqman->SetTransferMode(cl_transfer_mode_);
+        use_opencl_ = true;
+        OutDebugInfo("Init OpenCL complete");
+    } catch (InitOpenCLManagerException &e) {
+        SetInitError(e.message());
+    } catch (std::runtime_error &e) {
+        SetInitError(e.what());
+    }
+    return use_opencl_;
+}
+
+void OpticsCompensationEngine::InitOpenCLAsync(cl_device_type device_type) {
+    if (use_opencl_ || cl_init_future_.valid())
+        return;
+    cl_init_future_ = std::async(std::launch::async, [this, device_type]() {
+        return InitOpenCL(device_type);
+    });
+}
+
+bool OpticsCompensationEngine::IsOpenCLInitializing() const {
+    return cl_init_future_.valid() &&
+           cl_init_future_.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+}
+
+bool OpticsCompensationEngine::WaitOpenCL() {
+    if (cl_init_future_.valid())
+        cl_init_future_.get();
+    return use_opencl_;
+}
+
+std::string OpticsCompensationEngine::GetInitError() const {
+    std::lock_guard<std::mutex> lock(cl_settings_mutex_);
+    return init_error_;
+}
+
+void OpticsCompensationEngine::SetInitError(const std::string &init_error) {
+    std::lock_guard<std::mutex> lock(cl_settings_mutex_);
+    init_error_ = init_error;
+}
+
+bool OpticsCompensationEngine::InitMultiDevice(bool use_cpu) {
+    if (multi_device_executor_)
+        return true;
+
+    try {
+        OutDebugInfo("Init multi-device");
+        LoadOpenCLDLL();
+        return InitExecutor(GetAllCLDevices(CL_DEVICE_TYPE_ALL), use_cpu);
+    } catch (InitOpenCLManagerException &e) {
+        SetInitError(e.message());
+    } catch (std::runtime_error &e) {
+        SetInitError(e.what());
+    }
+    return false;
+}
+
+bool OpticsCompensationEngine::InitHybrid(cl_device_type device_type) {
+    if (multi_device_executor_)
+        return true;
+
+    try {
+        OutDebugInfo("Init hybrid");
+        LoadOpenCLDLL();
+        std::vector<cl::Device> devices = GetAllCLDevices(device_type);
+        if (devices.size() > 1)
+            devices.resize(1);
+        return InitExecutor(devices, true);
+    } catch (InitOpenCLManagerException &e) {
+        SetInitError(e.message());
+    } catch (std::runtime_error &e) {
+        SetInitError(e.what());
+    }
+    return false;
+}
+
+// Throws like the constructors of the OpenCL managers
+bool OpticsCompensationEngine::InitExecutor(const std::vector<cl::Device> &devices, bool use_cpu) {
+    std::shared_ptr<CLProgramCache> program_cache;
+    {
+        std::lock_guard<std::mutex> lock(cl_settings_mutex_);
+        program_cache = cl_program_cache_;
+    }
+    std::unique_ptr<MultiDeviceExecutor> executor(
+        new MultiDeviceExecutor(kernel_source, devices, use_cpu, program_cache.get(),
+                                &remap_table_cache_));
+    for (auto &skipped_device : executor->GetSkippedDevices())
+        OutDebugInfo("Skipped device : ", skipped_device);
+    // A single worker is what the other backends already do
+    if (executor->GetWorkerNum() < 2) {
+        SetInitError("Only one device to run on");
+        return false;
+    }
+    executor->Calibrate(aut::Size2D(1920, 1080), MakeOpticsCompensationParameter(50, false, glm::vec2(0)));
+    for (int i = 0; i < executor->GetWorkerNum(); i++) {
+        auto &stats = executor->GetWorkerStats(i);
+        OutDebugInfo("Worker ", stats.name, " : ", stats.throughput / 1e6, " Mpx/s  share ", stats.share);
+    }
+    multi_device_executor_ = executor.release();
+    return true;
+}
+
+void OpticsCompensationEngine::ReleaseMultiDevice() {
+    delete multi_device_executor_;
+    multi_device_executor_ = nullptr;
+}
+
+void OpticsCompensationEngine::Process(aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                                       const OpticsCompensationParameter &parameter) {
+    if (parameter.IsIdentity())
+        return;
+
+    if (multi_device_executor_) {
+        std::string profile_key = profiler_.IsEnabled() ?
+                                  Profiler::MakeKey(image_size, parameter, "multi_device") : std::string();
+        ScopedStageTimer frame_timer(&profiler_, profile_key, Profiler::stage_frame);
+        multi_device_executor_->Process(image_data, image_size, parameter);
+        for (int i = 0; i < multi_device_executor_->GetWorkerNum(); i++) {
+            auto &stats = multi_device_executor_->GetWorkerStats(i);
+            OutDebugInfo(stats.name, " : ", stats.band_seconds * 1000, " ms  share ", stats.share);
+        }
+    } else if (use_opencl_)
+        ProcessOpenCL(image_data, image_size, parameter);
+    else
+        ProcessCPU(image_data, image_size, parameter);
+}
+
+void OpticsCompensationEngine::Process(cv::Mat &image, const OpticsCompensationParameter &parameter) {
+    if (parameter.IsIdentity())
+        return;
+
+    aut::Size2D image_size(image.cols, image.rows);
+    if (image.type() == CV_8UC4) {
+        if (!image.isContinuous())
+            image = image.clone();
+        Process(reinterpret_cast<aut::PixelRGBA*>(image.data), image_size, parameter);
+        return;
+    }
+    if (image.type() != CV_32FC4)
+        throw std::invalid_argument("Image must be CV_8UC4 or CV_32FC4");
+
+    // Barrel with amount 1 leaves the image empty
+    if (parameter.IsEmptyOutput()) {
+        image.setTo(cv::Scalar::all(0));
+        return;
+    }
+
+    std::string profile_key = profiler_.IsEnabled() ?
+                              Profiler::MakeKey(image_size, parameter, "cpu_float") : std::string();
+    ScopedStageTimer frame_timer(&profiler_, profile_key, Profiler::stage_frame);
+
+    cv::Mat premultiplied(image.size(), CV_32FC4);
+    cv::Mat distorted(image.size(), CV_32FC4);
+    {
+        ScopedStageTimer timer(&profiler_, profile_key, Profiler::stage_premult);
+        #pragma omp parallel for num_threads(GetCPUThreadNum())
+        for (int y = 0; y < image.rows; y++) {
+            auto *in_row = image.ptr<cv::Vec4f>(y);
+            auto *out_row = premultiplied.ptr<cv::Vec4f>(y);
+            for (int x = 0; x < image.cols; x++) {
+                float alpha = in_row[x][3];
+                out_row[x] = cv::Vec4f(in_row[x][0] * alpha, in_row[x][1] * alpha,
+                                       in_row[x][2] * alpha, alpha);
+            }
+        }
+    }
+
+    {
+        ScopedStageTimer timer(&profiler_, profile_key, Profiler::stage_distortion);
+        DistortionCPUKernel(premultiplied, distorted, image_size, parameter);
+    }
+
+    ScopedStageTimer timer(&profiler_, profile_key, Profiler::stage_unpremult);
+    #pragma omp parallel for num_threads(GetCPUThreadNum())
+    for (int y = 0; y < image.rows; y++) {
+        auto *in_row = distorted.ptr<cv::Vec4f>(y);
+        auto *out_row = image.ptr<cv::Vec4f>(y);
+        for (int x = 0; x < image.cols; x++) {
+            float alpha = in_row[x][3];
+            out_row[x] = in_row[x];
+            if (alpha != 0) {
+                out_row[x][0] /= alpha;
+                out_row[x][1] /= alpha;
+                out_row[x][2] /= alpha;
+            }
+        }
+    }
+}
+
+void OpticsCompensationEngine::ProcessTile(const cv::Mat &source, const cv::Rect &source_rect,
+                                           cv::Mat &output, const aut::Size2D &image_size,
+                                           const cv::Rect &output_rect,
+                                           const OpticsCompensationParameter &parameter) {
+    std::string profile_key = profiler_.IsEnabled() ?
+                              Profiler::MakeKey(image_size, parameter, "cpu_tile") : std::string();
+    ScopedStageTimer timer(&profiler_, profile_key, Profiler::stage_fused);
+    TileCPUKernel(source, source_rect, output, image_size, output_rect, parameter);
+}
+
+void OpticsCompensationEngine::ProcessTiled(const cv::Mat &image, cv::Mat &output,
+                                            const OpticsCompensationParameter &parameter,
+                                            const aut::Size2D &tile_size) {
+    if (image.type() != CV_8UC4 && image.type() != CV_32FC4)
+        throw std::invalid_argument("Image must be CV_8UC4 or CV_32FC4");
+
+    aut::Size2D image_size(image.cols, image.rows);
+    std::string profile_key = profiler_.IsEnabled() ?
+                              Profiler::MakeKey(image_size, parameter, "cpu_tile") : std::string();
+    ScopedStageTimer frame_timer(&profiler_, profile_key, Profiler::stage_frame);
+
+    output.create(image.size(), image.type());
+    for (auto &output_rect : SplitIntoTiles(image_size, tile_size)) {
+        cv::Rect source_rect = CalcTileSourceRect(image_size, output_rect, parameter);
+        cv::Mat output_tile = output(output_rect);
+        ProcessTile(image(source_rect), source_rect, output_tile, image_size, output_rect, parameter);
+    }
+}
+
+void OpticsCompensationEngine::SetCLFusedKernel(bool fused) {
+    std::lock_guard<std::mutex> lock(cl_settings_mutex_);
+    cl_fused_kernel_ = fused;
+    if (use_opencl_)
+        distortion_kernel_set_->SetFused(cl_fused_kernel_);
+}
+
+void OpticsCompensationEngine::SetCLKernelVariants(bool enable) {
+    std::lock_guard<std::mutex> lock(cl_settings_mutex_);
+    cl_kernel_variants_ = enable;
+    if (use_opencl_)
+        distortion_kernel_set_->SetProgramVariants(cl_kernel_variants_ ? cl_program_variants_ : nullptr);
+}
+
+void OpticsCompensationEngine::SetCLRemapCoords(bool enable) {
+    std::lock_guard<std::mutex> lock(cl_settings_mutex_);
+    cl_remap_coords_ = enable;
+    if (use_opencl_)
+        distortion_kernel_set_->SetRemapCoords(cl_remap_coords_);
+}
+
+void OpticsCompensationEngine::SetCLTransferMode(CLCommandQueueManager::TransferMode transfer_mode) {
+    std::lock_guard<std::mutex> lock(cl_settings_mutex_);
+    cl_transfer_mode_ = transfer_mode;
+    if (use_opencl_)
+        opencl_manager_->GetCommandQueueManager()->SetTransferMode(cl_transfer_mode_);
+}
+
+CLFramePipeline* OpticsCompensationEngine::CreateCLFramePipeline(int depth) {
+    if (!use_opencl_)
+        return nullptr;
+    auto *pipeline = new CLFramePipeline(opencl_manager_, depth);
+    std::lock_guard<std::mutex> lock(cl_settings_mutex_);
+    pipeline->SetFused(cl_fused_kernel_);
+    pipeline->SetProgramVariants(cl_kernel_variants_ ? cl_program_variants_ : nullptr);
+    pipeline->SetRemapCoords(cl_remap_coords_);
+    pipeline->SetIntermediateFormat(intermediate_format_);
+    pipeline->SetProfiler(&profiler_);
+    return pipeline;
+}
+
+void OpticsCompensationEngine::ProcessOpenCL(aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                                             const OpticsCompensationParameter &parameter) {
+    bool profiling = profiler_.IsEnabled();
+    std::string profile_key = profiling ?
+                              Profiler::MakeKey(image_size, parameter, "opencl") : std::string();
+    ScopedStageTimer frame_timer(&profiler_, profile_key, Profiler::stage_frame);
+    // Transparent source gives a transparent image without the device
+    cv::Rect occupied_rect = CalcOccupiedRect(image_data, image_size);
+    if (occupied_rect.empty()) {
+        std::memset(image_data, 0, sizeof(aut::PixelRGBA) * image_size.w * image_size.h);
+        return;
+    }
+    // Events are only requested while profiling, the queue doesn't have to keep them otherwise
+    cl::Event upload_event, premult_event, distortion_event, unpremult_event, download_event;
+    auto event_of = [profiling](cl::Event &event) { return profiling ? &event : nullptr; };
+
+    auto *command_queue_manager = opencl_manager_->GetCommandQueueManager();
+    auto *image_pool = opencl_manager_->GetImagePool();
+    cl::ImageFormat fmt;
+    fmt.image_channel_data_type = CL_UNORM_INT8;
+    fmt.image_channel_order = CL_BGRA;
+    // Images are reused across the frames of the same resolution
+    PooledImage pooled_image_0(image_pool, image_size.w, image_size.h, fmt);
+    PooledImage pooled_image_1(image_pool, image_size.w, image_size.h, fmt);
+    cl::Image2D &image_0 = *pooled_image_0;
+    cl::Image2D &image_1 = *pooled_image_1;
+
+    std::int64_t enqueue_ns = profiling ? Profiler::Now() : 0;
+    {
+        ScopedStageTimer timer(&profiler_, profile_key, Profiler::stage_upload);
+        command_queue_manager->UploadImage2D(image_0, image_size.w, image_size.h,
+                                             sizeof(aut::PixelRGBA), image_data,
+                                             event_of(upload_event));
+    }
+
+    // Fused kernels read image_0 and write image_1 directly,
+    // otherwise image_0 -> Premult -> image_1 -> distortion -> image_0 -> Unpremult -> image_1.
+    // 16 bit intermediates premultiply into an image of their format instead, and the
+    // distortion writes a float image. The interpolated premultiplied colors of low alpha
+    // are divided by the alpha again, so rounding them to 16 bits would exceed 1 LSB.
+    bool packed_intermediate = !cl_fused_kernel_ && intermediate_format_ != intermediate_float;
+    cl::Image2D *intermediate_0 = &image_1;
+    cl::Image2D *intermediate_1 = &image_0;
+    PooledImage packed_image_0;
+    PooledImage packed_image_1;
+    if (packed_intermediate) {
+        cl::ImageFormat intermediate_fmt;
+        intermediate_fmt.image_channel_data_type =
+            intermediate_format_ == intermediate_half ? CL_HALF_FLOAT : CL_UNORM_INT16;
+        intermediate_fmt.image_channel_order = CL_RGBA;
+        cl::ImageFormat distorted_fmt;
+        distorted_fmt.image_channel_data_type = CL_FLOAT;
+        distorted_fmt.image_channel_order = CL_RGBA;
+        packed_image_0 = PooledImage(image_pool, image_size.w, image_size.h, intermediate_fmt);
+        packed_image_1 = PooledImage(image_pool, image_size.w, image_size.h, distorted_fmt);
+        intermediate_0 = packed_image_0.Get();
+        intermediate_1 = packed_image_1.Get();
+    }
+    cl::Image2D &distortion_in = cl_fused_kernel_ ? image_0 : *intermediate_0;
+    cl::Image2D &distortion_out = cl_fused_kernel_ ? image_1 : *intermediate_1;
+    if (!cl_fused_kernel_)
+        premult_kernel_manager_->CallPremult(image_0, *intermediate_0, image_size.w, image_size.h,
+                                             event_of(premult_event));
+
+    distortion_kernel_set_->CallKernel(distortion_in, distortion_out,
+                                       image_size.w, image_size.h, parameter, occupied_rect,
+                                       event_of(distortion_event));
+
+    if (!cl_fused_kernel_)
+        unpremult_kernel_manager_->CallUnpremult(*intermediate_1, image_1, image_size.w, image_size.h,
+                                                 event_of(unpremult_event));
+
+    {
+        // Includes the wait for the kernels, the device times tell them apart
+        ScopedStageTimer timer(&profiler_, profile_key, Profiler::stage_download);
+        command_queue_manager->DownloadImage2D(image_1, image_size.w, image_size.h,
+                                               sizeof(aut::PixelRGBA), image_data,
+                                               event_of(download_event));
+    }
+
+    // All the commands are complete once the download returns
+    if (profiling && command_queue_manager->IsProfilingEnabled()) {
+        std::int64_t clock_offset = Profiler::GetCLClockOffset(upload_event, enqueue_ns);
+        profiler_.RecordCLEvent(profile_key, Profiler::stage_upload, upload_event, clock_offset);
+        if (!cl_fused_kernel_)
+            profiler_.RecordCLEvent(profile_key, Profiler::stage_premult, premult_event, clock_offset);
+        profiler_.RecordCLEvent(profile_key, Profiler::stage_distortion, distortion_event, clock_offset);
+        if (!cl_fused_kernel_)
+            profiler_.RecordCLEvent(profile_key, Profiler::stage_unpremult, unpremult_event, clock_offset);
+        profiler_.RecordCLEvent(profile_key, Profiler::stage_download, download_event, clock_offset);
+    }
+
+    // Back in the pool for the debug info, the destructors would do it too
+    pooled_image_0.Reset();
+    pooled_image_1.Reset();
+    packed_image_0.Reset();
+    packed_image_1.Reset();
+    OutDebugInfo("Image pool : ", image_pool->GetImageNum(), " images  ",
+                 image_pool->GetByteSize() / 1024, " KB  created : ",
+                 image_pool->GetCreatedCount());
+}
+
+void OpticsCompensationEngine::ProcessCPU(aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                                          const OpticsCompensationParameter &parameter) {
+    std::string profile_key = profiler_.IsEnabled() ?
+                              Profiler::MakeKey(image_size, parameter, "cpu") : std::string();
+    ScopedStageTimer frame_timer(&profiler_, profile_key, Profiler::stage_frame);
+
+    // Barrel with amount 1 leaves the image empty, and so does a transparent source
+    cv::Rect occupied_rect = CalcOccupiedRect(image_data, image_size);
+    bool empty_output = parameter.IsEmptyOutput() || occupied_rect.empty();
+    std::shared_ptr<const RemapTable> remap_table;
+    if (!empty_output) {
+        ScopedStageTimer timer(&profiler_, profile_key, Profiler::stage_remap_table);
+        remap_table = remap_table_cache_.GetTable(image_size, parameter);
+    }
+    if (empty_output) {
+        std::memset(image_data, 0,
+                    sizeof(aut::PixelRGBA) * image_size.w * image_size.h);
+    } else if (remap_table && remap_table->GetLayout() == RemapTable::pixel_corner &&
+               parameter.aa_filter == aa_anisotropic) {
+        ScopedStageTimer timer(&profiler_, profile_key, Profiler::stage_fused);
+        AnisotropicCPUKernel(image_data, image_size, *remap_table,
+                             parameter.GetAAMaxSampling(kDefaultMaxAnisotropy));
+    } else if (remap_table) {
+        ScopedStageTimer timer(&profiler_, profile_key, Profiler::stage_fused);
+        // The spans of the table cover the whole source, a part of it narrows them down
+        cv::Rect live_rect(0, 0, image_size.w, image_size.h);
+        if (occupied_rect != live_rect) {
+            glm::vec2 center_coord((image_size.w - 1) / 2.f - parameter.center_pos.x,
+                                   (image_size.h - 1) / 2.f - parameter.center_pos.y);
+            live_rect = CalcLiveRect(image_size, occupied_rect, center_coord, parameter);
+        }
+        FusedCPUKernel(image_data, image_size, *remap_table, live_rect, intermediate_format_);
+    } else {
+        // Fall back to the full-size intermediate images if the table couldn't be allocated
+        cv::Size mat_size(image_size.w, image_size.h);
+        cv::Mat image_inout(mat_size, CV_8UC4, image_data);
+        // Left uninitialized, the kernels write every pixel
+        cv::Mat image_0(mat_size, CV_32FC4);
+        cv::Mat image_1(mat_size, CV_32FC4);
+
+        {
+            ScopedStageTimer timer(&profiler_, profile_key, Profiler::stage_premult);
+            PremultKernel(image_inout, image_0);
+        }
+
+        {
+            ScopedStageTimer timer(&profiler_, profile_key, Profiler::stage_distortion);
+            DistortionCPUKernel(image_0, image_1, image_size, parameter);
+        }
+
+        ScopedStageTimer timer(&profiler_, profile_key, Profiler::stage_unpremult);
+        UnpremultKernel(image_1, image_inout);
+    }
+    OutDebugInfo("Remap cache hit : ", remap_table_cache_.GetHitCount(),
+                 "  miss : ", remap_table_cache_.GetMissCount(),
+                 "  eviction : ", remap_table_cache_.GetEvictionCount());
+}
\ No newline at end of file
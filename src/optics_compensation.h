@@ -0,0 +1,135 @@
+#ifndef _OPTICSCOMPENSATION_S_SRC_OPTICS_COMPENSATION_H_
+#define _OPTICSCOMPENSATION_S_SRC_OPTICS_COMPENSATION_H_
+
+#include <atomic>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <aut/AUL_Type.h>
+#include <opencv2/opencv.hpp>
+#include "cl_kernel.h"
+#include "cl_manager.h"
+#include "cl_program_cache.h"
+#include "multi_device.h"
+#include "parameter.h"
+#include "profiler.h"
+#include "remap_table.h"
+#include "simd_sampler.h"
+
+// The effect without the Lua host, shared by the Lua module and the command line tool.
+// Runs on OpenCL after InitOpenCL() succeeds, on the CPU otherwise.
+// Process() and the setters are called from one thread, InitOpenCLAsync() is the only
+// work done on another.
+class OpticsCompensationEngine {
+public:
+    OpticsCompensationEngine();
+    ~OpticsCompensationEngine();
+
+    // Try to set up OpenCL, return false and keep using the CPU if it failed
+    bool InitOpenCL(cl_device_type device_type = CL_DEVICE_TYPE_GPU);
+    // Run InitOpenCL() on a thread and return at once. Process() keeps running on the CPU
+    // and switches to OpenCL on the first frame after the initialization succeeded.
+    void InitOpenCLAsync(cl_device_type device_type = CL_DEVICE_TYPE_GPU);
+    // InitOpenCLAsync() is still running
+    bool IsOpenCLInitializing() const;
+    // Wait for InitOpenCLAsync() and return IsOpenCLEnabled()
+    bool WaitOpenCL();
+    bool IsOpenCLEnabled() const { return use_opencl_; }
+    std::string GetInitError() const;
+    // Split the 8 bit frames across every OpenCL device and the CPU kernels (when use_cpu),
+    // see MultiDeviceExecutor. The shares are measured on a 1920x1080 frame at the start.
+    // Returns false and keeps the current backend if there is only one worker.
+    bool InitMultiDevice(bool use_cpu = true);
+    // Split the 8 bit frames between the first device of device_type and the CPU kernels,
+    // with the bands following the measured time of both frame to frame
+    bool InitHybrid(cl_device_type device_type = CL_DEVICE_TYPE_GPU);
+    void ReleaseMultiDevice();
+    // nullptr unless InitMultiDevice() succeeded
+    MultiDeviceExecutor* GetMultiDeviceExecutor() { return multi_device_executor_; }
+
+    // Apply the effect in place to straight alpha BGRA pixels
+    void Process(aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                 const OpticsCompensationParameter &parameter);
+    // Apply the effect in place to a straight alpha CV_8UC4 or CV_32FC4 image.
+    // Float images keep their range and always run on the CPU.
+    void Process(cv::Mat &image, const OpticsCompensationParameter &parameter);
+    // Apply the effect to output_rect of the image on the CPU, see TileCPUKernel().
+    // source is the source_rect part of the image from CalcTileSourceRect().
+    void ProcessTile(const cv::Mat &source, const cv::Rect &source_rect, cv::Mat &output,
+                     const aut::Size2D &image_size, const cv::Rect &output_rect,
+                     const OpticsCompensationParameter &parameter);
+    // Apply the effect to image into output tile by tile on the CPU, both CV_8UC4 or CV_32FC4.
+    // Only a tile is held as floats at a time, instead of the whole image.
+    // output must not share the pixels of image.
+    void ProcessTiled(const cv::Mat &image, cv::Mat &output,
+                      const OpticsCompensationParameter &parameter, const aut::Size2D &tile_size);
+
+    // Directory of the program binaries, see CLProgramCache. Empty builds the program from
+    // the source every time. Takes effect on the next InitOpenCL() / InitMultiDevice().
+    void SetCLProgramCacheDirectory(const std::string &directory);
+    // nullptr when the cache is disabled
+    CLProgramCache* GetCLProgramCache() { return cl_program_cache_.get(); }
+    // Premult, distortion and Unpremult in one kernel instead of three (default false).
+    // The fused kernels skip the 8 bit premultiplied images of the chain, so the straight
+    // color of low alpha pixels differs from it, see test/cl_fused_kernel_test.cc.
+    void SetCLFusedKernel(bool fused);
+    // Build the distortion kernels specialized for the fixed anti-aliasing and for the frames
+    // of whole work-groups in the background, and switch to them once built (default).
+    // See CLProgramVariants.
+    void SetCLKernelVariants(bool enable);
+    // nullptr unless OpenCL is enabled
+    CLProgramVariants* GetCLProgramVariants() { return use_opencl_ ? cl_program_variants_ : nullptr; }
+    // Keep the source coords of a static parameter on the device, see RemapKernelManager
+    void SetCLRemapCoords(bool enable);
+    void SetCLTransferMode(CLCommandQueueManager::TransferMode transfer_mode);
+    // Format of the premultiplied source rows of the CPU and of the premultiplied image of
+    // the unfused OpenCL kernels, whose distortion writes a float image for the packed formats.
+    // intermediate_float keeps 8 bit images on OpenCL as before.
+    void SetIntermediateFormat(IntermediateFormat format) { intermediate_format_ = format; }
+    IntermediateFormat GetIntermediateFormat() const { return intermediate_format_; }
+
+    RemapTableCache* GetRemapTableCache() { return &remap_table_cache_; }
+    // Per-stage timings, disabled until Profiler::SetEnabled(true)
+    Profiler* GetProfiler() { return &profiler_; }
+    // nullptr unless OpenCL is enabled
+    OpenCLManager* GetOpenCLManager() { return use_opencl_ ? opencl_manager_ : nullptr; }
+    // Pipeline of the batch frames on the OpenCL device, which runs the same kernels as Process()
+    // with the settings at the time of the call. The caller deletes it before the engine.
+    // nullptr unless OpenCL is enabled.
+    CLFramePipeline* CreateCLFramePipeline(int depth = kDefaultPipelineDepth);
+
+private:
+    void ProcessOpenCL(aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                       const OpticsCompensationParameter &parameter);
+    void ProcessCPU(aut::PixelRGBA *image_data, const aut::Size2D &image_size,
+                    const OpticsCompensationParameter &parameter);
+    bool InitExecutor(const std::vector<cl::Device> &devices, bool use_cpu);
+    void SetInitError(const std::string &init_error);
+
+    // Set last by InitOpenCL(), once the OpenCL objects are complete
+    std::atomic<bool> use_opencl_;
+    // One InitOpenCL() at a time
+    std::mutex cl_init_mutex_;
+    // The settings below, and the switch of use_opencl_ against the setters
+    mutable std::mutex cl_settings_mutex_;
+    std::future<bool> cl_init_future_;
+    std::string init_error_;
+    bool cl_fused_kernel_;
+    bool cl_kernel_variants_;
+    bool cl_remap_coords_;
+    CLCommandQueueManager::TransferMode cl_transfer_mode_;
+    IntermediateFormat intermediate_format_;
+    OpenCLManager *opencl_manager_;
+    DistortionKernelSet *distortion_kernel_set_;
+    CLProgramVariants *cl_program_variants_;
+    PremultKernelManager *premult_kernel_manager_;
+    UnpremultKernelManager *unpremult_kernel_manager_;
+    MultiDeviceExecutor *multi_device_executor_;
+    // Shared with InitOpenCLAsync(), which keeps the one it started with
+    std::shared_ptr<CLProgramCache> cl_program_cache_;
+    RemapTableCache remap_table_cache_;
+    Profiler profiler_;
+};
+
+#endif // _OPTICSCOMPENSATION_S_SRC_OPTICS_COMPENSATION_H_
\ No newline at end of file
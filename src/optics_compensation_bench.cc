@@ -0,0 +1,558 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "cl_kernel.h"
+#include "cpu_kernel.h"
+#include "cpu_pipeline.h"
+#include "cpu_scheduler.h"
+#include "optics_compensation.h"
+#include "parameter.h"
+#include "remap_table.h"
+
+// Benchmarks of every kernel, in the spirit of Google Benchmark.
+// Each benchmark repeats until min_time has passed and reports the mean time.
+
+struct BenchmarkOptions {
+    std::string filter = ".*";
+    std::string json_path;
+    double min_time = 0.2;
+    bool use_opencl = true;
+    cl_device_type cl_device_type_ = CL_DEVICE_TYPE_CPU;
+    bool full = false;
+};
+
+struct BenchmarkResult {
+    std::string name;
+    std::int64_t iterations;
+    double real_time_ns;
+    double ns_per_pixel;
+    double bytes_per_second;
+    int threads;
+};
+
+class BenchmarkRunner {
+public:
+    BenchmarkRunner(const BenchmarkOptions &options) :
+        options_(options),
+        filter_(options.filter) {}
+
+    // pixel_num and byte_num are per iteration, byte_num counts the reads and the writes
+    void Run(const std::string &name, std::size_t pixel_num, std::size_t byte_num, int threads,
+             const std::function<void()> &func) {
+        if (!std::regex_search(name, filter_))
+            return;
+
+        using clock = std::chrono::steady_clock;
+        // Warm up the caches and the remap tables
+        func();
+        std::int64_t iterations = 0;
+        auto start = clock::now();
+        auto now = start;
+        do {
+            func();
+            iterations++;
+            now = clock::now();
+        } while (std::chrono::duration<double>(now - start).count() < options_.min_time);
+
+        double total_ns = std::chrono::duration<double, std::nano>(now - start).count();
+        BenchmarkResult result;
+        result.name = name;
+        result.iterations = iterations;
+        result.real_time_ns = total_ns / iterations;
+        result.ns_per_pixel = result.real_time_ns / pixel_num;
+        result.bytes_per_second = byte_num / (result.real_time_ns * 1e-9);
+        result.threads = threads;
+        results_.push_back(result);
+
+        std::cout << std::left << std::setw(72) << name << std::right
+                  << std::setw(12) << std::fixed << std::setprecision(3)
+                  << result.real_time_ns * 1e-6 << " ms"
+                  << std::setw(10) << std::setprecision(3) << result.ns_per_pixel << " ns/px"
+                  << std::setw(9) << std::setprecision(2) << result.bytes_per_second * 1e-9 << " GB/s"
+                  << std::setw(8) << iterations << std::endl;
+    }
+
+    void WriteJSON(const std::string &path, const std::string &cl_device_name) const {
+        std::ofstream file(path);
+        file << "{\n  \"context\": {\n"
+             << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n"
+             << "    \"simd_level\": " << static_cast<int>(GetSIMDLevel()) << ",\n"
+             << "    \"opencl_device\": \"" << cl_device_name << "\",\n"
+             << "    \"min_time\": " << options_.min_time << "\n  },\n"
+             << "  \"benchmarks\": [\n";
+        for (std::size_t i = 0; i < results_.size(); i++) {
+            auto &result = results_[i];
+            file << "    {\"name\": \"" << result.name << "\", "
+                 << "\"iterations\": " << result.iterations << ", "
+                 << "\"real_time\": " << std::setprecision(6) << std::fixed << result.real_time_ns << ", "
+                 << "\"time_unit\": \"ns\", "
+                 << "\"ns_per_pixel\": " << result.ns_per_pixel << ", "
+                 << "\"bytes_per_second\": " << std::setprecision(0) << result.bytes_per_second << ", "
+                 << "\"threads\": " << result.threads << "}"
+                 << (i + 1 < results_.size() ? ",\n" : "\n");
+        }
+        file << "  ]\n}\n";
+    }
+
+private:
+    BenchmarkOptions options_;
+    std::regex filter_;
+    std::vector<BenchmarkResult> results_;
+};
+
+struct Resolution {
+    const char *name;
+    int w;
+    int h;
+};
+
+// Opaque gradient with a soft transparent border, so that premultiplication matters
+static cv::Mat MakeSourceImage(int w, int h) {
+    cv::Mat image(cv::Size(w, h), CV_8UC4);
+    for (int y = 0; y < h; y++) {
+        auto *row = image.ptr<cv::Vec4b>(y);
+        for (int x = 0; x < w; x++) {
+            int border = std::min(std::min(x, w - 1 - x), std::min(y, h - 1 - y));
+            row[x] = cv::Vec4b(static_cast<uchar>(x * 255 / w), static_cast<uchar>(y * 255 / h),
+                               static_cast<uchar>((x ^ y) & 0xff),
+                               static_cast<uchar>(std::min(border * 4, 255)));
+        }
+    }
+    return image;
+}
+
+static std::string GetModeName(const OpticsCompensationParameter &parameter) {
+    std::string mode = parameter.spool_mode ? "spool" : "barrel";
+    if (parameter.lens_model != lens_tan) {
+        mode = parameter.lens_model == lens_fisheye ? "fisheye" : "brown_conrady";
+        if (parameter.lens.undistort)
+            mode += "_undistort";
+    }
+    if (!parameter.anti_aliasing)
+        return mode;
+    if (parameter.aa_filter == aa_anisotropic)
+        return mode + "_aa_anisotropic";
+    return mode + (parameter.aa_adaptive ? "_aa_adaptive" : "_aa");
+}
+
+// Camera models of a typical lens, distorting and undistorting, with and without anti-aliasing
+static std::vector<OpticsCompensationParameter> MakeLensModelParameters() {
+    std::vector<OpticsCompensationParameter> parameters;
+    for (LensModel model : {lens_brown_conrady, lens_fisheye}) {
+        for (bool undistort : {false, true}) {
+            for (bool anti_aliasing : {false, true}) {
+                OpticsCompensationParameter parameter(0, false, anti_aliasing, glm::vec2(0));
+                parameter.lens_model = model;
+                if (model == lens_fisheye)
+                    parameter.lens = {0, 0.05f, -0.01f, 0, 0, 0, 0, undistort};
+                else
+                    parameter.lens = {0, -0.2f, 0.05f, 0, 0, 0.001f, -0.001f, undistort};
+                parameters.push_back(parameter);
+            }
+        }
+    }
+    return parameters;
+}
+
+static std::string FormatName(const std::string &kernel, const Resolution &resolution,
+                              const OpticsCompensationParameter *parameter, int threads) {
+    std::ostringstream name;
+    name << kernel << "/" << resolution.name;
+    if (parameter && parameter->lens_model != lens_tan) {
+        name << "/k1:" << parameter->lens.k1
+             << "/center:" << parameter->center_pos.x << "," << parameter->center_pos.y;
+    } else if (parameter) {
+        name << "/amount:" << static_cast<int>(parameter->amount * 100 + 0.5f)
+             << "/center:" << parameter->center_pos.x << "," << parameter->center_pos.y;
+    }
+    if (threads > 0)
+        name << "/threads:" << threads;
+    return name.str();
+}
+
+static void PrintUsage() {
+    std::cout <<
+        "Usage : OpticsCompensation_bench [options]\n"
+        "  --filter <regex>      Run the benchmarks whose name matches\n"
+        "  --json <file>         Write the results as JSON\n"
+        "  --min-time <s>        Minimum time of a benchmark (default 0.2)\n"
+        "  --full                All the resolutions and the amounts, and the thread scaling at 8K\n"
+        "  --no-opencl           Skip the OpenCL benchmarks\n"
+        "  --cl-device <type>    cpu, gpu or all (default cpu)\n";
+}
+
+int main(int argc, char **argv) {
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else if (arg == "--json" && i + 1 < argc) {
+            options.json_path = argv[++i];
+        } else if (arg == "--min-time" && i + 1 < argc) {
+            options.min_time = std::stod(argv[++i]);
+        } else if (arg == "--full") {
+            options.full = true;
+        } else if (arg == "--no-opencl") {
+            options.use_opencl = false;
+        } else if (arg == "--cl-device" && i + 1 < argc) {
+            std::string type = argv[++i];
+            options.cl_device_type_ = type == "gpu" ? CL_DEVICE_TYPE_GPU :
+                                      type == "all" ? CL_DEVICE_TYPE_ALL : CL_DEVICE_TYPE_CPU;
+        } else {
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    std::vector<Resolution> resolutions = {{"720p", 1280, 720}, {"1080p", 1920, 1080}, {"4K", 3840, 2160},
+                                           {"8K", 7680, 4320}};
+    std::vector<float> amounts = {0.5f};
+    if (options.full) {
+        resolutions = {{"720p", 1280, 720}, {"1080p", 1920, 1080}, {"1440p", 2560, 1440},
+                       {"4K", 3840, 2160}, {"8K", 7680, 4320}};
+        amounts = {0.1f, 0.5f, 0.9f};
+    }
+    std::vector<glm::vec2> centers = {glm::vec2(0), glm::vec2(200, -120)};
+
+    int max_threads = GetCPUThreadNum();
+    std::vector<int> thread_nums;
+    for (int n = 1; n < max_threads; n *= 2)
+        thread_nums.push_back(n);
+    thread_nums.push_back(max_threads);
+
+    BenchmarkRunner runner(options);
+    for (auto &resolution : resolutions) {
+        aut::Size2D image_size(resolution.w, resolution.h);
+        std::size_t pixel_num = static_cast<std::size_t>(resolution.w) * resolution.h;
+        cv::Mat source = MakeSourceImage(resolution.w, resolution.h);
+        cv::Mat image_8u = source.clone();
+        // Without --full, 8K only runs on all the threads, a single thread takes seconds per frame
+        std::vector<int> resolution_thread_nums = thread_nums;
+        if (!options.full && pixel_num > 3840 * 2160)
+            resolution_thread_nums = {max_threads};
+        cv::Mat image_0(source.size(), CV_32FC4);
+        cv::Mat image_1(source.size(), CV_32FC4);
+        PremultKernel(source, image_0);
+
+        // Thread scaling of the passes which don't depend on the parameter
+        for (int threads : resolution_thread_nums) {
+            SetCPUThreadNum(threads);
+            runner.Run(FormatName("PremultKernel", resolution, nullptr, threads), pixel_num,
+                       pixel_num * (4 + 16), threads, [&]() { PremultKernel(source, image_0); });
+            runner.Run(FormatName("UnpremultKernel", resolution, nullptr, threads), pixel_num,
+                       pixel_num * (16 + 4), threads, [&]() { UnpremultKernel(image_0, image_8u); });
+        }
+
+        for (float amount : amounts) {
+            for (auto &center : centers) {
+                for (bool spool_mode : {false, true}) {
+                    // Anti-aliasing off, fixed, adaptive and anisotropic
+                    for (int aa_mode : {0, 1, 2, 3}) {
+                        OpticsCompensationParameter parameter(amount, spool_mode, aa_mode != 0, center);
+                        parameter.aa_adaptive = aa_mode == 2;
+                        parameter.aa_filter = aa_mode == 3 ? aa_anisotropic : aa_supersampling;
+                        const char *aa_names[] = {"aa:0", "aa:1", "aa:adaptive", "aa:anisotropic"};
+                        std::string kernel = std::string(spool_mode ? "SpoolCPUKernel/" : "BarrelCPUKernel/") +
+                                             aa_names[aa_mode];
+                        std::string mode = GetModeName(parameter);
+                        for (int threads : resolution_thread_nums) {
+                            SetCPUThreadNum(threads);
+                            runner.Run(FormatName(kernel, resolution, &parameter, threads), pixel_num,
+                                       pixel_num * 16 * 2, threads, [&]() {
+                                if (spool_mode)
+                                    SpoolCPUKernel(image_0, image_1, image_size, parameter);
+                                else
+                                    BarrelCPUKernel(image_0, image_1, image_size, parameter);
+                            });
+                        }
+
+                        SetCPUThreadNum(0);
+                        runner.Run(FormatName("BuildRemapTable/" + mode, resolution, &parameter, max_threads),
+                                   pixel_num, 0, max_threads, [&]() {
+                            BuildRemapTable(image_size, parameter);
+                        });
+                        auto remap_table = BuildRemapTable(image_size, parameter);
+                        for (int threads : resolution_thread_nums) {
+                            SetCPUThreadNum(threads);
+                            runner.Run(FormatName("FusedCPUKernel/" + mode, resolution, &parameter, threads),
+                                       pixel_num, pixel_num * 4 * 2, threads, [&]() {
+                                // Works in place, the content doesn't change the cost
+                                auto *image_data = reinterpret_cast<aut::PixelRGBA*>(image_8u.data);
+                                if (parameter.aa_filter == aa_anisotropic)
+                                    AnisotropicCPUKernel(image_data, image_size, *remap_table,
+                                                         parameter.GetAAMaxSampling(kDefaultMaxAnisotropy));
+                                else
+                                    FusedCPUKernel(image_data, image_size, *remap_table);
+                            });
+                        }
+                        SetCPUThreadNum(0);
+                        // Packed source rows, the pyramid of the anisotropic filter stays float
+                        if (parameter.aa_filter == aa_anisotropic)
+                            continue;
+                        for (auto format : {intermediate_fixed16, intermediate_half}) {
+                            std::string format_name = format == intermediate_half ? "/half" : "/fixed16";
+                            runner.Run(FormatName("FusedCPUKernel/" + mode + format_name, resolution,
+                                                  &parameter, max_threads),
+                                       pixel_num, pixel_num * 4 * 2, max_threads, [&]() {
+                                auto *image_data = reinterpret_cast<aut::PixelRGBA*>(image_8u.data);
+                                FusedCPUKernel(image_data, image_size, *remap_table,
+                                               cv::Rect(0, 0, image_size.w, image_size.h), format);
+                            });
+                        }
+                    }
+                }
+            }
+        }
+
+        // The inverse of the camera models runs Newton's method for every grid point
+        for (auto &parameter : MakeLensModelParameters()) {
+            std::string mode = GetModeName(parameter);
+            runner.Run(FormatName("BuildRemapTable/" + mode, resolution, &parameter, max_threads),
+                       pixel_num, 0, max_threads, [&]() {
+                BuildRemapTable(image_size, parameter);
+            });
+            auto remap_table = BuildRemapTable(image_size, parameter);
+            runner.Run(FormatName("FusedCPUKernel/" + mode, resolution, &parameter, max_threads),
+                       pixel_num, pixel_num * 4 * 2, max_threads, [&]() {
+                auto *image_data = reinterpret_cast<aut::PixelRGBA*>(image_8u.data);
+                FusedCPUKernel(image_data, image_size, *remap_table);
+            });
+        }
+    }
+
+    std::string cl_device_name;
+    if (options.use_opencl) {
+        OpticsCompensationEngine engine;
+        if (!engine.InitOpenCL(options.cl_device_type_)) {
+            std::cerr << "OpenCL benchmarks skipped : " << engine.GetInitError() << std::endl;
+        } else {
+            OpenCLManager *opencl_manager = engine.GetOpenCLManager();
+            cl_device_name = opencl_manager->GetDeviceManager()->GetDeviceName(0);
+            std::cout << "OpenCL device : " << cl_device_name << std::endl;
+            CLCommandQueueManager *cqman = opencl_manager->GetCommandQueueManager();
+            cl::CommandQueue *queue = cqman->GetCommandQueue();
+            DistortionKernelSet distortion_kernel_set(opencl_manager->GetProgram(), queue);
+            PremultKernelManager premult_kernel_manager(opencl_manager->GetProgram(), queue);
+            UnpremultKernelManager unpremult_kernel_manager(opencl_manager->GetProgram(), queue);
+            CLProgramVariants *program_variants = engine.GetCLProgramVariants();
+
+            for (auto &resolution : resolutions) {
+                std::size_t pixel_num = static_cast<std::size_t>(resolution.w) * resolution.h;
+                cv::Mat source = MakeSourceImage(resolution.w, resolution.h);
+                cl::ImageFormat fmt;
+                fmt.image_channel_data_type = CL_UNORM_INT8;
+                fmt.image_channel_order = CL_BGRA;
+                auto *image_pool = opencl_manager->GetImagePool();
+                PooledImage pooled_image_0(image_pool, resolution.w, resolution.h, fmt);
+                PooledImage pooled_image_1(image_pool, resolution.w, resolution.h, fmt);
+                cl::Image2D &image_0 = *pooled_image_0;
+                cl::Image2D &image_1 = *pooled_image_1;
+
+                runner.Run(FormatName("CLUpload", resolution, nullptr, 0), pixel_num, pixel_num * 4, 0, [&]() {
+                    cqman->UploadImage2D(image_0, resolution.w, resolution.h, 4, source.data);
+                    queue->finish();
+                });
+                runner.Run(FormatName("CLDownload", resolution, nullptr, 0), pixel_num, pixel_num * 4, 0, [&]() {
+                    cqman->DownloadImage2D(image_0, resolution.w, resolution.h, 4, source.data);
+                });
+                runner.Run(FormatName("CLPremult", resolution, nullptr, 0), pixel_num, pixel_num * 8, 0, [&]() {
+                    premult_kernel_manager.CallPremult(image_0, image_1, resolution.w, resolution.h);
+                    queue->finish();
+                });
+                runner.Run(FormatName("CLUnpremult", resolution, nullptr, 0), pixel_num, pixel_num * 8, 0, [&]() {
+                    unpremult_kernel_manager.CallUnpremult(image_0, image_1, resolution.w, resolution.h);
+                    queue->finish();
+                });
+                // 16 bit intermediates of the unfused chain
+                for (cl_channel_type data_type : {CL_UNORM_INT16, CL_HALF_FLOAT}) {
+                    cl::ImageFormat intermediate_fmt;
+                    intermediate_fmt.image_channel_data_type = data_type;
+                    intermediate_fmt.image_channel_order = CL_RGBA;
+                    PooledImage pooled_intermediate(image_pool, resolution.w, resolution.h,
+                                                    intermediate_fmt);
+                    cl::Image2D &intermediate = *pooled_intermediate;
+                    std::string format_name = data_type == CL_HALF_FLOAT ? "/half" : "/unorm16";
+                    runner.Run(FormatName("CLPremult" + format_name, resolution, nullptr, 0), pixel_num,
+                               pixel_num * 12, 0, [&]() {
+                        premult_kernel_manager.CallPremult(image_0, intermediate, resolution.w, resolution.h);
+                        queue->finish();
+                    });
+                    runner.Run(FormatName("CLUnpremult" + format_name, resolution, nullptr, 0), pixel_num,
+                               pixel_num * 12, 0, [&]() {
+                        unpremult_kernel_manager.CallUnpremult(intermediate, image_1, resolution.w, resolution.h);
+                        queue->finish();
+                    });
+                }
+
+                for (float amount : amounts) {
+                    for (auto &center : centers) {
+                        for (bool spool_mode : {false, true}) {
+                            for (int aa_mode : {0, 1, 2, 3}) {
+                                OpticsCompensationParameter parameter(amount, spool_mode, aa_mode != 0, center);
+                                parameter.aa_adaptive = aa_mode == 2;
+                                parameter.aa_filter = aa_mode == 3 ? aa_anisotropic : aa_supersampling;
+                                std::string mode = GetModeName(parameter);
+                                for (bool fused : {false, true}) {
+                                    distortion_kernel_set.SetFused(fused);
+                                    // The repeated parameter would switch to the remap kernels
+                                    distortion_kernel_set.SetRemapCoords(false);
+                                    std::string kernel = std::string(fused ? "CLFused/" : "CLDistortion/") + mode;
+                                    runner.Run(FormatName(kernel, resolution, &parameter, 0), pixel_num,
+                                               pixel_num * 8, 0, [&]() {
+                                        distortion_kernel_set.CallKernel(image_0, image_1, resolution.w,
+                                                                         resolution.h, parameter);
+                                        queue->finish();
+                                    });
+                                    // The same kernel specialized for the fixed sampling and the whole
+                                    // work-groups, with the variant built before the runs
+                                    if (fused && program_variants && !parameter.aa_adaptive &&
+                                        parameter.aa_filter == aa_supersampling) {
+                                        distortion_kernel_set.SetProgramVariants(program_variants);
+                                        distortion_kernel_set.CallKernel(image_0, image_1, resolution.w,
+                                                                         resolution.h, parameter);
+                                        queue->finish();
+                                        program_variants->WaitBuilds();
+                                        runner.Run(FormatName("CLFusedVariant/" + mode, resolution, &parameter, 0),
+                                                   pixel_num, pixel_num * 8, 0, [&]() {
+                                            distortion_kernel_set.CallKernel(image_0, image_1, resolution.w,
+                                                                             resolution.h, parameter);
+                                            queue->finish();
+                                        });
+                                        distortion_kernel_set.SetProgramVariants(nullptr);
+                                    }
+                                    // Coords built once before the runs, as for a static parameter
+                                    if (parameter.aa_filter == aa_anisotropic)
+                                        continue;
+                                    distortion_kernel_set.SetRemapCoords(true);
+                                    distortion_kernel_set.GetRemapKernelManager()->UpdateCoords(
+                                        resolution.w, resolution.h, parameter);
+                                    kernel = std::string(fused ? "CLFusedRemap/" : "CLRemap/") + mode;
+                                    runner.Run(FormatName(kernel, resolution, &parameter, 0), pixel_num,
+                                               pixel_num * (8 + 8), 0, [&]() {
+                                        distortion_kernel_set.CallKernel(image_0, image_1, resolution.w,
+                                                                         resolution.h, parameter);
+                                        queue->finish();
+                                    });
+                                }
+                            }
+                        }
+                    }
+                }
+                for (auto &parameter : MakeLensModelParameters()) {
+                    std::string mode = GetModeName(parameter);
+                    distortion_kernel_set.SetFused(true);
+                    distortion_kernel_set.SetRemapCoords(false);
+                    runner.Run(FormatName("CLFused/" + mode, resolution, &parameter, 0), pixel_num,
+                               pixel_num * 8, 0, [&]() {
+                        distortion_kernel_set.CallKernel(image_0, image_1, resolution.w,
+                                                         resolution.h, parameter);
+                        queue->finish();
+                    });
+                    distortion_kernel_set.SetRemapCoords(true);
+                    distortion_kernel_set.GetRemapKernelManager()->UpdateCoords(resolution.w, resolution.h,
+                                                                                parameter);
+                    runner.Run(FormatName("CLFusedRemap/" + mode, resolution, &parameter, 0), pixel_num,
+                               pixel_num * (8 + 8), 0, [&]() {
+                        distortion_kernel_set.CallKernel(image_0, image_1, resolution.w,
+                                                         resolution.h, parameter);
+                        queue->finish();
+                    });
+                }
+                pooled_image_0.Reset();
+                pooled_image_1.Reset();
+                image_pool->Clear();
+            }
+        }
+    }
+
+    // Startup of OpenCL building the program from the source, and with the program cache
+    // empty (the build and the store) and filled (only the load of the binary)
+    if (options.use_opencl && !cl_device_name.empty()) {
+        std::string cache_dir =
+            (std::filesystem::temp_directory_path() / "OpticsCompensation_bench_cl_cache").string();
+        auto init_opencl = [&](const std::string &directory) {
+            OpticsCompensationEngine engine;
+            engine.SetCLProgramCacheDirectory(directory);
+            engine.InitOpenCL(options.cl_device_type_);
+        };
+        std::error_code error;
+        runner.Run("CLInit/NoCache", 1, 0, 0, [&]() { init_opencl(std::string()); });
+        runner.Run("CLInit/ColdCache", 1, 0, 0, [&]() {
+            std::filesystem::remove_all(cache_dir, error);
+            init_opencl(cache_dir);
+        });
+        runner.Run("CLInit/WarmCache", 1, 0, 0, [&]() { init_opencl(cache_dir); });
+        std::filesystem::remove_all(cache_dir, error);
+    }
+
+    // Whole frames on one device against the bands on every device and the CPU,
+    // and on the device and the CPU balanced frame to frame
+    if (options.use_opencl) {
+        OpticsCompensationEngine single_engine;
+        OpticsCompensationEngine multi_engine;
+        OpticsCompensationEngine hybrid_engine;
+        bool hybrid = hybrid_engine.InitHybrid(options.cl_device_type_);
+        if (!hybrid)
+            std::cerr << "Hybrid benchmarks skipped : " << hybrid_engine.GetInitError() << std::endl;
+        if (!single_engine.InitOpenCL(options.cl_device_type_) || !multi_engine.InitMultiDevice()) {
+            std::cerr << "Multi-device benchmarks skipped : " << single_engine.GetInitError()
+                      << multi_engine.GetInitError() << std::endl;
+        } else {
+            auto *executor = multi_engine.GetMultiDeviceExecutor();
+            for (int i = 0; i < executor->GetWorkerNum(); i++) {
+                auto &stats = executor->GetWorkerStats(i);
+                std::cout << "Worker " << stats.name << " : share " << stats.share << std::endl;
+            }
+            for (auto &resolution : resolutions) {
+                std::size_t pixel_num = static_cast<std::size_t>(resolution.w) * resolution.h;
+                aut::Size2D image_size(resolution.w, resolution.h);
+                cv::Mat source = MakeSourceImage(resolution.w, resolution.h);
+                cv::Mat frame = source.clone();
+                auto *image_data = reinterpret_cast<aut::PixelRGBA*>(frame.data);
+                for (float amount : amounts) {
+                    for (bool spool_mode : {false, true}) {
+                        for (bool anti_aliasing : {false, true}) {
+                            OpticsCompensationParameter parameter(amount, spool_mode, anti_aliasing, glm::vec2(0));
+                            std::string mode = GetModeName(parameter);
+                            // The frame is restored every run, both include the copy
+                            runner.Run(FormatName("CLFrame/" + mode, resolution, &parameter, 0), pixel_num,
+                                       pixel_num * 8, 0, [&]() {
+                                source.copyTo(frame);
+                                single_engine.Process(image_data, image_size, parameter);
+                            });
+                            runner.Run(FormatName("MultiDevice/" + mode, resolution, &parameter, max_threads),
+                                       pixel_num, pixel_num * 8, max_threads, [&]() {
+                                source.copyTo(frame);
+                                multi_engine.Process(image_data, image_size, parameter);
+                            });
+                            if (!hybrid)
+                                continue;
+                            runner.Run(FormatName("Hybrid/" + mode, resolution, &parameter, max_threads),
+                                       pixel_num, pixel_num * 8, max_threads, [&]() {
+                                source.copyTo(frame);
+                                hybrid_engine.Process(image_data, image_size, parameter);
+                            });
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (!options.json_path.empty())
+        runner.WriteJSON(options.json_path, cl_device_name);
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,481 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "cl_pipeline.h"
+#include "cpu_scheduler.h"
+#include "multi_device.h"
+#include "optics_compensation.h"
+#include "parameter.h"
+
+namespace fs = std::filesystem;
+
+// Values of the script for a frame, amount is in percent
+struct FrameParameter {
+    double amount = 0;
+    bool anti_aliasing = false;
+    glm::vec2 center_pos = glm::vec2(0);
+};
+
+struct CommandLineOptions {
+    fs::path input_dir;
+    fs::path output_dir;
+    FrameParameter parameter;
+    int aa_max_sampling = 0;
+    bool aa_adaptive = false;
+    float aa_quality = 1;
+    AAFilter aa_filter = aa_supersampling;
+    LensModel lens_model = lens_tan;
+    LensCoefficients lens = {0, 0, 0, 0, 0, 0, 0, false};
+    fs::path parameter_file;
+    bool use_opencl = true;
+    bool multi_device = false;
+    bool hybrid = false;
+    // Empty uses the default directory of the program binaries
+    std::string cl_cache_dir;
+    bool cl_cache = true;
+    bool cl_variants = true;
+    int thread_num = 0;
+    int job_num = 0;
+    int tile_size = 0;
+    IntermediateFormat intermediate_format = intermediate_float;
+    fs::path trace_file;
+    bool profile = false;
+};
+
+struct Frame {
+    fs::path path;
+    std::size_t index = 0;
+    cv::Mat image;
+    // Depth of the file, float images are converted back on save
+    int file_depth = CV_8U;
+};
+
+static void PrintUsage() {
+    std::cout <<
+        "Usage : OpticsCompensation_cli [options] <input_dir> <output_dir>\n"
+        "Apply the lens distortion to every PNG / EXR frame of input_dir.\n"
+        "\n"
+        "  -a, --amount <percent>   Amount in percent, negative for spool (default 0)\n"
+        "  --aa                     Enable anti-aliasing\n"
+        "  --aa-samples <n>         Maximum samples per axis of the anti-aliasing\n"
+        "                           (default : 2 on the CPU, 4 on OpenCL)\n"
+        "  --aa-adaptive [quality]  Adapt the samples to the distortion of each pixel,\n"
+        "                           quality is the samples per source pixel (default 1)\n"
+        "  --aa-filter <filter>     supersampling (default) or anisotropic, which takes\n"
+        "                           up to --aa-samples taps of a mip pyramid (default 8)\n"
+        "  --lens <model>           tan (default, uses --amount), brown-conrady or fisheye\n"
+        "  --focal <px>             Focal length of the lens model\n"
+        "                           (default : half the diagonal of the frame)\n"
+        "  --k1, --k2, --k3 <k>     Radial coefficients of the lens model\n"
+        "  --k4 <k>                 Fourth radial coefficient of fisheye\n"
+        "  --p1, --p2 <p>           Tangential coefficients of brown-conrady\n"
+        "  --undistort              Remove the distortion of the lens model from the frames\n"
+        "  -x, --center-x <px>      Offset of the center (default 0)\n"
+        "  -y, --center-y <px>      Offset of the center (default 0)\n"
+        "  -p, --params <file>      Per-frame parameters, lines of\n"
+        "                           \"frame amount [aa center_x center_y]\".\n"
+        "                           The values hold until the next listed frame.\n"
+        "  --cpu                    Don't use OpenCL\n"
+        "  --multi-device           Spread the frames over every OpenCL device and the CPU\n"
+        "  --hybrid                 Share every frame between the OpenCL GPU and the CPU\n"
+        "  --cl-cache <dir>         Directory of the built OpenCL programs\n"
+        "                           (default : the cache directory of the user)\n"
+        "  --no-cl-cache            Build the OpenCL program from the source\n"
+        "  --no-cl-variants         Only run the generic OpenCL kernels\n"
+        "  -t, --threads <n>        Threads of the CPU kernels, 0 uses all the cores\n"
+        "  -j, --jobs <n>           Frames decoded and encoded at the same time\n"
+        "                           (default : number of cores)\n"
+        "  --tile <px>              Process the frames in tiles of px x px on the CPU,\n"
+        "                           holding only a tile as floats (for huge frames)\n"
+        "  --intermediate <format>  float (default), fixed16 or half, format of the\n"
+        "                           premultiplied 8 bit rows on the CPU. fixed16 gives\n"
+        "                           the same result with half the memory traffic.\n"
+        "  --profile                Print the timings of the stages at the end\n"
+        "  --trace <file>           Write the stages as a Chrome trace JSON (implies --profile)\n"
+        "  -h, --help               Show this help\n";
+}
+
+static bool ParseCommandLine(int argc, char **argv, CommandLineOptions *options) {
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto next_value = [&](const char *name) -> std::string {
+            if (i + 1 >= argc)
+                throw std::invalid_argument(std::string("Missing value of ") + name);
+            return argv[++i];
+        };
+        if (arg == "-h" || arg == "--help") {
+            return false;
+        } else if (arg == "-a" || arg == "--amount") {
+            options->parameter.amount = std::stod(next_value("--amount"));
+        } else if (arg == "--aa") {
+            options->parameter.anti_aliasing = true;
+        } else if (arg == "--aa-samples") {
+            options->aa_max_sampling = std::stoi(next_value("--aa-samples"));
+        } else if (arg == "--aa-adaptive") {
+            options->aa_adaptive = true;
+            // Optional quality
+            if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0])))
+                options->aa_quality = std::stof(argv[++i]);
+        } else if (arg == "--aa-filter") {
+            std::string filter = next_value("--aa-filter");
+            if (filter == "anisotropic")
+                options->aa_filter = aa_anisotropic;
+            else if (filter == "supersampling")
+                options->aa_filter = aa_supersampling;
+            else
+                throw std::invalid_argument("Unknown filter " + filter);
+        } else if (arg == "--lens") {
+            std::string model = next_value("--lens");
+            if (model == "tan")
+                options->lens_model = lens_tan;
+            else if (model == "brown-conrady")
+                options->lens_model = lens_brown_conrady;
+            else if (model == "fisheye")
+                options->lens_model = lens_fisheye;
+            else
+                throw std::invalid_argument("Unknown lens model " + model);
+        } else if (arg == "--focal") {
+            options->lens.focal_length = std::stof(next_value("--focal"));
+        } else if (arg == "--k1") {
+            options->lens.k1 = std::stof(next_value("--k1"));
+        } else if (arg == "--k2") {
+            options->lens.k2 = std::stof(next_value("--k2"));
+        } else if (arg == "--k3") {
+            options->lens.k3 = std::stof(next_value("--k3"));
+        } else if (arg == "--k4") {
+            options->lens.k4 = std::stof(next_value("--k4"));
+        } else if (arg == "--p1") {
+            options->lens.p1 = std::stof(next_value("--p1"));
+        } else if (arg == "--p2") {
+            options->lens.p2 = std::stof(next_value("--p2"));
+        } else if (arg == "--undistort") {
+            options->lens.undistort = true;
+        } else if (arg == "-x" || arg == "--center-x") {
+            options->parameter.center_pos.x = std::stof(next_value("--center-x"));
+        } else if (arg == "-y" || arg == "--center-y") {
+            options->parameter.center_pos.y = std::stof(next_value("--center-y"));
+        } else if (arg == "-p" || arg == "--params") {
+            options->parameter_file = next_value("--params");
+        } else if (arg == "--cpu") {
+            options->use_opencl = false;
+        } else if (arg == "--multi-device") {
+            options->multi_device = true;
+        } else if (arg == "--hybrid") {
+            options->hybrid = true;
+        } else if (arg == "--cl-cache") {
+            options->cl_cache_dir = next_value("--cl-cache");
+        } else if (arg == "--no-cl-cache") {
+            options->cl_cache = false;
+        } else if (arg == "--no-cl-variants") {
+            options->cl_variants = false;
+        } else if (arg == "-t" || arg == "--threads") {
+            options->thread_num = std::stoi(next_value("--threads"));
+        } else if (arg == "-j" || arg == "--jobs") {
+            options->job_num = std::stoi(next_value("--jobs"));
+        } else if (arg == "--tile") {
+            options->tile_size = std::stoi(next_value("--tile"));
+        } else if (arg == "--intermediate") {
+            std::string format = next_value("--intermediate");
+            if (format == "float")
+                options->intermediate_format = intermediate_float;
+            else if (format == "fixed16")
+                options->intermediate_format = intermediate_fixed16;
+            else if (format == "half")
+                options->intermediate_format = intermediate_half;
+            else
+                throw std::invalid_argument("Unknown intermediate format " + format);
+        } else if (arg == "--profile") {
+            options->profile = true;
+        } else if (arg == "--trace") {
+            options->trace_file = next_value("--trace");
+            options->profile = true;
+        } else if (!arg.empty() && arg[0] == '-') {
+            throw std::invalid_argument("Unknown option " + arg);
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() != 2)
+        return false;
+
+    options->input_dir = positional[0];
+    options->output_dir = positional[1];
+    if (options->job_num <= 0)
+        options->job_num = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    return true;
+}
+
+// Keyframes of the parameter file, indexed by the frame
+static std::map<std::size_t, FrameParameter> LoadParameterFile(const fs::path &path,
+                                                               const FrameParameter &default_parameter) {
+    std::ifstream file(path);
+    if (!file)
+        throw std::runtime_error("Failed to open " + path.string());
+
+    std::map<std::size_t, FrameParameter> keyframes;
+    std::string line;
+    int line_num = 0;
+    while (std::getline(file, line)) {
+        line_num++;
+        auto comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+        std::istringstream stream(line);
+        std::size_t frame;
+        if (!(stream >> frame))
+            continue;
+
+        FrameParameter parameter = default_parameter;
+        if (!(stream >> parameter.amount))
+            throw std::runtime_error(path.string() + ":" + std::to_string(line_num) + " : missing amount");
+        int anti_aliasing;
+        if (stream >> anti_aliasing) {
+            parameter.anti_aliasing = anti_aliasing != 0;
+            stream >> parameter.center_pos.x >> parameter.center_pos.y;
+        }
+        keyframes[frame] = parameter;
+    }
+    return keyframes;
+}
+
+static FrameParameter GetFrameParameter(const std::map<std::size_t, FrameParameter> &keyframes,
+                                        std::size_t frame, const FrameParameter &default_parameter) {
+    // Last keyframe at or before the frame
+    auto it = keyframes.upper_bound(frame);
+    if (it == keyframes.begin())
+        return default_parameter;
+    return std::prev(it)->second;
+}
+
+static std::vector<fs::path> ListFrames(const fs::path &input_dir) {
+    std::vector<fs::path> frames;
+    for (auto &entry : fs::directory_iterator(input_dir)) {
+        if (!entry.is_regular_file())
+            continue;
+        std::string extension = entry.path().extension().string();
+        std::transform(extension.begin(), extension.end(), extension.begin(),
+                       [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        if (extension == ".png" || extension == ".exr")
+            frames.push_back(entry.path());
+    }
+    std::sort(frames.begin(), frames.end());
+    return frames;
+}
+
+// Read a frame as straight alpha BGRA, 8 bit images stay 8 bit and the others become float
+static Frame LoadFrame(const fs::path &path, std::size_t index) {
+    Frame frame;
+    frame.path = path;
+    frame.index = index;
+    cv::Mat image = cv::imread(path.string(), cv::IMREAD_UNCHANGED);
+    if (image.empty())
+        throw std::runtime_error("Failed to read " + path.string());
+
+    frame.file_depth = image.depth();
+    if (image.channels() == 1)
+        cv::cvtColor(image, image, cv::COLOR_GRAY2BGRA);
+    else if (image.channels() == 3)
+        cv::cvtColor(image, image, cv::COLOR_BGR2BGRA);
+
+    if (frame.file_depth == CV_8U)
+        frame.image = image;
+    else if (frame.file_depth == CV_16U)
+        image.convertTo(frame.image, CV_32FC4, 1.0 / 65535);
+    else
+        image.convertTo(frame.image, CV_32FC4);
+    return frame;
+}
+
+static void SaveFrame(const Frame &frame, const fs::path &output_dir) {
+    cv::Mat image = frame.image;
+    if (frame.file_depth == CV_16U)
+        frame.image.convertTo(image, CV_16UC4, 65535);
+    fs::path path = output_dir / frame.path.filename();
+    if (!cv::imwrite(path.string(), image))
+        throw std::runtime_error("Failed to write " + path.string());
+}
+
+int main(int argc, char **argv) {
+    CommandLineOptions options;
+    try {
+        if (!ParseCommandLine(argc, argv, &options)) {
+            PrintUsage();
+            return 1;
+        }
+    } catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        PrintUsage();
+        return 1;
+    }
+
+    try {
+        std::map<std::size_t, FrameParameter> keyframes;
+        if (!options.parameter_file.empty())
+            keyframes = LoadParameterFile(options.parameter_file, options.parameter);
+
+        std::vector<fs::path> frame_paths = ListFrames(options.input_dir);
+        fs::create_directories(options.output_dir);
+        SetCPUThreadNum(options.thread_num);
+
+        OpticsCompensationEngine engine;
+        engine.SetIntermediateFormat(options.intermediate_format);
+        if (!options.cl_cache)
+            engine.SetCLProgramCacheDirectory(std::string());
+        else if (!options.cl_cache_dir.empty())
+            engine.SetCLProgramCacheDirectory(options.cl_cache_dir);
+        engine.SetCLKernelVariants(options.cl_variants);
+        // Multi-device hands whole frames to the workers, hybrid shares every frame
+        // through engine.Process()
+        MultiDeviceExecutor *executor = nullptr;
+        if (options.use_opencl && (options.multi_device || options.hybrid)) {
+            if (options.hybrid ? engine.InitHybrid() : engine.InitMultiDevice()) {
+                auto *engine_executor = engine.GetMultiDeviceExecutor();
+                for (int i = 0; i < engine_executor->GetWorkerNum(); i++) {
+                    auto &stats = engine_executor->GetWorkerStats(i);
+                    std::cout << stats.name << " : " << stats.throughput / 1e6 << " Mpx/s, "
+                              << stats.share * 100 << " % of the frames" << std::endl;
+                }
+                if (!options.hybrid)
+                    executor = engine_executor;
+            } else {
+                std::cerr << "Multi-device is not available : " << engine.GetInitError() << std::endl;
+            }
+        }
+        if (options.use_opencl && !engine.GetMultiDeviceExecutor()) {
+            auto init_start = std::chrono::steady_clock::now();
+            if (engine.InitOpenCL()) {
+                std::chrono::duration<double, std::milli> init_time = std::chrono::steady_clock::now() - init_start;
+                bool loaded = engine.GetOpenCLManager()->GetProgramManager()->IsLoadedFromCache();
+                std::cout << "OpenCL init : " << init_time.count() << " ms, program "
+                          << (loaded ? "loaded from the cache" : "built from the source") << std::endl;
+            } else {
+                std::cerr << "OpenCL is not available, using the CPU : " << engine.GetInitError() << std::endl;
+            }
+        }
+
+        Profiler *profiler = engine.GetProfiler();
+        profiler->SetEnabled(options.profile);
+
+        // 8 bit frames go through the asynchronous pipeline when OpenCL is enabled,
+        // or are handed out whole to the devices and the CPU with multi-device
+        CLFramePipeline *pipeline = nullptr;
+        // The pipeline takes the kernel settings of the engine, so it renders like Process()
+        if (engine.IsOpenCLEnabled())
+            pipeline = engine.CreateCLFramePipeline();
+        bool asynchronous = pipeline || executor;
+        auto submit = [&](const aut::PixelRGBA *src, aut::PixelRGBA *dst, const aut::Size2D &image_size,
+                          const OpticsCompensationParameter &parameter) {
+            return executor ? executor->Submit(src, dst, image_size, parameter) :
+                              pipeline->Submit(src, dst, image_size, parameter);
+        };
+        auto wait = [&](std::uint64_t id) {
+            if (executor)
+                executor->Wait(id);
+            else
+                pipeline->Wait(id);
+        };
+        std::size_t depth = static_cast<std::size_t>(executor ? executor->GetDepth() :
+                                                     pipeline ? pipeline->GetDepth() : 0);
+
+        // Decoding and encoding run on their own threads, at most job_num frames each,
+        // so the memory stays bounded whatever the length of the sequence
+        std::size_t job_num = static_cast<std::size_t>(options.job_num);
+        std::deque<std::future<Frame>> loading;
+        std::deque<std::future<void>> saving;
+        std::deque<std::pair<std::uint64_t, Frame>> in_flight;
+        std::size_t next_load = 0;
+
+        auto save = [&](Frame frame) {
+            while (saving.size() >= job_num) {
+                saving.front().get();
+                saving.pop_front();
+            }
+            saving.push_back(std::async(std::launch::async, [&options](Frame frame) {
+                SaveFrame(frame, options.output_dir);
+            }, std::move(frame)));
+        };
+
+        for (std::size_t i = 0; i < frame_paths.size(); i++) {
+            while (next_load < frame_paths.size() && loading.size() < job_num) {
+                loading.push_back(std::async(std::launch::async, LoadFrame,
+                                             frame_paths[next_load], next_load));
+                next_load++;
+            }
+            Frame frame = loading.front().get();
+            loading.pop_front();
+
+            FrameParameter frame_parameter = GetFrameParameter(keyframes, frame.index, options.parameter);
+            OpticsCompensationParameter parameter =
+                MakeOpticsCompensationParameter(frame_parameter.amount, frame_parameter.anti_aliasing,
+                                                frame_parameter.center_pos);
+            parameter.aa_max_sampling = options.aa_max_sampling;
+            parameter.aa_adaptive = options.aa_adaptive;
+            parameter.aa_quality = options.aa_quality;
+            parameter.aa_filter = options.aa_filter;
+            parameter.lens_model = options.lens_model;
+            parameter.lens = options.lens;
+
+            if (options.tile_size > 0) {
+                cv::Mat output;
+                engine.ProcessTiled(frame.image, output, parameter,
+                                    aut::Size2D(options.tile_size, options.tile_size));
+                frame.image = output;
+                save(std::move(frame));
+            } else if (asynchronous && frame.image.type() == CV_8UC4 && frame.image.isContinuous()) {
+                auto *pixels = reinterpret_cast<aut::PixelRGBA*>(frame.image.data);
+                aut::Size2D image_size(frame.image.cols, frame.image.rows);
+                std::uint64_t id = submit(pixels, pixels, image_size, parameter);
+                in_flight.emplace_back(id, std::move(frame));
+                if (in_flight.size() >= depth) {
+                    wait(in_flight.front().first);
+                    save(std::move(in_flight.front().second));
+                    in_flight.pop_front();
+                }
+            } else {
+                engine.Process(frame.image, parameter);
+                save(std::move(frame));
+            }
+        }
+
+        while (!in_flight.empty()) {
+            wait(in_flight.front().first);
+            save(std::move(in_flight.front().second));
+            in_flight.pop_front();
+        }
+        while (!saving.empty()) {
+            saving.front().get();
+            saving.pop_front();
+        }
+        delete pipeline;
+
+        std::cout << frame_paths.size() << " frames processed" << std::endl;
+        if (options.hybrid && engine.GetMultiDeviceExecutor()) {
+            auto *engine_executor = engine.GetMultiDeviceExecutor();
+            for (int i = 0; i < engine_executor->GetWorkerNum(); i++) {
+                auto &stats = engine_executor->GetWorkerStats(i);
+                std::cout << stats.name << " : " << stats.share * 100 << " % of the rows at the end" << std::endl;
+            }
+        }
+        if (options.profile)
+            std::cout << profiler->FormatStats();
+        if (!options.trace_file.empty() && !profiler->WriteChromeTrace(options.trace_file.string()))
+            std::cerr << "Failed to write " << options.trace_file.string() << std::endl;
+    } catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
\ No newline at end of file
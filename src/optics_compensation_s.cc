@@ -1,152 +1,318 @@
+#include <algorithm>
+#include <limits>
 #include <string>
 #include <aut/AUL_Utils.h>
-#include <CL/cl.hpp>
 #include <lua.hpp>
-#include <opencv2/opencv.hpp>
-#include "cl_manager.h"
-#include "cl_kernel.h"
-#include "cpu_kernel.h"
-#include "exception.h"
+#include "cpu_scheduler.h"
+#include "optics_compensation.h"
 #include "out_debug.h"
 #include "parameter.h"
 #include "stopwatch.h"
 
-#define CL_KERNEL_SOURCE(x) #x
-static const std::string kernel_source =
-#include "kernel.cl"
-;
+static OpticsCompensationEngine *engine = nullptr;
 
-static OpenCLManager *opencl_manager = nullptr;
-static SpoolKernelManager *spool_kernel_manager = nullptr;
-static BarrelKernelManager *barrel_kernel_manager = nullptr;
-static MSBarrelKernelManager *ms_barrel_kernel_manager = nullptr;
-static PremultKernelManager *premult_kernel_manager = nullptr;
-static UnpremultKernelManager *unpremult_kernel_manager = nullptr;
+// OpenCL comes up on a thread started at the module load, the result is reported once
+static bool cl_init_pending = false;
 
-bool first_time = true;
-bool use_opencl = false;
+// Anti-aliasing settings of SetAntiAliasingQuality
+static int aa_max_sampling = 0;
+static bool aa_adaptive = false;
+static float aa_quality = 1;
+// Filter of SetAntiAliasingFilter
+static AAFilter aa_filter = aa_supersampling;
+// Camera model of SetLensModel
+static LensModel lens_model = lens_tan;
+static LensCoefficients lens = {0, 0, 0, 0, 0, 0, 0, false};
+
+// The engine lives until the process exits, like the OpenCL objects it owns
+static OpticsCompensationEngine* GetEngine() {
+    if (!engine)
+        engine = new OpticsCompensationEngine();
+    return engine;
+}
 
 int OpticsCompensation(lua_State *L) {
     StopWatch sw(true);
-    OpticsCompensationParameter parameter;
     int arg_num = static_cast<int>(lua_gettop(L));
-    parameter.amount = static_cast<float>(lua_tonumber(L, 1) / 100);
+    bool anti_aliasing = false;
+    glm::vec2 center_pos(0);
     if (arg_num >=2)
-        parameter.anti_aliasing = static_cast<bool>(lua_tointeger(L, 2));
+        anti_aliasing = static_cast<bool>(lua_tointeger(L, 2));
 
     if (arg_num >= 4) {
-        parameter.center_pos.x = static_cast<float>(lua_tonumber(L, 3));
-        parameter.center_pos.y = static_cast<float>(lua_tonumber(L, 4));
+        center_pos.x = static_cast<float>(lua_tonumber(L, 3));
+        center_pos.y = static_cast<float>(lua_tonumber(L, 4));
     }
+    OpticsCompensationParameter parameter =
+        MakeOpticsCompensationParameter(lua_tonumber(L, 1), anti_aliasing, center_pos);
+    parameter.aa_max_sampling = aa_max_sampling;
+    parameter.aa_adaptive = aa_adaptive;
+    parameter.aa_quality = aa_quality;
+    parameter.aa_filter = aa_filter;
+    parameter.lens_model = lens_model;
+    parameter.lens = lens;
 
-    if (!parameter.amount)
+    if (parameter.IsIdentity())
         return 0;
-    if (parameter.amount < 0) {
-        parameter.spool_mode = true;
-        parameter.amount *= -1;
-    }
 
     aut::PixelRGBA *image_data;
     aut::Size2D image_size;
     aut::getpixeldata(L, &image_data, &image_size);
 
-    if (first_time) {
-        try {
-            OutDebugInfo("Init OpenCL");
-            LoadOpenCLDLL();
-            if (!opencl_manager)
-                opencl_manager = new OpenCLManager(kernel_source);
-            cl::Context *context = opencl_manager->GetContext();
-            CLCommandQueueManager *cqman = opencl_manager->GetCommandQueueManager();
-
-            spool_kernel_manager = new SpoolKernelManager(opencl_manager->GetProgram(), cqman->GetCommandQueue());
-            barrel_kernel_manager = new BarrelKernelManager(opencl_manager->GetProgram(), cqman->GetCommandQueue());
-            ms_barrel_kernel_manager = new MSBarrelKernelManager(opencl_manager->GetProgram(), cqman->GetCommandQueue());
-            premult_kernel_manager = new PremultKernelManager(opencl_manager->GetProgram(), cqman->GetCommandQueue());
-            unpremult_kernel_manager = new UnpremultKernelManager(opencl_manager->GetProgram(), cqman->GetCommandQueue());
-
-            CLDeviceManager *dman = opencl_manager->GetDeviceManager();
-            for (unsigned int i = 0; i < dman->GetDeviceNum(); i++) {
-                aut::DebugPrint("Device ", i, " : ", dman->GetDeviceName(i));
-            }
-            OutDebugInfo("Build Log : ",
-                         opencl_manager->GetProgramManager()->GetBuildLog());
-            use_opencl = true;
-            OutDebugInfo("Init OpenCL complete");
-        } catch (InitOpenCLManagerException &e) {
-            aut::DebugPrint(e.message());
-            use_opencl = false;
-        } catch (std::runtime_error &e) {
-            aut::DebugPrint(e.what());
-            use_opencl = false;
-        }
-        first_time = false;
+    // The frames run on the CPU until OpenCL is ready
+    if (cl_init_pending && !GetEngine()->IsOpenCLInitializing()) {
+        if (!GetEngine()->WaitOpenCL())
+            aut::DebugPrint(GetEngine()->GetInitError());
+        cl_init_pending = false;
     }
 
-    if (use_opencl) {
-        auto *context = opencl_manager->GetContext();
-        auto *command_queue_manager = opencl_manager->GetCommandQueueManager();
-        cl::ImageFormat fmt;
-        fmt.image_channel_data_type = CL_UNORM_INT8;
-        fmt.image_channel_order = CL_BGRA;
-        cl::Image2D image_0(*context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, fmt,
-                            image_size.w, image_size.h, 0, image_data);
-        cl::Image2D image_1(*context, CL_MEM_READ_WRITE, fmt,
-                            image_size.w, image_size.h);
-
-        premult_kernel_manager->CallPremult(image_0, image_1, image_size.w, image_size.h);
-
-        if (parameter.spool_mode) {
-            spool_kernel_manager->CallKernel(
-                image_1, image_0, image_size.w, image_size.h, parameter);
-        } else {
-            if (parameter.amount != 1.0) {
-                if (parameter.anti_aliasing) {
-                    ms_barrel_kernel_manager->CallKernel(
-                        image_1, image_0, image_size.w, image_size.h, parameter);
-                } else {
-                    barrel_kernel_manager->CallKernel(
-                        image_1, image_0, image_size.w, image_size.h, parameter);
-                }
-            } else {
-                std::vector<uchar> empty_image(image_size.w * image_size.h * 4, 0);
-                command_queue_manager->WriteImage2D(image_0, true, 0, 0,
-                                                    image_size.w, image_size.h, empty_image.data());            }
-        }
-
-        unpremult_kernel_manager->CallUnpremult(image_0, image_1, image_size.w, image_size.h);
-
-        command_queue_manager->ReadImage2D(image_1, true, 0, 0,
-                                           image_size.w, image_size.h, image_data);
-
-        aut::putpixeldata(L, image_data);
-    } else {
-        cv::Size mat_size(image_size.w, image_size.h);
-        cv::Mat image_inout(mat_size, CV_8UC4, image_data);
-        cv::Mat image_0(mat_size, CV_32FC4, cv::Scalar::all(0));
-        cv::Mat image_1(mat_size, CV_32FC4, cv::Scalar::all(0));
-
-        PremultKernel(image_inout, image_0);
-
-        if (parameter.spool_mode) {
-            SpoolCPUKernel(image_0, image_1, image_size, parameter);
-        } else {
-            BarrelCPUKernel(image_0, image_1, image_size, parameter);
-        }
-
-        UnpremultKernel(image_1, image_inout);
-
-        aut::putpixeldata(L, reinterpret_cast<aut::PixelRGBA*>(image_inout.data));
-    }
+    GetEngine()->Process(image_data, image_size, parameter);
+    aut::putpixeldata(L, image_data);
 
     OutDebugInfo("Total Time : ", sw.Stop(), " ms");
 
     return 0;
 }
 
+// Return the counters of the remap table cache
+int GetRemapCacheStats(lua_State *L) {
+    auto *remap_table_cache = GetEngine()->GetRemapTableCache();
+    lua_pushnumber(L, static_cast<lua_Number>(remap_table_cache->GetHitCount()));
+    lua_pushnumber(L, static_cast<lua_Number>(remap_table_cache->GetMissCount()));
+    lua_pushnumber(L, static_cast<lua_Number>(remap_table_cache->GetEvictionCount()));
+    lua_pushnumber(L, remap_table_cache->GetUsedSize() / (1024.0 * 1024.0));
+    lua_pushinteger(L, static_cast<lua_Integer>(remap_table_cache->GetTableNum()));
+    return 5;
+}
+
+// Set the memory budget of the remap table cache in MB
+int SetRemapCacheBudget(lua_State *L) {
+    lua_Number budget_mb = lua_tonumber(L, 1);
+    if (budget_mb < 0)
+        budget_mb = 0;
+    // Out of the range of std::size_t the cast is undefined, SetBudget() clamps the bytes anyway
+    budget_mb = std::min(budget_mb, static_cast<lua_Number>(std::numeric_limits<std::size_t>::max() >> 20));
+    GetEngine()->GetRemapTableCache()->SetBudget(static_cast<std::size_t>(budget_mb));
+    return 0;
+}
+
+// Return the occupancy of the OpenCL image pool
+int GetCLImagePoolStats(lua_State *L) {
+    auto *opencl_manager = GetEngine()->GetOpenCLManager();
+    if (!opencl_manager) {
+        lua_pushinteger(L, 0);
+        lua_pushinteger(L, 0);
+        lua_pushnumber(L, 0);
+        lua_pushinteger(L, 0);
+        return 4;
+    }
+    auto *image_pool = opencl_manager->GetImagePool();
+    lua_pushinteger(L, static_cast<lua_Integer>(image_pool->GetImageNum()));
+    lua_pushinteger(L, static_cast<lua_Integer>(image_pool->GetUsedImageNum()));
+    lua_pushnumber(L, image_pool->GetByteSize() / (1024.0 * 1024.0));
+    lua_pushinteger(L, static_cast<lua_Integer>(image_pool->GetCreatedCount()));
+    return 4;
+}
+
+// Set how the pixels are transferred to the OpenCL device
+// (0 : auto, 1 : copy, 2 : map, 3 : pinned staging buffer)
+int SetCLTransferMode(lua_State *L) {
+    int mode = static_cast<int>(lua_tointeger(L, 1));
+    if (mode < CLCommandQueueManager::transfer_auto || mode > CLCommandQueueManager::transfer_pinned)
+        mode = CLCommandQueueManager::transfer_auto;
+    GetEngine()->SetCLTransferMode(static_cast<CLCommandQueueManager::TransferMode>(mode));
+    return 0;
+}
+
+// Set the directory of the OpenCL program binaries before the first frame.
+// An empty string builds the program every time, nil goes back to the default directory.
+int SetCLProgramCache(lua_State *L) {
+    const char *directory = lua_tostring(L, 1);
+    if (lua_isnoneornil(L, 1))
+        GetEngine()->SetCLProgramCacheDirectory(GetDefaultCLProgramCacheDirectory());
+    else
+        GetEngine()->SetCLProgramCacheDirectory(directory ? directory : "");
+    return 0;
+}
+
+// Return whether the OpenCL program came from the cache, and the counters of the cache
+int GetCLProgramCacheStats(lua_State *L) {
+    auto *program_cache = GetEngine()->GetCLProgramCache();
+    auto *opencl_manager = GetEngine()->GetOpenCLManager();
+    lua_pushboolean(L, opencl_manager && opencl_manager->GetProgramManager()->IsLoadedFromCache());
+    lua_pushinteger(L, program_cache ? static_cast<lua_Integer>(program_cache->GetHitCount()) : 0);
+    lua_pushinteger(L, program_cache ? static_cast<lua_Integer>(program_cache->GetMissCount()) : 0);
+    return 3;
+}
+
+// Switch between the fused OpenCL kernels and the Premult -> distortion -> Unpremult chain
+int SetCLFusedKernel(lua_State *L) {
+    GetEngine()->SetCLFusedKernel(lua_toboolean(L, 1) != 0);
+    return 0;
+}
+
+// Switch to the OpenCL kernels specialized for the anti-aliasing and the frame size once built
+int SetCLKernelVariants(lua_State *L) {
+    GetEngine()->SetCLKernelVariants(lua_toboolean(L, 1) != 0);
+    return 0;
+}
+
+// Split the frames across every OpenCL device and the CPU kernels,
+// or go back to the single device. The second argument leaves the CPU out when false.
+int SetMultiDevice(lua_State *L) {
+    if (!lua_toboolean(L, 1)) {
+        GetEngine()->ReleaseMultiDevice();
+        return 0;
+    }
+    bool use_cpu = lua_gettop(L) < 2 || lua_toboolean(L, 2) != 0;
+    if (!GetEngine()->InitMultiDevice(use_cpu))
+        aut::DebugPrint(GetEngine()->GetInitError());
+    return 0;
+}
+
+// Share every frame between the OpenCL device and the CPU kernels,
+// or go back to the single device
+int SetHybrid(lua_State *L) {
+    if (!lua_toboolean(L, 1)) {
+        GetEngine()->ReleaseMultiDevice();
+        return 0;
+    }
+    if (!GetEngine()->InitHybrid())
+        aut::DebugPrint(GetEngine()->GetInitError());
+    return 0;
+}
+
+// Keep the source coords on the device while the parameter doesn't change
+int SetCLRemapCoords(lua_State *L) {
+    GetEngine()->SetCLRemapCoords(lua_toboolean(L, 1) != 0);
+    return 0;
+}
+
+// Set the format of the premultiplied intermediates,
+// 0 : float (8 bit images on OpenCL as before), 1 : 16 bit fixed point, 2 : half float
+int SetIntermediateFormat(lua_State *L) {
+    int format = static_cast<int>(lua_tointeger(L, 1));
+    if (format < intermediate_float || format > intermediate_half)
+        format = intermediate_float;
+    GetEngine()->SetIntermediateFormat(static_cast<IntermediateFormat>(format));
+    return 0;
+}
+
+// Turn the per-stage profiler on or off, the collected timings are kept
+int SetProfiling(lua_State *L) {
+    GetEngine()->GetProfiler()->SetEnabled(lua_toboolean(L, 1) != 0);
+    return 0;
+}
+
+// Return the timings of the stages as an array of
+// {key, stage, clock, count, mean, p50, p99, max}, durations in ms
+int GetProfileStats(lua_State *L) {
+    auto stats = GetEngine()->GetProfiler()->GetStats();
+    lua_createtable(L, static_cast<int>(stats.size()), 0);
+    for (std::size_t i = 0; i < stats.size(); i++) {
+        auto &stage_stats = stats[i];
+        lua_createtable(L, 0, 8);
+        lua_pushstring(L, stage_stats.key.c_str());
+        lua_setfield(L, -2, "key");
+        lua_pushstring(L, Profiler::GetStageName(stage_stats.stage));
+        lua_setfield(L, -2, "stage");
+        lua_pushstring(L, stage_stats.device ? "device" : "host");
+        lua_setfield(L, -2, "clock");
+        lua_pushnumber(L, static_cast<lua_Number>(stage_stats.count));
+        lua_setfield(L, -2, "count");
+        lua_pushnumber(L, stage_stats.mean_ns * 1e-6);
+        lua_setfield(L, -2, "mean");
+        lua_pushnumber(L, stage_stats.p50_ns * 1e-6);
+        lua_setfield(L, -2, "p50");
+        lua_pushnumber(L, stage_stats.p99_ns * 1e-6);
+        lua_setfield(L, -2, "p99");
+        lua_pushnumber(L, stage_stats.max_ns * 1e-6);
+        lua_setfield(L, -2, "max");
+        lua_rawseti(L, -2, static_cast<int>(i + 1));
+    }
+    return 1;
+}
+
+// Write the recent stages as a Chrome trace JSON, return false if the file couldn't be written
+int WriteProfileTrace(lua_State *L) {
+    const char *path = lua_tostring(L, 1);
+    lua_pushboolean(L, path && GetEngine()->GetProfiler()->WriteChromeTrace(path));
+    return 1;
+}
+
+// Discard the collected timings
+int ResetProfile(lua_State *L) {
+    GetEngine()->GetProfiler()->Reset();
+    return 0;
+}
+
+// Set the maximum samples per axis of the anti-aliasing (0 : default of the backend),
+// whether the samples adapt to the distortion of each pixel, and the samples per
+// source pixel in adaptive mode
+int SetAntiAliasingQuality(lua_State *L) {
+    int max_sampling = static_cast<int>(lua_tointeger(L, 1));
+    aa_max_sampling = max_sampling < 0 ? 0 : max_sampling > kMaxAASampling ? kMaxAASampling : max_sampling;
+    aa_adaptive = lua_toboolean(L, 2) != 0;
+    if (lua_gettop(L) >= 3 && lua_tonumber(L, 3) > 0)
+        aa_quality = static_cast<float>(lua_tonumber(L, 3));
+    return 0;
+}
+
+// Set the filter of the anti-aliasing, 0 : supersampling, 1 : anisotropic on a mip pyramid
+int SetAntiAliasingFilter(lua_State *L) {
+    aa_filter = lua_tointeger(L, 1) == 1 ? aa_anisotropic : aa_supersampling;
+    return 0;
+}
+
+// Set the lens, 0 : tan of amount, 1 : Brown-Conrady, 2 : fisheye,
+// with the focal length in pixels (0 : half the diagonal), k1 to k4, p1, p2,
+// and whether to remove the distortion instead of applying it
+int SetLensModel(lua_State *L) {
+    int model = static_cast<int>(lua_tointeger(L, 1));
+    lens_model = model == 1 ? lens_brown_conrady : model == 2 ? lens_fisheye : lens_tan;
+    auto get_number = [L](int index) {
+        return lua_gettop(L) >= index ? static_cast<float>(lua_tonumber(L, index)) : 0.f;
+    };
+    lens.focal_length = std::max(get_number(2), 0.f);
+    lens.k1 = get_number(3);
+    lens.k2 = get_number(4);
+    lens.k3 = get_number(5);
+    lens.k4 = get_number(6);
+    lens.p1 = get_number(7);
+    lens.p2 = get_number(8);
+    lens.undistort = lua_toboolean(L, 9) != 0;
+    return 0;
+}
+
+// Set the number of threads of the CPU kernels, 0 uses all the cores
+int SetCPUThreadNum(lua_State *L) {
+    SetCPUThreadNum(static_cast<int>(lua_tointeger(L, 1)));
+    return 0;
+}
+
 // Lua側に登録する関数
 static luaL_Reg optics_compensation[] = {
 {"OpticsCompensation", OpticsCompensation},
+{"GetRemapCacheStats", GetRemapCacheStats},
+{"SetRemapCacheBudget", SetRemapCacheBudget},
+{"SetCPUThreadNum", SetCPUThreadNum},
+{"GetCLImagePoolStats", GetCLImagePoolStats},
+{"SetCLTransferMode", SetCLTransferMode},
+{"SetCLProgramCache", SetCLProgramCache},
+{"GetCLProgramCacheStats", GetCLProgramCacheStats},
+{"SetCLFusedKernel", SetCLFusedKernel},
+{"SetCLKernelVariants", SetCLKernelVariants},
+{"SetCLRemapCoords", SetCLRemapCoords},
+{"SetMultiDevice", SetMultiDevice},
+{"SetHybrid", SetHybrid},
+{"SetIntermediateFormat", SetIntermediateFormat},
+{"SetAntiAliasingQuality", SetAntiAliasingQuality},
+{"SetAntiAliasingFilter", SetAntiAliasingFilter},
+{"SetLensModel", SetLensModel},
+{"SetProfiling", SetProfiling},
+{"GetProfileStats", GetProfileStats},
+{"WriteProfileTrace", WriteProfileTrace},
+{"ResetProfile", ResetProfile},
 {nullptr, nullptr}
 };
 
@@ -154,6 +320,10 @@ static luaL_Reg optics_compensation[] = {
 extern "C" {
 __declspec(dllexport) int luaopen_OpticsCompensation_s(lua_State *L) {
     luaL_register(L, "OpticsCompensation_s", optics_compensation);
+    if (!cl_init_pending && !GetEngine()->IsOpenCLEnabled()) {
+        GetEngine()->InitOpenCLAsync();
+        cl_init_pending = true;
+    }
     return 1;
 }
 }
\ No newline at end of file
@@ -0,0 +1,140 @@
+#include "output_bounds.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include "cpu_kernel.h"
+#include "cpu_scheduler.h"
+
+cv::Rect CalcOccupiedRect(const aut::PixelRGBA *image_data, const aut::Size2D &image_size) {
+    int w = image_size.w;
+    int h = image_size.h;
+    std::vector<int> row_begin(h);
+    std::vector<int> row_end(h);
+    #pragma omp parallel for num_threads(GetCPUThreadNum())
+    for (int y = 0; y < h; y++) {
+        const aut::PixelRGBA *row = image_data + static_cast<std::size_t>(y) * w;
+        int begin = 0;
+        while (begin < w && !row[begin].a)
+            begin++;
+        int end = w;
+        while (end > begin && !row[end - 1].a)
+            end--;
+        row_begin[y] = begin;
+        row_end[y] = end;
+    }
+
+    int x0 = w;
+    int x1 = 0;
+    int y0 = h;
+    int y1 = 0;
+    for (int y = 0; y < h; y++) {
+        if (row_begin[y] >= row_end[y])
+            continue;
+        x0 = std::min(x0, row_begin[y]);
+        x1 = std::max(x1, row_end[y]);
+        y0 = std::min(y0, y);
+        y1 = y + 1;
+    }
+    if (x0 >= x1 || y0 >= y1)
+        return cv::Rect();
+    return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+cv::Rect CalcLiveRect(const aut::Size2D &image_size, const cv::Rect &source_rect,
+                      const glm::vec2 &center_coord, OpticsCompensationParameter parameter) {
+    cv::Rect image_rect(0, 0, image_size.w, image_size.h);
+    if (source_rect.empty())
+        return cv::Rect();
+    // Barrel with amount 1 leaves the image empty
+    if (parameter.IsEmptyOutput())
+        return cv::Rect();
+    // Pixels sample themselves without the distortion
+    if (parameter.IsIdentity())
+        return cv::Rect(source_rect.x - 1, source_rect.y - 1,
+                        source_rect.width + 2, source_rect.height + 2) & image_rect;
+    // The camera models have no closed inverse to walk the border with,
+    // the live spans of their tables still skip the pixels on the CPU
+    if (parameter.lens_model != lens_tan)
+        return image_rect;
+
+    float focal_distance = parameter.CalcFocalDistance();
+    // Bilinear taps of the coords in (left, right) x (top, bottom) reach source_rect
+    float left = source_rect.x - 1.f;
+    float top = source_rect.y - 1.f;
+    float right = static_cast<float>(source_rect.x + source_rect.width);
+    float bottom = static_cast<float>(source_rect.y + source_rect.height);
+
+    if (!parameter.spool_mode) {
+        // Beyond f * pi / 2 the clamped tan samples far on the opposite side, and the quads
+        // across it spread their samples over the line through the center
+        auto max_distance = [&center_coord](float x0, float y0, float x1, float y1) {
+            glm::vec2 corner(std::max(std::abs(x0 - center_coord.x), std::abs(x1 - center_coord.x)),
+                             std::max(std::abs(y0 - center_coord.y), std::abs(y1 - center_coord.y)));
+            return glm::length(corner);
+        };
+        float clamp_distance = focal_distance * kHalfPi;
+        // A pixel more for the corners of the quads
+        float image_distance = max_distance(0, 0, image_size.w - 1.f, image_size.h - 1.f) + 1;
+        if (image_distance >= clamp_distance) {
+            if (parameter.anti_aliasing)
+                return image_rect;
+            float opposite_distance = focal_distance * std::abs(std::tan(kHalfPi));
+            if (opposite_distance <= max_distance(left, top, right, bottom))
+                return image_rect;
+        }
+    }
+
+    glm::vec2 min_coords(std::numeric_limits<float>::max());
+    glm::vec2 max_coords(std::numeric_limits<float>::lowest());
+    // Longest step between the inverted points, the border between them can bulge that much
+    float max_step = 0;
+    bool unbounded = false;
+    auto walk_edge = [&](const glm::vec2 &begin, const glm::vec2 &end) {
+        // A point per source pixel
+        int step_num = static_cast<int>(std::ceil(glm::distance(begin, end))) + 1;
+        glm::vec2 prev_coords;
+        for (int i = 0; i <= step_num && !unbounded; i++) {
+            glm::vec2 relative_coords = LinearInterpolation2D(begin, end, i / static_cast<float>(step_num)) -
+                                        center_coord;
+            glm::vec2 coords;
+            if (parameter.spool_mode) {
+                // atan of the spool never reaches f * pi / 2 from the center, the pixels
+                // sampling the border beyond it don't exist and the region isn't bounded
+                if (glm::length(relative_coords) / focal_distance >= kHalfPi) {
+                    unbounded = true;
+                    break;
+                }
+                coords = CalcBarrelOffset(relative_coords, focal_distance) + center_coord;
+            } else {
+                coords = CalcSpoolOffset(relative_coords, focal_distance) + center_coord;
+            }
+            min_coords = glm::min(min_coords, coords);
+            max_coords = glm::max(max_coords, coords);
+            if (i > 0)
+                max_step = std::max(max_step, glm::distance(prev_coords, coords));
+            prev_coords = coords;
+        }
+    };
+    walk_edge(glm::vec2(left, top), glm::vec2(right, top));
+    walk_edge(glm::vec2(right, top), glm::vec2(right, bottom));
+    walk_edge(glm::vec2(right, bottom), glm::vec2(left, bottom));
+    walk_edge(glm::vec2(left, bottom), glm::vec2(left, top));
+    if (unbounded)
+        return image_rect;
+
+    // The quads of the anti-aliasing reach half a pixel around, and a pixel more covers
+    // the difference between the quads and the map of the pixels
+    float margin = max_step + (parameter.anti_aliasing ? 2.f : 1.f);
+    // Comparing in float keeps huge coords from overflowing
+    auto clamp_bound = [](float bound, int n) {
+        return static_cast<int>(std::min(std::max(bound, 0.f), static_cast<float>(n)));
+    };
+    int x0 = clamp_bound(std::floor(min_coords.x - margin), image_size.w);
+    int y0 = clamp_bound(std::floor(min_coords.y - margin), image_size.h);
+    int x1 = clamp_bound(std::ceil(max_coords.x + margin) + 1, image_size.w);
+    int y1 = clamp_bound(std::ceil(max_coords.y + margin) + 1, image_size.h);
+    if (x0 >= x1 || y0 >= y1)
+        return cv::Rect();
+    return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
\ No newline at end of file
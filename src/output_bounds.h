@@ -0,0 +1,22 @@
+#ifndef _OPTICSCOMPENSATION_S_SRC_OUTPUT_BOUNDS_H_
+#define _OPTICSCOMPENSATION_S_SRC_OUTPUT_BOUNDS_H_
+
+#include <aut/AUL_Type.h>
+#include <glm/glm.hpp>
+#include <opencv2/opencv.hpp>
+#include "parameter.h"
+
+// Bounding rect of the pixels with alpha != 0, empty if the image is transparent.
+// Opaque rows stop at their first and last pixel, so it only scans the transparent areas.
+cv::Rect CalcOccupiedRect(const aut::PixelRGBA *image_data, const aut::Size2D &image_size);
+
+// Output pixels which can sample the source pixels in source_rect, for the lens centered at
+// center_coord (which differs between the CPU and OpenCL). The others are transparent.
+// The inverse of the radial map is the map of the other mode, and it carries the border of
+// source_rect to the border of the region, so walking the border bounds the region.
+// Not for the anisotropic filter, whose mip taps reach beyond the quads of the pixels.
+// The whole image for the camera models.
+cv::Rect CalcLiveRect(const aut::Size2D &image_size, const cv::Rect &source_rect,
+                      const glm::vec2 &center_coord, OpticsCompensationParameter parameter);
+
+#endif // _OPTICSCOMPENSATION_S_SRC_OUTPUT_BOUNDS_H_
\ No newline at end of file
@@ -5,17 +5,79 @@
 #include <cmath>
 #include <glm/vec2.hpp>
 
+// Upper limit of the samples per axis of the anti-aliasing
+const int kMaxAASampling = 16;
+// Taps along the major axis of the anisotropic filter unless aa_max_sampling sets it
+const int kDefaultMaxAnisotropy = 8;
+
+// How the anti-aliasing filters the quad of a pixel on the source.
+// aa_supersampling averages a grid of bilinear samples inside the quad,
+// aa_anisotropic takes trilinear taps of a mip pyramid along its major axis.
+enum AAFilter {aa_supersampling, aa_anisotropic};
+
+// Lens of the distortion.
+// lens_tan is the tan / atan lens of amount and spool_mode,
+// lens_brown_conrady and lens_fisheye are camera models with LensCoefficients.
+enum LensModel {lens_tan, lens_brown_conrady, lens_fisheye};
+
+// Coefficients of the camera models on the coords normalized by the focal length
+struct LensCoefficients {
+    // Pixels, 0 uses half the diagonal of the image
+    float focal_length;
+    // Radial, k4 is only used by lens_fisheye
+    float k1, k2, k3, k4;
+    // Tangential, only used by lens_brown_conrady
+    float p1, p2;
+    // Remove the distortion of the footage instead of applying it
+    bool undistort;
+};
+
 struct OpticsCompensationParameter {
     OpticsCompensationParameter();
     OpticsCompensationParameter(float amount, bool spool_mode, bool anti_aliasing, 
                                 const glm::vec2 &center_pos);
 
     float CalcFocalDistance();
+    // Focal length of the camera models in pixels
+    float CalcLensFocalLength(int w, int h) const {
+        return lens.focal_length > 0 ? lens.focal_length :
+                                       0.5f * std::sqrt(static_cast<float>(w) * w + static_cast<float>(h) * h);
+    }
+    // Output is the source
+    bool IsIdentity() const {
+        if (lens_model == lens_tan)
+            return !amount;
+        // The fisheye without coefficients is still the equidistant projection
+        return lens_model == lens_brown_conrady &&
+               !lens.k1 && !lens.k2 && !lens.k3 && !lens.p1 && !lens.p2;
+    }
+    // Barrel with amount 1 leaves the image empty
+    bool IsEmptyOutput() const {
+        return lens_model == lens_tan && !spool_mode && amount == 1;
+    }
+    // Maximum samples per axis of the anti-aliasing
+    int GetAAMaxSampling(int default_sampling) const {
+        int max_sampling = aa_max_sampling > 0 ? aa_max_sampling : default_sampling;
+        return max_sampling < kMaxAASampling ? max_sampling : kMaxAASampling;
+    }
 
     float amount;
     bool spool_mode;
     bool anti_aliasing;
     glm::vec2 center_pos;
+    // Samples per axis of the anti-aliasing, 0 uses the default of the backend
+    int aa_max_sampling;
+    // Take 1 to aa_max_sampling samples per axis depending on the size of
+    // the pixel on the source, instead of aa_max_sampling everywhere
+    bool aa_adaptive;
+    // Samples per source pixel of the pixel size in adaptive mode
+    float aa_quality;
+    // aa_max_sampling limits the taps along the major axis with aa_anisotropic,
+    // aa_adaptive and aa_quality only apply to aa_supersampling
+    AAFilter aa_filter;
+    // amount and spool_mode only apply to lens_tan, lens to the camera models
+    LensModel lens_model;
+    LensCoefficients lens;
 };
 
 inline OpticsCompensationParameter::
@@ -28,10 +90,31 @@ inline OpticsCompensationParameter::
     amount(amount),
     spool_mode(spool_mode),
     anti_aliasing(anti_aliasing), 
-    center_pos(center_pos) {}
+    center_pos(center_pos),
+    aa_max_sampling(0),
+    aa_adaptive(false),
+    aa_quality(1),
+    aa_filter(aa_supersampling),
+    lens_model(lens_tan),
+    lens({0, 0, 0, 0, 0, 0, 0, false}) {}
 
 inline float OpticsCompensationParameter::CalcFocalDistance() {
     return static_cast<float>(500.0 / std::tan(0.5 * amount * 3.14159265358979323846));
 }
 
+// Parameter from the values of the script, amount is in percent and negative for spool
+inline OpticsCompensationParameter MakeOpticsCompensationParameter(double amount_percent,
+                                                                   bool anti_aliasing,
+                                                                   const glm::vec2 &center_pos) {
+    OpticsCompensationParameter parameter;
+    parameter.amount = static_cast<float>(amount_percent / 100);
+    parameter.anti_aliasing = anti_aliasing;
+    parameter.center_pos = center_pos;
+    if (parameter.amount < 0) {
+        parameter.spool_mode = true;
+        parameter.amount *= -1;
+    }
+    return parameter;
+}
+
 #endif // _OPTICSCOMPENSATION_S_SRC_PARAMETER_H_
\ No newline at end of file
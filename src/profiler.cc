@@ -0,0 +1,227 @@
+#include "profiler.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <thread>
+
+/* LatencyHistogram */
+
+LatencyHistogram::LatencyHistogram() {
+    Reset();
+}
+
+void LatencyHistogram::Add(std::int64_t duration_ns) {
+    duration_ns = std::max<std::int64_t>(duration_ns, 0);
+    buckets_[GetBucketIndex(duration_ns)]++;
+    count_++;
+    sum_ns_ += duration_ns;
+    min_ns_ = std::min(min_ns_, duration_ns);
+    max_ns_ = std::max(max_ns_, duration_ns);
+}
+
+void LatencyHistogram::Reset() {
+    buckets_.fill(0);
+    count_ = 0;
+    sum_ns_ = 0;
+    min_ns_ = std::numeric_limits<std::int64_t>::max();
+    max_ns_ = 0;
+}
+
+std::int64_t LatencyHistogram::GetPercentile(double ratio) const {
+    if (!count_)
+        return 0;
+    auto target = static_cast<std::uint64_t>(std::ceil(std::min(std::max(ratio, 0.0), 1.0) * count_));
+    target = std::max<std::uint64_t>(target, 1);
+    std::uint64_t accumulated = 0;
+    for (int i = 0; i < kBucketNum; i++) {
+        accumulated += buckets_[i];
+        if (accumulated >= target)
+            return std::min(std::max(GetBucketUpperBound(i), min_ns_), max_ns_);
+    }
+    return max_ns_;
+}
+
+int LatencyHistogram::GetBucketIndex(std::int64_t duration_ns) {
+    if (duration_ns < 1000)
+        return 0;
+    int index = static_cast<int>(std::log2(duration_ns / 1000.0) * 8) + 1;
+    return std::min(index, kBucketNum - 1);
+}
+
+std::int64_t LatencyHistogram::GetBucketUpperBound(int index) {
+    return static_cast<std::int64_t>(1000 * std::exp2(index / 8.0));
+}
+
+/* Profiler */
+
+Profiler::Profiler() :
+    enabled_(false),
+    origin_ns_(Now()),
+    trace_next_(0) {}
+
+std::int64_t Profiler::Now() {
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+const char* Profiler::GetStageName(Stage stage) {
+    switch (stage) {
+    case stage_frame:
+        return "frame";
+    case stage_upload:
+        return "upload";
+    case stage_premult:
+        return "premult";
+    case stage_distortion:
+        return "distortion";
+    case stage_unpremult:
+        return "unpremult";
+    case stage_download:
+        return "download";
+    case stage_remap_table:
+        return "remap_table";
+    case stage_fused:
+        return "fused";
+    default:
+        break;
+    }
+    return "unknown";
+}
+
+std::string Profiler::MakeKey(const aut::Size2D &image_size,
+                              const OpticsCompensationParameter &parameter,
+                              const char *backend) {
+    std::string mode = parameter.spool_mode ? "spool" : "barrel";
+    if (parameter.lens_model != lens_tan) {
+        mode = parameter.lens_model == lens_fisheye ? "fisheye" : "brown_conrady";
+        if (parameter.lens.undistort)
+            mode += "_undistort";
+    }
+    if (parameter.anti_aliasing) {
+        mode += parameter.aa_filter == aa_anisotropic ? "_aa_anisotropic" :
+                parameter.aa_adaptive ? "_aa_adaptive" : "_aa";
+    }
+    return std::to_string(image_size.w) + "x" + std::to_string(image_size.h) +
+           "/" + mode + "/" + backend;
+}
+
+void Profiler::Record(const std::string &key, Stage stage, std::int64_t start_ns, std::int64_t end_ns) {
+    AddEvent(key, stage, false, start_ns, end_ns);
+}
+
+void Profiler::RecordCLEvent(const std::string &key, Stage stage, const cl::Event &event,
+                             std::int64_t clock_offset_ns) {
+    cl_ulong start = 0;
+    cl_ulong end = 0;
+    // Not available if the queue was created without profiling
+    if (event.getProfilingInfo(CL_PROFILING_COMMAND_START, &start) != CL_SUCCESS ||
+        event.getProfilingInfo(CL_PROFILING_COMMAND_END, &end) != CL_SUCCESS)
+        return;
+    AddEvent(key, stage, true, static_cast<std::int64_t>(start) + clock_offset_ns,
+             static_cast<std::int64_t>(end) + clock_offset_ns);
+}
+
+std::int64_t Profiler::GetCLClockOffset(const cl::Event &first_event, std::int64_t enqueue_ns) {
+    cl_ulong queued = 0;
+    if (first_event.getProfilingInfo(CL_PROFILING_COMMAND_QUEUED, &queued) != CL_SUCCESS)
+        return 0;
+    return enqueue_ns - static_cast<std::int64_t>(queued);
+}
+
+void Profiler::AddEvent(const std::string &key, Stage stage, bool device,
+                        std::int64_t start_ns, std::int64_t end_ns) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    histograms_[std::make_tuple(key, static_cast<int>(stage), device)].Add(end_ns - start_ns);
+
+    TraceEvent event = {stage, device, device ? 0 : GetThreadIndex(), start_ns, end_ns - start_ns, key};
+    if (trace_events_.size() < kMaxTraceEventNum) {
+        trace_events_.push_back(std::move(event));
+    } else {
+        trace_events_[trace_next_] = std::move(event);
+        trace_next_ = (trace_next_ + 1) % kMaxTraceEventNum;
+    }
+}
+
+std::uint32_t Profiler::GetThreadIndex() {
+    std::size_t id = std::hash<std::thread::id>()(std::this_thread::get_id());
+    auto it = std::find(thread_ids_.begin(), thread_ids_.end(), id);
+    if (it != thread_ids_.end())
+        return static_cast<std::uint32_t>(it - thread_ids_.begin()) + 1;
+    thread_ids_.push_back(id);
+    return static_cast<std::uint32_t>(thread_ids_.size());
+}
+
+std::vector<Profiler::StageStats> Profiler::GetStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<StageStats> stats;
+    for (auto &entry : histograms_) {
+        auto &histogram = entry.second;
+        StageStats stage_stats;
+        stage_stats.key = std::get<0>(entry.first);
+        stage_stats.stage = static_cast<Stage>(std::get<1>(entry.first));
+        stage_stats.device = std::get<2>(entry.first);
+        stage_stats.count = histogram.GetCount();
+        stage_stats.mean_ns = histogram.GetMean();
+        stage_stats.p50_ns = histogram.GetPercentile(0.5);
+        stage_stats.p99_ns = histogram.GetPercentile(0.99);
+        stage_stats.max_ns = histogram.GetMax();
+        stats.push_back(stage_stats);
+    }
+    return stats;
+}
+
+std::string Profiler::FormatStats() const {
+    std::ostringstream text;
+    text << std::left << std::setw(32) << "key" << std::setw(12) << "stage" << std::setw(8) << "clock"
+         << std::right << std::setw(8) << "count" << std::setw(11) << "mean ms" << std::setw(11) << "p50 ms"
+         << std::setw(11) << "p99 ms" << std::setw(11) << "max ms" << "\n";
+    text << std::fixed << std::setprecision(3);
+    for (auto &stats : GetStats()) {
+        text << std::left << std::setw(32) << stats.key << std::setw(12) << GetStageName(stats.stage)
+             << std::setw(8) << (stats.device ? "device" : "host")
+             << std::right << std::setw(8) << stats.count
+             << std::setw(11) << stats.mean_ns * 1e-6 << std::setw(11) << stats.p50_ns * 1e-6
+             << std::setw(11) << stats.p99_ns * 1e-6 << std::setw(11) << stats.max_ns * 1e-6 << "\n";
+    }
+    return text.str();
+}
+
+bool Profiler::WriteChromeTrace(const std::string &path) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ofstream file(path);
+    if (!file)
+        return false;
+
+    file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    file << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+            "\"args\": {\"name\": \"OpenCL device\"}}";
+    for (std::size_t i = 0; i < thread_ids_.size(); i++) {
+        file << ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << i + 1
+             << ", \"args\": {\"name\": \"Host " << i + 1 << "\"}}";
+    }
+    file << std::fixed << std::setprecision(3);
+    // Oldest first
+    for (std::size_t i = 0; i < trace_events_.size(); i++) {
+        auto &event = trace_events_[(trace_next_ + i) % trace_events_.size()];
+        file << ",\n  {\"name\": \"" << GetStageName(event.stage) << "\", "
+             << "\"cat\": \"" << (event.device ? "device" : "host") << "\", "
+             << "\"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread << ", "
+             << "\"ts\": " << (event.start_ns - origin_ns_) * 1e-3 << ", "
+             << "\"dur\": " << event.duration_ns * 1e-3 << ", "
+             << "\"args\": {\"key\": \"" << event.key << "\"}}";
+    }
+    file << "\n]}\n";
+    return static_cast<bool>(file);
+}
+
+void Profiler::Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    histograms_.clear();
+    trace_events_.clear();
+    trace_next_ = 0;
+}
\ No newline at end of file
@@ -0,0 +1,152 @@
+#ifndef _OPTICSCOMPENSATION_S_SRC_PROFILER_H_
+#define _OPTICSCOMPENSATION_S_SRC_PROFILER_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <aut/AUL_Type.h>
+#include <CL/cl.hpp>
+#include "parameter.h"
+
+// Durations on log2 buckets with 8 steps per octave from 1 us, about 9% resolution.
+// Recording is O(1) and the memory is fixed whatever the number of frames.
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void Add(std::int64_t duration_ns);
+    void Reset();
+
+    std::uint64_t GetCount() const { return count_; }
+    double GetMean() const { return count_ ? static_cast<double>(sum_ns_) / count_ : 0; }
+    std::int64_t GetMin() const { return count_ ? min_ns_ : 0; }
+    std::int64_t GetMax() const { return max_ns_; }
+    // Duration under which the ratio of the samples are, ratio in [0, 1]
+    std::int64_t GetPercentile(double ratio) const;
+
+private:
+    static const int kBucketNum = 200;
+    static int GetBucketIndex(std::int64_t duration_ns);
+    static std::int64_t GetBucketUpperBound(int index);
+
+    std::array<std::uint32_t, kBucketNum> buckets_;
+    std::uint64_t count_;
+    std::int64_t sum_ns_;
+    std::int64_t min_ns_;
+    std::int64_t max_ns_;
+};
+
+// Per-stage timings of the frames, on the host with steady_clock and on the device with
+// the profiling info of the OpenCL events. Timings are aggregated per key (resolution,
+// mode and backend), stage and clock, and the last events are kept for a Chrome trace.
+// The host time of a transfer includes the copies on the host, the device time only the command.
+// Disabled by default, the hot path only checks IsEnabled() then.
+class Profiler {
+public:
+    enum Stage {
+        stage_frame,
+        stage_upload,
+        stage_premult,
+        stage_distortion,
+        stage_unpremult,
+        stage_download,
+        stage_remap_table,
+        stage_fused,
+        stage_num
+    };
+
+    struct StageStats {
+        std::string key;
+        Stage stage;
+        // Measured by the device events, otherwise by the host
+        bool device;
+        std::uint64_t count;
+        double mean_ns;
+        std::int64_t p50_ns;
+        std::int64_t p99_ns;
+        std::int64_t max_ns;
+    };
+
+    Profiler();
+
+    void SetEnabled(bool enabled) { enabled_ = enabled; }
+    bool IsEnabled() const { return enabled_; }
+
+    // Time of steady_clock in ns
+    static std::int64_t Now();
+    static const char* GetStageName(Stage stage);
+    // Key of the histograms like "1920x1080/barrel_aa/opencl"
+    static std::string MakeKey(const aut::Size2D &image_size,
+                               const OpticsCompensationParameter &parameter,
+                               const char *backend);
+
+    // Record a stage measured on the host
+    void Record(const std::string &key, Stage stage, std::int64_t start_ns, std::int64_t end_ns);
+    // Record a completed command of a queue created with CL_QUEUE_PROFILING_ENABLE.
+    // clock_offset_ns moves the device time onto steady_clock, see GetCLClockOffset().
+    void RecordCLEvent(const std::string &key, Stage stage, const cl::Event &event,
+                       std::int64_t clock_offset_ns);
+    // Offset between the device clock and steady_clock, from the first command of a frame
+    // and the host time just before it was enqueued
+    static std::int64_t GetCLClockOffset(const cl::Event &first_event, std::int64_t enqueue_ns);
+
+    std::vector<StageStats> GetStats() const;
+    // Human readable table of GetStats()
+    std::string FormatStats() const;
+    // Write the kept events as a Chrome trace (chrome://tracing, Perfetto)
+    bool WriteChromeTrace(const std::string &path) const;
+    void Reset();
+
+private:
+    struct TraceEvent {
+        Stage stage;
+        bool device;
+        std::uint32_t thread;
+        std::int64_t start_ns;
+        std::int64_t duration_ns;
+        std::string key;
+    };
+
+    static const std::size_t kMaxTraceEventNum = 1 << 16;
+
+    void AddEvent(const std::string &key, Stage stage, bool device,
+                  std::int64_t start_ns, std::int64_t end_ns);
+    std::uint32_t GetThreadIndex();
+
+    std::atomic<bool> enabled_;
+    std::int64_t origin_ns_;
+    mutable std::mutex mutex_;
+    std::map<std::tuple<std::string, int, bool>, LatencyHistogram> histograms_;
+    // Ring buffer, trace_next_ is the next slot to overwrite once it is full
+    std::vector<TraceEvent> trace_events_;
+    std::size_t trace_next_;
+    std::vector<std::size_t> thread_ids_;
+};
+
+// Record the scope as a host stage if the profiler is enabled
+class ScopedStageTimer {
+public:
+    ScopedStageTimer(Profiler *profiler, const std::string &key, Profiler::Stage stage) :
+        profiler_(profiler->IsEnabled() ? profiler : nullptr),
+        // Copied, the key may be a temporary. Only while enabled, so a disabled timer doesn't allocate
+        key_(profiler_ ? key : std::string()),
+        stage_(stage),
+        start_ns_(profiler_ ? Profiler::Now() : 0) {}
+    ~ScopedStageTimer() {
+        if (profiler_)
+            profiler_->Record(key_, stage_, start_ns_, Profiler::Now());
+    }
+
+private:
+    Profiler *profiler_;
+    std::string key_;
+    Profiler::Stage stage_;
+    std::int64_t start_ns_;
+};
+
+#endif // _OPTICSCOMPENSATION_S_SRC_PROFILER_H_
\ No newline at end of file
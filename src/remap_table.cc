@@ -0,0 +1,397 @@
+#include "remap_table.h"
+#include <algorithm>
+#include <limits>
+#include <new>
+#include "cpu_kernel.h"
+#include "cpu_scheduler.h"
+#include "lens_model.h"
+
+/* RemapTable */
+
+RemapTable::RemapTable(const aut::Size2D &image_size, Layout layout) :
+    layout_(layout),
+    image_size_(image_size),
+    grid_w_(layout == pixel_corner ? image_size.w + 1 : image_size.w),
+    grid_h_(layout == pixel_corner ? image_size.h + 1 : image_size.h),
+    coords_(static_cast<std::size_t>(grid_w_) * grid_h_) {}
+
+void RemapTable::UpdateLiveSpans(const glm::vec2 &source_min, const glm::vec2 &source_max) {
+    live_begin_.resize(image_size_.h);
+    live_end_.resize(image_size_.h);
+    // Bilinear taps of the coords in (source_min - 1, source_max) reach the source
+    glm::vec2 reach_min = source_min - glm::vec2(1.f);
+    auto reaches_source = [&](const glm::vec2 &min_coords, const glm::vec2 &max_coords) {
+        return max_coords.x > reach_min.x && min_coords.x < source_max.x &&
+               max_coords.y > reach_min.y && min_coords.y < source_max.y;
+    };
+
+    #pragma omp parallel for num_threads(GetCPUThreadNum())
+    for (int y = 0; y < image_size_.h; y++) {
+        const glm::vec2 *top_row = GetRow(y);
+        // Samples of the anti-aliasing are inside the quad of the corners
+        const glm::vec2 *bottom_row = layout_ == pixel_corner ? GetRow(y + 1) : top_row;
+        int begin = image_size_.w;
+        int end = 0;
+        for (int x = 0; x < image_size_.w; x++) {
+            glm::vec2 min_coords = top_row[x];
+            glm::vec2 max_coords = top_row[x];
+            if (layout_ == pixel_corner) {
+                min_coords = glm::min(glm::min(min_coords, top_row[x + 1]),
+                                      glm::min(bottom_row[x], bottom_row[x + 1]));
+                max_coords = glm::max(glm::max(max_coords, top_row[x + 1]),
+                                      glm::max(bottom_row[x], bottom_row[x + 1]));
+            }
+            if (reaches_source(min_coords, max_coords)) {
+                begin = std::min(begin, x);
+                end = x + 1;
+            }
+        }
+        live_begin_[y] = begin < end ? begin : 0;
+        live_end_[y] = begin < end ? end : 0;
+    }
+}
+
+void RemapTable::UpdateRowRanges() {
+    row_min_y_.resize(grid_h_);
+    row_max_y_.resize(grid_h_);
+    #pragma omp parallel for num_threads(GetCPUThreadNum())
+    for (int y = 0; y < grid_h_; y++) {
+        // Grid points used by the live pixels, a corner row is shared by the pixel rows
+        // above and below it
+        int begin = grid_w_;
+        int end = 0;
+        auto add_pixel_row = [&](int pixel_y) {
+            if (pixel_y < 0 || pixel_y >= image_size_.h || GetLiveBegin(pixel_y) >= GetLiveEnd(pixel_y))
+                return;
+            begin = std::min(begin, GetLiveBegin(pixel_y));
+            end = std::max(end, layout_ == pixel_corner ? GetLiveEnd(pixel_y) + 1 : GetLiveEnd(pixel_y));
+        };
+        add_pixel_row(y);
+        if (layout_ == pixel_corner)
+            add_pixel_row(y - 1);
+
+        const glm::vec2 *row = GetRow(y);
+        float min_y = std::numeric_limits<float>::max();
+        float max_y = std::numeric_limits<float>::lowest();
+        for (int x = begin; x < end; x++) {
+            min_y = std::min(min_y, row[x].y);
+            max_y = std::max(max_y, row[x].y);
+        }
+        row_min_y_[y] = min_y;
+        row_max_y_[y] = max_y;
+    }
+}
+
+void RemapTable::UpdateSamplingNums(int max_sampling, bool adaptive, float quality) {
+    if (layout_ != pixel_corner)
+        return;
+
+    sampling_nums_.resize(static_cast<std::size_t>(image_size_.w) * image_size_.h);
+    row_sample_nums_.resize(image_size_.h);
+    #pragma omp parallel for num_threads(GetCPUThreadNum())
+    for (int y = 0; y < image_size_.h; y++) {
+        const glm::vec2 *top_row = GetRow(y);
+        const glm::vec2 *bottom_row = GetRow(y + 1);
+        SamplingNum *sampling_nums = sampling_nums_.data() + static_cast<std::size_t>(y) * image_size_.w;
+        int row_sample_num = 0;
+        for (int x = 0; x < image_size_.w; x++) {
+            auto sampling_num = CalcAASamplingNum(top_row[x], top_row[x + 1],
+                                                  bottom_row[x], bottom_row[x + 1],
+                                                  max_sampling, adaptive, quality);
+            sampling_nums[x].x = static_cast<std::uint8_t>(sampling_num.x);
+            sampling_nums[x].y = static_cast<std::uint8_t>(sampling_num.y);
+            row_sample_num += sampling_num.x * sampling_num.y;
+        }
+        row_sample_nums_[y] = row_sample_num;
+    }
+}
+
+/* RemapTableKey */
+
+RemapTableKey::RemapTableKey(const aut::Size2D &image_size,
+                             const OpticsCompensationParameter &parameter) :
+    w(image_size.w),
+    h(image_size.h),
+    // The camera models don't use the amount
+    amount(parameter.lens_model == lens_tan ? parameter.amount : 0),
+    spool_mode(parameter.lens_model == lens_tan && parameter.spool_mode),
+    anti_aliasing(parameter.anti_aliasing),
+    center_pos(parameter.center_pos),
+    // Sampling settings only matter to the anti-aliasing tables
+    aa_max_sampling(anti_aliasing ? parameter.GetAAMaxSampling(SAMPLE_NUM) : 0),
+    aa_adaptive(anti_aliasing && parameter.aa_adaptive),
+    aa_quality(aa_adaptive ? parameter.aa_quality : 0),
+    lens_model(parameter.lens_model),
+    // Coefficients only matter to the camera models
+    lens(lens_model != lens_tan ? parameter.lens : LensCoefficients{0, 0, 0, 0, 0, 0, 0, false}) {}
+
+bool RemapTableKey::operator==(const RemapTableKey &other) const {
+    return w == other.w && h == other.h &&
+           amount == other.amount &&
+           spool_mode == other.spool_mode &&
+           anti_aliasing == other.anti_aliasing &&
+           center_pos.x == other.center_pos.x &&
+           center_pos.y == other.center_pos.y &&
+           aa_max_sampling == other.aa_max_sampling &&
+           aa_adaptive == other.aa_adaptive &&
+           aa_quality == other.aa_quality &&
+           lens_model == other.lens_model &&
+           lens.focal_length == other.lens.focal_length &&
+           lens.k1 == other.lens.k1 && lens.k2 == other.lens.k2 &&
+           lens.k3 == other.lens.k3 && lens.k4 == other.lens.k4 &&
+           lens.p1 == other.lens.p1 && lens.p2 == other.lens.p2 &&
+           lens.undistort == other.lens.undistort;
+}
+
+// Index of the grid line mirrored across the center for every line of an axis,
+// or -1 if the mirrored line is out of the grid or isn't on a grid line.
+static std::vector<int> CalcMirrorIndices(int grid_n, float origin, float center) {
+    std::vector<int> mirror_indices(grid_n, -1);
+    // Index i and j are mirrored if (i + origin) + (j + origin) == 2 * center
+    float index_sum = 2 * (center - origin);
+    if (index_sum != std::floor(index_sum) || std::abs(index_sum) > 2.f * grid_n)
+        return mirror_indices;
+
+    int sum = static_cast<int>(index_sum);
+    for (int i = 0; i < grid_n; i++) {
+        int j = sum - i;
+        if (j >= 0 && j < grid_n)
+            mirror_indices[i] = j;
+    }
+    return mirror_indices;
+}
+
+// Lines which are calculated directly, the others are copied from their mirror
+static bool IsPrimaryIndex(const std::vector<int> &mirror_indices, int i) {
+    return mirror_indices[i] < 0 || mirror_indices[i] >= i;
+}
+
+// Fill the table from the offsets of the primary quadrant.
+// center_coord is the center on the grid and source_center is the center on the coords
+// stored in the table, which differ for a tile of the image.
+// The offsets of the mirrored pixels only differ in sign, and the pixel with swapped
+// relative coords has the swapped offset, so the transcendental functions are evaluated
+// once per 8 pixels around a centered lens.
+template<typename CalcOffset>
+static void FillRemapTable(RemapTable *table, float origin, const glm::vec2 &center_coord,
+                           const glm::vec2 &source_center, CalcOffset calc_offset) {
+    int grid_w = table->GetGridWidth();
+    int grid_h = table->GetGridHeight();
+    auto mirror_x = CalcMirrorIndices(grid_w, origin, center_coord.x);
+    auto mirror_y = CalcMirrorIndices(grid_h, origin, center_coord.y);
+
+    // Swapping needs the grids of both axes lying on the same lattice
+    float index_shift = center_coord.y - center_coord.x;
+    bool use_swap = index_shift == std::floor(index_shift) &&
+                    std::abs(index_shift) < static_cast<float>(grid_w + grid_h);
+    int shift = use_swap ? static_cast<int>(index_shift) : 0;
+
+    auto put = [&](int x, int y, const glm::vec2 &offset) {
+        int mx = mirror_x[x];
+        int my = mirror_y[y];
+        table->GetRow(y)[x] = offset + source_center;
+        if (mx > x)
+            table->GetRow(y)[mx] = glm::vec2(-offset.x, offset.y) + source_center;
+        if (my > y) {
+            table->GetRow(my)[x] = glm::vec2(offset.x, -offset.y) + source_center;
+            if (mx > x)
+                table->GetRow(my)[mx] = glm::vec2(-offset.x, -offset.y) + source_center;
+        }
+    };
+
+    #pragma omp parallel for schedule(dynamic, 16) num_threads(GetCPUThreadNum())
+    for (int y = 0; y < grid_h; y++) {
+        if (!IsPrimaryIndex(mirror_y, y))
+            continue;
+        for (int x = 0; x < grid_w; x++) {
+            if (!IsPrimaryIndex(mirror_x, x))
+                continue;
+            glm::vec2 relative_coords(x + origin - center_coord.x, y + origin - center_coord.y);
+
+            // Pixel at the swapped relative coords
+            int sx = y - shift;
+            int sy = x + shift;
+            bool has_swapped = use_swap && (sx != x || sy != y) &&
+                               sx >= 0 && sx < grid_w && sy >= 0 && sy < grid_h &&
+                               IsPrimaryIndex(mirror_x, sx) && IsPrimaryIndex(mirror_y, sy);
+            // The swapped pair is calculated by the one with the smaller x
+            if (has_swapped && relative_coords.x > relative_coords.y)
+                continue;
+
+            auto offset = calc_offset(relative_coords);
+            put(x, y, offset);
+            if (has_swapped)
+                put(sx, sy, glm::vec2(offset.y, offset.x));
+        }
+    }
+}
+
+// Fill the table of a camera model row by row, the tangential terms break the symmetry
+// which FillRemapTable relies on. The inverse starts Newton's method from the solution of
+// the previous pixel of the row, which is a pixel away, so most pixels take 2 or 3 steps.
+static void FillLensModelRemapTable(RemapTable *table, float origin, const glm::vec2 &center_coord,
+                                    const glm::vec2 &source_center,
+                                    const OpticsCompensationParameter &parameter, float focal_length) {
+    int grid_w = table->GetGridWidth();
+    int grid_h = table->GetGridHeight();
+    LensModel model = parameter.lens_model;
+    const LensCoefficients &lens = parameter.lens;
+    float inv_focal_length = 1 / focal_length;
+    float max_error = kLensModelMaxError * inv_focal_length;
+    glm::vec2 unreachable_coords = glm::vec2(kLensModelUnreachableOffset) + source_center;
+
+    #pragma omp parallel for schedule(dynamic, 16) num_threads(GetCPUThreadNum())
+    for (int y = 0; y < grid_h; y++) {
+        glm::vec2 *row = table->GetRow(y);
+        float coords_y = (y + origin - center_coord.y) * inv_focal_length;
+        if (lens.undistort) {
+            // The polynomials of Brown-Conrady have no branch, so the row vectorizes
+            if (model == lens_brown_conrady) {
+                for (int x = 0; x < grid_w; x++) {
+                    glm::vec2 coords((x + origin - center_coord.x) * inv_focal_length, coords_y);
+                    row[x] = DistortBrownConrady(lens, coords) * focal_length + source_center;
+                }
+            } else {
+                for (int x = 0; x < grid_w; x++) {
+                    glm::vec2 coords((x + origin - center_coord.x) * inv_focal_length, coords_y);
+                    row[x] = DistortFisheye(lens, coords) * focal_length + source_center;
+                }
+            }
+            continue;
+        }
+
+        glm::vec2 guess;
+        bool has_guess = false;
+        for (int x = 0; x < grid_w; x++) {
+            glm::vec2 coords((x + origin - center_coord.x) * inv_focal_length, coords_y);
+            glm::vec2 source_coords;
+            bool converged = UndistortLensModel(model, lens, coords, has_guess ? guess : coords,
+                                                max_error, &source_coords);
+            // The previous pixel can be on the other side of a fold, start over from the pixel
+            if (!converged && has_guess)
+                converged = UndistortLensModel(model, lens, coords, coords, max_error, &source_coords);
+            has_guess = converged;
+            guess = source_coords;
+            row[x] = converged ? source_coords * focal_length + source_center : unreachable_coords;
+        }
+    }
+}
+
+std::shared_ptr<RemapTable> BuildTileRemapTable(const aut::Size2D &image_size,
+                                                const glm::ivec2 &output_origin,
+                                                const aut::Size2D &output_size,
+                                                const glm::ivec2 &source_origin,
+                                                OpticsCompensationParameter parameter) {
+    bool use_corner = parameter.anti_aliasing;
+    auto table = std::make_shared<RemapTable>(
+        output_size, use_corner ? RemapTable::pixel_corner : RemapTable::pixel_center);
+
+    glm::vec2 center_coord(
+        (image_size.w - 1) / 2.f - parameter.center_pos.x,
+        (image_size.h - 1) / 2.f - parameter.center_pos.y
+    );
+    glm::vec2 grid_center = center_coord - glm::vec2(output_origin);
+    glm::vec2 source_center = center_coord - glm::vec2(source_origin);
+    // Corners are half a pixel left-top of the pixel
+    float origin = use_corner ? -0.5f : 0.f;
+    auto focal_distance = parameter.CalcFocalDistance();
+
+    if (parameter.lens_model != lens_tan) {
+        FillLensModelRemapTable(table.get(), origin, grid_center, source_center, parameter,
+                                parameter.CalcLensFocalLength(image_size.w, image_size.h));
+    } else if (parameter.spool_mode) {
+        FillRemapTable(table.get(), origin, grid_center, source_center,
+                       [focal_distance](const glm::vec2 &relative_coords) {
+                           return CalcSpoolOffset(relative_coords, focal_distance);
+                       });
+    } else {
+        FillRemapTable(table.get(), origin, grid_center, source_center,
+                       [focal_distance](const glm::vec2 &relative_coords) {
+                           return CalcBarrelOffset(relative_coords, focal_distance);
+                       });
+    }
+    // The source of a tile is a part of the image, the image bounds it
+    table->UpdateLiveSpans(-glm::vec2(source_origin),
+                           glm::vec2(image_size.w, image_size.h) - glm::vec2(source_origin));
+    table->UpdateRowRanges();
+    table->UpdateSamplingNums(parameter.GetAAMaxSampling(SAMPLE_NUM), parameter.aa_adaptive,
+                              parameter.aa_quality);
+
+    return table;
+}
+
+std::shared_ptr<RemapTable> BuildRemapTable(const aut::Size2D &image_size,
+                                            OpticsCompensationParameter parameter) {
+    return BuildTileRemapTable(image_size, glm::ivec2(0), image_size, glm::ivec2(0), parameter);
+}
+
+/* RemapTableCache */
+
+// The product overflows std::size_t from 4096 MB on the 32 bit builds, clamp it
+static std::size_t BudgetToBytes(std::size_t budget_mb) {
+    const std::size_t mb = 1024 * 1024;
+    if (budget_mb > std::numeric_limits<std::size_t>::max() / mb)
+        return std::numeric_limits<std::size_t>::max();
+    return budget_mb * mb;
+}
+
+RemapTableCache::RemapTableCache(std::size_t budget_mb) :
+    budget_(BudgetToBytes(budget_mb)),
+    used_size_(0),
+    hit_count_(0),
+    miss_count_(0),
+    eviction_count_(0) {}
+
+std::shared_ptr<const RemapTable> RemapTableCache::GetTable(
+    const aut::Size2D &image_size, const OpticsCompensationParameter &parameter) {
+    RemapTableKey key(image_size, parameter);
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->key == key) {
+            hit_count_++;
+            // Move to the front as the most recently used
+            entries_.splice(entries_.begin(), entries_, it);
+            return entries_.front().table;
+        }
+    }
+
+    miss_count_++;
+    std::shared_ptr<const RemapTable> table;
+    try {
+        table = BuildRemapTable(image_size, parameter);
+    } catch (std::bad_alloc&) {
+        // Retry after releasing the cached tables
+        Clear();
+        try {
+            table = BuildRemapTable(image_size, parameter);
+        } catch (std::bad_alloc&) {
+            return nullptr;
+        }
+    }
+
+    // Use the table only for this frame if it doesn't fit in the budget
+    if (table->GetByteSize() > budget_)
+        return table;
+
+    Evict(table->GetByteSize());
+    entries_.push_front({key, table});
+    used_size_ += table->GetByteSize();
+    return table;
+}
+
+void RemapTableCache::SetBudget(std::size_t budget_mb) {
+    budget_ = BudgetToBytes(budget_mb);
+    Evict(0);
+}
+
+void RemapTableCache::Clear() {
+    entries_.clear();
+    used_size_ = 0;
+}
+
+void RemapTableCache::Evict(std::size_t required_size) {
+    while (!entries_.empty() && used_size_ + required_size > budget_) {
+        used_size_ -= entries_.back().table->GetByteSize();
+        entries_.pop_back();
+        eviction_count_++;
+    }
+}
\ No newline at end of file
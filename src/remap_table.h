@@ -0,0 +1,152 @@
+#ifndef _OPTICSCOMPENSATION_S_SRC_REMAP_TABLE_H_
+#define _OPTICSCOMPENSATION_S_SRC_REMAP_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <vector>
+#include <aut/AUL_Type.h>
+#include <glm/glm.hpp>
+#include "parameter.h"
+
+// Per-pixel sampling coords of the distortion.
+// pixel_center holds the sampling coord of every pixel (w * h),
+// pixel_corner holds the coords of the pixel corners ((w + 1) * (h + 1)),
+// which are shared by the neighbouring pixels when anti-aliasing.
+// pixel_corner also holds the samples per axis of every pixel for the anti-aliasing.
+class RemapTable {
+public:
+    enum Layout {pixel_center, pixel_corner};
+
+    struct SamplingNum {
+        std::uint8_t x;
+        std::uint8_t y;
+    };
+
+    RemapTable(const aut::Size2D &image_size, Layout layout);
+
+    Layout GetLayout() const { return layout_; }
+    aut::Size2D GetImageSize() const { return image_size_; }
+    int GetGridWidth() const { return grid_w_; }
+    int GetGridHeight() const { return grid_h_; }
+    std::size_t GetByteSize() const {
+        return coords_.size() * sizeof(glm::vec2) + row_min_y_.size() * sizeof(float) * 2 +
+               sampling_nums_.size() * sizeof(SamplingNum) + row_sample_nums_.size() * sizeof(int) +
+               live_begin_.size() * sizeof(int) * 2;
+    }
+
+    glm::vec2* GetRow(int y) { return coords_.data() + static_cast<std::size_t>(y) * grid_w_; }
+    const glm::vec2* GetRow(int y) const {
+        return coords_.data() + static_cast<std::size_t>(y) * grid_w_;
+    }
+
+    // Pixels of row y whose samples can reach the source, the others sample transparent black.
+    // The whole row until UpdateLiveSpans() is called.
+    int GetLiveBegin(int y) const { return live_begin_.empty() ? 0 : live_begin_[y]; }
+    int GetLiveEnd(int y) const { return live_end_.empty() ? image_size_.w : live_end_[y]; }
+    // Find the spans for the source in [source_min, source_max) on the coords of the table
+    void UpdateLiveSpans(const glm::vec2 &source_min, const glm::vec2 &source_max);
+
+    // Range of the y coords in grid row y, valid after UpdateRowRanges().
+    // Only the coords used by the live spans count, min > max if there is none.
+    float GetRowMinY(int y) const { return row_min_y_[y]; }
+    float GetRowMaxY(int y) const { return row_max_y_[y]; }
+    void UpdateRowRanges();
+
+    // Samples per axis of the pixels in row y and their total,
+    // valid after UpdateSamplingNums()
+    const SamplingNum* GetSamplingNumRow(int y) const {
+        return sampling_nums_.data() + static_cast<std::size_t>(y) * image_size_.w;
+    }
+    int GetRowSampleNum(int y) const { return row_sample_nums_[y]; }
+    // Decide the samples of every pixel from the quad of its corners, see CalcAASamplingNum()
+    void UpdateSamplingNums(int max_sampling, bool adaptive, float quality);
+
+private:
+    Layout layout_;
+    aut::Size2D image_size_;
+    int grid_w_;
+    int grid_h_;
+    std::vector<glm::vec2> coords_;
+    std::vector<int> live_begin_;
+    std::vector<int> live_end_;
+    std::vector<float> row_min_y_;
+    std::vector<float> row_max_y_;
+    std::vector<SamplingNum> sampling_nums_;
+    std::vector<int> row_sample_nums_;
+};
+
+// Values which decide the content of a RemapTable
+struct RemapTableKey {
+    RemapTableKey(const aut::Size2D &image_size, const OpticsCompensationParameter &parameter);
+
+    bool operator==(const RemapTableKey &other) const;
+
+    int w;
+    int h;
+    float amount;
+    bool spool_mode;
+    bool anti_aliasing;
+    glm::vec2 center_pos;
+    int aa_max_sampling;
+    bool aa_adaptive;
+    float aa_quality;
+    LensModel lens_model;
+    LensCoefficients lens;
+};
+
+// Build the table for the parameter (defined in remap_table.cc)
+std::shared_ptr<RemapTable> BuildRemapTable(const aut::Size2D &image_size,
+                                            OpticsCompensationParameter parameter);
+
+// Build the table of the output_size pixels from output_origin of the image, for a tile.
+// The coords are relative to source_origin, where the source of the tile starts.
+std::shared_ptr<RemapTable> BuildTileRemapTable(const aut::Size2D &image_size,
+                                                const glm::ivec2 &output_origin,
+                                                const aut::Size2D &output_size,
+                                                const glm::ivec2 &source_origin,
+                                                OpticsCompensationParameter parameter);
+
+// Holds the anti-aliasing table of an 8K frame, (7681 * 4321) corners * 8 B + 2 B per pixel = 317 MB
+const std::size_t kDefaultRemapCacheBudgetMB = 384;
+
+// LRU cache of the remap tables.
+// A table covers the whole frame, tables over the budget are built for every frame.
+class RemapTableCache {
+public:
+    RemapTableCache(std::size_t budget_mb = kDefaultRemapCacheBudgetMB);
+
+    // Return the table for the parameter, building it on a miss.
+    // Return nullptr if the table couldn't be allocated.
+    std::shared_ptr<const RemapTable> GetTable(const aut::Size2D &image_size,
+                                               const OpticsCompensationParameter &parameter);
+
+    void SetBudget(std::size_t budget_mb);
+    void Clear();
+
+    std::size_t GetBudget() const { return budget_; }
+    std::size_t GetUsedSize() const { return used_size_; }
+    std::size_t GetTableNum() const { return entries_.size(); }
+    std::uint64_t GetHitCount() const { return hit_count_; }
+    std::uint64_t GetMissCount() const { return miss_count_; }
+    std::uint64_t GetEvictionCount() const { return eviction_count_; }
+
+private:
+    struct Entry {
+        RemapTableKey key;
+        std::shared_ptr<const RemapTable> table;
+    };
+
+    void Evict(std::size_t required_size);
+
+    std::size_t budget_;
+    std::size_t used_size_;
+    std::uint64_t hit_count_;
+    std::uint64_t miss_count_;
+    std::uint64_t eviction_count_;
+    // Most recently used entry is at the front
+    std::list<Entry> entries_;
+};
+
+#endif // _OPTICSCOMPENSATION_S_SRC_REMAP_TABLE_H_
\ No newline at end of file
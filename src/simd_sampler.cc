@@ -0,0 +1,503 @@
+#include "simd_sampler.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define SIMD_SAMPLER_X86
+#endif
+
+#ifdef SIMD_SAMPLER_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SIMD_TARGET(x)
+#else
+#define SIMD_TARGET(x) __attribute__((target(x)))
+#endif
+#endif // SIMD_SAMPLER_X86
+
+// Number of coords processed at once by the vectorized paths
+#define BLOCK_SIZE 16
+
+std::vector<const cv::Vec4f*> GetRowPointers(const cv::Mat &image) {
+    std::vector<const cv::Vec4f*> rows(image.rows);
+    for (int y = 0; y < image.rows; y++)
+        rows[y] = image.ptr<cv::Vec4f>(y);
+    return rows;
+}
+
+/* Packed sources */
+
+// Formats of PackedSamplingSource as types, so that the loops don't branch on them
+struct Fixed16Source {
+    const cv::Vec4w *const *rows;
+    int w;
+    int h;
+};
+
+struct HalfSource {
+    const cv::Vec4w *const *rows;
+    int w;
+    int h;
+};
+
+/* Scalar */
+
+static inline cv::Vec4f LoadPixel(const SamplingSource &source, int x, int y) {
+    return source.rows[y][x];
+}
+
+static inline cv::Vec4f LoadPixel(const Fixed16Source &source, int x, int y) {
+    const cv::Vec4w &pixel = source.rows[y][x];
+    return cv::Vec4f(pixel[0], pixel[1], pixel[2], pixel[3]);
+}
+
+static inline cv::Vec4f LoadPixel(const HalfSource &source, int x, int y) {
+    const cv::Vec4w &pixel = source.rows[y][x];
+    return cv::Vec4f(HalfToFloat(pixel[0]), HalfToFloat(pixel[1]),
+                     HalfToFloat(pixel[2]), HalfToFloat(pixel[3]));
+}
+
+template<typename Source>
+static inline cv::Vec4f FetchPixel(const Source &source, float fx, float fy) {
+    // Compare in float to avoid overflow of huge coords
+    if (fx < 0 || fx >= source.w || fy < 0 || fy >= source.h)
+        return cv::Vec4f(cv::Scalar::all(0));
+    return LoadPixel(source, static_cast<int>(fx), static_cast<int>(fy));
+}
+
+template<typename Source>
+static void SampleRowScalar(const Source &source, const glm::vec2 *coords, int n,
+                            cv::Vec4f *out_pixels) {
+    for (int i = 0; i < n; i++) {
+        float x = coords[i].x;
+        float y = coords[i].y;
+        float fx = std::floor(x);
+        float fy = std::floor(y);
+        float dx = x - fx;
+        float dy = y - fy;
+
+        auto plt = FetchPixel(source, fx, fy);
+        auto prt = FetchPixel(source, fx + 1, fy);
+        auto plb = FetchPixel(source, fx, fy + 1);
+        auto prb = FetchPixel(source, fx + 1, fy + 1);
+
+        out_pixels[i] = (1 - dx) * (1 - dy) * plt +
+                             dx  * (1 - dy) * prt +
+                        (1 - dx) *      dy  * plb +
+                             dx  *      dy  * prb;
+    }
+}
+
+#ifdef SIMD_SAMPLER_X86
+
+// Weights, clamped indices and validity masks (0 or -1) of the 4 taps
+struct alignas(64) TapBlock {
+    float w00[BLOCK_SIZE], w10[BLOCK_SIZE], w01[BLOCK_SIZE], w11[BLOCK_SIZE];
+    int x0[BLOCK_SIZE], x1[BLOCK_SIZE], y0[BLOCK_SIZE], y1[BLOCK_SIZE];
+    int m00[BLOCK_SIZE], m10[BLOCK_SIZE], m01[BLOCK_SIZE], m11[BLOCK_SIZE];
+};
+
+/* SSE4.1 */
+
+SIMD_TARGET("sse4.1")
+static inline __m128 LoadPixelSSE41(const SamplingSource &source, int x, int y) {
+    return _mm_loadu_ps(source.rows[y][x].val);
+}
+
+SIMD_TARGET("sse4.1")
+static inline __m128 LoadPixelSSE41(const Fixed16Source &source, int x, int y) {
+    __m128i pixel = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(source.rows[y][x].val));
+    return _mm_cvtepi32_ps(_mm_cvtepu16_epi32(pixel));
+}
+
+SIMD_TARGET("sse4.1")
+static inline __m128 LoadPixelSSE41(const HalfSource &source, int x, int y) {
+    __m128i pixel = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(source.rows[y][x].val));
+    // Same conversion as HalfToFloat
+    __m128i bits = _mm_slli_epi32(_mm_cvtepu16_epi32(pixel), 13);
+    return _mm_mul_ps(_mm_castsi128_ps(bits), _mm_set1_ps(5.192296858534828e+33f));
+}
+
+// Calculate the taps of 4 coords from the j-th entry of the block
+template<typename Source>
+SIMD_TARGET("sse4.1")
+static void CalcTapsSSE41(const Source &source, const glm::vec2 *coords,
+                          TapBlock *block, int j) {
+    const __m128 one = _mm_set1_ps(1.f);
+    __m128 c01 = _mm_loadu_ps(&coords[0].x);
+    __m128 c23 = _mm_loadu_ps(&coords[2].x);
+    __m128 x = _mm_shuffle_ps(c01, c23, _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 y = _mm_shuffle_ps(c01, c23, _MM_SHUFFLE(3, 1, 3, 1));
+    __m128 fx = _mm_floor_ps(x);
+    __m128 fy = _mm_floor_ps(y);
+    __m128 dx = _mm_sub_ps(x, fx);
+    __m128 dy = _mm_sub_ps(y, fy);
+    __m128 rx = _mm_sub_ps(one, dx);
+    __m128 ry = _mm_sub_ps(one, dy);
+    _mm_store_ps(block->w00 + j, _mm_mul_ps(rx, ry));
+    _mm_store_ps(block->w10 + j, _mm_mul_ps(dx, ry));
+    _mm_store_ps(block->w01 + j, _mm_mul_ps(rx, dy));
+    _mm_store_ps(block->w11 + j, _mm_mul_ps(dx, dy));
+
+    // Clamp before converting so that huge coords stay out of the image
+    __m128i ix = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(fx, _mm_set1_ps(-2.f)),
+                                             _mm_set1_ps(static_cast<float>(source.w))));
+    __m128i iy = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(fy, _mm_set1_ps(-2.f)),
+                                             _mm_set1_ps(static_cast<float>(source.h))));
+    const __m128i minus_one = _mm_set1_epi32(-1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i w = _mm_set1_epi32(source.w);
+    const __m128i h = _mm_set1_epi32(source.h);
+    __m128i ix1 = _mm_sub_epi32(ix, minus_one);
+    __m128i iy1 = _mm_sub_epi32(iy, minus_one);
+    __m128i vx0 = _mm_and_si128(_mm_cmpgt_epi32(ix, minus_one), _mm_cmpgt_epi32(w, ix));
+    __m128i vx1 = _mm_and_si128(_mm_cmpgt_epi32(ix1, minus_one), _mm_cmpgt_epi32(w, ix1));
+    __m128i vy0 = _mm_and_si128(_mm_cmpgt_epi32(iy, minus_one), _mm_cmpgt_epi32(h, iy));
+    __m128i vy1 = _mm_and_si128(_mm_cmpgt_epi32(iy1, minus_one), _mm_cmpgt_epi32(h, iy1));
+    __m128i max_x = _mm_add_epi32(w, minus_one);
+    __m128i max_y = _mm_add_epi32(h, minus_one);
+    _mm_store_si128(reinterpret_cast<__m128i*>(block->x0 + j),
+                    _mm_min_epi32(_mm_max_epi32(ix, zero), max_x));
+    _mm_store_si128(reinterpret_cast<__m128i*>(block->x1 + j),
+                    _mm_min_epi32(_mm_max_epi32(ix1, zero), max_x));
+    _mm_store_si128(reinterpret_cast<__m128i*>(block->y0 + j),
+                    _mm_min_epi32(_mm_max_epi32(iy, zero), max_y));
+    _mm_store_si128(reinterpret_cast<__m128i*>(block->y1 + j),
+                    _mm_min_epi32(_mm_max_epi32(iy1, zero), max_y));
+    _mm_store_si128(reinterpret_cast<__m128i*>(block->m00 + j),
+                    _mm_and_si128(vx0, vy0));
+    _mm_store_si128(reinterpret_cast<__m128i*>(block->m10 + j),
+                    _mm_and_si128(vx1, vy0));
+    _mm_store_si128(reinterpret_cast<__m128i*>(block->m01 + j),
+                    _mm_and_si128(vx0, vy1));
+    _mm_store_si128(reinterpret_cast<__m128i*>(block->m11 + j),
+                    _mm_and_si128(vx1, vy1));
+}
+
+// Blend the taps a pixel at a time, taps out of the image are zeroed by the masks
+template<typename Source>
+SIMD_TARGET("sse4.1")
+static void BlendTapsSSE41(const Source &source, const TapBlock &block,
+                           int begin, int end, cv::Vec4f *out_pixels) {
+    for (int k = begin; k < end; k++) {
+        __m128 p00 = _mm_and_ps(LoadPixelSSE41(source, block.x0[k], block.y0[k]),
+                                _mm_castsi128_ps(_mm_set1_epi32(block.m00[k])));
+        __m128 p10 = _mm_and_ps(LoadPixelSSE41(source, block.x1[k], block.y0[k]),
+                                _mm_castsi128_ps(_mm_set1_epi32(block.m10[k])));
+        __m128 p01 = _mm_and_ps(LoadPixelSSE41(source, block.x0[k], block.y1[k]),
+                                _mm_castsi128_ps(_mm_set1_epi32(block.m01[k])));
+        __m128 p11 = _mm_and_ps(LoadPixelSSE41(source, block.x1[k], block.y1[k]),
+                                _mm_castsi128_ps(_mm_set1_epi32(block.m11[k])));
+        // Same order of operations as the scalar path
+        __m128 pixel = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(block.w00[k]), p00),
+                                  _mm_mul_ps(_mm_set1_ps(block.w10[k]), p10));
+        pixel = _mm_add_ps(pixel, _mm_mul_ps(_mm_set1_ps(block.w01[k]), p01));
+        pixel = _mm_add_ps(pixel, _mm_mul_ps(_mm_set1_ps(block.w11[k]), p11));
+        _mm_storeu_ps(out_pixels[k].val, pixel);
+    }
+}
+
+template<typename Source>
+SIMD_TARGET("sse4.1")
+static void SampleRowSSE41(const Source &source, const glm::vec2 *coords, int n,
+                           cv::Vec4f *out_pixels) {
+    TapBlock block;
+    int i = 0;
+    for (; i + BLOCK_SIZE <= n; i += BLOCK_SIZE) {
+        for (int j = 0; j < BLOCK_SIZE; j += 4)
+            CalcTapsSSE41(source, coords + i + j, &block, j);
+        BlendTapsSSE41(source, block, 0, BLOCK_SIZE, out_pixels + i);
+    }
+    SampleRowScalar(source, coords + i, n - i, out_pixels + i);
+}
+
+/* AVX2 */
+
+template<typename Source>
+SIMD_TARGET("avx2")
+static void CalcTapsAVX2(const Source &source, const glm::vec2 *coords,
+                         TapBlock *block, int j) {
+    const __m256 one = _mm256_set1_ps(1.f);
+    __m256 c0 = _mm256_loadu_ps(&coords[0].x);
+    __m256 c1 = _mm256_loadu_ps(&coords[4].x);
+    // Deinterleave to x0 x1 x4 x5 x2 x3 x6 x7 and restore the order
+    __m256 x = _mm256_shuffle_ps(c0, c1, _MM_SHUFFLE(2, 0, 2, 0));
+    __m256 y = _mm256_shuffle_ps(c0, c1, _MM_SHUFFLE(3, 1, 3, 1));
+    x = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(x), _MM_SHUFFLE(3, 1, 2, 0)));
+    y = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(y), _MM_SHUFFLE(3, 1, 2, 0)));
+    __m256 fx = _mm256_floor_ps(x);
+    __m256 fy = _mm256_floor_ps(y);
+    __m256 dx = _mm256_sub_ps(x, fx);
+    __m256 dy = _mm256_sub_ps(y, fy);
+    __m256 rx = _mm256_sub_ps(one, dx);
+    __m256 ry = _mm256_sub_ps(one, dy);
+    _mm256_store_ps(block->w00 + j, _mm256_mul_ps(rx, ry));
+    _mm256_store_ps(block->w10 + j, _mm256_mul_ps(dx, ry));
+    _mm256_store_ps(block->w01 + j, _mm256_mul_ps(rx, dy));
+    _mm256_store_ps(block->w11 + j, _mm256_mul_ps(dx, dy));
+
+    __m256i ix = _mm256_cvttps_epi32(_mm256_min_ps(
+        _mm256_max_ps(fx, _mm256_set1_ps(-2.f)), _mm256_set1_ps(static_cast<float>(source.w))));
+    __m256i iy = _mm256_cvttps_epi32(_mm256_min_ps(
+        _mm256_max_ps(fy, _mm256_set1_ps(-2.f)), _mm256_set1_ps(static_cast<float>(source.h))));
+    const __m256i minus_one = _mm256_set1_epi32(-1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i w = _mm256_set1_epi32(source.w);
+    const __m256i h = _mm256_set1_epi32(source.h);
+    __m256i ix1 = _mm256_sub_epi32(ix, minus_one);
+    __m256i iy1 = _mm256_sub_epi32(iy, minus_one);
+    __m256i vx0 = _mm256_and_si256(_mm256_cmpgt_epi32(ix, minus_one), _mm256_cmpgt_epi32(w, ix));
+    __m256i vx1 = _mm256_and_si256(_mm256_cmpgt_epi32(ix1, minus_one), _mm256_cmpgt_epi32(w, ix1));
+    __m256i vy0 = _mm256_and_si256(_mm256_cmpgt_epi32(iy, minus_one), _mm256_cmpgt_epi32(h, iy));
+    __m256i vy1 = _mm256_and_si256(_mm256_cmpgt_epi32(iy1, minus_one), _mm256_cmpgt_epi32(h, iy1));
+    __m256i max_x = _mm256_add_epi32(w, minus_one);
+    __m256i max_y = _mm256_add_epi32(h, minus_one);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(block->x0 + j),
+                       _mm256_min_epi32(_mm256_max_epi32(ix, zero), max_x));
+    _mm256_store_si256(reinterpret_cast<__m256i*>(block->x1 + j),
+                       _mm256_min_epi32(_mm256_max_epi32(ix1, zero), max_x));
+    _mm256_store_si256(reinterpret_cast<__m256i*>(block->y0 + j),
+                       _mm256_min_epi32(_mm256_max_epi32(iy, zero), max_y));
+    _mm256_store_si256(reinterpret_cast<__m256i*>(block->y1 + j),
+                       _mm256_min_epi32(_mm256_max_epi32(iy1, zero), max_y));
+    _mm256_store_si256(reinterpret_cast<__m256i*>(block->m00 + j),
+                       _mm256_and_si256(vx0, vy0));
+    _mm256_store_si256(reinterpret_cast<__m256i*>(block->m10 + j),
+                       _mm256_and_si256(vx1, vy0));
+    _mm256_store_si256(reinterpret_cast<__m256i*>(block->m01 + j),
+                       _mm256_and_si256(vx0, vy1));
+    _mm256_store_si256(reinterpret_cast<__m256i*>(block->m11 + j),
+                       _mm256_and_si256(vx1, vy1));
+}
+
+template<typename Source>
+SIMD_TARGET("avx2")
+static inline __m256 LoadTapPairAVX2(const Source &source, int x_a, int y_a, int mask_a,
+                                     int x_b, int y_b, int mask_b) {
+    __m256 pixels = _mm256_insertf128_ps(_mm256_castps128_ps256(LoadPixelSSE41(source, x_a, y_a)),
+                                         LoadPixelSSE41(source, x_b, y_b), 1);
+    __m256i mask = _mm256_setr_epi32(mask_a, mask_a, mask_a, mask_a,
+                                     mask_b, mask_b, mask_b, mask_b);
+    return _mm256_and_ps(pixels, _mm256_castsi256_ps(mask));
+}
+
+SIMD_TARGET("avx2")
+static inline __m256 BroadcastPairAVX2(float a, float b) {
+    return _mm256_setr_ps(a, a, a, a, b, b, b, b);
+}
+
+// Blend the taps two pixels at a time
+template<typename Source>
+SIMD_TARGET("avx2")
+static void BlendTapsAVX2(const Source &source, const TapBlock &block,
+                          int begin, int end, cv::Vec4f *out_pixels) {
+    int k = begin;
+    for (; k + 2 <= end; k += 2) {
+        int l = k + 1;
+        __m256 p00 = LoadTapPairAVX2(source, block.x0[k], block.y0[k], block.m00[k],
+                                     block.x0[l], block.y0[l], block.m00[l]);
+        __m256 p10 = LoadTapPairAVX2(source, block.x1[k], block.y0[k], block.m10[k],
+                                     block.x1[l], block.y0[l], block.m10[l]);
+        __m256 p01 = LoadTapPairAVX2(source, block.x0[k], block.y1[k], block.m01[k],
+                                     block.x0[l], block.y1[l], block.m01[l]);
+        __m256 p11 = LoadTapPairAVX2(source, block.x1[k], block.y1[k], block.m11[k],
+                                     block.x1[l], block.y1[l], block.m11[l]);
+        __m256 pixels = _mm256_add_ps(
+            _mm256_mul_ps(BroadcastPairAVX2(block.w00[k], block.w00[l]), p00),
+            _mm256_mul_ps(BroadcastPairAVX2(block.w10[k], block.w10[l]), p10));
+        pixels = _mm256_add_ps(pixels,
+            _mm256_mul_ps(BroadcastPairAVX2(block.w01[k], block.w01[l]), p01));
+        pixels = _mm256_add_ps(pixels,
+            _mm256_mul_ps(BroadcastPairAVX2(block.w11[k], block.w11[l]), p11));
+        _mm256_storeu_ps(out_pixels[k].val, pixels);
+    }
+    BlendTapsSSE41(source, block, k, end, out_pixels);
+}
+
+template<typename Source>
+SIMD_TARGET("avx2")
+static void SampleRowAVX2(const Source &source, const glm::vec2 *coords, int n,
+                          cv::Vec4f *out_pixels) {
+    TapBlock block;
+    int i = 0;
+    for (; i + BLOCK_SIZE <= n; i += BLOCK_SIZE) {
+        for (int j = 0; j < BLOCK_SIZE; j += 8)
+            CalcTapsAVX2(source, coords + i + j, &block, j);
+        BlendTapsAVX2(source, block, 0, BLOCK_SIZE, out_pixels + i);
+    }
+    SampleRowScalar(source, coords + i, n - i, out_pixels + i);
+}
+
+/* AVX-512 */
+
+template<typename Source>
+SIMD_TARGET("avx512f")
+static void CalcTapsAVX512(const Source &source, const glm::vec2 *coords,
+                           TapBlock *block) {
+    const __m512 one = _mm512_set1_ps(1.f);
+    __m512 c0 = _mm512_loadu_ps(&coords[0].x);
+    __m512 c1 = _mm512_loadu_ps(&coords[8].x);
+    const __m512i even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14,
+                                           16, 18, 20, 22, 24, 26, 28, 30);
+    const __m512i odd = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15,
+                                          17, 19, 21, 23, 25, 27, 29, 31);
+    __m512 x = _mm512_permutex2var_ps(c0, even, c1);
+    __m512 y = _mm512_permutex2var_ps(c0, odd, c1);
+    __m512 fx = _mm512_roundscale_ps(x, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    __m512 fy = _mm512_roundscale_ps(y, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    __m512 dx = _mm512_sub_ps(x, fx);
+    __m512 dy = _mm512_sub_ps(y, fy);
+    __m512 rx = _mm512_sub_ps(one, dx);
+    __m512 ry = _mm512_sub_ps(one, dy);
+    _mm512_store_ps(block->w00, _mm512_mul_ps(rx, ry));
+    _mm512_store_ps(block->w10, _mm512_mul_ps(dx, ry));
+    _mm512_store_ps(block->w01, _mm512_mul_ps(rx, dy));
+    _mm512_store_ps(block->w11, _mm512_mul_ps(dx, dy));
+
+    __m512i ix = _mm512_cvttps_epi32(_mm512_min_ps(
+        _mm512_max_ps(fx, _mm512_set1_ps(-2.f)), _mm512_set1_ps(static_cast<float>(source.w))));
+    __m512i iy = _mm512_cvttps_epi32(_mm512_min_ps(
+        _mm512_max_ps(fy, _mm512_set1_ps(-2.f)), _mm512_set1_ps(static_cast<float>(source.h))));
+    const __m512i one_i = _mm512_set1_epi32(1);
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i w = _mm512_set1_epi32(source.w);
+    const __m512i h = _mm512_set1_epi32(source.h);
+    __m512i ix1 = _mm512_add_epi32(ix, one_i);
+    __m512i iy1 = _mm512_add_epi32(iy, one_i);
+    // Validity as mask registers
+    __mmask16 vx0 = _mm512_cmpge_epi32_mask(ix, zero) & _mm512_cmplt_epi32_mask(ix, w);
+    __mmask16 vx1 = _mm512_cmpge_epi32_mask(ix1, zero) & _mm512_cmplt_epi32_mask(ix1, w);
+    __mmask16 vy0 = _mm512_cmpge_epi32_mask(iy, zero) & _mm512_cmplt_epi32_mask(iy, h);
+    __mmask16 vy1 = _mm512_cmpge_epi32_mask(iy1, zero) & _mm512_cmplt_epi32_mask(iy1, h);
+    __m512i max_x = _mm512_sub_epi32(w, one_i);
+    __m512i max_y = _mm512_sub_epi32(h, one_i);
+    const __m512i minus_one = _mm512_set1_epi32(-1);
+    _mm512_store_si512(block->x0, _mm512_min_epi32(_mm512_max_epi32(ix, zero), max_x));
+    _mm512_store_si512(block->x1, _mm512_min_epi32(_mm512_max_epi32(ix1, zero), max_x));
+    _mm512_store_si512(block->y0, _mm512_min_epi32(_mm512_max_epi32(iy, zero), max_y));
+    _mm512_store_si512(block->y1, _mm512_min_epi32(_mm512_max_epi32(iy1, zero), max_y));
+    _mm512_store_si512(block->m00, _mm512_maskz_mov_epi32(vx0 & vy0, minus_one));
+    _mm512_store_si512(block->m10, _mm512_maskz_mov_epi32(vx1 & vy0, minus_one));
+    _mm512_store_si512(block->m01, _mm512_maskz_mov_epi32(vx0 & vy1, minus_one));
+    _mm512_store_si512(block->m11, _mm512_maskz_mov_epi32(vx1 & vy1, minus_one));
+}
+
+template<typename Source>
+SIMD_TARGET("avx512f")
+static void SampleRowAVX512(const Source &source, const glm::vec2 *coords, int n,
+                            cv::Vec4f *out_pixels) {
+    TapBlock block;
+    int i = 0;
+    for (; i + BLOCK_SIZE <= n; i += BLOCK_SIZE) {
+        CalcTapsAVX512(source, coords + i, &block);
+        BlendTapsAVX2(source, block, 0, BLOCK_SIZE, out_pixels + i);
+    }
+    SampleRowScalar(source, coords + i, n - i, out_pixels + i);
+}
+
+/* Dispatch */
+
+static SIMDLevel DetectSIMDLevel() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    int max_id = info[0];
+    __cpuid(info, 1);
+    bool sse41 = (info[2] & (1 << 19)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!sse41)
+        return SIMDLevel::scalar;
+    if (!osxsave || !avx || max_id < 7)
+        return SIMDLevel::sse41;
+    // Check that the OS saves the YMM and ZMM registers
+    unsigned long long xcr0 = _xgetbv(0);
+    __cpuidex(info, 7, 0);
+    bool avx2 = (info[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6;
+    bool avx512 = (info[1] & (1 << 16)) != 0 && (xcr0 & 0xe6) == 0xe6;
+    if (avx2 && avx512)
+        return SIMDLevel::avx512;
+    if (avx2)
+        return SIMDLevel::avx2;
+    return SIMDLevel::sse41;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2"))
+        return SIMDLevel::avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return SIMDLevel::avx2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return SIMDLevel::sse41;
+    return SIMDLevel::scalar;
+#endif
+}
+
+#else // SIMD_SAMPLER_X86
+
+static SIMDLevel DetectSIMDLevel() {
+    return SIMDLevel::scalar;
+}
+
+#endif // SIMD_SAMPLER_X86
+
+template<typename Source>
+using SampleRowFunc = void (*)(const Source&, const glm::vec2*, int, cv::Vec4f*);
+
+template<typename Source>
+static SampleRowFunc<Source> GetSampleRowFunc(SIMDLevel level) {
+    switch (level) {
+#ifdef SIMD_SAMPLER_X86
+    case SIMDLevel::avx512:
+        return SampleRowAVX512<Source>;
+    case SIMDLevel::avx2:
+        return SampleRowAVX2<Source>;
+    case SIMDLevel::sse41:
+        return SampleRowSSE41<Source>;
+#endif
+    default:
+        break;
+    }
+    return SampleRowScalar<Source>;
+}
+
+static SIMDLevel supported_simd_level = DetectSIMDLevel();
+static SIMDLevel simd_level = supported_simd_level;
+static SampleRowFunc<SamplingSource> sample_row_func = GetSampleRowFunc<SamplingSource>(simd_level);
+
+SIMDLevel GetSupportedSIMDLevel() {
+    return supported_simd_level;
+}
+
+SIMDLevel GetSIMDLevel() {
+    return simd_level;
+}
+
+void SetSIMDLevel(SIMDLevel level) {
+    simd_level = std::min(level, supported_simd_level);
+    sample_row_func = GetSampleRowFunc<SamplingSource>(simd_level);
+}
+
+void SampleRow(const SamplingSource &source, const glm::vec2 *coords, int n,
+               cv::Vec4f *out_pixels) {
+    if (source.w <= 0 || source.h <= 0) {
+        std::fill(out_pixels, out_pixels + n, cv::Vec4f(cv::Scalar::all(0)));
+        return;
+    }
+    sample_row_func(source, coords, n, out_pixels);
+}
+
+void SampleRow(const PackedSamplingSource &source, const glm::vec2 *coords, int n,
+               cv::Vec4f *out_pixels) {
+    if (source.w <= 0 || source.h <= 0) {
+        std::fill(out_pixels, out_pixels + n, cv::Vec4f(cv::Scalar::all(0)));
+        return;
+    }
+    if (source.format == intermediate_half) {
+        HalfSource half_source = {source.rows, source.w, source.h};
+        GetSampleRowFunc<HalfSource>(simd_level)(half_source, coords, n, out_pixels);
+        return;
+    }
+    Fixed16Source fixed16_source = {source.rows, source.w, source.h};
+    GetSampleRowFunc<Fixed16Source>(simd_level)(fixed16_source, coords, n, out_pixels);
+}
\ No newline at end of file
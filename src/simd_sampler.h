@@ -0,0 +1,73 @@
+#ifndef _OPTICSCOMPENSATION_S_SRC_SIMD_SAMPLER_H_
+#define _OPTICSCOMPENSATION_S_SRC_SIMD_SAMPLER_H_
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <glm/glm.hpp>
+#include <opencv2/opencv.hpp>
+
+// Premultiplied float BGRA image accessed through the row pointers.
+// rows[y] must be valid for 0 <= y < h.
+struct SamplingSource {
+    const cv::Vec4f *const *rows;
+    int w;
+    int h;
+};
+
+// Row pointers of a CV_32FC4 image for SamplingSource
+std::vector<const cv::Vec4f*> GetRowPointers(const cv::Mat &image);
+
+// Formats of the premultiplied intermediate pixels.
+// Color * alpha of 8 bit pixels is an integer up to 65025, so intermediate_fixed16
+// keeps it exactly in 16 bits, and intermediate_half rounds it to 11 significant bits.
+enum IntermediateFormat {intermediate_float, intermediate_fixed16, intermediate_half};
+
+// Premultiplied BGRA image packed in 16 bits per channel, intermediate_fixed16 or
+// intermediate_half. Half rows hold the bits of the half floats.
+struct PackedSamplingSource {
+    const cv::Vec4w *const *rows;
+    int w;
+    int h;
+    IntermediateFormat format;
+};
+
+// Conversions of the non-negative finite values of the intermediates, without F16C
+inline std::uint16_t FloatToHalf(float value) {
+    // Subnormal halves are multiples of 2^-24
+    if (value < 6.103515625e-05f)
+        return static_cast<std::uint16_t>(std::nearbyint(value * 16777216.f));
+    std::uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    // Round the mantissa to 10 bits to nearest even, and rebias the exponent from 127 to 15
+    bits += 0xfff + ((bits >> 13) & 1);
+    return static_cast<std::uint16_t>((bits - (112u << 23)) >> 13);
+}
+
+inline float HalfToFloat(std::uint16_t half) {
+    // Shifted to the float layout the value is 2^-112 of the half, subnormals included
+    std::uint32_t bits = static_cast<std::uint32_t>(half) << 13;
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value * 5.192296858534828e+33f;
+}
+
+enum class SIMDLevel {scalar, sse41, avx2, avx512};
+
+// Best instruction set supported by the running CPU
+SIMDLevel GetSupportedSIMDLevel();
+SIMDLevel GetSIMDLevel();
+// Select the instruction set, clamped to the supported one
+void SetSIMDLevel(SIMDLevel level);
+
+// Bilinear sampling of n coords, pixels out of the source are sampled as 0.
+// Gives the same result as SamplingPixel<float> on every instruction set.
+void SampleRow(const SamplingSource &source, const glm::vec2 *coords, int n,
+               cv::Vec4f *out_pixels);
+// Same sampling of a packed source, pixels are converted to floats before the blend.
+// intermediate_fixed16 gives the same result as the float source of the same pixels.
+void SampleRow(const PackedSamplingSource &source, const glm::vec2 *coords, int n,
+               cv::Vec4f *out_pixels);
+
+#endif // _OPTICSCOMPENSATION_S_SRC_SIMD_SAMPLER_H_
\ No newline at end of file
@@ -19,11 +19,11 @@ public:
     void Reset();
 
 private:
-    int DurationMs(const std::chrono::system_clock::time_point &first,
-                 const std::chrono::system_clock::time_point &second);
+    double DurationMs(const std::chrono::steady_clock::time_point &first,
+                 const std::chrono::steady_clock::time_point &second);
     double TimeBaseFactor(TimeBase time_base);
     bool _measuring;
-    std::chrono::system_clock::time_point _start, _stop;
+    std::chrono::steady_clock::time_point _start, _stop;
     double _duration;
 };
 
@@ -37,19 +37,19 @@ void StopWatch::Start() {
     if (_measuring) return;
     Reset();
     _measuring = true;
-    _start = std::chrono::system_clock::now();
+    _start = std::chrono::steady_clock::now();
 }
 
 void StopWatch::Resume() {
     if (_measuring) return;
     _measuring = true;
-    _start = std::chrono::system_clock::now();
+    _start = std::chrono::steady_clock::now();
 }
 
 double StopWatch::Stop(TimeBase time_base) {
     if (!_measuring) return _duration;
     _measuring = false;
-    _stop = std::chrono::system_clock::now();
+    _stop = std::chrono::steady_clock::now();
     _duration += DurationMs(_start, _stop);
 
     return _duration * TimeBaseFactor(time_base);
@@ -85,7 +85,7 @@ double StopWatch::StopPrint(const std::string &subject, TimeBase time_base) {
 }
 
 double StopWatch::Duration(TimeBase time_base) {
-    _stop = std::chrono::system_clock::now();
+    _stop = std::chrono::steady_clock::now();
     _duration += DurationMs(_start, _stop);
     _start = _stop;
     return _duration * TimeBaseFactor(time_base);
@@ -96,11 +96,11 @@ void StopWatch::Reset() {
     _duration = 0;
 }
 
-int StopWatch::DurationMs(const std::chrono::system_clock::time_point &first,
-                           const std::chrono::system_clock::time_point &second) {
+double StopWatch::DurationMs(const std::chrono::steady_clock::time_point &first,
+                           const std::chrono::steady_clock::time_point &second) {
     using namespace std::chrono;
 
-    return static_cast<int>(duration_cast<microseconds>(second - first).count());
+    return duration_cast<duration<double, std::micro>>(second - first).count();
 }
 
 double StopWatch::TimeBaseFactor(TimeBase time_base) {
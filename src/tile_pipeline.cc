@@ -0,0 +1,258 @@
+#include "tile_pipeline.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include "cpu_kernel.h"
+#include "cpu_scheduler.h"
+#include "mip_pyramid.h"
+#include "remap_table.h"
+
+std::vector<cv::Rect> SplitIntoTiles(const aut::Size2D &image_size, const aut::Size2D &tile_size) {
+    if (tile_size.w <= 0 || tile_size.h <= 0)
+        throw std::invalid_argument("Tile size must be positive");
+
+    std::vector<cv::Rect> tiles;
+    for (int y = 0; y < image_size.h; y += tile_size.h) {
+        for (int x = 0; x < image_size.w; x += tile_size.w) {
+            tiles.emplace_back(x, y, std::min(tile_size.w, image_size.w - x),
+                               std::min(tile_size.h, image_size.h - y));
+        }
+    }
+    return tiles;
+}
+
+// Range of the source coords
+struct CoordsBounds {
+    CoordsBounds() :
+        min_coords(std::numeric_limits<float>::max()),
+        max_coords(std::numeric_limits<float>::lowest()) {}
+
+    void Add(const glm::vec2 &coords) {
+        min_coords = glm::min(min_coords, coords);
+        max_coords = glm::max(max_coords, coords);
+    }
+    void Add(const CoordsBounds &other) {
+        min_coords = glm::min(min_coords, other.min_coords);
+        max_coords = glm::max(max_coords, other.max_coords);
+    }
+
+    glm::vec2 min_coords;
+    glm::vec2 max_coords;
+};
+
+// Levels of the mip pyramid of the image, down to 1x1
+static int CalcMipLevelNum(aut::Size2D size) {
+    int level_num = 1;
+    while (size.w > 1 || size.h > 1) {
+        size.w = (size.w + 1) / 2;
+        size.h = (size.h + 1) / 2;
+        level_num++;
+    }
+    return level_num;
+}
+
+// Clamp the bound to [0, n], comparing in float for huge coords
+static int ClampBound(float bound, int n) {
+    return static_cast<int>(std::min(std::max(bound, 0.f), static_cast<float>(n)));
+}
+
+cv::Rect CalcTileSourceRect(const aut::Size2D &image_size, const cv::Rect &output_rect,
+                            OpticsCompensationParameter parameter) {
+    cv::Rect image_rect(0, 0, image_size.w, image_size.h);
+    if (output_rect.empty())
+        return cv::Rect();
+    // Without the distortion the tile samples itself
+    if (parameter.IsIdentity())
+        return output_rect & image_rect;
+    // Barrel with amount 1 leaves the image empty
+    if (parameter.IsEmptyOutput())
+        return cv::Rect();
+
+    bool use_corner = parameter.anti_aliasing;
+    bool use_anisotropic = use_corner && parameter.aa_filter == aa_anisotropic;
+    // Corners are half a pixel left-top of the pixel
+    float origin = use_corner ? -0.5f : 0.f;
+    int grid_w = use_corner ? output_rect.width + 1 : output_rect.width;
+    int grid_h = use_corner ? output_rect.height + 1 : output_rect.height;
+    glm::vec2 center_coord(
+        (image_size.w - 1) / 2.f - parameter.center_pos.x,
+        (image_size.h - 1) / 2.f - parameter.center_pos.y
+    );
+    // Same relative coords as the table of the tile
+    glm::vec2 grid_center = center_coord - glm::vec2(output_rect.x, output_rect.y);
+    float focal_distance = parameter.CalcFocalDistance();
+    auto calc_relative_coords = [&](int x, int y) {
+        return glm::vec2(x + origin - grid_center.x, y + origin - grid_center.y);
+    };
+
+    // The barrel offsets flip their sign at the clamp of tan,
+    // so the border doesn't bound the pixels beyond it
+    bool reaches_clamp = false;
+    if (parameter.lens_model == lens_tan && !parameter.spool_mode) {
+        glm::vec2 corners[] = {
+            calc_relative_coords(0, 0), calc_relative_coords(grid_w - 1, 0),
+            calc_relative_coords(0, grid_h - 1), calc_relative_coords(grid_w - 1, grid_h - 1)
+        };
+        for (auto &corner : corners) {
+            if (glm::length(corner) / focal_distance >= kHalfPi)
+                reaches_clamp = true;
+        }
+    }
+
+    CoordsBounds bounds;
+    float max_lod = 0;
+    // The camera models aren't radial with the tangential terms and can fold back,
+    // so their tables are scanned as a whole too
+    if (use_anisotropic || reaches_clamp || parameter.lens_model != lens_tan) {
+        auto remap_table = BuildTileRemapTable(image_size, glm::ivec2(output_rect.x, output_rect.y),
+                                               aut::Size2D(output_rect.width, output_rect.height),
+                                               glm::ivec2(0), parameter);
+        int max_anisotropy = parameter.GetAAMaxSampling(kDefaultMaxAnisotropy);
+        std::vector<CoordsBounds> row_bounds(grid_h);
+        std::vector<float> row_max_lods(grid_h, 0.f);
+        #pragma omp parallel for num_threads(GetCPUThreadNum())
+        for (int y = 0; y < grid_h; y++) {
+            const glm::vec2 *top_row = remap_table->GetRow(y);
+            for (int x = 0; x < grid_w; x++)
+                row_bounds[y].Add(top_row[x]);
+            if (!use_anisotropic || y + 1 >= grid_h)
+                continue;
+
+            const glm::vec2 *bottom_row = remap_table->GetRow(y + 1);
+            for (int x = 0; x + 1 < grid_w; x++) {
+                auto footprint = CalcAnisotropicFootprint(top_row[x], top_row[x + 1],
+                                                          bottom_row[x], bottom_row[x + 1],
+                                                          max_anisotropy);
+                row_max_lods[y] = std::max(row_max_lods[y], footprint.lod);
+            }
+        }
+        for (int y = 0; y < grid_h; y++) {
+            bounds.Add(row_bounds[y]);
+            max_lod = std::max(max_lod, row_max_lods[y]);
+        }
+    } else {
+        auto calc_coords = [&](int x, int y) {
+            auto relative_coords = calc_relative_coords(x, y);
+            auto offset = parameter.spool_mode ? CalcSpoolOffset(relative_coords, focal_distance) :
+                                                 CalcBarrelOffset(relative_coords, focal_distance);
+            return offset + center_coord;
+        };
+        for (int x = 0; x < grid_w; x++) {
+            bounds.Add(calc_coords(x, 0));
+            bounds.Add(calc_coords(x, grid_h - 1));
+        }
+        for (int y = 1; y + 1 < grid_h; y++) {
+            bounds.Add(calc_coords(0, y));
+            bounds.Add(calc_coords(grid_w - 1, y));
+        }
+    }
+
+    // Bilinear taps reach floor + 1, and a pixel of margin on both sides covers
+    // the rounding of the anti-aliasing sample coords like FusedCPUKernel
+    float left = std::floor(bounds.min_coords.x) - 1;
+    float top = std::floor(bounds.min_coords.y) - 1;
+    float right = std::floor(bounds.max_coords.x) + 3;
+    float bottom = std::floor(bounds.max_coords.y) + 3;
+    if (use_anisotropic) {
+        // Bilinear taps of level l reach 2^(l + 1) pixels beyond the footprint, and the source
+        // aligned to the pixels of the deepest level read builds the same levels as the image
+        int level = std::min(static_cast<int>(max_lod) + 1, CalcMipLevelNum(image_size) - 1);
+        float margin = std::ldexp(1.f, level + 1);
+        float level_pixel = std::ldexp(1.f, level);
+        left = std::floor((left - margin) / level_pixel) * level_pixel;
+        top = std::floor((top - margin) / level_pixel) * level_pixel;
+        right = std::ceil((right + margin) / level_pixel) * level_pixel;
+        bottom = std::ceil((bottom + margin) / level_pixel) * level_pixel;
+    }
+
+    int x0 = ClampBound(left, image_size.w);
+    int y0 = ClampBound(top, image_size.h);
+    int x1 = ClampBound(right, image_size.w);
+    int y1 = ClampBound(bottom, image_size.h);
+    if (x0 >= x1 || y0 >= y1)
+        return cv::Rect();
+    return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+void TileCPUKernel(const cv::Mat &source, const cv::Rect &source_rect, cv::Mat &output,
+                   const aut::Size2D &image_size, const cv::Rect &output_rect,
+                   const OpticsCompensationParameter &parameter) {
+    int type = output.type();
+    cv::Rect image_rect(0, 0, image_size.w, image_size.h);
+    if (type != CV_8UC4 && type != CV_32FC4)
+        throw std::invalid_argument("Tile must be CV_8UC4 or CV_32FC4");
+    if (output.size() != output_rect.size() || (output_rect & image_rect) != output_rect)
+        throw std::invalid_argument("Output rect must be in the image and have the size of the output");
+    if (!source_rect.empty() && (source.type() != type || source.size() != source_rect.size()))
+        throw std::invalid_argument("Source must have the size of the source rect and the type of the output");
+
+    if (parameter.IsIdentity()) {
+        if ((source_rect & output_rect) != output_rect)
+            throw std::invalid_argument("Source rect must contain the output rect");
+        source(output_rect - source_rect.tl()).copyTo(output);
+        return;
+    }
+    // Barrel with amount 1 leaves the image empty, and so does the source out of the image
+    if (source_rect.empty() || parameter.IsEmptyOutput()) {
+        output.setTo(cv::Scalar::all(0));
+        return;
+    }
+
+    cv::Mat premultiplied(source_rect.size(), CV_32FC4);
+    #pragma omp parallel for num_threads(GetCPUThreadNum())
+    for (int y = 0; y < source_rect.height; y++) {
+        auto *out_row = premultiplied.ptr<cv::Vec4f>(y);
+        if (type == CV_8UC4) {
+            PremultRow(source.ptr<cv::Vec4b>(y), out_row, source_rect.width);
+            continue;
+        }
+        auto *in_row = source.ptr<cv::Vec4f>(y);
+        for (int x = 0; x < source_rect.width; x++) {
+            float alpha = in_row[x][3];
+            out_row[x] = cv::Vec4f(in_row[x][0] * alpha, in_row[x][1] * alpha,
+                                   in_row[x][2] * alpha, alpha);
+        }
+    }
+
+    auto remap_table = BuildTileRemapTable(image_size, glm::ivec2(output_rect.x, output_rect.y),
+                                           aut::Size2D(output_rect.width, output_rect.height),
+                                           glm::ivec2(source_rect.x, source_rect.y), parameter);
+    auto rows = GetRowPointers(premultiplied);
+    SamplingSource sampling_source = {rows.data(), source_rect.width, source_rect.height};
+    // The source rect is aligned so that its pyramid matches the one of the image
+    std::unique_ptr<MipPyramid> pyramid;
+    if (remap_table->GetLayout() == RemapTable::pixel_corner && parameter.aa_filter == aa_anisotropic)
+        pyramid.reset(new MipPyramid(sampling_source));
+    int max_anisotropy = parameter.GetAAMaxSampling(kDefaultMaxAnisotropy);
+
+    int w = output_rect.width;
+    #pragma omp parallel num_threads(GetCPUThreadNum())
+    {
+        RemapRowBuffer buffer;
+        std::vector<cv::Vec4f> distorted_row(w);
+        #pragma omp for schedule(dynamic, 4)
+        for (int y = 0; y < output_rect.height; y++) {
+            if (pyramid)
+                AnisotropicRemapRow(*pyramid, *remap_table, y, max_anisotropy, distorted_row.data());
+            else
+                RemapRow(sampling_source, *remap_table, y, &buffer, distorted_row.data());
+
+            if (type == CV_8UC4) {
+                UnpremultRow(distorted_row.data(), output.ptr<cv::Vec4b>(y), w);
+                continue;
+            }
+            auto *out_row = output.ptr<cv::Vec4f>(y);
+            for (int x = 0; x < w; x++) {
+                float alpha = distorted_row[x][3];
+                out_row[x] = distorted_row[x];
+                if (alpha != 0) {
+                    out_row[x][0] /= alpha;
+                    out_row[x][1] /= alpha;
+                    out_row[x][2] /= alpha;
+                }
+            }
+        }
+    }
+}
\ No newline at end of file
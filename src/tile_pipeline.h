@@ -0,0 +1,31 @@
+#ifndef _OPTICSCOMPENSATION_S_SRC_TILE_PIPELINE_H_
+#define _OPTICSCOMPENSATION_S_SRC_TILE_PIPELINE_H_
+
+#include <vector>
+#include <aut/AUL_Type.h>
+#include <opencv2/opencv.hpp>
+#include "parameter.h"
+
+// Tiles of tile_size covering the image in row-major order, the last ones are cut at the border
+std::vector<cv::Rect> SplitIntoTiles(const aut::Size2D &image_size, const aut::Size2D &tile_size);
+
+// Source pixels sampled by the output_rect of the image, clipped to the image.
+// Empty if every pixel of output_rect samples outside of the image.
+// The distortion moves the pixels along the rays from the center and keeps their order
+// on a ray, so the bounds come from the border of output_rect. The whole rect is scanned
+// only when it reaches the clamped tan of the barrel, for the camera models, and for the
+// anisotropic filter, whose source is widened and aligned to the mip levels it reads.
+cv::Rect CalcTileSourceRect(const aut::Size2D &image_size, const cv::Rect &output_rect,
+                            OpticsCompensationParameter parameter);
+
+// Apply the effect to output_rect of the image on the CPU.
+// source holds the straight alpha pixels of source_rect from CalcTileSourceRect(),
+// output receives output_rect, both CV_8UC4 or CV_32FC4 and can be views of larger images.
+// Only the source and output of the tile are held as floats, and the function doesn't share
+// any state, so the tiles can be processed on any thread or process in any order.
+// The result is the same as processing the whole image up to the rounding of the coords.
+void TileCPUKernel(const cv::Mat &source, const cv::Rect &source_rect, cv::Mat &output,
+                   const aut::Size2D &image_size, const cv::Rect &output_rect,
+                   const OpticsCompensationParameter &parameter);
+
+#endif // _OPTICSCOMPENSATION_S_SRC_TILE_PIPELINE_H_
\ No newline at end of file
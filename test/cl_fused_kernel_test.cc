@@ -0,0 +1,73 @@
+// Results of the fused OpenCL kernels against the Premult -> distortion -> Unpremult chain
+// of the same device. The chain holds the premultiplied colors in 8 bit images, so the
+// straight color of a low alpha pixel moves by up to 255 / alpha and can't be compared
+// channel by channel. Instead the alpha has to be within 1 and the premultiplied color
+// (color * alpha / 255) within 2, which covers the rounding of the premultiplied image (0.5),
+// of the alpha (1) and of the output color (0.5). Returns kSkipCode without an OpenCL device.
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "optics_compensation.h"
+#include "parameter.h"
+#include "test_image.h"
+
+namespace {
+
+// SKIP_RETURN_CODE of ctest
+const int kSkipCode = 77;
+const int kAlphaTolerance = 1;
+const float kPremultipliedTolerance = 2.0f;
+
+std::vector<OpticsCompensationParameter> MakeParameters() {
+    std::vector<OpticsCompensationParameter> parameters;
+    for (bool spool_mode : {false, true}) {
+        for (bool anti_aliasing : {false, true}) {
+            for (const glm::vec2 &center_pos : {glm::vec2(0), glm::vec2(7.25f, -3.5f)})
+                parameters.emplace_back(0.45f, spool_mode, anti_aliasing, center_pos);
+        }
+    }
+    return parameters;
+}
+
+std::string MakeName(const OpticsCompensationParameter &parameter) {
+    std::ostringstream name;
+    name << "fused" << (parameter.spool_mode ? " spool" : " barrel")
+         << (parameter.anti_aliasing ? " aa" : "")
+         << " center (" << parameter.center_pos.x << ", " << parameter.center_pos.y << ")";
+    return name.str();
+}
+
+} // namespace
+
+int main() {
+    OpticsCompensationEngine engine;
+    // Always build the program from the source
+    engine.SetCLProgramCacheDirectory("");
+    if (!engine.InitOpenCL(CL_DEVICE_TYPE_ALL)) {
+        std::cout << "OpenCL test skipped : " << engine.GetInitError() << std::endl;
+        return kSkipCode;
+    }
+    std::cout << "OpenCL device : "
+              << engine.GetOpenCLManager()->GetDeviceManager()->GetDeviceName(0) << std::endl;
+    // The generic kernels recomputing the coords, only the fusion differs
+    engine.SetCLKernelVariants(false);
+    engine.SetCLRemapCoords(false);
+
+    cv::Mat source = MakeRandomImage(113, 67, 11);
+    bool passed = true;
+    for (auto &parameter : MakeParameters()) {
+        cv::Mat expected = source.clone();
+        engine.SetCLFusedKernel(false);
+        engine.Process(expected, parameter);
+        cv::Mat actual = source.clone();
+        engine.SetCLFusedKernel(true);
+        engine.Process(actual, parameter);
+        passed &= ComparePremultiplied(MakeName(parameter), expected, actual,
+                                       kAlphaTolerance, kPremultipliedTolerance);
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
\ No newline at end of file
@@ -0,0 +1,86 @@
+// The specialized OpenCL kernels (SetCLKernelVariants) against the generic kernels. A variant
+// only folds the fixed anti-aliasing and the bounds check of whole work-groups into constants,
+// so the output has to be bit-identical. Every frame is rendered once to start the builds of
+// its variants, which are waited for before the compared frame. The sizes cover frames of whole
+// work-groups and frames with partial groups at the border. Returns kSkipCode without an
+// OpenCL device.
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "optics_compensation.h"
+#include "parameter.h"
+#include "test_image.h"
+
+namespace {
+
+// SKIP_RETURN_CODE of ctest
+const int kSkipCode = 77;
+
+std::vector<OpticsCompensationParameter> MakeParameters() {
+    std::vector<OpticsCompensationParameter> parameters;
+    for (bool spool_mode : {false, true}) {
+        for (bool anti_aliasing : {false, true}) {
+            for (const glm::vec2 &center_pos : {glm::vec2(0), glm::vec2(7.25f, -3.5f)})
+                parameters.emplace_back(0.45f, spool_mode, anti_aliasing, center_pos);
+        }
+    }
+    return parameters;
+}
+
+std::string MakeName(const cv::Mat &source, const OpticsCompensationParameter &parameter, bool fused) {
+    std::ostringstream name;
+    name << "variants " << source.cols << "x" << source.rows << (fused ? " fused" : "")
+         << (parameter.spool_mode ? " spool" : " barrel") << (parameter.anti_aliasing ? " aa" : "")
+         << " center (" << parameter.center_pos.x << ", " << parameter.center_pos.y << ")";
+    return name.str();
+}
+
+cv::Mat ProcessImage(OpticsCompensationEngine *engine, const cv::Mat &source,
+                     const OpticsCompensationParameter &parameter) {
+    cv::Mat image = source.clone();
+    engine->Process(image, parameter);
+    return image;
+}
+
+} // namespace
+
+int main() {
+    OpticsCompensationEngine engine;
+    // Always build the programs from the source
+    engine.SetCLProgramCacheDirectory("");
+    if (!engine.InitOpenCL(CL_DEVICE_TYPE_ALL)) {
+        std::cout << "OpenCL test skipped : " << engine.GetInitError() << std::endl;
+        return kSkipCode;
+    }
+    std::cout << "OpenCL device : "
+              << engine.GetOpenCLManager()->GetDeviceManager()->GetDeviceName(0) << std::endl;
+
+    bool passed = true;
+    for (const cv::Mat &source : {MakeRandomImage(128, 64, 17), MakeRandomImage(113, 67, 17)}) {
+        for (bool fused : {false, true}) {
+            engine.SetCLFusedKernel(fused);
+            for (auto &parameter : MakeParameters()) {
+                engine.SetCLKernelVariants(false);
+                cv::Mat expected = ProcessImage(&engine, source, parameter);
+                engine.SetCLKernelVariants(true);
+                ProcessImage(&engine, source, parameter);
+                engine.GetCLProgramVariants()->WaitBuilds();
+                cv::Mat actual = ProcessImage(&engine, source, parameter);
+                passed &= CompareImages(MakeName(source, parameter, fused), expected, actual);
+            }
+        }
+    }
+    // Otherwise only the generic kernels were compared
+    int built_num = engine.GetCLProgramVariants()->GetBuiltNum();
+    if (built_num == 0) {
+        std::cerr << "FAIL no variant was built" << std::endl;
+        passed = false;
+    } else {
+        std::cout << "ok   " << built_num << " variants built" << std::endl;
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
\ No newline at end of file
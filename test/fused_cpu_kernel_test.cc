@@ -0,0 +1,99 @@
+// FusedCPUKernel against PremultKernel -> SpoolCPUKernel / BarrelCPUKernel -> UnpremultKernel.
+// The remap table samples at the same coords as the distortion kernels,
+// so the fused result has to be bit-identical.
+// FusedCPUBandKernel has to give the same rows.
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <opencv2/opencv.hpp>
+#include "cpu_kernel.h"
+#include "cpu_pipeline.h"
+#include "parameter.h"
+#include "remap_table.h"
+#include "test_image.h"
+
+namespace {
+
+cv::Mat ProcessThreePass(const cv::Mat &source, const OpticsCompensationParameter &parameter) {
+    aut::Size2D image_size(source.cols, source.rows);
+    cv::Mat image_0(source.size(), CV_32FC4);
+    cv::Mat image_1(source.size(), CV_32FC4);
+    cv::Mat result(source.size(), CV_8UC4);
+    PremultKernel(source, image_0);
+    if (parameter.spool_mode)
+        SpoolCPUKernel(image_0, image_1, image_size, parameter);
+    else
+        BarrelCPUKernel(image_0, image_1, image_size, parameter);
+    UnpremultKernel(image_1, result);
+    return result;
+}
+
+bool TestParameter(const cv::Mat &source, const OpticsCompensationParameter &parameter,
+                   const std::string &name) {
+    aut::Size2D image_size(source.cols, source.rows);
+    cv::Mat expected = ProcessThreePass(source, parameter);
+    auto remap_table = BuildRemapTable(image_size, parameter);
+    if (!remap_table) {
+        std::cerr << "FAIL " << name << " : the remap table couldn't be built" << std::endl;
+        return false;
+    }
+
+    bool passed = true;
+    // 5 doesn't divide the heights, the last band is shorter
+    for (int band_height : {32, 5}) {
+        cv::Mat actual = source.clone();
+        FusedCPUKernel(reinterpret_cast<aut::PixelRGBA *>(actual.data), image_size,
+                       *remap_table, band_height);
+        passed &= CompareImages(name + " band " + std::to_string(band_height), expected, actual);
+    }
+
+    // The live rect of the whole image samples every pixel
+    cv::Mat actual = source.clone();
+    FusedCPUKernel(reinterpret_cast<aut::PixelRGBA *>(actual.data), image_size, *remap_table,
+                   cv::Rect(0, 0, source.cols, source.rows));
+    passed &= CompareImages(name + " live rect", expected, actual);
+
+    // Bands of the multi-device CPU worker, written in place and into a separate image
+    for (auto &rows : {cv::Range(0, source.rows), cv::Range(source.rows / 3, source.rows - 5)}) {
+        cv::Mat band(rows.size(), source.cols, CV_8UC4);
+        FusedCPUBandKernel(reinterpret_cast<const aut::PixelRGBA *>(source.data), image_size,
+                           *remap_table, rows.start, rows.end, reinterpret_cast<aut::PixelRGBA *>(band.data));
+        passed &= CompareImages(name + " band rows " + std::to_string(rows.start) + "-" +
+                                std::to_string(rows.end), expected(cv::Rect(0, rows.start, source.cols, rows.size())), band);
+    }
+    cv::Mat in_place = source.clone();
+    FusedCPUBandKernel(reinterpret_cast<aut::PixelRGBA *>(in_place.data), image_size, *remap_table,
+                       0, source.rows, reinterpret_cast<aut::PixelRGBA *>(in_place.data));
+    passed &= CompareImages(name + " band in place", expected, in_place);
+    return passed;
+}
+
+} // namespace
+
+int main() {
+    bool passed = true;
+    std::uint32_t seed = 1;
+    for (const cv::Size &size : {cv::Size(97, 61), cv::Size(128, 72)}) {
+        cv::Mat source = MakeRandomImage(size.width, size.height, seed++);
+        for (bool spool_mode : {false, true}) {
+            // Barrel with amount 1 returns without writing, it is not compared
+            for (float amount : {0.3f, 0.6f}) {
+                for (bool anti_aliasing : {false, true}) {
+                    for (const glm::vec2 &center_pos : {glm::vec2(0), glm::vec2(7.25f, -3.5f)}) {
+                        OpticsCompensationParameter parameter(amount, spool_mode, anti_aliasing,
+                                                              center_pos);
+                        std::ostringstream name;
+                        name << size.width << "x" << size.height
+                             << (spool_mode ? " spool " : " barrel ") << amount
+                             << (anti_aliasing ? " aa" : "")
+                             << " center (" << center_pos.x << ", " << center_pos.y << ")";
+                        passed &= TestParameter(source, parameter, name.str());
+                    }
+                }
+            }
+        }
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
\ No newline at end of file
@@ -0,0 +1,141 @@
+// Results of the 16 bit intermediate formats against the float intermediates.
+// On the CPU intermediate_fixed16 has to be bit-identical and intermediate_half within 1.
+// With --opencl, the unfused OpenCL chain of both formats has to be within 1 of the same
+// chain through float images. Returns kSkipCode without an OpenCL device.
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "cl_kernel.h"
+#include "cpu_pipeline.h"
+#include "optics_compensation.h"
+#include "parameter.h"
+#include "remap_table.h"
+#include "simd_sampler.h"
+#include "test_image.h"
+
+namespace {
+
+// SKIP_RETURN_CODE of ctest
+const int kSkipCode = 77;
+
+std::vector<OpticsCompensationParameter> MakeParameters() {
+    std::vector<OpticsCompensationParameter> parameters;
+    for (bool spool_mode : {false, true}) {
+        for (bool anti_aliasing : {false, true}) {
+            for (const glm::vec2 &center_pos : {glm::vec2(0), glm::vec2(7.25f, -3.5f)})
+                parameters.emplace_back(0.45f, spool_mode, anti_aliasing, center_pos);
+        }
+    }
+    return parameters;
+}
+
+std::string MakeName(const std::string &prefix, const OpticsCompensationParameter &parameter,
+                     IntermediateFormat format) {
+    std::ostringstream name;
+    name << prefix << (parameter.spool_mode ? " spool" : " barrel")
+         << (parameter.anti_aliasing ? " aa" : "")
+         << " center (" << parameter.center_pos.x << ", " << parameter.center_pos.y << ")"
+         << (format == intermediate_half ? " half" : " fixed16");
+    return name.str();
+}
+
+bool TestCPU(const cv::Mat &source) {
+    aut::Size2D image_size(source.cols, source.rows);
+    cv::Rect image_rect(0, 0, source.cols, source.rows);
+    bool passed = true;
+    for (auto &parameter : MakeParameters()) {
+        auto remap_table = BuildRemapTable(image_size, parameter);
+        cv::Mat expected = source.clone();
+        FusedCPUKernel(reinterpret_cast<aut::PixelRGBA *>(expected.data), image_size, *remap_table,
+                       image_rect, intermediate_float);
+        for (IntermediateFormat format : {intermediate_fixed16, intermediate_half}) {
+            cv::Mat actual = source.clone();
+            FusedCPUKernel(reinterpret_cast<aut::PixelRGBA *>(actual.data), image_size, *remap_table,
+                           image_rect, format);
+            // The color of transparent pixels is undefined
+            passed &= format == intermediate_fixed16 ?
+                      CompareImages(MakeName("cpu", parameter, format), expected, actual) :
+                      CompareImages(MakeName("cpu", parameter, format), expected, actual, 1, true);
+        }
+    }
+    return passed;
+}
+
+// Premult -> distortion -> Unpremult of the engine through CL_FLOAT images
+cv::Mat ProcessCLFloat(OpticsCompensationEngine *engine, const cv::Mat &source,
+                       const OpticsCompensationParameter &parameter) {
+    OpenCLManager *opencl_manager = engine->GetOpenCLManager();
+    CLCommandQueueManager *cqman = opencl_manager->GetCommandQueueManager();
+    cl::CommandQueue *queue = cqman->GetCommandQueue();
+    CLImagePool *image_pool = opencl_manager->GetImagePool();
+    DistortionKernelSet distortion_kernel_set(opencl_manager->GetProgram(), queue);
+    PremultKernelManager premult_kernel_manager(opencl_manager->GetProgram(), queue);
+    UnpremultKernelManager unpremult_kernel_manager(opencl_manager->GetProgram(), queue);
+    distortion_kernel_set.SetFused(false);
+    distortion_kernel_set.SetRemapCoords(false);
+
+    int w = source.cols;
+    int h = source.rows;
+    cl::ImageFormat fmt;
+    fmt.image_channel_data_type = CL_UNORM_INT8;
+    fmt.image_channel_order = CL_BGRA;
+    cl::ImageFormat float_fmt;
+    float_fmt.image_channel_data_type = CL_FLOAT;
+    float_fmt.image_channel_order = CL_RGBA;
+    PooledImage image_0(image_pool, w, h, fmt);
+    PooledImage image_1(image_pool, w, h, fmt);
+    PooledImage intermediate_0(image_pool, w, h, float_fmt);
+    PooledImage intermediate_1(image_pool, w, h, float_fmt);
+
+    cv::Mat result(source.size(), CV_8UC4);
+    cqman->UploadImage2D(*image_0, w, h, sizeof(aut::PixelRGBA), source.data);
+    premult_kernel_manager.CallPremult(*image_0, *intermediate_0, w, h);
+    distortion_kernel_set.CallKernel(*intermediate_0, *intermediate_1, w, h, parameter);
+    unpremult_kernel_manager.CallUnpremult(*intermediate_1, *image_1, w, h);
+    cqman->DownloadImage2D(*image_1, w, h, sizeof(aut::PixelRGBA), result.data);
+    return result;
+}
+
+// Returns EXIT_SUCCESS, EXIT_FAILURE or kSkipCode
+int TestOpenCL(const cv::Mat &source) {
+    OpticsCompensationEngine engine;
+    // Always build the program from the source
+    engine.SetCLProgramCacheDirectory("");
+    if (!engine.InitOpenCL(CL_DEVICE_TYPE_ALL)) {
+        std::cout << "OpenCL test skipped : " << engine.GetInitError() << std::endl;
+        return kSkipCode;
+    }
+    std::cout << "OpenCL device : "
+              << engine.GetOpenCLManager()->GetDeviceManager()->GetDeviceName(0) << std::endl;
+    // The unfused generic kernels, the same as ProcessCLFloat()
+    engine.SetCLFusedKernel(false);
+    engine.SetCLKernelVariants(false);
+    engine.SetCLRemapCoords(false);
+
+    bool passed = true;
+    for (auto &parameter : MakeParameters()) {
+        cv::Mat expected = ProcessCLFloat(&engine, source, parameter);
+        for (IntermediateFormat format : {intermediate_fixed16, intermediate_half}) {
+            engine.SetIntermediateFormat(format);
+            cv::Mat actual = source.clone();
+            engine.Process(actual, parameter);
+            passed &= CompareImages(MakeName("opencl", parameter, format), expected, actual, 1, true);
+        }
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    bool opencl = argc > 1 && std::strcmp(argv[1], "--opencl") == 0;
+    cv::Mat source = MakeRandomImage(113, 67, 7);
+    if (opencl)
+        return TestOpenCL(source);
+    return TestCPU(source) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
\ No newline at end of file
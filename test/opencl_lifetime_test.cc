@@ -0,0 +1,78 @@
+// Init and release of the OpenCL backends twice in a row. The second round runs on
+// fresh contexts, so it has to give the same frames as the first one.
+// Returns kSkipCode without an OpenCL device.
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <opencv2/opencv.hpp>
+#include "multi_device.h"
+#include "optics_compensation.h"
+#include "parameter.h"
+#include "test_image.h"
+
+namespace {
+
+// SKIP_RETURN_CODE of ctest
+const int kSkipCode = 77;
+
+const int kRoundNum = 2;
+
+} // namespace
+
+int main() {
+    cv::Mat source = MakeRandomImage(160, 90, 11);
+    OpticsCompensationParameter parameter = MakeOpticsCompensationParameter(40, false, glm::vec2(3, -2));
+    bool passed = true;
+
+    // A whole engine per round, like the CLInit benchmarks
+    cv::Mat first_result;
+    for (int round = 0; round < kRoundNum; round++) {
+        OpticsCompensationEngine engine;
+        engine.SetCLProgramCacheDirectory("");
+        if (!engine.InitOpenCL(CL_DEVICE_TYPE_ALL)) {
+            std::cout << "OpenCL test skipped : " << engine.GetInitError() << std::endl;
+            return kSkipCode;
+        }
+        cv::Mat result = source.clone();
+        engine.Process(result, parameter);
+        std::size_t used_image_num = engine.GetOpenCLManager()->GetImagePool()->GetUsedImageNum();
+        if (used_image_num != 0) {
+            std::cerr << "FAIL engine round " << round << " : " << used_image_num
+                      << " images still in use" << std::endl;
+            passed = false;
+        }
+        if (round == 0)
+            first_result = result;
+        else
+            passed &= CompareImages("engine round " + std::to_string(round), first_result, result);
+    }
+
+    // The executor of the same engine created and released again
+    OpticsCompensationEngine engine;
+    engine.SetCLProgramCacheDirectory("");
+    int worker_num = 0;
+    for (int round = 0; round < kRoundNum; round++) {
+        if (!engine.InitMultiDevice(true)) {
+            std::cout << "Multi-device test skipped : " << engine.GetInitError() << std::endl;
+            break;
+        }
+        MultiDeviceExecutor *executor = engine.GetMultiDeviceExecutor();
+        if (round == 0) {
+            worker_num = executor->GetWorkerNum();
+        } else if (executor->GetWorkerNum() != worker_num) {
+            std::cerr << "FAIL multi-device round " << round << " : " << executor->GetWorkerNum()
+                      << " workers instead of " << worker_num << std::endl;
+            passed = false;
+        }
+        cv::Mat result = source.clone();
+        engine.Process(result, parameter);
+        engine.ReleaseMultiDevice();
+        if (engine.GetMultiDeviceExecutor()) {
+            std::cerr << "FAIL multi-device round " << round << " : the executor wasn't released" << std::endl;
+            passed = false;
+        }
+        std::cout << "ok   multi-device round " << round << " (" << worker_num << " workers)" << std::endl;
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
\ No newline at end of file
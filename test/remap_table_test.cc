@@ -0,0 +1,87 @@
+// Remap tables filled by mirroring the offsets of the primary quadrant against the offsets
+// evaluated directly for every grid point. The offsets only differ in sign and order, so the
+// coords have to be bit-identical. The centers cover the symmetric lens, centers which mirror
+// only some lines, and centers off the half pixel lattice where nothing can be mirrored.
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "cpu_kernel.h"
+#include "parameter.h"
+#include "remap_table.h"
+
+namespace {
+
+std::string MakeName(const aut::Size2D &image_size, const OpticsCompensationParameter &parameter,
+                     const glm::ivec2 &output_origin) {
+    std::ostringstream name;
+    name << image_size.w << "x" << image_size.h << (parameter.spool_mode ? " spool" : " barrel")
+         << (parameter.anti_aliasing ? " pixel_corner" : " pixel_center")
+         << " center (" << parameter.center_pos.x << ", " << parameter.center_pos.y << ")"
+         << " origin (" << output_origin.x << ", " << output_origin.y << ")";
+    return name.str();
+}
+
+// The coords of BuildTileRemapTable() calculated pixel by pixel
+glm::vec2 CalcDirectCoord(const aut::Size2D &image_size, OpticsCompensationParameter parameter,
+                          const glm::ivec2 &output_origin, int x, int y) {
+    glm::vec2 center_coord((image_size.w - 1) / 2.f - parameter.center_pos.x,
+                           (image_size.h - 1) / 2.f - parameter.center_pos.y);
+    glm::vec2 grid_center = center_coord - glm::vec2(output_origin);
+    float origin = parameter.anti_aliasing ? -0.5f : 0.f;
+    float focal_distance = parameter.CalcFocalDistance();
+    glm::vec2 relative_coords(x + origin - grid_center.x, y + origin - grid_center.y);
+    glm::vec2 offset = parameter.spool_mode ? CalcSpoolOffset(relative_coords, focal_distance) :
+                                              CalcBarrelOffset(relative_coords, focal_distance);
+    return offset + center_coord;
+}
+
+bool TestTable(const aut::Size2D &image_size, const OpticsCompensationParameter &parameter,
+               const glm::ivec2 &output_origin, const aut::Size2D &output_size) {
+    std::string name = MakeName(image_size, parameter, output_origin);
+    auto table = BuildTileRemapTable(image_size, output_origin, output_size, glm::ivec2(0), parameter);
+    for (int y = 0; y < table->GetGridHeight(); y++) {
+        const glm::vec2 *row = table->GetRow(y);
+        for (int x = 0; x < table->GetGridWidth(); x++) {
+            glm::vec2 expected = CalcDirectCoord(image_size, parameter, output_origin, x, y);
+            if (std::memcmp(&expected, &row[x], sizeof(glm::vec2)) == 0)
+                continue;
+            std::cerr << "FAIL " << name << " : grid (" << x << ", " << y << ") expected ("
+                      << expected.x << ", " << expected.y << ") actual (" << row[x].x << ", "
+                      << row[x].y << ")" << std::endl;
+            return false;
+        }
+    }
+    std::cout << "ok   " << name << std::endl;
+    return true;
+}
+
+} // namespace
+
+int main() {
+    // Odd and even sizes, and a square where every pixel has a swapped pair
+    const aut::Size2D image_sizes[] = {aut::Size2D(37, 23), aut::Size2D(64, 48), aut::Size2D(40, 40)};
+    // Symmetric, mirrored on some lines, swapped with a shift, and not mirrored at all
+    const glm::vec2 center_positions[] = {glm::vec2(0), glm::vec2(5, -3), glm::vec2(0.5f, 0),
+                                          glm::vec2(7.25f, -3.3f)};
+    bool passed = true;
+    for (auto &image_size : image_sizes) {
+        for (bool spool_mode : {false, true}) {
+            // The anti-aliasing uses the pixel_corner tables
+            for (bool anti_aliasing : {false, true}) {
+                for (auto &center_pos : center_positions) {
+                    OpticsCompensationParameter parameter(0.45f, spool_mode, anti_aliasing, center_pos);
+                    passed &= TestTable(image_size, parameter, glm::ivec2(0), image_size);
+                    // A tile, whose center on the grid moves with the origin
+                    aut::Size2D tile_size(image_size.w / 2 + 1, image_size.h / 3);
+                    passed &= TestTable(image_size, parameter, glm::ivec2(image_size.w / 3, 5), tile_size);
+                }
+            }
+        }
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
\ No newline at end of file
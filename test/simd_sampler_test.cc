@@ -0,0 +1,148 @@
+// SampleRow forced to each instruction set against SamplingPixel<float>.
+// The coords go up to 3 pixels out of the image on every side, where the taps are sampled as 0,
+// and include integer coords. Every level has to be bit-identical to the scalar sampling, for
+// the float source and for the packed sources holding the same values. Levels the running CPU
+// doesn't support are skipped.
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <glm/glm.hpp>
+#include <opencv2/opencv.hpp>
+#include "cpu_kernel.h"
+#include "simd_sampler.h"
+
+namespace {
+
+// Not a multiple of the blocks of the vector paths, so the scalar tail runs too
+const int kCoordNum = 16 * 61 + 7;
+const float kOutOfImage = 3.0f;
+
+// Premultiplied pixels of 8 bit colors are integers up to 255 * 255,
+// which intermediate_fixed16 holds exactly
+cv::Mat MakeRandomSource(int w, int h, std::uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> value(0, 255 * 255);
+    cv::Mat image(cv::Size(w, h), CV_32FC4);
+    for (int y = 0; y < h; y++) {
+        auto *row = image.ptr<cv::Vec4f>(y);
+        for (int x = 0; x < w; x++) {
+            for (int c = 0; c < 4; c++)
+                row[x][c] = static_cast<float>(value(rng));
+        }
+    }
+    return image;
+}
+
+std::vector<glm::vec2> MakeRandomCoords(int w, int h, std::uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> coord_x(-kOutOfImage, w + kOutOfImage);
+    std::uniform_real_distribution<float> coord_y(-kOutOfImage, h + kOutOfImage);
+    std::uniform_int_distribution<int> kind(0, 3);
+    std::vector<glm::vec2> coords(kCoordNum);
+    for (auto &coord : coords) {
+        coord = glm::vec2(coord_x(rng), coord_y(rng));
+        // A quarter of the coords on the pixel centers, where a weight is 0
+        if (kind(rng) == 0)
+            coord = glm::floor(coord);
+    }
+    return coords;
+}
+
+// Pack image in format, unpacked gets the float values the packed image holds
+cv::Mat PackImage(const cv::Mat &image, IntermediateFormat format, cv::Mat *unpacked) {
+    cv::Mat packed(image.size(), CV_16UC4);
+    unpacked->create(image.size(), CV_32FC4);
+    for (int y = 0; y < image.rows; y++) {
+        auto *row = image.ptr<cv::Vec4f>(y);
+        auto *packed_row = packed.ptr<cv::Vec4w>(y);
+        auto *unpacked_row = unpacked->ptr<cv::Vec4f>(y);
+        for (int x = 0; x < image.cols; x++) {
+            for (int c = 0; c < 4; c++) {
+                if (format == intermediate_half) {
+                    packed_row[x][c] = FloatToHalf(row[x][c]);
+                    unpacked_row[x][c] = HalfToFloat(packed_row[x][c]);
+                } else {
+                    packed_row[x][c] = static_cast<ushort>(row[x][c]);
+                    unpacked_row[x][c] = row[x][c];
+                }
+            }
+        }
+    }
+    return packed;
+}
+
+std::vector<cv::Vec4f> SampleReference(const cv::Mat &image, const std::vector<glm::vec2> &coords) {
+    aut::Size2D image_size(image.cols, image.rows);
+    std::vector<cv::Vec4f> pixels;
+    for (auto &coord : coords)
+        pixels.push_back(SamplingPixel<float>(image, coord.x, coord.y, image_size));
+    return pixels;
+}
+
+bool ComparePixels(const std::string &name, const std::vector<glm::vec2> &coords,
+                   const std::vector<cv::Vec4f> &expected, const std::vector<cv::Vec4f> &actual) {
+    for (size_t i = 0; i < coords.size(); i++) {
+        if (std::memcmp(expected[i].val, actual[i].val, sizeof(cv::Vec4f)) == 0)
+            continue;
+        std::cerr << "FAIL " << name << " : coord (" << coords[i].x << ", " << coords[i].y
+                  << ") expected (" << expected[i][0] << ", " << expected[i][1] << ", "
+                  << expected[i][2] << ", " << expected[i][3] << ") actual (" << actual[i][0] << ", "
+                  << actual[i][1] << ", " << actual[i][2] << ", " << actual[i][3] << ")" << std::endl;
+        return false;
+    }
+    std::cout << "ok   " << name << std::endl;
+    return true;
+}
+
+bool TestSize(int w, int h, const std::string &level_name) {
+    cv::Mat image = MakeRandomSource(w, h, 5);
+    auto coords = MakeRandomCoords(w, h, 9);
+    std::string size_name = " " + std::to_string(w) + "x" + std::to_string(h) + " " + level_name;
+    bool passed = true;
+
+    auto rows = GetRowPointers(image);
+    SamplingSource source = {rows.data(), w, h};
+    std::vector<cv::Vec4f> actual(coords.size());
+    SampleRow(source, coords.data(), kCoordNum, actual.data());
+    passed &= ComparePixels("float" + size_name, coords, SampleReference(image, coords), actual);
+
+    for (IntermediateFormat format : {intermediate_fixed16, intermediate_half}) {
+        cv::Mat unpacked;
+        cv::Mat packed = PackImage(image, format, &unpacked);
+        std::vector<const cv::Vec4w*> packed_rows;
+        for (int y = 0; y < h; y++)
+            packed_rows.push_back(packed.ptr<cv::Vec4w>(y));
+        PackedSamplingSource packed_source = {packed_rows.data(), w, h, format};
+        SampleRow(packed_source, coords.data(), kCoordNum, actual.data());
+        passed &= ComparePixels((format == intermediate_half ? "half" : "fixed16") + size_name,
+                                coords, SampleReference(unpacked, coords), actual);
+    }
+    return passed;
+}
+
+} // namespace
+
+int main() {
+    const std::pair<SIMDLevel, const char*> levels[] = {
+        {SIMDLevel::scalar, "scalar"}, {SIMDLevel::sse41, "sse4.1"},
+        {SIMDLevel::avx2, "avx2"}, {SIMDLevel::avx512, "avx512"}};
+    bool passed = true;
+    for (auto &level : levels) {
+        if (level.first > GetSupportedSIMDLevel()) {
+            std::cout << "skip " << level.second << " : not supported by the CPU" << std::endl;
+            continue;
+        }
+        SetSIMDLevel(level.first);
+        // Odd and even sizes, and an image narrower than a vector
+        passed &= TestSize(37, 23, level.second);
+        passed &= TestSize(64, 48, level.second);
+        passed &= TestSize(3, 2, level.second);
+    }
+    SetSIMDLevel(GetSupportedSIMDLevel());
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
\ No newline at end of file
@@ -0,0 +1,116 @@
+#ifndef _OPTICSCOMPENSATION_S_TEST_TEST_IMAGE_H_
+#define _OPTICSCOMPENSATION_S_TEST_TEST_IMAGE_H_
+
+#include <cstdint>
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <opencv2/opencv.hpp>
+
+// Random straight alpha BGRA image. The alpha is a mix of transparent, opaque, any value
+// and the lowest values 1 to 3, where the unpremultiplied color is the most sensitive.
+inline cv::Mat MakeRandomImage(int w, int h, std::uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::uniform_int_distribution<int> alpha_kind(0, 3);
+    std::uniform_int_distribution<int> low_alpha(1, 3);
+    cv::Mat image(cv::Size(w, h), CV_8UC4);
+    for (int y = 0; y < h; y++) {
+        auto *row = image.ptr<cv::Vec4b>(y);
+        for (int x = 0; x < w; x++) {
+            int kind = alpha_kind(rng);
+            int alpha = kind == 0 ? 0 : kind == 1 ? low_alpha(rng) : kind == 2 ? 255 : byte(rng);
+            row[x] = cv::Vec4b(static_cast<uchar>(byte(rng)), static_cast<uchar>(byte(rng)),
+                               static_cast<uchar>(byte(rng)), static_cast<uchar>(alpha));
+        }
+    }
+    return image;
+}
+
+inline std::string FormatPixel(const cv::Vec4b &pixel) {
+    return "(" + std::to_string(pixel[0]) + ", " + std::to_string(pixel[1]) + ", " +
+           std::to_string(pixel[2]) + ", " + std::to_string(pixel[3]) + ")";
+}
+
+// Compare two CV_8UC4 images channel by channel and print the first mismatch.
+// Channels differing by more than tolerance fail, the color of pixels transparent
+// in both is skipped when skip_transparent_color is true.
+// Returns true if the images match.
+inline bool CompareImages(const std::string &name, const cv::Mat &expected, const cv::Mat &actual,
+                          int tolerance = 0, bool skip_transparent_color = false) {
+    int mismatch_num = 0;
+    int max_difference = 0;
+    for (int y = 0; y < expected.rows; y++) {
+        auto *expected_row = expected.ptr<cv::Vec4b>(y);
+        auto *actual_row = actual.ptr<cv::Vec4b>(y);
+        for (int x = 0; x < expected.cols; x++) {
+            bool transparent = expected_row[x][3] == 0 && actual_row[x][3] == 0;
+            int first_channel = skip_transparent_color && transparent ? 3 : 0;
+            int difference = 0;
+            for (int c = first_channel; c < 4; c++)
+                difference = std::max(difference, std::abs(expected_row[x][c] - actual_row[x][c]));
+            max_difference = std::max(max_difference, difference);
+            if (difference <= tolerance)
+                continue;
+            if (mismatch_num == 0) {
+                std::cerr << "FAIL " << name << " : first mismatch at (" << x << ", " << y
+                          << ") expected " << FormatPixel(expected_row[x])
+                          << " actual " << FormatPixel(actual_row[x]) << std::endl;
+            }
+            mismatch_num++;
+        }
+    }
+    if (mismatch_num > 0) {
+        std::cerr << "FAIL " << name << " : " << mismatch_num << " pixels differ by more than "
+                  << tolerance << ", max " << max_difference << std::endl;
+        return false;
+    }
+    std::cout << "ok   " << name << " (max difference " << max_difference << ")" << std::endl;
+    return true;
+}
+
+// Compare two CV_8UC4 images in the premultiplied space, where the straight color of low alpha
+// pixels doesn't amplify the rounding. Alphas differing by more than alpha_tolerance or
+// premultiplied colors (color * alpha / 255) by more than color_tolerance fail.
+// Returns true if the images match.
+inline bool ComparePremultiplied(const std::string &name, const cv::Mat &expected, const cv::Mat &actual,
+                                 int alpha_tolerance, float color_tolerance) {
+    int mismatch_num = 0;
+    int max_alpha_difference = 0;
+    float max_color_difference = 0.0f;
+    for (int y = 0; y < expected.rows; y++) {
+        auto *expected_row = expected.ptr<cv::Vec4b>(y);
+        auto *actual_row = actual.ptr<cv::Vec4b>(y);
+        for (int x = 0; x < expected.cols; x++) {
+            int alpha_difference = std::abs(expected_row[x][3] - actual_row[x][3]);
+            float color_difference = 0.0f;
+            for (int c = 0; c < 3; c++) {
+                int premultiplied_difference = expected_row[x][c] * expected_row[x][3] -
+                                               actual_row[x][c] * actual_row[x][3];
+                color_difference = std::max(color_difference, std::abs(premultiplied_difference) / 255.0f);
+            }
+            max_alpha_difference = std::max(max_alpha_difference, alpha_difference);
+            max_color_difference = std::max(max_color_difference, color_difference);
+            if (alpha_difference <= alpha_tolerance && color_difference <= color_tolerance)
+                continue;
+            if (mismatch_num == 0) {
+                std::cerr << "FAIL " << name << " : first mismatch at (" << x << ", " << y
+                          << ") expected " << FormatPixel(expected_row[x])
+                          << " actual " << FormatPixel(actual_row[x]) << std::endl;
+            }
+            mismatch_num++;
+        }
+    }
+    if (mismatch_num > 0) {
+        std::cerr << "FAIL " << name << " : " << mismatch_num << " pixels out of tolerance, max alpha "
+                  << max_alpha_difference << ", max premultiplied color " << max_color_difference << std::endl;
+        return false;
+    }
+    std::cout << "ok   " << name << " (max alpha " << max_alpha_difference
+              << ", max premultiplied color " << max_color_difference << ")" << std::endl;
+    return true;
+}
+
+#endif // _OPTICSCOMPENSATION_S_TEST_TEST_IMAGE_H_
\ No newline at end of file
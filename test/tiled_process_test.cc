@@ -0,0 +1,55 @@
+// ProcessTiled against Process of the whole image on the CPU. The tile tables hold the coords
+// relative to the source of the tile, so they round differently from the table of the frame
+// (see TileCPUKernel) and an output channel can round the other way: the alpha has to be
+// within 1 and the premultiplied color within 2, one rounding of the alpha and of the color.
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "optics_compensation.h"
+#include "parameter.h"
+#include "test_image.h"
+
+namespace {
+
+const int kAlphaTolerance = 1;
+const float kPremultipliedTolerance = 2.0f;
+
+std::string MakeName(const OpticsCompensationParameter &parameter, const aut::Size2D &tile_size) {
+    std::ostringstream name;
+    name << "tiled" << (parameter.spool_mode ? " spool" : " barrel")
+         << (parameter.anti_aliasing ? " aa" : "")
+         << " center (" << parameter.center_pos.x << ", " << parameter.center_pos.y << ")"
+         << " tile " << tile_size.w << "x" << tile_size.h;
+    return name.str();
+}
+
+} // namespace
+
+int main() {
+    OpticsCompensationEngine engine;
+    cv::Mat source = MakeRandomImage(113, 67, 13);
+    // Tiles dividing the image or not, narrower than a SIMD block, and larger than the image
+    const aut::Size2D tile_sizes[] = {aut::Size2D(32, 16), aut::Size2D(37, 23), aut::Size2D(7, 5),
+                                      aut::Size2D(113, 1), aut::Size2D(256, 256)};
+    bool passed = true;
+    for (bool spool_mode : {false, true}) {
+        for (bool anti_aliasing : {false, true}) {
+            for (const glm::vec2 &center_pos : {glm::vec2(0), glm::vec2(7.25f, -3.5f)}) {
+                OpticsCompensationParameter parameter(0.45f, spool_mode, anti_aliasing, center_pos);
+                cv::Mat expected = source.clone();
+                engine.Process(expected, parameter);
+                for (auto &tile_size : tile_sizes) {
+                    cv::Mat actual;
+                    engine.ProcessTiled(source, actual, parameter, tile_size);
+                    passed &= ComparePremultiplied(MakeName(parameter, tile_size), expected, actual,
+                                                   kAlphaTolerance, kPremultipliedTolerance);
+                }
+            }
+        }
+    }
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
\ No newline at end of file